@@ -0,0 +1,137 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arena.h"
+
+ssize_t (*reply_write)(int fd, const void *data, size_t len) = write;
+
+using namespace std;
+
+Arena::Arena(size_t size) : size(size), used(0), spilled(0)
+{
+    block = (char *) malloc(size);
+}
+
+Arena::~Arena()
+{
+    reset();
+    free(block);
+}
+
+/* Take memory for the current command, from an extra block if it does not fit */
+char *Arena::alloc(size_t len)
+{
+    len = (len + 7) & ~(size_t) 7;
+    if (used + len <= size)
+    {
+        char *ptr = block + used;
+        used += len;
+        return ptr;
+    }
+    char *spill = (char *) malloc(len);
+    spills.push_back(spill);
+    spilled += len;
+    return spill;
+}
+
+/* Release the memory of the last command. The block grows if it was too small. */
+void Arena::reset()
+{
+    if (!spills.empty())
+    {
+        for (size_t i = 0; i < spills.size(); i++)
+        {
+            free(spills[i]);
+        }
+        spills.clear();
+        size = used + spilled;
+        free(block);
+        block = (char *) malloc(size);
+    }
+    used = 0;
+    spilled = 0;
+}
+
+/* Write a number in decimal, two digits at a time, returns the end. Like to_chars, without locale or allocation. */
+char *format_uint(char *out, uint64_t value)
+{
+    static const char DIGITS[] =
+        "0001020304050607080910111213141516171819"
+        "2021222324252627282930313233343536373839"
+        "4041424344454647484950515253545556575859"
+        "6061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    char tmp[20], *p = tmp + sizeof(tmp);
+    while (value >= 100)
+    {
+        p -= 2;
+        memcpy(p, DIGITS + (value % 100) * 2, 2);
+        value /= 100;
+    }
+    if (value >= 10)
+    {
+        p -= 2;
+        memcpy(p, DIGITS + value * 2, 2);
+    }
+    else
+    {
+        *--p = '0' + value;
+    }
+    size_t len = tmp + sizeof(tmp) - p;
+    memcpy(out, p, len);
+    return out + len;
+}
+
+Reply::Reply(Arena &arena, size_t capacity, int fd) : fd(fd)
+{
+    begin = end = arena.alloc(capacity);
+    limit = begin + capacity - 1; // room for the NUL of c_str()
+}
+
+Reply &Reply::add(const char *text)
+{
+    return add(text, strlen(text));
+}
+
+Reply &Reply::add(const char *text, size_t len)
+{
+    if (end + len > limit && fd >= 0)
+    {
+        send();
+        if (len > (size_t)(limit - begin))
+        {
+            reply_write(fd, text, len); // larger than the whole buffer
+            return *this;
+        }
+    }
+    if (end + len > limit)
+    {
+        len = limit - end;
+    }
+    memcpy(end, text, len);
+    end += len;
+    return *this;
+}
+
+Reply &Reply::num(uint64_t value)
+{
+    char digits[20];
+    return add(digits, format_uint(digits, value) - digits);
+}
+
+const char *Reply::c_str()
+{
+    *end = '\0';
+    return begin;
+}
+
+/* Write the reply to its socket and empty it */
+void Reply::send()
+{
+    if (end > begin)
+    {
+        reply_write(fd, begin, end - begin);
+    }
+    end = begin;
+}
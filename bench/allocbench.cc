@@ -0,0 +1,234 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <string>
+
+using namespace std;
+
+// Heap allocations per command of the SMTP and POP3 servers. Each verb is run
+// in a session of REPEAT commands and in an empty session, and the difference
+// of the allocation counts of the two server runs is divided by REPEAT.
+//
+// Usage: allocbench [-n repeat] [-p port] [bindir]
+
+#define PORT 26500
+
+struct step_t
+{
+    const char *name;
+    const char *setup;   // commands before the measured ones
+    const char *command; // sent REPEAT times
+    int commands;        // commands in one repetition
+    bool multiline;      // response ends with a line holding a dot
+};
+
+static const step_t SMTP_STEPS[] =
+{
+    { "HELO", "", "HELO bench\r\n", 1, false },
+    { "NOOP", "HELO bench\r\n", "NOOP\r\n", 1, false },
+    { "MAIL+RSET", "HELO bench\r\n", "MAIL FROM:<bench@localhost>\r\nRSET\r\n", 2, false },
+    { "RCPT", "HELO bench\r\nMAIL FROM:<bench@localhost>\r\n", "RCPT TO:<bench@localhost>\r\n", 1, false },
+    { "RCPT unknown", "HELO bench\r\nMAIL FROM:<bench@localhost>\r\n", "RCPT TO:<nobody@localhost>\r\n", 1, false },
+    { "DATA line", "HELO bench\r\nMAIL FROM:<bench@localhost>\r\nRCPT TO:<bench@localhost>\r\nDATA\r\n",
+      "Subject: a line of a message body, long enough for the heap\r\n", 1, false },
+};
+
+static const step_t POP3_STEPS[] =
+{
+    { "STAT", "USER bench\r\nPASS cis505\r\n", "STAT\r\n", 1, false },
+    { "LIST", "USER bench\r\nPASS cis505\r\n", "LIST\r\n", 1, true },
+    { "LIST n", "USER bench\r\nPASS cis505\r\n", "LIST 2\r\n", 1, false },
+    { "UIDL", "USER bench\r\nPASS cis505\r\n", "UIDL\r\n", 1, true },
+    { "UIDL n", "USER bench\r\nPASS cis505\r\n", "UIDL 2\r\n", 1, false },
+    { "RETR", "USER bench\r\nPASS cis505\r\n", "RETR 1\r\n", 1, true },
+    { "DELE+RSET", "USER bench\r\nPASS cis505\r\n", "DELE 1\r\nRSET\r\n", 2, false },
+    { "NOOP", "USER bench\r\nPASS cis505\r\n", "NOOP\r\n", 1, false },
+};
+
+static string BINDIR = ".";
+static int REPEAT = 2000;
+static int port = PORT;
+
+/* Helper function that reads until the expected number of responses arrived */
+static void expect(int fd, int lines, bool multiline)
+{
+    static char buffer[1 << 16];
+    int seen = 0, len = 0;
+    while (seen < lines)
+    {
+        int n = read(fd, buffer + len, sizeof(buffer) - len - 1);
+        if (n <= 0)
+        {
+            fprintf(stderr, "Connection lost\n");
+            exit(1);
+        }
+        len += n;
+        buffer[len] = '\0';
+        char *p = buffer, *end;
+        const char *mark = multiline ? "\r\n.\r\n" : "\r\n";
+        while ((end = strstr(p, mark)) != NULL && seen < lines)
+        {
+            seen++;
+            p = end + strlen(mark);
+        }
+        memmove(buffer, p, len - (p - buffer));
+        len -= p - buffer;
+    }
+}
+
+/* Helper function that counts the lines of a command string */
+static int lines(const char *commands)
+{
+    int n = 0;
+    for (const char *p = commands; (p = strstr(p, "\r\n")) != NULL; p += 2)
+    {
+        n++;
+    }
+    return n;
+}
+
+/* Run one server with a session that sends a command a number of times, returns the allocations of the server */
+static unsigned long run(const char *server, const string &dir, const step_t &step, int repeat)
+{
+    string count_file = dir + "/allocs";
+    unlink(count_file.c_str());
+    port++;
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        string preload = BINDIR + "/bench/alloccount.so", binary = BINDIR + "/" + server;
+        setenv("LD_PRELOAD", preload.c_str(), 1);
+        setenv("ALLOC_COUNT_FILE", count_file.c_str(), 1);
+        char port_arg[16];
+        snprintf(port_arg, sizeof(port_arg), "%d", port);
+        freopen("/dev/null", "w", stderr);
+        execl(binary.c_str(), server, "-p", port_arg, dir.c_str(), (char *) NULL);
+        _exit(127);
+    }
+    int fd = -1;
+    for (int tries = 0; tries < 100 && fd < 0; tries++)
+    {
+        usleep(20000);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr = { };
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd < 0)
+    {
+        fprintf(stderr, "Cannot connect to %s\n", server);
+        exit(1);
+    }
+    expect(fd, 1, false);
+    write(fd, step.setup, strlen(step.setup));
+    expect(fd, lines(step.setup), false);
+    bool data = strstr(step.setup, "DATA") != NULL; // message lines are not answered
+    for (int i = 0; i < repeat; i++)
+    {
+        write(fd, step.command, strlen(step.command));
+        if (!data)
+        {
+            expect(fd, step.commands, step.multiline);
+        }
+    }
+    if (data)
+    {
+        write(fd, ".\r\n", 3);
+        expect(fd, 1, false);
+    }
+    write(fd, "QUIT\r\n", 6);
+    expect(fd, 1, false);
+    close(fd);
+    usleep(50000);
+    kill(pid, SIGINT);
+    waitpid(pid, NULL, 0);
+    FILE *f = fopen(count_file.c_str(), "r");
+    unsigned long count = 0;
+    if (f == NULL || fscanf(f, "%lu", &count) != 1)
+    {
+        fprintf(stderr, "No allocation count from %s\n", server);
+        exit(1);
+    }
+    fclose(f);
+    return count;
+}
+
+/* Helper function that writes the mailbox the sessions use */
+static string make_mailbox()
+{
+    char dir[] = "/tmp/allocbench.XXXXXX";
+    if (mkdtemp(dir) == NULL)
+    {
+        perror("mkdtemp");
+        exit(1);
+    }
+    string path = string(dir) + "/bench.mbox";
+    FILE *f = fopen(path.c_str(), "w");
+    for (int i = 0; i < 20; i++)
+    {
+        fprintf(f, "From <bench@localhost> Mon Jan  1 00:00:00 2024\n");
+        fprintf(f, "Subject: message %d\r\n\r\n", i);
+        for (int j = 0; j < 40; j++)
+        {
+            fprintf(f, "line %d of the body of message %d, with some text to fill it\r\n", j, i);
+        }
+    }
+    fclose(f);
+    return dir;
+}
+
+static void measure(const char *server, const string &dir, const step_t *steps, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        unsigned long base = run(server, dir, steps[i], 0);
+        unsigned long total = run(server, dir, steps[i], REPEAT);
+        printf("%-5s %-14s %8.3f allocations per command\n", server, steps[i].name,
+               (double)((long) total - (long) base) / REPEAT / steps[i].commands);
+        fflush(stdout);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int ch;
+    while ((ch = getopt(argc, argv, "n:p:")) != -1)
+    {
+        switch (ch)
+        {
+        case 'n':
+            REPEAT = atoi(optarg);
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Error: Please input [-n repeat] [-p port] [bindir]\n");
+            exit(1);
+        }
+    }
+    if (optind < argc)
+    {
+        BINDIR = argv[optind];
+    }
+    signal(SIGPIPE, SIG_IGN);
+    string dir = make_mailbox();
+    measure("smtp", dir, SMTP_STEPS, sizeof(SMTP_STEPS) / sizeof(SMTP_STEPS[0]));
+    measure("pop3", dir, POP3_STEPS, sizeof(POP3_STEPS) / sizeof(POP3_STEPS[0]));
+    string clean = "rm -rf " + dir;
+    system(clean.c_str());
+    return 0;
+}
@@ -0,0 +1,45 @@
+#include <sys/types.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <atomic>
+
+// Counts heap allocations of a server run with LD_PRELOAD. The total is
+// written to $ALLOC_COUNT_FILE when the process exits.
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+static std::atomic<unsigned long> COUNT(0);
+
+extern "C" void *malloc(size_t size)
+{
+    COUNT++;
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t n, size_t size)
+{
+    COUNT++;
+    return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+    COUNT++;
+    return __libc_realloc(ptr, size);
+}
+
+__attribute__((destructor)) static void report()
+{
+    const char *path = getenv("ALLOC_COUNT_FILE");
+    if (path != NULL)
+    {
+        char line[32];
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        write(fd, line, snprintf(line, sizeof(line), "%lu\n", COUNT.load()));
+        close(fd);
+    }
+}
@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <stdint.h>
+
+#include "command.h"
+
+// Cost of finding the command of a line and checking it against the session
+// state: the strcasecmp chains the servers used before, and the packed verb
+// with a perfect hash switch and a transition table they use now. The lookup
+// functions are copies of the ones in smtp.cc and pop3.cc.
+//
+// Usage: dispatchbench [-n lines]
+
+enum smtp_t { S_HELO, S_MAIL, S_RCPT, S_DATA, S_RSET, S_NOOP, S_QUIT, S_UNKNOWN };
+enum pop3_t { P_USER, P_PASS, P_QUIT, P_STAT, P_UIDL, P_RETR, P_DELE, P_LIST, P_RSET, P_NOOP, P_UNKNOWN };
+
+static const bool SMTP_ALLOWED[4][S_UNKNOWN + 1] =
+{
+    {  true, false, false, false, false, false,  true,  true },
+    {  true,  true, false, false,  true,  true,  true,  true },
+    { false, false,  true, false,  true,  true,  true,  true },
+    { false, false,  true,  true,  true,  true,  true,  true },
+};
+
+static const bool POP3_ALLOWED[2][P_UNKNOWN + 1] =
+{
+    {  true,  true,  true, false, false, false, false, false, false, false,  true },
+    { false, false,  true,  true,  true,  true,  true,  true,  true,  true,  true },
+};
+
+#define SMTP_HASH 0x9e377a53u
+#define POP3_HASH 0x9e3779dfu
+
+static smtp_t smtp_lookup(const char *buffer)
+{
+    uint32_t code = read_verb(buffer);
+    switch (verb_slot(code, SMTP_HASH, 3))
+    {
+    case verb_slot(verb("HELO"), SMTP_HASH, 3):
+        return code == verb("HELO") ? S_HELO : S_UNKNOWN;
+    case verb_slot(verb("MAIL"), SMTP_HASH, 3):
+        return code == verb("MAIL") && read_verb(buffer + 5) == verb("FROM") ? S_MAIL : S_UNKNOWN;
+    case verb_slot(verb("RCPT"), SMTP_HASH, 3):
+        return code == verb("RCPT") && (read_verb(buffer + 5) & 0xffff) == (verb("TO  ") & 0xffff) ?
+               S_RCPT : S_UNKNOWN;
+    case verb_slot(verb("DATA"), SMTP_HASH, 3):
+        return code == verb("DATA") ? S_DATA : S_UNKNOWN;
+    case verb_slot(verb("RSET"), SMTP_HASH, 3):
+        return code == verb("RSET") ? S_RSET : S_UNKNOWN;
+    case verb_slot(verb("NOOP"), SMTP_HASH, 3):
+        return code == verb("NOOP") ? S_NOOP : S_UNKNOWN;
+    case verb_slot(verb("QUIT"), SMTP_HASH, 3):
+        return code == verb("QUIT") ? S_QUIT : S_UNKNOWN;
+    default:
+        return S_UNKNOWN;
+    }
+}
+
+static pop3_t pop3_lookup(const char *buffer)
+{
+    uint32_t code = read_verb(buffer);
+    switch (verb_slot(code, POP3_HASH, 4))
+    {
+    case verb_slot(verb("USER"), POP3_HASH, 4):
+        return code == verb("USER") ? P_USER : P_UNKNOWN;
+    case verb_slot(verb("PASS"), POP3_HASH, 4):
+        return code == verb("PASS") ? P_PASS : P_UNKNOWN;
+    case verb_slot(verb("QUIT"), POP3_HASH, 4):
+        return code == verb("QUIT") ? P_QUIT : P_UNKNOWN;
+    case verb_slot(verb("STAT"), POP3_HASH, 4):
+        return code == verb("STAT") ? P_STAT : P_UNKNOWN;
+    case verb_slot(verb("UIDL"), POP3_HASH, 4):
+        return code == verb("UIDL") ? P_UIDL : P_UNKNOWN;
+    case verb_slot(verb("RETR"), POP3_HASH, 4):
+        return code == verb("RETR") ? P_RETR : P_UNKNOWN;
+    case verb_slot(verb("DELE"), POP3_HASH, 4):
+        return code == verb("DELE") ? P_DELE : P_UNKNOWN;
+    case verb_slot(verb("LIST"), POP3_HASH, 4):
+        return code == verb("LIST") ? P_LIST : P_UNKNOWN;
+    case verb_slot(verb("RSET"), POP3_HASH, 4):
+        return code == verb("RSET") ? P_RSET : P_UNKNOWN;
+    case verb_slot(verb("NOOP"), POP3_HASH, 4):
+        return code == verb("NOOP") ? P_NOOP : P_UNKNOWN;
+    default:
+        return P_UNKNOWN;
+    }
+}
+
+/* The chain smtp.cc used: copy the verb, compare it with every command in turn, then check the state in the handler */
+static int smtp_chain(const char *buffer, int status)
+{
+    char command[5] = { };
+    for (int i = 0; i < 4; i++)
+    {
+        command[i] = buffer[i];
+    }
+    if (strcasecmp(command, "HELO") == 0)
+    {
+        return status > 1 ? -1 : S_HELO;
+    }
+    else if (strcasecmp(command, "QUIT") == 0)
+    {
+        return S_QUIT;
+    }
+    else if (strcasecmp(command, "MAIL") == 0)
+    {
+        for (int i = 5; i < 9; i++)
+        {
+            command[i - 5] = buffer[i];
+        }
+        return strcasecmp(command, "FROM") != 0 ? S_UNKNOWN : status != 1 ? -1 : S_MAIL;
+    }
+    else if (strcasecmp(command, "RCPT") == 0)
+    {
+        for (int i = 5; i < 7; i++)
+        {
+            command[i - 5] = buffer[i];
+        }
+        command[2] = '\0';
+        return strcasecmp(command, "TO") != 0 ? S_UNKNOWN : status < 2 || status > 3 ? -1 : S_RCPT;
+    }
+    else if (strcasecmp(command, "DATA") == 0)
+    {
+        return status != 3 ? -1 : S_DATA;
+    }
+    else if (strcasecmp(command, "RSET") == 0)
+    {
+        return status == 0 ? -1 : S_RSET;
+    }
+    else if (strcasecmp(command, "NOOP") == 0)
+    {
+        return status == 0 ? -1 : S_NOOP;
+    }
+    return S_UNKNOWN;
+}
+
+/* The chain pop3.cc used */
+static int pop3_chain(const char *buffer, int status)
+{
+    static const char *VERBS[] = { "USER", "QUIT", "PASS", "STAT", "UIDL", "RETR", "DELE", "LIST", "RSET", "NOOP" };
+    static const int IDS[] = { P_USER, P_QUIT, P_PASS, P_STAT, P_UIDL, P_RETR, P_DELE, P_LIST, P_RSET, P_NOOP };
+    char command[5] = { };
+    for (int i = 0; i < 4; i++)
+    {
+        command[i] = buffer[i];
+    }
+    for (int i = 0; i < 10; i++)
+    {
+        if (strcasecmp(command, VERBS[i]) == 0)
+        {
+            return POP3_ALLOWED[status][IDS[i]] ? IDS[i] : -1;
+        }
+    }
+    return P_UNKNOWN;
+}
+
+static int smtp_table(const char *buffer, int status)
+{
+    smtp_t cmd = smtp_lookup(buffer);
+    return SMTP_ALLOWED[status][cmd] ? cmd : -1;
+}
+
+static int pop3_table(const char *buffer, int status)
+{
+    pop3_t cmd = pop3_lookup(buffer);
+    return POP3_ALLOWED[status][cmd] ? cmd : -1;
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define LINES 4096 // cycled, so the lines stay in cache like a session's buffer
+
+/* Time a dispatcher over the lines, returns nanoseconds per line and adds the results to a checksum */
+static double run(int (*dispatch)(const char *, int), char **lines, int *states, int n, long &sum)
+{
+    double start = now();
+    for (int i = 0; i < n; i++)
+    {
+        sum += dispatch(lines[i & (LINES - 1)], states[i & (LINES - 1)]);
+    }
+    return (now() - start) * 1e9 / n;
+}
+
+int main(int argc, char *argv[])
+{
+    int n = 20000000;
+    if (argc == 3 && strcmp(argv[1], "-n") == 0)
+    {
+        n = atoi(argv[2]);
+    }
+    static const char *SMTP_LINES[] = { "HELO localhost\r\n", "MAIL FROM:<a@b>\r\n", "RCPT TO:<u@localhost>\r\n",
+                                        "rcpt to:<v@localhost>\r\n", "DATA\r\n", "RSET\r\n", "NOOP\r\n", "QUIT\r\n", "EHLO x\r\n"
+                                      };
+    static const char *POP3_LINES[] = { "USER u\r\n", "PASS p\r\n", "STAT\r\n", "LIST\r\n", "uidl 3\r\n", "RETR 1\r\n",
+                                        "DELE 2\r\n", "RSET\r\n", "NOOP\r\n", "QUIT\r\n", "TOP 1 2\r\n"
+                                      };
+    const int lines = LINES;
+    char *smtp[lines], *pop3[lines];
+    int smtp_state[lines], pop3_state[lines];
+    srand(1);
+    for (int i = 0; i < lines; i++)
+    {
+        smtp[i] = (char *) calloc(64, 1);
+        strcpy(smtp[i], SMTP_LINES[rand() % 9]);
+        smtp_state[i] = rand() % 4;
+        pop3[i] = (char *) calloc(64, 1);
+        strcpy(pop3[i], POP3_LINES[rand() % 11]);
+        pop3_state[i] = rand() % 2;
+    }
+    for (int i = 0; i < lines; i++)
+    {
+        if (smtp_chain(smtp[i], smtp_state[i]) != smtp_table(smtp[i], smtp_state[i])
+                || pop3_chain(pop3[i], pop3_state[i]) != pop3_table(pop3[i], pop3_state[i]))
+        {
+            fprintf(stderr, "Dispatch mismatch on %s", smtp[i]);
+            return 1;
+        }
+    }
+    long sum = 0;
+    printf("smtp strcasecmp chain %6.2f ns/command\n", run(smtp_chain, smtp, smtp_state, n, sum));
+    printf("smtp hashed switch    %6.2f ns/command\n", run(smtp_table, smtp, smtp_state, n, sum));
+    printf("pop3 strcasecmp chain %6.2f ns/command\n", run(pop3_chain, pop3, pop3_state, n, sum));
+    printf("pop3 hashed switch    %6.2f ns/command\n", run(pop3_table, pop3, pop3_state, n, sum));
+    return sum == 42 ? 1 : 0;
+}
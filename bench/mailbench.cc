@@ -0,0 +1,534 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+
+using namespace std;
+
+// Load generator for the SMTP and POP3 servers. One thread drives thousands
+// of nonblocking connections with epoll. Sessions are started at a target
+// rate (open loop) or as soon as one finishes (closed loop), and every step
+// of a session is timed into a histogram.
+//
+// An SMTP session delivers one message: HELO, MAIL, RCPT (one or more), DATA,
+// the body, QUIT. A POP3 session logs in, runs STAT, retrieves and deletes
+// the first message if there is one, and quits.
+//
+// In open loop, session latency is measured from the time the session was
+// scheduled to start, so a server that falls behind shows it in the tail
+// instead of slowing the generator down (coordinated omission).
+
+#define USAGE "Usage: mailbench [-s smtp_port] [-p pop3_port] [-h host] [-c connections] [-r sessions_per_second]\n" \
+              "                 [-d seconds] [-m smtp_percent] [-n recipients] [-z message_bytes] [-k] [-u user,...]\n"
+
+/* A histogram of latencies in microseconds with 1% precision: 64 linear buckets in every power of two */
+#define SUB_BITS 7
+#define SUB_COUNT (1 << SUB_BITS)
+#define MAGNITUDES 40
+#define BUCKETS ((MAGNITUDES + 2) * SUB_COUNT / 2)
+
+class Histogram
+{
+public:
+    Histogram() : total(0), max(0)
+    {
+        counts.assign(BUCKETS, 0);
+    }
+
+    void record(uint64_t value)
+    {
+        counts[index(value)]++;
+        total++;
+        if (value > max)
+        {
+            max = value;
+        }
+    }
+
+    /* The smallest value that at least a fraction of the recorded values do not exceed */
+    uint64_t percentile(double fraction) const
+    {
+        uint64_t rank = (uint64_t)(fraction * total + 0.5), seen = 0;
+        if (rank == 0)
+        {
+            rank = 1;
+        }
+        for (size_t i = 0; i < counts.size(); i++)
+        {
+            seen += counts[i];
+            if (seen >= rank)
+            {
+                return highest(i) < max ? highest(i) : max;
+            }
+        }
+        return max;
+    }
+
+    uint64_t count() const
+    {
+        return total;
+    }
+
+    uint64_t maximum() const
+    {
+        return max;
+    }
+
+private:
+    vector<uint64_t> counts;
+    uint64_t total, max;
+
+    /* Values below SUB_COUNT have a bucket each, then every power of two is split in SUB_COUNT / 2 buckets */
+    static size_t index(uint64_t value)
+    {
+        if (value < SUB_COUNT)
+        {
+            return value;
+        }
+        int magnitude = 64 - __builtin_clzll(value) - SUB_BITS; // shift that leaves SUB_BITS bits
+        if (magnitude > MAGNITUDES)
+        {
+            return BUCKETS - 1;
+        }
+        return magnitude * SUB_COUNT / 2 + (value >> magnitude);
+    }
+
+    static uint64_t highest(size_t i)
+    {
+        if (i < SUB_COUNT)
+        {
+            return i;
+        }
+        uint64_t magnitude = (i - SUB_COUNT / 2) / (SUB_COUNT / 2), sub = i - magnitude * SUB_COUNT / 2;
+        return ((sub + 1) << magnitude) - 1;
+    }
+};
+
+enum op_t
+{
+    SMTP_CONNECT, SMTP_HELO, SMTP_MAIL, SMTP_RCPT, SMTP_DATA, SMTP_BODY, SMTP_QUIT, SMTP_SESSION,
+    POP3_CONNECT, POP3_USER, POP3_PASS, POP3_STAT, POP3_RETR, POP3_DELE, POP3_QUIT, POP3_SESSION, OPS
+};
+
+const char *OP_NAMES[OPS] =
+{
+    "smtp connect", "smtp HELO", "smtp MAIL", "smtp RCPT", "smtp DATA", "smtp message", "smtp QUIT", "smtp session",
+    "pop3 connect", "pop3 USER", "pop3 PASS", "pop3 STAT", "pop3 RETR", "pop3 DELE", "pop3 QUIT", "pop3 session"
+};
+
+struct session_t
+{
+    int fd;
+    bool pop3;
+    int step;              // op being waited for
+    int rcpts;             // recipients left to send
+    int messages;          // from STAT
+    double scheduled, sent;
+    string out;            // bytes not written yet
+    size_t out_done;
+    string in;             // bytes of the current response
+    bool multiline;
+};
+
+Histogram HISTOGRAMS[OPS];
+uint64_t ERRORS[OPS];
+uint64_t BYTES_OUT, BYTES_IN;
+string HOST = "127.0.0.1";
+int SMTP_PORT = 2500, POP3_PORT = 11000;
+int CONNECTIONS = 100, RECIPIENTS = 1, MESSAGE_BYTES = 2000, SMTP_PERCENT = 50;
+double RATE = 0, DURATION = 10;
+bool KEEP = false;
+vector<string> USERS;
+string BODY;
+int epoll_fd;
+set<session_t *> SESSIONS;
+
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Helper function that builds a message body of about the requested size, with CRLF lines of mail-like length */
+string make_body(int size)
+{
+    string body = "Subject: mailbench\r\nFrom: bench@localhost\r\n\r\n";
+    const char *words = "the quick brown fox jumps over the lazy dog and keeps running through the field ";
+    while ((int) body.size() < size)
+    {
+        string line;
+        while (line.size() < 72)
+        {
+            line += words + rand() % 40;
+            line.resize(line.size() < 72 ? line.size() : 72);
+        }
+        body += line + "\r\n";
+    }
+    return body + ".\r\n";
+}
+
+/* Helper function that queues bytes on a session and writes what the socket takes */
+bool send_text(session_t *s, const string &text)
+{
+    s->out += text;
+    while (s->out_done < s->out.size())
+    {
+        ssize_t n = write(s->fd, s->out.data() + s->out_done, s->out.size() - s->out_done);
+        if (n < 0)
+        {
+            if (errno == EAGAIN)
+            {
+                struct epoll_event ev = { };
+                ev.events = EPOLLIN | EPOLLOUT;
+                ev.data.ptr = s;
+                epoll_ctl(epoll_fd, EPOLL_CTL_MOD, s->fd, &ev);
+                return true;
+            }
+            return false;
+        }
+        s->out_done += n;
+        BYTES_OUT += n;
+    }
+    s->out.clear();
+    s->out_done = 0;
+    return true;
+}
+
+/* Helper function that sends the command of the next step and starts timing it */
+bool next_step(session_t *s, int step)
+{
+    s->step = step;
+    s->sent = now();
+    s->in.clear();
+    s->multiline = false;
+    char line[128];
+    const string &user = USERS[rand() % USERS.size()];
+    switch (step)
+    {
+    case SMTP_HELO:
+        return send_text(s, "HELO mailbench\r\n");
+    case SMTP_MAIL:
+        return send_text(s, "MAIL FROM:<bench@localhost>\r\n");
+    case SMTP_RCPT:
+        snprintf(line, sizeof(line), "RCPT TO:<%s@localhost>\r\n", user.c_str());
+        s->rcpts--;
+        return send_text(s, line);
+    case SMTP_DATA:
+        return send_text(s, "DATA\r\n");
+    case SMTP_BODY:
+        return send_text(s, BODY);
+    case POP3_USER:
+        snprintf(line, sizeof(line), "USER %s\r\n", user.c_str());
+        return send_text(s, line);
+    case POP3_PASS:
+        return send_text(s, "PASS cis505\r\n");
+    case POP3_STAT:
+        return send_text(s, "STAT\r\n");
+    case POP3_RETR:
+        s->multiline = true;
+        return send_text(s, "RETR 1\r\n");
+    case POP3_DELE:
+        return send_text(s, "DELE 1\r\n");
+    case SMTP_QUIT:
+    case POP3_QUIT:
+        return send_text(s, "QUIT\r\n");
+    }
+    return false;
+}
+
+/* Start a session that was scheduled at a time */
+session_t *start(bool pop3, double scheduled)
+{
+    session_t *s = new session_t();
+    s->pop3 = pop3;
+    s->scheduled = scheduled;
+    s->sent = now();
+    s->step = pop3 ? POP3_CONNECT : SMTP_CONNECT;
+    s->rcpts = RECIPIENTS;
+    s->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int one = 1;
+    setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct sockaddr_in addr = { };
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(pop3 ? POP3_PORT : SMTP_PORT);
+    inet_pton(AF_INET, HOST.c_str(), &addr.sin_addr);
+    connect(s->fd, (struct sockaddr *) &addr, sizeof(addr)); // completes with the greeting
+    struct epoll_event ev = { };
+    ev.events = EPOLLIN;
+    ev.data.ptr = s;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s->fd, &ev);
+    SESSIONS.insert(s);
+    return s;
+}
+
+void finish(session_t *s, bool failed)
+{
+    if (failed)
+    {
+        ERRORS[s->step]++;
+        ERRORS[s->pop3 ? POP3_SESSION : SMTP_SESSION]++;
+    }
+    else
+    {
+        HISTOGRAMS[s->pop3 ? POP3_SESSION : SMTP_SESSION].record((uint64_t)((now() - s->scheduled) * 1e6));
+    }
+    close(s->fd);
+    SESSIONS.erase(s);
+    delete s;
+}
+
+/* Helper function that checks if the response of the current step is complete */
+bool complete(session_t *s)
+{
+    if (s->multiline && s->in.size() > 0 && s->in[0] == '+')
+    {
+        return s->in.size() >= 5 && s->in.compare(s->in.size() - 5, 5, "\r\n.\r\n") == 0;
+    }
+    return s->in.size() >= 2 && s->in.compare(s->in.size() - 2, 2, "\r\n") == 0;
+}
+
+/* Handle the complete response of a step and go on, returns false when the session is over */
+bool advance(session_t *s, bool &failed)
+{
+    double done = now();
+    bool ok = s->pop3 ? s->in[0] == '+' : s->in[0] == '2' || s->in[0] == '3';
+    if (!ok)
+    {
+        failed = true;
+        return false;
+    }
+    HISTOGRAMS[s->step].record((uint64_t)((done - s->sent) * 1e6));
+    switch (s->step)
+    {
+    case SMTP_CONNECT:
+        return next_step(s, SMTP_HELO);
+    case SMTP_HELO:
+        return next_step(s, SMTP_MAIL);
+    case SMTP_MAIL:
+        return next_step(s, SMTP_RCPT);
+    case SMTP_RCPT:
+        return next_step(s, s->rcpts > 0 ? SMTP_RCPT : SMTP_DATA);
+    case SMTP_DATA:
+        return next_step(s, SMTP_BODY);
+    case SMTP_BODY:
+        return next_step(s, SMTP_QUIT);
+    case POP3_CONNECT:
+        return next_step(s, POP3_USER);
+    case POP3_USER:
+        return next_step(s, POP3_PASS);
+    case POP3_PASS:
+        return next_step(s, POP3_STAT);
+    case POP3_STAT:
+        s->messages = atoi(s->in.c_str() + 4);
+        return next_step(s, s->messages > 0 ? POP3_RETR : POP3_QUIT);
+    case POP3_RETR:
+        return next_step(s, KEEP ? POP3_QUIT : POP3_DELE);
+    case POP3_DELE:
+        return next_step(s, POP3_QUIT);
+    }
+    return false; // QUIT answered
+}
+
+/* Read what a session received, returns false when the session is over */
+bool receive(session_t *s, bool &failed)
+{
+    char buffer[64 * 1024];
+    while (true)
+    {
+        ssize_t n = read(s->fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EAGAIN)
+        {
+            return true;
+        }
+        if (n <= 0)
+        {
+            failed = true;
+            return false;
+        }
+        BYTES_IN += n;
+        s->in.append(buffer, n);
+        if (complete(s) && !advance(s, failed))
+        {
+            return false;
+        }
+    }
+}
+
+void report(double elapsed)
+{
+    printf("%-14s %10s %8s %10s %10s %10s %10s\n", "operation", "count", "errors", "p50 ms", "p99 ms", "p999 ms",
+           "max ms");
+    for (int i = 0; i < OPS; i++)
+    {
+        const Histogram &h = HISTOGRAMS[i];
+        if (h.count() == 0 && ERRORS[i] == 0)
+        {
+            continue;
+        }
+        printf("%-14s %10lu %8lu %10.3f %10.3f %10.3f %10.3f\n", OP_NAMES[i], (unsigned long) h.count(),
+               (unsigned long) ERRORS[i], h.percentile(0.5) / 1e3, h.percentile(0.99) / 1e3,
+               h.percentile(0.999) / 1e3, h.maximum() / 1e3);
+    }
+    printf("\n%.1f seconds, %.1f smtp sessions/s, %.1f pop3 sessions/s, %.2f MB/s out, %.2f MB/s in\n", elapsed,
+           HISTOGRAMS[SMTP_SESSION].count() / elapsed, HISTOGRAMS[POP3_SESSION].count() / elapsed,
+           BYTES_OUT / elapsed / 1e6, BYTES_IN / elapsed / 1e6);
+}
+
+int main(int argc, char *argv[])
+{
+    int ch;
+    string users = "bench";
+    while ((ch = getopt(argc, argv, "s:p:h:c:r:d:m:n:z:ku:")) != -1)
+    {
+        switch (ch)
+        {
+        case 's':
+            SMTP_PORT = atoi(optarg);
+            break;
+        case 'p':
+            POP3_PORT = atoi(optarg);
+            break;
+        case 'h':
+            HOST = optarg;
+            break;
+        case 'c':
+            CONNECTIONS = atoi(optarg);
+            break;
+        case 'r':
+            RATE = atof(optarg);
+            break;
+        case 'd':
+            DURATION = atof(optarg);
+            break;
+        case 'm':
+            SMTP_PERCENT = atoi(optarg);
+            break;
+        case 'n':
+            RECIPIENTS = atoi(optarg);
+            break;
+        case 'z':
+            MESSAGE_BYTES = atoi(optarg);
+            break;
+        case 'k':
+            KEEP = true;
+            break;
+        case 'u':
+            users = optarg;
+            break;
+        default:
+            fprintf(stderr, USAGE);
+            exit(1);
+        }
+    }
+    if (CONNECTIONS < 1 || RECIPIENTS < 1 || SMTP_PERCENT < 0 || SMTP_PERCENT > 100)
+    {
+        fprintf(stderr, USAGE);
+        exit(1);
+    }
+    for (size_t start = 0, end; start <= users.size(); start = end + 1)
+    {
+        end = users.find(',', start);
+        end = end == string::npos ? users.size() : end;
+        if (end > start)
+        {
+            USERS.push_back(users.substr(start, end - start));
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+    srand(1);
+    BODY = make_body(MESSAGE_BYTES);
+    epoll_fd = epoll_create1(0);
+
+    double begin = now(), next = begin, end = begin + DURATION;
+    uint64_t started = 0;
+    int active = 0;
+    deque<double> backlog; // scheduled sessions waiting for a free connection
+    vector<struct epoll_event> events(1024);
+    while (now() < end || active > 0)
+    {
+        double t = now();
+        if (t < end)
+        {
+            if (RATE > 0)
+            {
+                while (next <= t)
+                {
+                    backlog.push_back(next);
+                    next = begin + ++started / RATE;
+                }
+            }
+            else
+            {
+                while ((int)(active + backlog.size()) < CONNECTIONS)
+                {
+                    backlog.push_back(t);
+                }
+            }
+        }
+        else if (t > end + 30)
+        {
+            fprintf(stderr, "%d sessions did not finish\n", active);
+            while (!SESSIONS.empty())
+            {
+                finish(*SESSIONS.begin(), true);
+            }
+            break;
+        }
+        while (!backlog.empty() && active < CONNECTIONS && (t < end || RATE == 0))
+        {
+            start(rand() % 100 >= SMTP_PERCENT, backlog.front());
+            backlog.pop_front();
+            active++;
+        }
+        if (t >= end)
+        {
+            backlog.clear();
+        }
+        int timeout = RATE > 0 && t < end ? (int)((next - t) * 1000) : 10;
+        int n = epoll_wait(epoll_fd, &events[0], events.size(), timeout < 1 ? 1 : timeout);
+        for (int i = 0; i < n; i++)
+        {
+            session_t *s = (session_t *) events[i].data.ptr;
+            bool failed = false, alive = true;
+            if (events[i].events & EPOLLOUT)
+            {
+                alive = send_text(s, "");
+                if (alive && s->out.empty())
+                {
+                    struct epoll_event ev = { };
+                    ev.events = EPOLLIN;
+                    ev.data.ptr = s;
+                    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, s->fd, &ev);
+                }
+                failed = !alive;
+            }
+            if (alive && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+            {
+                alive = receive(s, failed);
+            }
+            if (!alive)
+            {
+                finish(s, failed);
+                active--;
+            }
+        }
+    }
+    report(now() - begin);
+    return 0;
+}
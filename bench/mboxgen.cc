@@ -0,0 +1,345 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Generator of synthetic mailboxes for scale testing. Messages are written
+// the way do_data stores them: a "From <sender> <ctime>" title line, then the
+// lines exactly as the client sent them, CRLF terminated and dot-stuffed.
+//
+// Bodies are plain text or, for a share of the messages, MIME multipart with
+// a base64 attachment. Dot-leading lines, bare-LF lines and pathological long
+// lines can be mixed in. The output depends only on the options and the seed,
+// so the same corpus can be generated again anywhere. Every mailbox gets -n
+// messages or stops at -g bytes, whichever comes first.
+//
+// Mailboxes are written in the flat layout; "mboxindex -m" moves them into
+// the hashed one.
+
+#define USAGE "Usage: mboxgen [-n messages] [-g max_bytes] [-z size] [-d fixed|uniform|lognormal] [-a attach_percent]\n" \
+              "              [-t dot_percent] [-b bare_lf_percent] [-l long_percent] [-L long_length] [-s seed]\n" \
+              "              [-U users] dir [user ...]\n"
+
+#define LINE_WIDTH 72
+#define BASE64_WIDTH 76
+#define START_TIME 1507989451 // Sat Oct 14 13:57:31 2017
+
+enum dist_t {FIXED, UNIFORM, LOGNORMAL};
+
+int MESSAGES = 100, ATTACH_PERCENT = 10, DOT_PERCENT = 1, BARE_PERCENT = 0, LONG_PERCENT = 0;
+uint64_t MAX_BYTES = 0, SIZE = 4096, LONG_LENGTH = 1024 * 1024;
+dist_t DIST = LOGNORMAL;
+uint64_t STATE = 1;
+
+const char *WORDS[] =
+{
+    "the", "mail", "server", "message", "deliver", "mailbox", "of", "to", "and", "a", "in", "is", "that",
+    "for", "it", "with", "as", "was", "on", "be", "at", "by", "this", "have", "from", "or", "one", "had",
+    "not", "but", "what", "all", "were", "when", "we", "there", "can", "an", "your", "which", "their",
+    "said", "if", "do", "will", "each", "about", "how", "up", "out", "them", "then", "she", "many", "some",
+    "so", "these", "would", "other", "into", "has", "more", "her", "two", "like", "him", "see", "time"
+};
+const int WORD_COUNT = sizeof(WORDS) / sizeof(WORDS[0]);
+
+const char *NAMES[] =
+{
+    "alice", "bob", "carol", "dave", "erin", "frank", "grace", "heidi", "ivan", "judy", "mallory", "oscar"
+};
+const int NAME_COUNT = sizeof(NAMES) / sizeof(NAMES[0]);
+
+const char BASE64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* xorshift64*, fast and the same on every platform */
+uint64_t next_random()
+{
+    STATE ^= STATE >> 12;
+    STATE ^= STATE << 25;
+    STATE ^= STATE >> 27;
+    return STATE * 0x2545f4914f6cdd1dULL;
+}
+
+/* Helper function that returns a random integer in [0, n) */
+uint64_t below(uint64_t n)
+{
+    return n ? next_random() % n : 0;
+}
+
+/* Helper function that returns a random number in (0, 1) */
+double uniform()
+{
+    return ((next_random() >> 11) + 0.5) / 9007199254740992.0;
+}
+
+/* Helper function that parses a size with an optional K, M or G suffix */
+uint64_t parse_size(const char *text)
+{
+    char *end;
+    uint64_t size = strtoull(text, &end, 10);
+    switch (*end)
+    {
+    case 'G':
+    case 'g':
+        size <<= 10;
+    case 'M':
+    case 'm':
+        size <<= 10;
+    case 'K':
+    case 'k':
+        size <<= 10;
+    }
+    return size;
+}
+
+/* Body size of the next message, following the distribution around SIZE */
+uint64_t body_size()
+{
+    switch (DIST)
+    {
+    case FIXED:
+        return SIZE;
+    case UNIFORM:
+        return SIZE / 2 + below(SIZE + 1);
+    default:
+        // median SIZE, sigma 1: most mail is small, a few messages are very large
+        return (uint64_t)(SIZE * exp(sqrt(-2 * log(uniform())) * cos(2 * M_PI * uniform())));
+    }
+}
+
+/* Helper function that appends one text line to a body, with the requested oddities unless it is a header */
+void add_line(string &body, size_t width, bool header = false)
+{
+    size_t start = body.size();
+    if (!header && below(100) < DOT_PERCENT)
+    {
+        body += ".."; // a line starting with a dot, as the client sends it
+    }
+    while (body.size() - start < width)
+    {
+        body += WORDS[below(WORD_COUNT)];
+        body += ' ';
+    }
+    body.resize(body.size() - 1);
+    body += !header && below(100) < BARE_PERCENT ? "\n" : "\r\n";
+}
+
+/* Helper function that appends text lines up to about a number of bytes */
+void add_text(string &body, uint64_t size)
+{
+    size_t end = body.size() + size;
+    while (body.size() < end)
+    {
+        add_line(body, 20 + below(LINE_WIDTH - 20));
+    }
+}
+
+/* Helper function that appends base64 lines of random bytes up to about a number of bytes */
+void add_base64(string &body, uint64_t size)
+{
+    size_t end = body.size() + size;
+    while (body.size() < end)
+    {
+        for (int i = 0; i < BASE64_WIDTH; i += 8)
+        {
+            uint64_t r = next_random();
+            for (int j = 0; j < 8; j++, r >>= 6)
+            {
+                body += BASE64[r & 63];
+            }
+        }
+        body.resize(body.size() - 4); // 76 characters per line
+        body += "\r\n";
+    }
+}
+
+/* Build one message: the title line and everything do_data would have stored */
+void make_message(string &out, const string &user, int number)
+{
+    time_t date = START_TIME + (time_t) number * 97 + below(97);
+    struct tm tm;
+    char title_date[32], header_date[64];
+    gmtime_r(&date, &tm);
+    asctime_r(&tm, title_date); // the format of ctime, ending with a LF
+    strftime(header_date, sizeof(header_date), "%a, %d %b %Y %H:%M:%S +0000", &tm);
+    const char *sender = NAMES[below(NAME_COUNT)];
+    uint64_t size = body_size(), id = next_random();
+
+    char line[512];
+    snprintf(line, sizeof(line), "From <%s@localhost> %s", sender, title_date);
+    out = line;
+    snprintf(line, sizeof(line), "From: %s <%s@localhost>\r\nTo: %s@localhost\r\n"
+             "Message-ID: <%016llx@localhost>\r\nDate: %s\r\nSubject: ", sender, sender, user.c_str(),
+             (unsigned long long) id, header_date);
+    out += line;
+    add_line(out, 10 + below(40), true);
+    out += "MIME-Version: 1.0\r\n";
+    bool attach = below(100) < ATTACH_PERCENT;
+    if (attach)
+    {
+        snprintf(line, sizeof(line), "Content-Type: multipart/mixed; boundary=\"b%016llx\"\r\n\r\n"
+                 "--b%016llx\r\nContent-Type: text/plain; charset=utf-8\r\n\r\n",
+                 (unsigned long long) id, (unsigned long long) id);
+        out += line;
+        add_text(out, size / 5);
+        snprintf(line, sizeof(line), "--b%016llx\r\nContent-Type: application/octet-stream\r\n"
+                 "Content-Transfer-Encoding: base64\r\n"
+                 "Content-Disposition: attachment; filename=\"file%d.bin\"\r\n\r\n",
+                 (unsigned long long) id, number);
+        out += line;
+        add_base64(out, size - size / 5);
+        snprintf(line, sizeof(line), "--b%016llx--\r\n", (unsigned long long) id);
+        out += line;
+    }
+    else
+    {
+        out += "Content-Type: text/plain; charset=utf-8; format=flowed\r\nContent-Transfer-Encoding: 7bit\r\n\r\n";
+        add_text(out, size);
+    }
+    if (below(100) < LONG_PERCENT)
+    {
+        add_line(out, LONG_LENGTH);
+    }
+    out += "\r\n";
+}
+
+/* Write the messages of one mailbox, returns the number of bytes */
+uint64_t write_mailbox(const string &dir, const string &user, uint64_t &messages)
+{
+    string path = dir + "/" + user + ".mbox";
+    FILE *file = fopen(path.c_str(), "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Cannot open %s (%s)\n", path.c_str(), strerror(errno));
+        exit(1);
+    }
+    setvbuf(file, NULL, _IOFBF, 1 << 20);
+    string message;
+    uint64_t bytes = 0;
+    for (int i = 0; i < MESSAGES && (MAX_BYTES == 0 || bytes < MAX_BYTES); i++)
+    {
+        make_message(message, user, i);
+        if (fwrite(message.data(), 1, message.size(), file) != message.size())
+        {
+            fprintf(stderr, "Cannot write %s (%s)\n", path.c_str(), strerror(errno));
+            exit(1);
+        }
+        bytes += message.size();
+        messages++;
+    }
+    if (fclose(file) != 0)
+    {
+        fprintf(stderr, "Cannot write %s (%s)\n", path.c_str(), strerror(errno));
+        exit(1);
+    }
+    return bytes;
+}
+
+int main(int argc, char *argv[])
+{
+    /* Parsing command line arguments */
+    int ch = 0, user_count = 0;
+    uint64_t seed = 1;
+    while ((ch = getopt(argc, argv, "n:g:z:d:a:t:b:l:L:s:U:")) != -1)
+    {
+        switch (ch)
+        {
+        case 'n':
+            MESSAGES = atoi(optarg);
+            break;
+        case 'g':
+            MAX_BYTES = parse_size(optarg);
+            break;
+        case 'z':
+            SIZE = parse_size(optarg);
+            break;
+        case 'd':
+            if (strcmp(optarg, "fixed") == 0)
+            {
+                DIST = FIXED;
+            }
+            else if (strcmp(optarg, "uniform") == 0)
+            {
+                DIST = UNIFORM;
+            }
+            else if (strcmp(optarg, "lognormal") == 0)
+            {
+                DIST = LOGNORMAL;
+            }
+            else
+            {
+                fprintf(stderr, USAGE);
+                exit(1);
+            }
+            break;
+        case 'a':
+            ATTACH_PERCENT = atoi(optarg);
+            break;
+        case 't':
+            DOT_PERCENT = atoi(optarg);
+            break;
+        case 'b':
+            BARE_PERCENT = atoi(optarg);
+            break;
+        case 'l':
+            LONG_PERCENT = atoi(optarg);
+            break;
+        case 'L':
+            LONG_LENGTH = parse_size(optarg);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'U':
+            user_count = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, USAGE);
+            exit(1);
+        }
+    }
+    if (optind >= argc)
+    {
+        fprintf(stderr, USAGE);
+        exit(1);
+    }
+    string dir = argv[optind];
+    vector<string> users(argv + optind + 1, argv + argc);
+    for (int i = 0; i < user_count; i++)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "user%05d", i);
+        users.push_back(name);
+    }
+    if (users.empty())
+    {
+        users.push_back("bench");
+    }
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "Cannot create %s (%s)\n", dir.c_str(), strerror(errno));
+        exit(1);
+    }
+
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    uint64_t bytes = 0, messages = 0;
+    for (int i = 0; i < users.size(); i++)
+    {
+        STATE = (seed + i) * 0x9e3779b97f4a7c15ULL | 1; // every mailbox is reproducible on its own
+        bytes += write_mailbox(dir, users[i], messages);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = end.tv_sec - begin.tv_sec + (end.tv_nsec - begin.tv_nsec) / 1e9;
+    printf("Wrote %d mailboxes, %llu messages, %llu bytes in %.2f s (%.1f MB/s)\n", (int) users.size(),
+           (unsigned long long) messages, (unsigned long long) bytes, elapsed, bytes / elapsed / 1e6);
+    return 0;
+}
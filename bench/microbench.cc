@@ -0,0 +1,420 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "arena.h"
+#include "digest.h"
+#include "mailbox.h"
+
+using namespace std;
+
+// Microbenchmarks of the inner loops of the servers. Every kernel is run in
+// batches until it has taken a fixed time, five times over, and the median
+// and fastest nanoseconds per operation are reported as JSON. With a
+// baseline file from an earlier run, the change of every kernel is printed
+// as well, so a change can show what it does to each loop.
+//
+// The line framing of client_t, parse() of pop3.cc and the address splitting
+// of do_rcpt are copies, since they live in the servers; the mailbox parser,
+// the digests and the response builder are linked from the sources.
+//
+// Usage: microbench [-t seconds] [-k kernel] [-o result.json] [-c baseline.json]
+
+#define REPEATS 5
+#define MBOX_BYTES (1024 * 1024) // below the size that is parsed with several threads
+#define MESSAGE_BYTES 4096
+
+struct kernel_t
+{
+    const char *name;
+    size_t (*run)();          // one batch, returns the number of operations
+    size_t bytes;             // bytes per operation, 0 if not meaningful
+};
+
+struct result_t
+{
+    string name;
+    double median, fastest;
+    uint64_t ops;
+    size_t bytes;
+};
+
+volatile uint64_t SINK; // keeps the results of the kernels alive
+string MBOX_PATH;
+char MESSAGE[MESSAGE_BYTES];
+
+static const char *LINES[] =
+{
+    "HELO localhost\r\n", "MAIL FROM:<alice@localhost>\r\n", "RCPT TO:<bob@localhost>\r\n",
+    "RCPT TO:<carol.lastname@localhost>\r\n", "DATA\r\n", "Subject: a line of the message body\r\n",
+    "USER alice\r\n", "PASS cis505\r\n", "RETR 12\r\n", "QUIT\r\n"
+};
+static const int LINE_COUNT = sizeof(LINES) / sizeof(LINES[0]);
+
+/* Line framing of client_t: find the end of the first line, then move the rest of the buffer to its head */
+static size_t frame()
+{
+    static char buffer[1024 * 8];
+    static string block;
+    if (block.empty())
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            for (int j = 0; j < LINE_COUNT; j++)
+            {
+                block += LINES[j];
+            }
+        }
+    }
+    memcpy(buffer, block.c_str(), block.size() + 1);
+    size_t ops = 0;
+    char *tail;
+    while ((tail = strstr(buffer, "\r\n")) != NULL)
+    {
+        tail += 2;
+        SINK += buffer[0];
+        char *new_head = buffer;
+        while (new_head != tail)
+        {
+            *new_head = '\0';
+            new_head++;
+        }
+        new_head = buffer;
+        while (*tail != '\0')
+        {
+            *new_head = *tail;
+            *tail = '\0';
+            new_head++;
+            tail++;
+        }
+        ops++;
+    }
+    return ops;
+}
+
+/* parse() of pop3.cc */
+static void parse(char *buffer, char *dest, int limit)
+{
+    int i = 0, j = 0, len = strlen(buffer);
+    while (buffer[i] != ' ' && i < len)
+    {
+        i++;
+    }
+    i++;
+    while (buffer[i] != '\r' && i < len && j < limit)
+    {
+        dest[j] = buffer[i];
+        j++;
+        i++;
+    }
+}
+
+static size_t parse_args()
+{
+    static char lines[3][32] = { "USER alice\r\n", "PASS cis505\r\n", "RETR 12\r\n" };
+    for (int i = 0; i < 3; i++)
+    {
+        char dest[65] = { };
+        parse(lines[i], dest, 64);
+        SINK += dest[0];
+    }
+    return 3;
+}
+
+/* The address splitting of do_rcpt, up to the host check */
+static size_t rcpt_split()
+{
+    static char lines[2][48] = { "RCPT TO:<bob@localhost>\r\n", "RCPT TO:<carol.lastname@localhost>\r\n" };
+    for (int k = 0; k < 2; k++)
+    {
+        char *buffer = lines[k];
+        char one_rcpt[65] = { }, one_host[65] = { };
+        int i = 0, j = 0, len = strlen(buffer);
+        while (buffer[i] != '<' && i < len)
+        {
+            i++;
+        }
+        i++;
+        while (buffer[i] != '@' && i < len)
+        {
+            one_rcpt[j] = buffer[i];
+            j++;
+            i++;
+        }
+        i++;
+        j = 0;
+        while (buffer[i] != '>' && i < len)
+        {
+            one_host[j] = buffer[i];
+            j++;
+            i++;
+        }
+        SINK += strcmp(one_host, "localhost") + one_rcpt[0];
+    }
+    return 2;
+}
+
+/* Parse and index a whole mailbox, as the first PASS of a user does */
+static size_t mbox_parse()
+{
+    snapshot_ptr snap = mbox_acquire(MBOX_PATH);
+    SINK += snap->count();
+    return 1; // the snapshot is dropped, so the next call parses again
+}
+
+static size_t digest_xxh64()
+{
+    unsigned char out[MAX_DIGEST_LENGTH];
+    computeDigest(MESSAGE, MESSAGE_BYTES, out);
+    SINK += out[0];
+    return 1;
+}
+
+static size_t digest_md5()
+{
+    unsigned char out[MAX_DIGEST_LENGTH];
+    computeDigest(MESSAGE, MESSAGE_BYTES, out);
+    SINK += out[0];
+    return 1;
+}
+
+/* The status line of STAT and PASS */
+static size_t format_stat()
+{
+    static Arena arena;
+    arena.reset();
+    Reply reply(arena, 64);
+    reply.add("+OK ").num(1234).add(" ").num(5678901).add("\r\n");
+    SINK += reply.size();
+    return 1;
+}
+
+/* Sixteen lines of a LIST listing */
+static size_t format_list()
+{
+    static Arena arena;
+    arena.reset();
+    Reply reply(arena, 1024);
+    for (int i = 1; i <= 16; i++)
+    {
+        reply.num(i).add(" ").num(1000 + i * 379).add("\r\n");
+    }
+    SINK += reply.size();
+    return 16;
+}
+
+static const kernel_t KERNELS[] =
+{
+    { "frame", frame, 0 },
+    { "parse", parse_args, 0 },
+    { "rcpt_split", rcpt_split, 0 },
+    { "mbox_parse", mbox_parse, MBOX_BYTES },
+    { "digest_xxh64", digest_xxh64, MESSAGE_BYTES },
+    { "digest_md5", digest_md5, MESSAGE_BYTES },
+    { "format_stat", format_stat, 0 },
+    { "format_list", format_list, 0 },
+};
+static const int KERNEL_COUNT = sizeof(KERNELS) / sizeof(KERNELS[0]);
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Helper function that writes a mailbox of about MBOX_BYTES in the format the SMTP server stores */
+static void make_mbox()
+{
+    char path[] = "/tmp/microbench-XXXXXX";
+    int fd = mkstemp(path);
+    string data;
+    for (int i = 0; data.size() < MBOX_BYTES; i++)
+    {
+        char title[128];
+        snprintf(title, sizeof(title), "From <alice@localhost> Sat Oct 14 13:%02d:%02d 2017\n", i / 60 % 60, i % 60);
+        data += title;
+        data += "Subject: message\r\n\r\n";
+        for (int j = 0; j < 40; j++)
+        {
+            data += "the quick brown fox jumps over the lazy dog, then it does it again\r\n";
+        }
+    }
+    if (write(fd, data.data(), data.size()) != (ssize_t) data.size())
+    {
+        perror("write");
+        exit(1);
+    }
+    close(fd);
+    MBOX_PATH = path;
+}
+
+/* Time a kernel: batches for about a fifth of the time, five times, the median and the fastest repetition */
+static result_t measure(const kernel_t &kernel, double seconds)
+{
+    if (strncmp(kernel.name, "digest_", 7) == 0)
+    {
+        digest_select(kernel.name + 7);
+    }
+    result_t result;
+    result.name = kernel.name;
+    result.bytes = kernel.bytes;
+    result.ops = 0;
+    vector<double> times;
+    kernel.run(); // warm up
+    for (int r = 0; r < REPEATS; r++)
+    {
+        uint64_t ops = 0;
+        double start = now(), end = start + seconds / REPEATS, t;
+        do
+        {
+            for (int i = 0; i < 64; i++)
+            {
+                ops += kernel.run();
+            }
+        }
+        while ((t = now()) < end);
+        times.push_back((t - start) * 1e9 / ops);
+        result.ops += ops;
+    }
+    sort(times.begin(), times.end());
+    result.median = times[REPEATS / 2];
+    result.fastest = times[0];
+    return result;
+}
+
+static void write_json(FILE *out, const vector<result_t> &results)
+{
+    fprintf(out, "{\n  \"kernels\": [\n");
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const result_t &r = results[i];
+        fprintf(out, "    {\"name\": \"%s\", \"ns_per_op\": %.3f, \"fastest_ns_per_op\": %.3f, \"ops\": %llu",
+                r.name.c_str(), r.median, r.fastest, (unsigned long long) r.ops);
+        if (r.bytes)
+        {
+            fprintf(out, ", \"mb_per_s\": %.1f", r.bytes / r.median * 1e3);
+        }
+        fprintf(out, "}%s\n", i + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+/* Helper function that reads the ns per op of every kernel of a file written by write_json */
+static bool read_json(const char *path, vector<pair<string, double> > &baseline)
+{
+    FILE *in = fopen(path, "r");
+    if (in == NULL)
+    {
+        return false;
+    }
+    char line[512], name[64];
+    double ns;
+    while (fgets(line, sizeof(line), in) != NULL)
+    {
+        if (sscanf(line, " {\"name\": \"%63[^\"]\", \"ns_per_op\": %lf", name, &ns) == 2)
+        {
+            baseline.push_back(make_pair(string(name), ns));
+        }
+    }
+    fclose(in);
+    return true;
+}
+
+static void compare(const vector<result_t> &results, const vector<pair<string, double> > &baseline)
+{
+    fprintf(stderr, "%-14s %14s %14s %9s\n", "kernel", "baseline ns", "current ns", "change");
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const result_t &r = results[i];
+        size_t j = 0;
+        while (j < baseline.size() && baseline[j].first != r.name)
+        {
+            j++;
+        }
+        if (j == baseline.size())
+        {
+            fprintf(stderr, "%-14s %14s %14.3f %9s\n", r.name.c_str(), "-", r.median, "new");
+        }
+        else
+        {
+            fprintf(stderr, "%-14s %14.3f %14.3f %+8.1f%%\n", r.name.c_str(), baseline[j].second, r.median,
+                    (r.median / baseline[j].second - 1) * 100);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int ch;
+    double seconds = 1;
+    const char *only = NULL, *output = NULL, *base = NULL;
+    while ((ch = getopt(argc, argv, "t:k:o:c:")) != -1)
+    {
+        switch (ch)
+        {
+        case 't':
+            seconds = atof(optarg);
+            break;
+        case 'k':
+            only = optarg;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'c':
+            base = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: microbench [-t seconds] [-k kernel] [-o result.json] [-c baseline.json]\n");
+            exit(1);
+        }
+    }
+    vector<pair<string, double> > baseline;
+    if (base != NULL && !read_json(base, baseline))
+    {
+        fprintf(stderr, "Cannot read %s\n", base);
+        exit(1);
+    }
+    make_mbox();
+    for (int i = 0; i < MESSAGE_BYTES; i++)
+    {
+        MESSAGE[i] = "the quick brown fox\r\n"[i % 21];
+    }
+
+    vector<result_t> results;
+    for (int i = 0; i < KERNEL_COUNT; i++)
+    {
+        if (only == NULL || strcmp(only, KERNELS[i].name) == 0)
+        {
+            results.push_back(measure(KERNELS[i], seconds));
+        }
+    }
+    unlink(MBOX_PATH.c_str());
+
+    FILE *out = stdout;
+    if (output != NULL && (out = fopen(output, "w")) == NULL)
+    {
+        fprintf(stderr, "Cannot write %s\n", output);
+        exit(1);
+    }
+    write_json(out, results);
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+    if (base != NULL)
+    {
+        compare(results, baseline);
+    }
+    return 0;
+}
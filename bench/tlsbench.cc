@@ -0,0 +1,232 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+using namespace std;
+
+// Cost of TLS on the POP3 server. One blocking client measures, each for a
+// fixed time:
+//
+//   handshakes   connect, STLS, a full handshake, QUIT
+//   resumed      the same, resuming the first session with its ticket
+//   plain RETR   one login, then RETR of the same message over and over
+//   TLS RETR     the same after STLS
+//
+// and prints the rate of each, with the throughput of the RETR runs. The
+// message is only read, so the mailbox is left as it was. Run the server
+// with -T, and on a kernel with the tls module loaded to measure kTLS.
+
+#define USAGE "Usage: tlsbench [-p pop3_port] [-h host] [-d seconds] [-u user] [-n message]\n"
+
+string HOST = "127.0.0.1", USER = "bench";
+int POP3_PORT = 11000, MESSAGE = 1;
+double DURATION = 5;
+SSL_CTX *CTX;
+
+/* A POP3 connection, encrypted once ssl is set */
+struct conn_t
+{
+    int fd;
+    SSL *ssl;
+    string in;   // bytes received and not consumed yet
+};
+
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void fail(const char *what)
+{
+    fprintf(stderr, "tlsbench: %s\n", what);
+    ERR_print_errors_fp(stderr);
+    exit(1);
+}
+
+/* Helper function that reads more bytes into the connection's buffer */
+void receive(conn_t &c)
+{
+    char data[64 * 1024];
+    int n = c.ssl ? SSL_read(c.ssl, data, sizeof(data)) : read(c.fd, data, sizeof(data));
+    if (n <= 0)
+    {
+        fail("connection closed");
+    }
+    c.in.append(data, n);
+}
+
+/* Read a response up to its terminator, "\r\n" or "\r\n.\r\n", and return its size */
+size_t response(conn_t &c, bool multiline)
+{
+    const char *end = multiline ? "\r\n.\r\n" : "\r\n";
+    size_t pos;
+    while ((pos = c.in.find(end)) == string::npos)
+    {
+        receive(c);
+    }
+    if (c.in[0] != '+')
+    {
+        fail(c.in.substr(0, c.in.find("\r\n")).c_str());
+    }
+    pos += strlen(end);
+    c.in.erase(0, pos);
+    return pos;
+}
+
+size_t command(conn_t &c, const string &line, bool multiline = false)
+{
+    int n = c.ssl ? SSL_write(c.ssl, line.data(), line.size()) : write(c.fd, line.data(), line.size());
+    if (n != (int) line.size())
+    {
+        fail("write failed");
+    }
+    return response(c, multiline);
+}
+
+conn_t open_conn()
+{
+    conn_t c = { socket(AF_INET, SOCK_STREAM, 0), NULL, "" };
+    struct sockaddr_in addr = { };
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(POP3_PORT);
+    inet_pton(AF_INET, HOST.c_str(), &addr.sin_addr);
+    int one = 1;
+    setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c.fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+    {
+        fail("cannot connect");
+    }
+    response(c, false); // greeting
+    return c;
+}
+
+/* STLS and a handshake, resuming session if there is one */
+void start_tls(conn_t &c, SSL_SESSION *session)
+{
+    command(c, "STLS\r\n");
+    c.ssl = SSL_new(CTX);
+    SSL_set_fd(c.ssl, c.fd);
+    if (session)
+    {
+        SSL_set_session(c.ssl, session);
+    }
+    if (SSL_connect(c.ssl) != 1)
+    {
+        fail("handshake failed");
+    }
+}
+
+void close_conn(conn_t &c)
+{
+    command(c, "QUIT\r\n");
+    if (c.ssl)
+    {
+        SSL_shutdown(c.ssl);
+        SSL_free(c.ssl);
+    }
+    close(c.fd);
+}
+
+/* Connect and handshake for DURATION seconds. The first session is kept, its ticket arrives after the handshake. */
+void handshakes(bool resume, SSL_SESSION *&session)
+{
+    int count = 0, reused = 0;
+    double start = now();
+    while (now() - start < DURATION)
+    {
+        conn_t c = open_conn();
+        start_tls(c, resume ? session : NULL);
+        reused += SSL_session_reused(c.ssl);
+        command(c, "CAPA\r\n", true);
+        if (session == NULL)
+        {
+            session = SSL_get1_session(c.ssl);
+        }
+        close_conn(c);
+        count++;
+    }
+    double elapsed = now() - start;
+    printf("%-12s %8d in %.1fs  %10.1f/s  %d resumed\n", resume ? "resumed" : "handshakes", count, elapsed,
+           count / elapsed, reused);
+}
+
+/* Retrieve the message for DURATION seconds on one session */
+void retrieve(bool tls)
+{
+    conn_t c = open_conn();
+    if (tls)
+    {
+        start_tls(c, NULL);
+    }
+    command(c, "USER " + USER + "\r\n");
+    command(c, "PASS cis505\r\n");
+    char retr[32];
+    snprintf(retr, sizeof(retr), "RETR %d\r\n", MESSAGE);
+    int count = 0;
+    uint64_t bytes = 0;
+    double start = now();
+    while (now() - start < DURATION)
+    {
+        bytes += command(c, retr, true);
+        count++;
+    }
+    double elapsed = now() - start;
+    printf("%-12s %8d in %.1fs  %10.1f/s  %.1f MB/s\n", tls ? "TLS RETR" : "plain RETR", count, elapsed,
+           count / elapsed, bytes / elapsed / 1e6);
+    close_conn(c);
+}
+
+int main(int argc, char *argv[])
+{
+    int ch;
+    while ((ch = getopt(argc, argv, "p:h:d:u:n:")) != -1)
+    {
+        switch (ch)
+        {
+        case 'p':
+            POP3_PORT = atoi(optarg);
+            break;
+        case 'h':
+            HOST = optarg;
+            break;
+        case 'd':
+            DURATION = atof(optarg);
+            break;
+        case 'u':
+            USER = optarg;
+            break;
+        case 'n':
+            MESSAGE = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, USAGE);
+            exit(1);
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+    CTX = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_verify(CTX, SSL_VERIFY_NONE, NULL); // a benchmark, the server's certificate is usually self-signed
+
+    SSL_SESSION *session = NULL;
+    handshakes(false, session);
+    handshakes(true, session);
+    retrieve(false);
+    retrieve(true);
+    SSL_SESSION_free(session);
+    SSL_CTX_free(CTX);
+    return 0;
+}
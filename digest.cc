@@ -0,0 +1,224 @@
+#include <openssl/md5.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "digest.h"
+
+/* Primes and rounds of XXH64, see https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md */
+static const uint64_t P1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t P2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t P3 = 0x165667B19E3779F9ULL;
+static const uint64_t P4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t P5 = 0x27D4EB2F165667C5ULL;
+
+/* Number of messages hashed together by the batch function */
+#define LANES 4
+
+struct xxh64_state
+{
+    uint64_t v[4];
+    const unsigned char *p;
+    size_t len;
+};
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char *p)
+{
+    uint64_t x;
+    memcpy(&x, p, 8); // little endian host
+    return x;
+}
+
+static inline uint32_t read32(const unsigned char *p)
+{
+    uint32_t x;
+    memcpy(&x, p, 4);
+    return x;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * P2;
+    acc = rotl(acc, 31);
+    return acc * P1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t val)
+{
+    acc ^= xxh64_round(0, val);
+    return acc * P1 + P4;
+}
+
+static void xxh64_init(xxh64_state *s, const char *data, size_t len)
+{
+    s->v[0] = P1 + P2;
+    s->v[1] = P2;
+    s->v[2] = 0;
+    s->v[3] = -P1;
+    s->p = (const unsigned char *) data;
+    s->len = len;
+}
+
+/* Consume one 32-byte stripe */
+static inline void xxh64_stripe(xxh64_state *s, const unsigned char *p)
+{
+    s->v[0] = xxh64_round(s->v[0], read64(p));
+    s->v[1] = xxh64_round(s->v[1], read64(p + 8));
+    s->v[2] = xxh64_round(s->v[2], read64(p + 16));
+    s->v[3] = xxh64_round(s->v[3], read64(p + 24));
+}
+
+/* Consume the remaining stripes and write the digest in canonical (big endian) order */
+static void xxh64_finish(xxh64_state *s, size_t done, unsigned char *out)
+{
+    const unsigned char *p = s->p + done * 32, *end = s->p + s->len;
+    uint64_t h;
+    if (s->len >= 32)
+    {
+        for (; p + 32 <= end; p += 32)
+        {
+            xxh64_stripe(s, p);
+        }
+        h = rotl(s->v[0], 1) + rotl(s->v[1], 7) + rotl(s->v[2], 12)
+            + rotl(s->v[3], 18);
+        for (int i = 0; i < 4; i++)
+        {
+            h = xxh64_merge(h, s->v[i]);
+        }
+    }
+    else
+    {
+        h = P5;
+    }
+    h += s->len;
+    for (; p + 8 <= end; p += 8)
+    {
+        h ^= xxh64_round(0, read64(p));
+        h = rotl(h, 27) * P1 + P4;
+    }
+    if (p + 4 <= end)
+    {
+        h ^= (uint64_t) read32(p) * P1;
+        h = rotl(h, 23) * P2 + P3;
+        p += 4;
+    }
+    for (; p < end; p++)
+    {
+        h ^= (*p) * P5;
+        h = rotl(h, 11) * P1;
+    }
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    for (int i = 7; i >= 0; i--)
+    {
+        out[i] = h & 0xff;
+        h >>= 8;
+    }
+}
+
+static void xxh64_one(const char *data, size_t len, unsigned char *out)
+{
+    xxh64_state s;
+    xxh64_init(&s, data, len);
+    xxh64_finish(&s, 0, out);
+}
+
+/* Hash LANES messages at a time. The stripes they have in common are consumed in one loop, so the multiplications of different messages are independent and overlap in the pipeline. */
+static void xxh64_batch(const char *const *data, const size_t *len, int n,
+                        unsigned char *out)
+{
+    int i = 0;
+    for (; i + LANES <= n; i += LANES)
+    {
+        xxh64_state s[LANES];
+        size_t common = (size_t) -1;
+        for (int k = 0; k < LANES; k++)
+        {
+            xxh64_init(&s[k], data[i + k], len[i + k]);
+            if (len[i + k] / 32 < common)
+            {
+                common = len[i + k] / 32;
+            }
+        }
+        for (size_t j = 0; j < common; j++)
+        {
+            for (int k = 0; k < LANES; k++)
+            {
+                xxh64_stripe(&s[k], s[k].p + j * 32);
+            }
+        }
+        for (int k = 0; k < LANES; k++)
+        {
+            xxh64_finish(&s[k], common, out + (size_t)(i + k) * 8);
+        }
+    }
+    for (; i < n; i++)
+    {
+        xxh64_one(data[i], len[i], out + (size_t) i * 8);
+    }
+}
+
+static void md5_one(const char *data, size_t len, unsigned char *out)
+{
+    MD5_CTX c;
+    MD5_Init(&c);
+    MD5_Update(&c, data, len);
+    MD5_Final(out, &c);
+}
+
+static void md5_batch(const char *const *data, const size_t *len, int n,
+                      unsigned char *out)
+{
+    for (int i = 0; i < n; i++)
+    {
+        md5_one(data[i], len[i], out + (size_t) i * MD5_DIGEST_LENGTH);
+    }
+}
+
+static const digest_t DIGESTS[] =
+{
+    { "xxh64", 8, xxh64_one, xxh64_batch },
+    { "md5", MD5_DIGEST_LENGTH, md5_one, md5_batch },
+};
+
+static const digest_t *CURRENT = &DIGESTS[0];
+
+/* Choose the digest by name, returns false if it is unknown */
+bool digest_select(const char *name)
+{
+    for (int i = 0; i < sizeof(DIGESTS) / sizeof(DIGESTS[0]); i++)
+    {
+        if (strcmp(DIGESTS[i].name, name) == 0)
+        {
+            CURRENT = &DIGESTS[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+const digest_t *digest_current()
+{
+    return CURRENT;
+}
+
+void computeDigest(const char *data, int dataLengthBytes,
+                   unsigned char *digestBuffer)
+{
+    /* The digest will be written to digestBuffer, which must be at least MAX_DIGEST_LENGTH bytes long */
+
+    CURRENT->one(data, dataLengthBytes, digestBuffer);
+}
+
+void digest_batch(const char *const *data, const size_t *len, int n,
+                  unsigned char *out)
+{
+    CURRENT->batch(data, len, n, out);
+}
@@ -15,6 +15,8 @@
 #include <vector>
 #include <pthread.h>
 
+#include "probes.h"
+
 using namespace std;
 
 /* Const messages and global variables */
@@ -181,6 +183,7 @@ void *client_t(void *p)
     }
 
     /* Close client connection */
+    PROBE1(session__close, fd);
     if (RUNNING)
     {
         close(fd);
@@ -301,6 +304,7 @@ int main(int argc, char *argv[])
         }
         set_nonblocking(comm_fd);
         SOCKETS.push_back(comm_fd);
+        PROBE1(session__accept, comm_fd);
         if (DEBUG)
         {
             fprintf(stderr, "[%d] New connection\n", comm_fd);
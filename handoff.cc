@@ -0,0 +1,125 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "handoff.h"
+
+using namespace std;
+
+static int server_fd = -1, handed_fd = -1, drain_fd = -1;
+
+/* Helper function that fills a UNIX socket address, returns false if the path is too long */
+static bool unix_address(const string &path, struct sockaddr_un &addr)
+{
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Handoff path too long: %s\n", path.c_str());
+        return false;
+    }
+    strcpy(addr.sun_path, path.c_str());
+    return true;
+}
+
+/* Thread function that waits for the next server, passes the listening socket to it and tells this server to drain */
+static void *handoff_t(void *p)
+{
+    while (true)
+    {
+        int fd = accept(server_fd, NULL, NULL);
+        if (fd < 0)
+        {
+            break;
+        }
+        char byte = 'L', control[CMSG_SPACE(sizeof(int))] = { };
+        struct iovec iov = { &byte, 1 };
+        struct msghdr msg = { };
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &handed_fd, sizeof(int));
+        bool sent = sendmsg(fd, &msg, MSG_NOSIGNAL) == 1 && read(fd, &byte, 1) == 1; // wait until it has the socket
+        close(fd);
+        if (sent)
+        {
+            close(server_fd);
+            byte = 'h';
+            write(drain_fd, &byte, 1);
+            break;
+        }
+        perror("Listening socket handoff failed");
+    }
+    return NULL;
+}
+
+/* Receive the listening socket from the server running on a handoff path. Returns -1 if there is none. */
+int handoff_receive(const string &path)
+{
+    struct sockaddr_un addr;
+    if (!unix_address(path, addr))
+    {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    char byte, control[CMSG_SPACE(sizeof(int))] = { };
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg = { };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    int listen_fd = -1;
+    if (recvmsg(fd, &msg, 0) == 1)
+    {
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            memcpy(&listen_fd, CMSG_DATA(cmsg), sizeof(int));
+            write(fd, &byte, 1); // the old server may stop accepting now
+        }
+    }
+    close(fd);
+    return listen_fd;
+}
+
+/* Offer a listening socket to the next server on a handoff path. A byte is written to notify_fd once it was taken. */
+bool handoff_start(const string &path, int listen_fd, int notify_fd)
+{
+    struct sockaddr_un addr;
+    if (!unix_address(path, addr))
+    {
+        return false;
+    }
+    unlink(path.c_str()); // left by the previous server
+    server_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server_fd < 0 || bind(server_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+            || listen(server_fd, 1) != 0)
+    {
+        perror("Handoff socket failed");
+        return false;
+    }
+    handed_fd = listen_fd;
+    drain_fd = notify_fd;
+    pthread_t thread;
+    pthread_create(&thread, NULL, &handoff_t, NULL);
+    pthread_detach(thread);
+    return true;
+}
@@ -0,0 +1,54 @@
+#ifndef __arena_h__
+#define __arena_h__
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <stdint.h>
+#include <vector>
+
+// Scratch memory of a session. The temporaries of a command (response text,
+// log lines) are carved from one block that is reset before the next command.
+// A command that needs more gets extra blocks, and the block grows to the size
+// used at the next reset, so a session settles without heap allocations.
+
+class Arena
+{
+public:
+  explicit Arena(size_t size = 4096);
+  ~Arena();
+  char *alloc(size_t size);
+  void reset();
+
+private:
+  char *block;
+  size_t size, used, spilled;
+  std::vector<char *> spills;
+};
+
+// A response built in arena memory. With a socket, pieces that do not fit are
+// preceded by a write of what is already there, so a long listing goes out in
+// a few large writes instead of one per line. Without one, the text is cut.
+
+class Reply
+{
+public:
+  Reply(Arena &arena, size_t capacity, int fd = -1);
+  Reply &add(const char *text);
+  Reply &add(const char *text, size_t len);
+  Reply &num(uint64_t value);
+  const char *c_str();
+  size_t size() const { return end - begin; }
+  void send();
+
+private:
+  char *begin, *end, *limit;
+  int fd;
+};
+
+// How replies reach a socket: write() unless a server routes them through its
+// transport, as TLS does.
+extern ssize_t (*reply_write)(int fd, const void *data, size_t len);
+
+char *format_uint(char *out, uint64_t value);
+
+#endif /* defined(__arena_h__) */
@@ -0,0 +1,33 @@
+#ifndef __command_h__
+#define __command_h__
+
+#include <stdint.h>
+
+// Command verbs packed into a uint32, one byte per letter with the first
+// letter lowest, folded to lower case. Verbs are all letters, so or-ing 0x20
+// into every byte folds case without ever mapping another byte onto a verb.
+//
+// A server turns the packed verb into a slot with a multiplicative hash and
+// switches on it. The case labels are the slots of its verbs, computed at
+// compile time, so a hash that is not perfect for the verb set fails to
+// compile (duplicate case value); pick another multiplier then.
+
+constexpr uint32_t verb(const char *name)
+{
+  return (uint32_t)(name[0] | 0x20) | (uint32_t)(name[1] | 0x20) << 8 |
+         (uint32_t)(name[2] | 0x20) << 16 | (uint32_t)(name[3] | 0x20) << 24;
+}
+
+inline uint32_t read_verb(const char *buffer)
+{
+  const unsigned char *p = (const unsigned char *) buffer;
+  return ((uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 |
+          (uint32_t) p[3] << 24) | 0x20202020;
+}
+
+constexpr uint32_t verb_slot(uint32_t code, uint32_t multiplier, int bits)
+{
+  return (uint32_t)(code * multiplier) >> (32 - bits);
+}
+
+#endif /* defined(__command_h__) */
@@ -0,0 +1,25 @@
+#ifndef __digest_h__
+#define __digest_h__
+
+#include <stddef.h>
+
+#define MAX_DIGEST_LENGTH 16
+
+// The digest used for UIDL strings can be chosen at startup. "xxh64" is the
+// fast default; "md5" keeps the UIDs of earlier versions of the server.
+// digest_batch() hashes many messages per call, which lets the default digest
+// work on several messages at once while a mailbox is indexed.
+
+struct digest_t {
+  const char *name;
+  int length;
+  void (*one)(const char *data, size_t len, unsigned char *out);
+  void (*batch)(const char *const *data, const size_t *len, int n, unsigned char *out);
+};
+
+bool digest_select(const char *name);
+const digest_t *digest_current();
+void computeDigest(const char *data, int dataLengthBytes, unsigned char *digestBuffer);
+void digest_batch(const char *const *data, const size_t *len, int n, unsigned char *out);
+
+#endif /* defined(__digest_h__) */
@@ -0,0 +1,15 @@
+#ifndef __handoff_h__
+#define __handoff_h__
+
+#include <string>
+
+// Zero-downtime restart. A server started with a handoff path keeps a UNIX
+// socket there. A new server started with the same path connects to it and
+// receives the listening socket (SCM_RIGHTS) instead of binding the port, so
+// connections queue on the same socket throughout and none are refused. The
+// old server is told to drain once the socket has been handed over.
+
+int handoff_receive(const std::string &path);
+bool handoff_start(const std::string &path, int listen_fd, int notify_fd);
+
+#endif /* defined(__handoff_h__) */
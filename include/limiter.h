@@ -0,0 +1,46 @@
+#ifndef __limiter_h__
+#define __limiter_h__
+
+#include <stdint.h>
+#include <atomic>
+
+// Rate limits per client address and for the whole server, configured with
+// a list like "rate=10,sessions=20,messages=100,bytes=50M,global-rate=500":
+//
+//   rate, global-rate            connections per second
+//   sessions                     concurrent sessions of one address
+//   messages, global-messages    recipients accepted per minute
+//   bytes, global-bytes          message bytes accepted per minute
+//
+// A missing key is unlimited. Every limit is a token bucket that holds one
+// window (a second or a minute) of tokens, kept as the time at which it will
+// be full again, so taking tokens is one compare-and-swap. A message larger
+// than the bytes of a whole window takes a full bucket, so it is delayed but
+// not refused forever. Tokens taken for an address are given back when a
+// global limit refuses.
+//
+// The records of the addresses are in a fixed table split into shards of a
+// few slots, picked by a hash of the address. A record that has been idle
+// longer than a window is as good as new, so it is reused for another address
+// when its shard is full; a new address whose shard has no such record is
+// refused. Lookups and inserts stay O(1) under a flood. Only the accept loop
+// adds records, and hands the record to the session, which holds it until it
+// closes.
+
+struct Client {
+  std::atomic<uint32_t> address;
+  std::atomic<uint32_t> last;       // seconds, last time the record was used
+  std::atomic<int> sessions;
+  std::atomic<uint64_t> connections; // full times of the buckets
+  std::atomic<uint64_t> messages;
+  std::atomic<uint64_t> bytes;
+};
+
+bool limiter_configure(const char *spec);
+bool limiter_accept(uint32_t address, Client *&client);
+void limiter_close(Client *client);
+bool limiter_message(Client *client);
+bool limiter_bytes(Client *client, uint64_t bytes);
+void limiter_stats(unsigned long &connections, unsigned long &messages, unsigned long &bytes);
+
+#endif /* defined(__limiter_h__) */
@@ -0,0 +1,51 @@
+#ifndef __log_h__
+#define __log_h__
+
+#include <stddef.h>
+
+// Debug logging that stays off the session threads' critical path. Every
+// thread formats its lines into a ring buffer of its own (one producer, one
+// consumer), and a background thread drains all rings to stderr. It sleeps
+// while they are empty, woken by the first line, and is not started at all
+// without -v or a transcript. A line that does not fit into a full ring is
+// dropped and counted instead of blocking.
+//
+// Log sites are filtered at compile time: a build with a lower LOG_LEVEL
+// (make CPPFLAGS=-DLOG_LEVEL=1) has no code at all for the finer sites, and
+// the remaining ones cost a branch unless the server runs with -v.
+//
+// With a transcript file, every command line and its response are also
+// written as one JSON object per line, with -v or without.
+
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_SESSION 1   // connections opened, closed, timed out
+#define LOG_LEVEL_COMMAND 2   // every command and response
+#define LOG_LEVEL_CONTENT 3   // every line of a message
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_CONTENT
+#endif
+
+extern bool DEBUG;
+extern bool TRANSCRIPT;
+
+#if LOG_LEVEL >= LOG_LEVEL_SESSION
+#define log_session(...) do { if (DEBUG) log_printf(__VA_ARGS__); } while (0)
+#else
+#define log_session(...) do { } while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_COMMAND
+#define log_command(...) do { if (DEBUG) log_printf(__VA_ARGS__); } while (0)
+#else
+#define log_command(...) do { } while (0)
+#endif
+
+#define LOG_CONTENT (LOG_LEVEL >= LOG_LEVEL_CONTENT && DEBUG)
+
+bool log_start(const char *server, const char *transcript);
+void log_printf(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void log_transcript(int fd, const char *line, size_t len, const char *reply);
+void log_flush();
+
+#endif /* defined(__log_h__) */
@@ -0,0 +1,57 @@
+#ifndef __mailbox_h__
+#define __mailbox_h__
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <memory>
+
+// A read-only mapping of a byte range of a mailbox file. Mailbox files are
+// only ever appended to or replaced by rename(), so mapped bytes never change.
+
+struct Chunk {
+  const char *data;
+  size_t size;
+  void *map;
+  size_t map_len;
+
+  Chunk() : data(NULL), size(0), map(NULL), map_len(0) {}
+  ~Chunk();
+};
+
+// A parsed, immutable version of one mailbox file. Sessions of the same user
+// share one snapshot read-only. The message table is kept as parallel arrays
+// (one entry per message), so STAT/LIST/UIDL only scan a few small columns.
+// Each message is its title line followed by its content, as stored in one of
+// the chunks. Chunks are shared between versions, so a snapshot built after an
+// SMTP append only maps and parses the appended bytes.
+
+struct Snapshot {
+  std::vector<std::shared_ptr<const Chunk> > chunks;
+  std::vector<uint32_t> chunk;       // chunk holding the message
+  std::vector<uint64_t> offset;      // offset of the title line in the chunk
+  std::vector<uint32_t> title_len;
+  std::vector<uint64_t> len;         // stored length of the content
+  std::vector<uint32_t> size;        // size of the content in octets once lines end with CRLF
+  std::vector<unsigned char> uids;   // uid_len bytes per message
+  int uid_len;
+  off_t file_size;                   // bytes of the file covered by this snapshot
+  ino_t file_ino;
+  time_t file_mtime;
+  unsigned long version;
+
+  int count() const { return size.size(); }
+  const char *title(int i) const { return chunks[chunk[i]]->data + offset[i]; }
+  const char *content(int i) const { return title(i) + title_len[i]; }
+  const unsigned char *uid(int i) const { return &uids[(size_t) i * uid_len]; }
+};
+
+typedef std::shared_ptr<const Snapshot> snapshot_ptr;
+
+snapshot_ptr mbox_acquire(const std::string &address, int fd = -1);
+void mbox_publish(const std::string &address, const snapshot_ptr &snap);
+snapshot_ptr mbox_select(const snapshot_ptr &snap, const std::vector<int> &keep, int fd);
+
+#endif /* defined(__mailbox_h__) */
@@ -0,0 +1,45 @@
+#ifndef __metrics_h__
+#define __metrics_h__
+
+#include <pthread.h>
+#include <stdint.h>
+
+// Opt-in runtime metrics of a server, served in the Prometheus text format
+// to whoever connects to a local port or UNIX socket (plain text, or an HTTP
+// response if the client sends a GET).
+//
+// Every thread counts into a block of its own with plain relaxed stores, so
+// recording never takes a lock or shares a cache line. A block is handed to
+// the next thread when its thread exits. A scrape sums all blocks.
+//
+// Latencies go into histograms with power-of-two buckets in microseconds:
+// one per command verb, the wait for the mailbox lock, and the time to write
+// a mailbox file (an SMTP append or a POP3 rewrite). Bytes in and out are
+// read from TCP_INFO when a session ends.
+
+enum metric_t {
+  M_ACCEPTS,
+  M_CLOSES,
+  M_BYTES_IN,
+  M_BYTES_OUT,
+  M_LOCK_WAITS,      // lock requests
+  M_LOCK_ACQUIRED,   // requests that got the lock, the difference is the queue
+  M_COUNTERS
+};
+
+enum histogram_t {
+  H_LOCK_WAIT,
+  H_MAILBOX_WRITE,
+  H_VERBS            // H_VERBS + command
+};
+
+extern bool METRICS;
+
+bool metrics_start(const char *server, const char *spec, const char *const *verbs, int verb_count);
+uint64_t metrics_clock();
+void metrics_add(metric_t counter, uint64_t n = 1);
+void metrics_time(int histogram, uint64_t start);
+void metrics_lock(pthread_mutex_t *lock);
+void metrics_session_end(int fd);
+
+#endif /* defined(__metrics_h__) */
@@ -0,0 +1,102 @@
+#ifndef __probes_h__
+#define __probes_h__
+
+#include <stdint.h>
+#include <type_traits>
+
+// Static tracepoints (USDT) for perf, bpftrace and SystemTap, under the
+// provider "simplemail". A probe is a single nop plus an ELF note that tells
+// a tracer where it is and where its arguments live, so it costs nothing
+// until a tracer attaches. Probe names use "__" for "-", e.g.
+//
+//   bpftrace -e 'usdt:./smtp:simplemail:command__start { @[str(arg1)] = count(); }'
+//
+// session__accept(fd)                         new connection (all servers)
+// session__close(fd)                          connection closed
+// command__start(fd, verb, status)            command line dispatched
+// command__end(fd, verb, status)              command handled, status is the new state
+// lock__acquire(fd) / lock__acquired(fd) / lock__release(fd)
+//                                             the mailbox lock around delivery and QUIT
+// mail__deliver(path, bytes, ok)              one message appended to a mailbox
+// mbox__parse__start(fd, offset, size)        mailbox bytes about to be parsed
+// mbox__parse__done(fd, messages)             messages in the snapshot
+// retr__sent(fd, message, bytes)              bytes of a RETR response
+//
+// The notes have the layout of <sys/sdt.h>. That header is used when it is
+// installed; otherwise the same notes are emitted here on x86-64, and on
+// other machines the probes compile to nothing.
+
+#define PROBE_PROVIDER simplemail
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define HAVE_SYS_SDT_H 1
+#endif
+#endif
+
+#if defined(HAVE_SYS_SDT_H)
+
+#include <sys/sdt.h>
+#define PROBE0(name) DTRACE_PROBE(simplemail, name)
+#define PROBE1(name, a) DTRACE_PROBE1(simplemail, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(simplemail, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(simplemail, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(simplemail, name, a, b, c, d)
+
+#elif defined(__x86_64__) && defined(__GNUC__)
+
+/* Argument size in bytes, negative for signed integers, as the note describes it */
+#define PROBE_SIZE(x) ((std::is_signed<typename std::decay<decltype(x)>::type>::value ? -1 : 1) \
+                       * (int) sizeof(typename std::decay<decltype(x)>::type))
+#define PROBE_STR(x) #x
+#define PROBE_XSTR(x) PROBE_STR(x)
+
+/* The nop, a .note.stapsdt entry (pc, base, semaphore, provider, name, arguments) and the shared base symbol */
+#define PROBE_ASM(name, args) \
+    "990: nop\n" \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+    ".balign 4\n" \
+    ".4byte 992f-991f, 994f-993f, 3\n" \
+    "991: .asciz \"stapsdt\"\n" \
+    "992: .balign 4\n" \
+    "993: .8byte 990b\n" \
+    ".8byte _.stapsdt.base\n" \
+    ".8byte 0\n" \
+    ".asciz \"" PROBE_XSTR(PROBE_PROVIDER) "\"\n" \
+    ".asciz \"" #name "\"\n" \
+    ".asciz \"" args "\"\n" \
+    "994: .balign 4\n" \
+    ".popsection\n" \
+    ".ifndef _.stapsdt.base\n" \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    ".weak _.stapsdt.base\n" \
+    ".hidden _.stapsdt.base\n" \
+    "_.stapsdt.base: .space 1\n" \
+    ".size _.stapsdt.base, 1\n" \
+    ".popsection\n" \
+    ".endif\n"
+
+#define PROBE_ARG(n, x) [s##n] "n" (PROBE_SIZE(x)), [a##n] "nor" (x)
+
+#define PROBE0(name) __asm__ __volatile__(PROBE_ASM(name, ""))
+#define PROBE1(name, a) __asm__ __volatile__(PROBE_ASM(name, "%c[s1]@%[a1]") :: PROBE_ARG(1, a))
+#define PROBE2(name, a, b) __asm__ __volatile__(PROBE_ASM(name, "%c[s1]@%[a1] %c[s2]@%[a2]") \
+                                                :: PROBE_ARG(1, a), PROBE_ARG(2, b))
+#define PROBE3(name, a, b, c) __asm__ __volatile__(PROBE_ASM(name, "%c[s1]@%[a1] %c[s2]@%[a2] %c[s3]@%[a3]") \
+                                                   :: PROBE_ARG(1, a), PROBE_ARG(2, b), PROBE_ARG(3, c))
+#define PROBE4(name, a, b, c, d) __asm__ __volatile__(PROBE_ASM(name, "%c[s1]@%[a1] %c[s2]@%[a2] %c[s3]@%[a3] " \
+                                                                "%c[s4]@%[a4]") \
+                                                      :: PROBE_ARG(1, a), PROBE_ARG(2, b), PROBE_ARG(3, c), \
+                                                      PROBE_ARG(4, d))
+
+#else
+
+#define PROBE0(name) do { } while (0)
+#define PROBE1(name, a) do { } while (0)
+#define PROBE2(name, a, b) do { } while (0)
+#define PROBE3(name, a, b, c) do { } while (0)
+#define PROBE4(name, a, b, c, d) do { } while (0)
+
+#endif
+
+#endif /* defined(__probes_h__) */
@@ -0,0 +1,37 @@
+#ifndef __quota_h__
+#define __quota_h__
+
+#include <stdint.h>
+#include <string>
+
+#define USAGE_SUFFIX ".usage"
+
+// Mailbox quotas, configured with a list like "bytes=50M,messages=1000".
+//
+// The usage of a mailbox is kept in a small record next to it
+// (user.mbox.usage), so checking a quota never reads the mailbox. Whoever
+// changes a mailbox updates its record while holding the mailbox lock: SMTP
+// adds each message it appends, and POP3 writes the totals of the file it
+// leaves at QUIT (only for mailboxes that have a record).
+//
+// The record also notes the size and inode of the file it describes. One
+// that does not match the mailbox any more, because something else changed
+// it, is rebuilt by counting the messages at the next append. Until then a
+// check goes by the file size.
+//
+// A quota is checked before a recipient is accepted, when the size of the
+// message is not known yet, so the last message may go over it.
+
+struct Usage {
+  uint64_t bytes;
+  uint64_t messages;
+  uint64_t file_size;
+  uint64_t file_ino;
+};
+
+bool quota_configure(const char *spec);
+bool quota_check(const std::string &address);
+void quota_appended(const std::string &address, int fd, uint64_t bytes);
+void quota_replaced(const std::string &address, const std::string &file, uint64_t messages);
+
+#endif /* defined(__quota_h__) */
@@ -0,0 +1,36 @@
+#ifndef __registry_h__
+#define __registry_h__
+
+#include <string>
+#include <vector>
+
+#define INDEX_NAME "users.idx"
+
+// The set of local mailboxes (file names ending in ".mbox").
+//
+// In the flat layout all mailboxes are in the mailbox directory. A background
+// thread watches it with inotify and publishes a new set whenever mailboxes are
+// added or removed, so users can be provisioned without restarting the servers.
+//
+// In the hashed layout a mailbox lives in two levels of sub-directories named
+// after its hash (e.g. 3f/a2/user.mbox), and nothing is loaded at startup.
+// Lookups probe a sorted on-disk index (users.idx) that is mapped into memory
+// and remapped when it is replaced. Without an index, the file is checked.
+//
+// A Bloom filter over the local parts is rebuilt with every new set or index,
+// so lookups of unknown users (mostly dictionary and spam runs) are rejected
+// without building the file name or probing the set, index or file system.
+//
+// Lookups never take a lock.
+
+void registry_start(const std::string &dir, bool hashed);
+bool registry_has(const std::string &mbox);
+bool registry_has_user(const char *user);
+void registry_filter_stats(unsigned long &probes, unsigned long &rejected,
+                           unsigned long &false_positives, double &expected);
+std::string registry_path(const std::string &mbox);
+std::string registry_hashed_path(const std::string &dir, const std::string &mbox);
+bool registry_read_index(const std::string &dir, std::vector<std::string> &mboxes);
+bool registry_write_index(const std::string &dir, std::vector<std::string> &mboxes);
+
+#endif /* defined(__registry_h__) */
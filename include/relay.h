@@ -0,0 +1,54 @@
+#ifndef __relay_h__
+#define __relay_h__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#define QUEUE_DIR ".queue"
+
+// Relaying of mail for recipients on other hosts.
+//
+// The domains that are relayed, and the server each one is sent to, are read
+// from a routes file of lines "domain host port"; a domain of * stands for
+// every domain not listed. Blank lines and lines starting with # are skipped.
+// Recipients of any other domain are refused as before.
+//
+// Only clients on this host, or on a network listed in a line "trust
+// address/bits" of the same file, may relay, so the server is no open relay.
+// A relayed message gets a Received: line naming the client, and one that
+// already has MAX_HOPS of them is refused as a mail loop.
+//
+// A message is queued before its DATA is answered, as one file per
+// destination in user_dir/.queue holding the sender, the recipients and the
+// message, so queued mail outlives a restart. A file is locked while its
+// message is sent and a locked file is skipped, so during a handoff the old
+// and the new server do not both send it. The old one finishes the messages
+// it is sending when the drain starts and starts no more.
+//
+// A destination gets up to RELAY_SESSIONS connections. Each sends one message
+// after another in the same SMTP session, and quits after RELAY_IDLE seconds
+// without mail. When the server offers PIPELINING, MAIL, all RCPTs and DATA go
+// out in one write.
+//
+// A proxy queues with relay_forward instead, for a server it names itself;
+// the server is kept in the queue file, and no routes file is needed.
+//
+// A recipient refused with 4xx, or a message that could not be sent at all, is
+// tried again after 1, 2, 4... minutes, at most an hour apart, until it has
+// been queued for QUEUE_LIFETIME. A recipient refused with 5xx is dropped and
+// logged.
+
+bool relay_start(const std::string &dir, const std::string &routes);
+bool relay_accepts(const char *domain, uint32_t peer);
+bool relay_looping(const std::string &content);
+bool relay_enqueue(const std::string &sender, const std::vector<std::string> &rcpts, const std::string &content,
+                   uint32_t peer);
+bool relay_forward(const std::string &host, const std::string &port, const std::string &sender,
+                   const std::vector<std::string> &rcpts, const std::string &content);
+void relay_stop();
+bool relay_busy();
+void relay_stats(unsigned long &queued, unsigned long &sent, unsigned long &deferred, unsigned long &bounced,
+                 unsigned long &sessions, unsigned long &reused);
+
+#endif /* defined(__relay_h__) */
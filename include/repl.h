@@ -0,0 +1,48 @@
+#ifndef __repl_h__
+#define __repl_h__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <utility>
+
+#define REPL_DIR ".repl"
+
+// Asynchronous replication of a mailbox directory to a standby.
+//
+// Every change to a mailbox file is recorded, under the lock of the mailbox,
+// in a log kept in user_dir/.repl: an SMTP append as its offset and bytes, a
+// POP3 rewrite as the byte ranges of the old file it kept (or the new file,
+// if the old one is not a plain run of messages). Both servers of a directory
+// record into the same log, in segments named by their starting position.
+// Messages and new files larger than 16MB go in several records.
+//
+// The server started with "host:port" ships the log to the standby, one
+// connection, batches of whole records sent without waiting for the acks of
+// the ones before. With ",sync" an SMTP DATA is answered once the standby
+// has its records, or after REPL_SYNC_TIMEOUT seconds without them, when the
+// reply goes out anyway and the timeout is counted. The other server is
+// started with "log" and only records. Segments are removed once the standby
+// has them.
+//
+// A standby server receives on "port", which only takes connections from
+// this host, or on "address:port". It checks every record and drops a
+// connection that sends one too large, or one for a file that is not a
+// mailbox in its directory. It applies records in order to its own directory
+// and keeps the position it reached, which it tells the primary when the
+// connection is made again, so a standby that was away or restarted catches
+// up from there. Its mailbox files stay byte-identical to the primary's;
+// usage records and search indexes are rebuilt on use there, and compression
+// dictionaries have to be installed on both.
+
+bool repl_start(const std::string &dir, const char *spec);
+bool repl_follow(const std::string &dir, const char *spec);
+void repl_appended(const std::string &address, uint64_t offset, const char *title, size_t title_len,
+                   const std::string &body);
+bool repl_replaced(const std::string &address, uint64_t old_size,
+                   const std::vector<std::pair<uint64_t, uint64_t> > &ranges);
+void repl_rewritten(const std::string &address, uint64_t old_size, const std::string &file);
+bool repl_sync();
+void repl_stats(uint64_t &behind, uint64_t &lag_ms, unsigned long &timeouts);
+
+#endif /* defined(__repl_h__) */
@@ -0,0 +1,45 @@
+#ifndef __ring_h__
+#define __ring_h__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <utility>
+
+// Consistent hashing of mailbox names onto the backend servers of a cluster.
+//
+// Every node is placed at 128 points per unit of weight on a 64-bit ring,
+// hashed from its name, and a mailbox belongs to the node of the first point
+// at or after the hash of its name. Points depend only on names, not on the
+// order of the list, so a node that joins takes over the arcs just before its
+// own points, about weight / total of the mailboxes, and every other mailbox
+// stays where it was. A node that leaves hands its arcs to the nodes after
+// them.
+//
+// Nodes are read from a file of lines "name host smtp_port pop3_port
+// [weight]"; blank lines and lines starting with # are skipped.
+
+struct Node
+{
+  std::string name, host;
+  int smtp_port, pop3_port, weight;
+};
+
+class Ring
+{
+public:
+  explicit Ring(const std::vector<Node> &nodes);
+  const Node *lookup(const std::string &key) const;
+  double moved(const Ring &other) const;
+  size_t size() const { return nodes.size(); }
+
+private:
+  std::vector<Node> nodes;
+  std::vector<std::pair<uint64_t, int> > points; // sorted, with the index of their node
+  int owner(uint64_t hash) const;
+};
+
+bool ring_load(const std::string &path, std::vector<Node> &nodes);
+uint64_t ring_hash(const char *data, size_t len);
+
+#endif /* defined(__ring_h__) */
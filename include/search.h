@@ -0,0 +1,42 @@
+#ifndef __search_h__
+#define __search_h__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#define SEARCH_SUFFIX ".search"
+
+// Full-text index of a mailbox, kept next to it (user.mbox.search).
+//
+// Terms are lower-case runs of 2 to 32 letters and digits, taken from the
+// whole message, and taken again with their field as a prefix ("from:",
+// "to:", "cc:", "subject:") from those header fields. Lines of 60 bytes or
+// more without a space are taken for encoded attachments and skipped.
+//
+// The index is a run of segments, each an inverted index of a range of
+// messages: a sorted term table and, for each term, the numbers of its
+// messages as delta-coded varints. Delivery adds a segment for the new
+// message and merges the last segments while they are no larger, up to a
+// cap, so a mailbox of n messages has about n / cap + log n segments and a
+// lookup is one binary search in each. Messages are numbered from 0 in file
+// order.
+//
+// The header notes the inode, size and message count of the mailbox file the
+// index describes. SMTP only extends an index that matches the file before
+// its append, and never creates one. POP3 renumbers the index when QUIT
+// removes messages, and builds it from a session's messages when a search
+// finds it missing or out of date.
+
+void search_terms(const char *content, size_t len, std::vector<std::string> &terms);
+void search_parse(const char *query, std::vector<std::string> &terms);
+void search_appended(const std::string &address, int fd, uint64_t bytes,
+                     const std::string &content, std::vector<std::string> &terms);
+bool search_lookup(const std::string &address, uint64_t file_ino, uint32_t messages,
+                   const std::vector<std::string> &query, std::vector<uint32_t> &hits);
+void search_write(const std::string &address, const std::string &file,
+                  const std::vector<std::vector<std::string> > &terms);
+void search_remap(const std::string &address, const std::string &file, uint64_t file_ino,
+                  uint32_t messages, const std::vector<int> &keep);
+
+#endif /* defined(__search_h__) */
@@ -0,0 +1,69 @@
+#ifndef __store_h__
+#define __store_h__
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <zlib.h>
+
+#define STORE_MARK "X-Deflate: "
+#define STORE_MARK_LEN 11
+#define DICT_SUFFIX ".dict"
+#define DEFAULT_DICT "default.dict"
+
+// Compressed message contents. With compression on, the SMTP server stores
+// the content of a message as
+//
+//   X-Deflate: <octets> <bytes>\n<deflate stream>\n
+//
+// where octets is the size POP3 reports for the message and bytes is its
+// size uncompressed. The stream has its LF and ESC bytes escaped as ESC 'n'
+// and ESC 'e', so it is a single line: the title lines of the mailbox stay
+// where the POP3 server looks for them, and compressed and plain messages can
+// be mixed in one mailbox. Sizes come from the header line, and RETR inflates
+// the stream piece by piece as it sends it.
+//
+// Messages are compressed with a preset dictionary when there is one, the
+// mailbox's own (user.mbox.dict) or else the directory's (default.dict), as
+// made by mboxdict from sample mail. A stream names its dictionary by
+// checksum, so a dictionary has to be kept while messages still use it.
+
+void store_start(const std::string &dir, int level);
+bool store_encode(const std::string &address, const std::string &content, std::string &stored);
+
+// Whether stored content is compressed, and the size POP3 reports for it.
+
+inline bool store_compressed(const char *content, size_t len, uint64_t &octets)
+{
+  if (len <= STORE_MARK_LEN || memcmp(content, STORE_MARK, STORE_MARK_LEN) != 0)
+  {
+    return false;
+  }
+  octets = 0;
+  for (size_t i = STORE_MARK_LEN; i < len && content[i] >= '0' && content[i] <= '9'; i++)
+  {
+    octets = octets * 10 + (content[i] - '0');
+  }
+  return true;
+}
+
+// Streams the original bytes of a compressed content, one piece at a time.
+
+class Inflater
+{
+public:
+  Inflater(const std::string &address, const char *content, size_t len);
+  ~Inflater();
+  bool next(const char *&data, size_t &len);
+  bool failed() const { return error; }
+
+private:
+  z_stream stream;
+  std::string address;
+  const char *in, *end;  // escaped stream not decoded yet
+  unsigned char decoded[16 * 1024];
+  unsigned char out[64 * 1024];
+  bool done, error;
+};
+
+#endif /* defined(__store_h__) */
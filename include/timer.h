@@ -0,0 +1,33 @@
+#ifndef __timer_h__
+#define __timer_h__
+
+#include <stdint.h>
+#include <atomic>
+
+// Session deadlines kept in a hierarchical timer wheel: three levels of 64
+// slots, one tick per second at the lowest level, so any deadline up to about
+// three days is filed in O(1) and a tick only touches the timers due in it.
+//
+// Sessions reset their deadline after every command by storing a new value
+// (no lock, no list operation). The wheel thread re-files a timer whose
+// deadline has moved when its slot comes up, and marks it expired otherwise.
+// The session polls expired from its read loop.
+
+struct Timer {
+  Timer *prev;
+  Timer *next;
+  std::atomic<uint64_t> deadline;   // in wheel ticks
+  uint64_t filed;                   // tick of the slot the timer is in
+  std::atomic<bool> expired;
+
+  Timer() : prev(NULL), next(NULL), deadline(0), filed(0), expired(false) {}
+};
+
+void timer_start();
+uint64_t timer_now();
+void timer_add(Timer *timer, unsigned int seconds);
+void timer_reset(Timer *timer, unsigned int seconds);
+void timer_reset_until(Timer *timer, uint64_t deadline);
+void timer_cancel(Timer *timer);
+
+#endif /* defined(__timer_h__) */
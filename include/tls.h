@@ -0,0 +1,30 @@
+#ifndef __tls_h__
+#define __tls_h__
+
+#include <sys/types.h>
+
+// TLS for the connections that ask for it with STARTTLS (SMTP) or STLS
+// (POP3), configured with "cert.pem[,key.pem]".
+//
+// A session thread serves one connection, so the TLS state of a connection
+// is kept per thread, and tls_read()/tls_write() stand in for read()/write()
+// on its socket. Before the handshake they are read() and write(). After it
+// they go through OpenSSL, unless the kernel took over the record layer
+// (kTLS) for that direction, in which case plain read() and write() on the
+// socket are encrypted by the kernel and no bytes are copied through OpenSSL.
+//
+// Session tickets are sealed with keys kept in key.pem.tickets, made on first
+// start. Every server started with the same key shares them, so a client
+// resumes its session on the other protocol, or after a restart or handoff,
+// without a full handshake.
+
+bool tls_start(const char *spec);
+bool tls_available();
+bool tls_active();
+bool tls_accept(int fd, int timeout);
+ssize_t tls_read(int fd, void *data, size_t len);
+ssize_t tls_write(int fd, const void *data, size_t len);
+void tls_end();
+void tls_stats(unsigned long &handshakes, unsigned long &resumed, unsigned long &offloaded);
+
+#endif /* defined(__tls_h__) */
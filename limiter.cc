@@ -0,0 +1,315 @@
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <atomic>
+
+#include "limiter.h"
+
+using namespace std;
+
+#define SHARD_BITS 12
+#define SHARD_SLOTS 8
+#define SECOND 1000000000ULL
+#define MINUTE (60 * SECOND)
+#define MAX_AGE 60 // seconds without use after which all buckets of a record are full again, so it can be reused
+
+/* A token bucket of limit tokens per window, as the time it needs per token (GCRA) */
+struct rate_t
+{
+    uint64_t window;
+    uint64_t interval; // 0 if unlimited
+};
+
+static bool ENABLED = false;
+static rate_t CONNECTIONS, MESSAGES, BYTES, GLOBAL_CONNECTIONS, GLOBAL_MESSAGES, GLOBAL_BYTES;
+static int MAX_SESSIONS = 0; // 0 if unlimited
+static bool PER_CLIENT = false;
+static Client TABLE[1 << SHARD_BITS][SHARD_SLOTS];
+static atomic<uint64_t> global_connections(0), global_messages(0), global_bytes(0);
+static atomic<unsigned long> refused_connections(0), refused_messages(0), refused_bytes(0);
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * SECOND + ts.tv_nsec;
+}
+
+/* Take cost tokens from a bucket, returns false if it does not have them. The bucket is the time at which it is full again. A cost
+ * larger than the whole bucket takes all of it, so it can pass once the bucket is full instead of never. */
+static bool take(atomic<uint64_t> &full, const rate_t &rate, uint64_t now, uint64_t cost)
+{
+    if (rate.interval == 0)
+    {
+        return true;
+    }
+    if (cost > rate.window / rate.interval)
+    {
+        cost = rate.window / rate.interval;
+    }
+    uint64_t old = full.load(memory_order_relaxed);
+    while (true)
+    {
+        uint64_t next = (old > now ? old : now) + rate.interval * cost;
+        if (next > now + rate.window)
+        {
+            return false;
+        }
+        if (full.compare_exchange_weak(old, next, memory_order_relaxed))
+        {
+            return true;
+        }
+    }
+}
+
+/* Give back the tokens taken by take(), when another limit refused what they were taken for */
+static void give_back(atomic<uint64_t> &full, const rate_t &rate, uint64_t cost)
+{
+    if (rate.interval == 0)
+    {
+        return;
+    }
+    if (cost > rate.window / rate.interval)
+    {
+        cost = rate.window / rate.interval;
+    }
+    full.fetch_sub(rate.interval * cost, memory_order_relaxed);
+}
+
+/* Helper function that parses a limit, with an optional K, M or G suffix, into a rate over a window */
+static bool parse_rate(const string &value, uint64_t window, rate_t &rate)
+{
+    char *end;
+    uint64_t limit = strtoull(value.c_str(), &end, 10);
+    switch (*end)
+    {
+    case 'G':
+        limit <<= 10;
+        // fall through
+    case 'M':
+        limit <<= 10;
+        // fall through
+    case 'K':
+        limit <<= 10;
+        end++;
+    }
+    if (*end != '\0' || limit == 0)
+    {
+        return false;
+    }
+    rate.window = window;
+    rate.interval = window / limit > 0 ? window / limit : 1;
+    return true;
+}
+
+/* Parse the limits of a comma separated list of key=value, returns false if it has an unknown key or bad value */
+bool limiter_configure(const char *spec)
+{
+    string list = spec;
+    for (size_t start = 0, end; start < list.size(); start = end + 1)
+    {
+        end = list.find(',', start);
+        end = end == string::npos ? list.size() : end;
+        string item = list.substr(start, end - start);
+        size_t eq = item.find('=');
+        if (eq == string::npos)
+        {
+            return false;
+        }
+        string key = item.substr(0, eq), value = item.substr(eq + 1);
+        bool ok;
+        if (key == "rate")
+        {
+            ok = parse_rate(value, SECOND, CONNECTIONS);
+        }
+        else if (key == "messages")
+        {
+            ok = parse_rate(value, MINUTE, MESSAGES);
+        }
+        else if (key == "bytes")
+        {
+            ok = parse_rate(value, MINUTE, BYTES);
+        }
+        else if (key == "global-rate")
+        {
+            ok = parse_rate(value, SECOND, GLOBAL_CONNECTIONS);
+        }
+        else if (key == "global-messages")
+        {
+            ok = parse_rate(value, MINUTE, GLOBAL_MESSAGES);
+        }
+        else if (key == "global-bytes")
+        {
+            ok = parse_rate(value, MINUTE, GLOBAL_BYTES);
+        }
+        else if (key == "sessions")
+        {
+            MAX_SESSIONS = atoi(value.c_str());
+            ok = MAX_SESSIONS > 0;
+        }
+        else
+        {
+            ok = false;
+        }
+        if (!ok)
+        {
+            return false;
+        }
+    }
+    PER_CLIENT = CONNECTIONS.interval || MESSAGES.interval || BYTES.interval || MAX_SESSIONS;
+    ENABLED = PER_CLIENT || GLOBAL_CONNECTIONS.interval || GLOBAL_MESSAGES.interval || GLOBAL_BYTES.interval;
+    return true;
+}
+
+/* Helper function that returns the shard of an address */
+static Client *shard(uint32_t address)
+{
+    uint32_t hash = address * 0x9e3779b1u;
+    return TABLE[hash >> (32 - SHARD_BITS)];
+}
+
+/* Helper function that finds or makes the record of an address. A free slot is taken first, then the one idle the longest,
+ * if it has been idle long enough. Returns NULL if the shard is full of active addresses. Only called by the accept loop. */
+static Client *claim(uint32_t address, uint32_t seconds)
+{
+    Client *slots = shard(address), *victim = NULL;
+    uint32_t victim_age = 0;
+    for (int i = 0; i < SHARD_SLOTS; i++)
+    {
+        uint32_t owner = slots[i].address.load(memory_order_relaxed);
+        if (owner == address)
+        {
+            return &slots[i];
+        }
+        uint32_t age = owner == 0 ? UINT32_MAX : seconds - slots[i].last.load(memory_order_relaxed);
+        if (slots[i].sessions.load(memory_order_relaxed) == 0 && (victim == NULL || age > victim_age))
+        {
+            victim = &slots[i];
+            victim_age = age;
+        }
+    }
+    if (victim == NULL || victim_age < MAX_AGE)
+    {
+        return NULL;
+    }
+    victim->connections.store(0, memory_order_relaxed);
+    victim->messages.store(0, memory_order_relaxed);
+    victim->bytes.store(0, memory_order_relaxed);
+    victim->address.store(address, memory_order_release);
+    return victim;
+}
+
+/* Check a new connection from an address (host order) against the limits, and count it as a session of the address.
+ * The record the session holds is returned in client, NULL if only global limits are set. A connection whose address
+ * finds its shard full of active addresses is refused, as it could not be held to the per-address limits. */
+bool limiter_accept(uint32_t address, Client *&client)
+{
+    client = NULL;
+    if (!ENABLED)
+    {
+        return true;
+    }
+    uint64_t now = now_ns();
+    if (PER_CLIENT && address != 0)
+    {
+        Client *record = claim(address, now / SECOND);
+        if (record == NULL)
+        {
+            refused_connections++;
+            return false;
+        }
+        record->last.store(now / SECOND, memory_order_relaxed);
+        if ((MAX_SESSIONS && record->sessions.load(memory_order_relaxed) >= MAX_SESSIONS)
+                || !take(record->connections, CONNECTIONS, now, 1))
+        {
+            refused_connections++;
+            return false;
+        }
+        if (!take(global_connections, GLOBAL_CONNECTIONS, now, 1))
+        {
+            give_back(record->connections, CONNECTIONS, 1); // not the client's doing
+            refused_connections++;
+            return false;
+        }
+        record->sessions++;
+        client = record;
+        return true;
+    }
+    if (!take(global_connections, GLOBAL_CONNECTIONS, now, 1))
+    {
+        refused_connections++;
+        return false;
+    }
+    return true;
+}
+
+/* End a session of a record */
+void limiter_close(Client *client)
+{
+    if (client != NULL)
+    {
+        client->last.store(now_ns() / SECOND, memory_order_relaxed);
+        client->sessions--;
+    }
+}
+
+/* Take a message (an accepted recipient) from the limits of a session's address and the server */
+bool limiter_message(Client *client)
+{
+    if (!ENABLED)
+    {
+        return true;
+    }
+    uint64_t now = now_ns();
+    if (client != NULL && !take(client->messages, MESSAGES, now, 1))
+    {
+        refused_messages++;
+        return false;
+    }
+    if (!take(global_messages, GLOBAL_MESSAGES, now, 1))
+    {
+        if (client != NULL)
+        {
+            give_back(client->messages, MESSAGES, 1);
+        }
+        refused_messages++;
+        return false;
+    }
+    return true;
+}
+
+/* Take the bytes of a message from the limits of a session's address and the server */
+bool limiter_bytes(Client *client, uint64_t bytes)
+{
+    if (!ENABLED)
+    {
+        return true;
+    }
+    uint64_t now = now_ns();
+    if (client != NULL && !take(client->bytes, BYTES, now, bytes))
+    {
+        refused_bytes++;
+        return false;
+    }
+    if (!take(global_bytes, GLOBAL_BYTES, now, bytes))
+    {
+        if (client != NULL)
+        {
+            give_back(client->bytes, BYTES, bytes);
+        }
+        refused_bytes++;
+        return false;
+    }
+    return true;
+}
+
+void limiter_stats(unsigned long &connections, unsigned long &messages, unsigned long &bytes)
+{
+    connections = refused_connections.load();
+    messages = refused_messages.load();
+    bytes = refused_bytes.load();
+}
@@ -0,0 +1,325 @@
+#include <sys/types.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <string>
+#include <atomic>
+#include <pthread.h>
+
+#include "log.h"
+
+using namespace std;
+
+#define RING_SIZE (64 * 1024)
+#define MAX_LINE 4096 // longer lines are cut
+
+enum kind_t { RECORD_PAD, RECORD_TEXT, RECORD_TRANSCRIPT };
+
+/* A record in a ring, followed by its bytes. Records start at multiples of 8 and never wrap around the end of the ring. */
+struct record_t
+{
+    uint32_t size;     // of the whole record, including padding
+    uint16_t kind;
+    int32_t fd;
+    uint32_t first;    // bytes of the text, or of the command line of a transcript record
+    uint32_t second;   // bytes of the response of a transcript record
+    uint64_t time;     // wall clock in microseconds, of transcript records
+};
+
+/* The ring of one thread at a time. Only that thread moves tail, only the writer moves head. */
+struct ring_t
+{
+    char data[RING_SIZE];
+    atomic<uint64_t> head, tail;
+    atomic<uint64_t> dropped;
+    uint64_t reported;   // drops already reported, writer only
+    ring_t *next;
+    bool used;
+};
+
+/* Gives the ring of a thread back when the thread exits */
+struct ring_holder_t
+{
+    ring_t *ring;
+    ~ring_holder_t();
+};
+
+bool TRANSCRIPT = false;
+static string SERVER;
+static int transcript_fd = -1;
+static ring_t *RINGS = NULL; // every ring ever made
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static thread_local ring_holder_t HOLDER;
+static int wake_fd = -1;
+static atomic<bool> IDLE(false); // the writer is sleeping, the next record wakes it
+
+ring_holder_t::~ring_holder_t()
+{
+    if (ring != NULL)
+    {
+        pthread_mutex_lock(&rings_lock);
+        ring->used = false;
+        pthread_mutex_unlock(&rings_lock);
+    }
+}
+
+/* Helper function that returns the ring of the calling thread, taking a free one or making one on first use */
+static ring_t *mine()
+{
+    if (HOLDER.ring == NULL)
+    {
+        pthread_mutex_lock(&rings_lock);
+        ring_t *ring = RINGS;
+        while (ring != NULL && ring->used)
+        {
+            ring = ring->next;
+        }
+        if (ring == NULL)
+        {
+            ring = new ring_t();
+            ring->next = RINGS;
+            RINGS = ring;
+        }
+        ring->used = true;
+        pthread_mutex_unlock(&rings_lock);
+        HOLDER.ring = ring;
+    }
+    return HOLDER.ring;
+}
+
+/* Append a record with up to two pieces of bytes to the ring of the calling thread, or count it as dropped if the ring is full */
+static void append(kind_t kind, int fd, const char *first, size_t first_len, const char *second, size_t second_len)
+{
+    ring_t *ring = mine();
+    uint64_t tail = ring->tail.load(memory_order_relaxed);
+    uint64_t size = (sizeof(record_t) + first_len + second_len + 7) & ~(uint64_t) 7;
+    uint64_t to_end = RING_SIZE - tail % RING_SIZE, skip = size > to_end ? to_end : 0;
+    if (tail + skip + size - ring->head.load(memory_order_acquire) > RING_SIZE)
+    {
+        ring->dropped.store(ring->dropped.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        return;
+    }
+    if (skip >= sizeof(record_t))
+    {
+        record_t *pad = (record_t *)(ring->data + tail % RING_SIZE);
+        pad->size = skip;
+        pad->kind = RECORD_PAD;
+    }
+    tail += skip;
+    record_t *record = (record_t *)(ring->data + tail % RING_SIZE);
+    record->size = size;
+    record->kind = kind;
+    record->fd = fd;
+    record->first = first_len;
+    record->second = second_len;
+    record->time = 0;
+    if (kind == RECORD_TRANSCRIPT)
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        record->time = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+    memcpy(record + 1, first, first_len);
+    memcpy((char *)(record + 1) + first_len, second, second_len);
+    ring->tail.store(tail + size, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst); // the record is seen by the writer, or the writer is seen going to sleep
+    if (IDLE.load(memory_order_relaxed) && IDLE.exchange(false))
+    {
+        uint64_t one = 1;
+        write(wake_fd, &one, sizeof(one)); // only the first record after the writer went to sleep costs a write
+    }
+}
+
+void log_printf(const char *format, ...)
+{
+    char text[MAX_LINE];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if (len >= (int) sizeof(text))
+    {
+        len = sizeof(text) - 1;
+        text[len - 1] = '\n';
+    }
+    if (len > 0)
+    {
+        append(RECORD_TEXT, -1, text, len, NULL, 0);
+    }
+}
+
+/* Record a command line and the response it got. The line may be cut short by the caller, e.g. to leave out a password. */
+void log_transcript(int fd, const char *line, size_t len, const char *reply)
+{
+    size_t reply_len = strlen(reply);
+    append(RECORD_TRANSCRIPT, fd, line, len < MAX_LINE ? len : MAX_LINE, reply,
+           reply_len < MAX_LINE ? reply_len : MAX_LINE);
+}
+
+/* Helper function that appends bytes as the contents of a JSON string */
+static void escape(string &out, const char *text, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        unsigned char c = text[i];
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += c;
+        }
+        else if (c == '\r')
+        {
+            out += "\\r";
+        }
+        else if (c == '\n')
+        {
+            out += "\\n";
+        }
+        else if (c < 0x20)
+        {
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", c);
+            out += code;
+        }
+        else
+        {
+            out += c;
+        }
+    }
+}
+
+/* Helper function that writes all of a buffer */
+static void write_all(int fd, const string &out)
+{
+    for (size_t done = 0; done < out.size();)
+    {
+        ssize_t n = write(fd, out.data() + done, out.size() - done);
+        if (n <= 0)
+        {
+            return;
+        }
+        done += n;
+    }
+}
+
+/* Empty every ring once, returns false if there was nothing to write */
+static bool drain()
+{
+    pthread_mutex_lock(&drain_lock);
+    pthread_mutex_lock(&rings_lock);
+    ring_t *first = RINGS; // rings are only ever added at the front
+    pthread_mutex_unlock(&rings_lock);
+    string text, json;
+    for (ring_t *ring = first; ring != NULL; ring = ring->next)
+    {
+        uint64_t head = ring->head.load(memory_order_relaxed), tail = ring->tail.load(memory_order_acquire);
+        while (head < tail)
+        {
+            uint64_t to_end = RING_SIZE - head % RING_SIZE;
+            if (to_end < sizeof(record_t))
+            {
+                head += to_end;
+                continue;
+            }
+            const record_t *record = (const record_t *)(ring->data + head % RING_SIZE);
+            const char *bytes = (const char *)(record + 1);
+            if (record->kind == RECORD_TEXT)
+            {
+                text.append(bytes, record->first);
+            }
+            else if (record->kind == RECORD_TRANSCRIPT)
+            {
+                char prefix[128];
+                snprintf(prefix, sizeof(prefix), "{\"time\": %llu.%06llu, \"server\": \"%s\", \"fd\": %d, \"command\": \"",
+                         (unsigned long long) record->time / 1000000, (unsigned long long) record->time % 1000000,
+                         SERVER.c_str(), record->fd);
+                json += prefix;
+                escape(json, bytes, record->first);
+                json += "\", \"response\": \"";
+                escape(json, bytes + record->first, record->second);
+                json += "\"}\n";
+            }
+            head += record->size;
+        }
+        ring->head.store(head, memory_order_release);
+        uint64_t dropped = ring->dropped.load(memory_order_relaxed);
+        if (dropped != ring->reported)
+        {
+            char line[64];
+            snprintf(line, sizeof(line), "Log: %llu lines dropped\n", (unsigned long long)(dropped - ring->reported));
+            text += line;
+            ring->reported = dropped;
+        }
+    }
+    write_all(STDERR_FILENO, text);
+    if (transcript_fd >= 0)
+    {
+        write_all(transcript_fd, json);
+    }
+    pthread_mutex_unlock(&drain_lock);
+    return !text.empty() || !json.empty();
+}
+
+/* Thread function that writes the rings out, and sleeps on the eventfd while they are empty. The rings are drained once more after
+ * IDLE is set, so a record added just before is not left waiting for the next one. */
+static void *writer(void *arg)
+{
+    struct pollfd pfd = { wake_fd, POLLIN, 0 };
+    uint64_t count;
+    while (true)
+    {
+        if (drain())
+        {
+            continue;
+        }
+        IDLE = true;
+        atomic_thread_fence(memory_order_seq_cst);
+        if (!drain() && poll(&pfd, 1, -1) == 1)
+        {
+            read(wake_fd, &count, sizeof(count));
+        }
+        IDLE = false;
+    }
+    return NULL;
+}
+
+/* Start the writer thread, with a transcript file if a path is given, unless nothing is logged at all. Returns false if the
+ * transcript cannot be opened. */
+bool log_start(const char *server, const char *transcript)
+{
+    SERVER = server;
+    if (transcript != NULL)
+    {
+        transcript_fd = open(transcript, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0640);
+        if (transcript_fd < 0)
+        {
+            return false;
+        }
+        TRANSCRIPT = true;
+    }
+    if (!DEBUG && !TRANSCRIPT)
+    {
+        return true;
+    }
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pthread_t thread;
+    pthread_create(&thread, NULL, &writer, NULL);
+    pthread_detach(thread);
+    return true;
+}
+
+/* Write out everything logged so far, before the process exits */
+void log_flush()
+{
+    while (drain())
+    {
+    }
+}
@@ -0,0 +1,387 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "mailbox.h"
+#include "digest.h"
+#include "store.h"
+#include "probes.h"
+
+using namespace std;
+
+/* Ranges smaller than this are not worth a thread of their own */
+#ifndef PARALLEL_MIN
+#define PARALLEL_MIN (4 * 1024 * 1024)
+#endif
+
+/* Process-wide cache of mailbox snapshots. Only weak references are kept, so a snapshot lives as long as a session uses it. */
+static unordered_map<string, weak_ptr<const Snapshot> > CACHE;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long VERSION = 0;
+
+static const char TITLE[] = "From <";
+static const int TITLE_LEN = 6;
+
+/* Work of one parser thread: finds the titles in [begin, end) of a chunk and counts the LFs not preceded by CR in between */
+struct scan_t
+{
+    const char *data;
+    size_t size, begin, end;
+    vector<size_t> titles;
+    vector<uint64_t> bare; // bare[k] LFs before titles[k], the last one after the last title
+};
+
+/* Work of one indexing thread: computes the UIDs of messages [begin, end) */
+struct index_t
+{
+    Snapshot *snap;
+    int begin, end;
+};
+
+Chunk::~Chunk()
+{
+    if (map != NULL)
+    {
+        munmap(map, map_len);
+    }
+}
+
+/* Helper function that checks the LF at position i: counts it if it is bare and records a title after it */
+static inline void scan_lf(scan_t *s, size_t i, uint64_t &bare)
+{
+    if (i == 0 || s->data[i - 1] != '\r')
+    {
+        bare++;
+    }
+    if (i + 1 + TITLE_LEN <= s->size
+            && memcmp(s->data + i + 1, TITLE, TITLE_LEN) == 0)
+    {
+        s->bare.push_back(bare);
+        s->titles.push_back(i + 1);
+        bare = 0;
+    }
+}
+
+/* Thread function that scans a range of a chunk. LFs are found 16 bytes at a time, and only blocks with a LF followed by 'F' are checked byte by byte. */
+static void *scan_range(void *p)
+{
+    scan_t *s = (scan_t *) p;
+    uint64_t bare = 0;
+    size_t i = s->begin;
+    if (i == 0 && i < s->end)
+    {
+        if (s->data[0] == '\n')
+        {
+            scan_lf(s, 0, bare);
+        }
+        i++;
+    }
+#ifdef __SSE2__
+    const __m128i lf = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r'),
+                  f = _mm_set1_epi8('F');
+    for (; i + 16 <= s->end && i + 17 <= s->size; i += 16)
+    {
+        unsigned int lfs = _mm_movemask_epi8(
+                               _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s->data + i)), lf));
+        if (lfs == 0)
+        {
+            continue;
+        }
+        unsigned int crs = _mm_movemask_epi8(
+                               _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s->data + i - 1)), cr));
+        unsigned int fs = _mm_movemask_epi8(
+                              _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s->data + i + 1)), f));
+        if ((lfs & fs) == 0)
+        {
+            bare += __builtin_popcount(lfs & ~crs); // no title starts in this block
+            continue;
+        }
+        while (lfs != 0)
+        {
+            scan_lf(s, i + __builtin_ctz(lfs), bare);
+            lfs &= lfs - 1;
+        }
+    }
+#endif
+    for (; i < s->end; i++)
+    {
+        const char *next = (const char *) memchr(s->data + i, '\n', s->end - i);
+        if (next == NULL)
+        {
+            break;
+        }
+        i = next - s->data;
+        scan_lf(s, i, bare);
+    }
+    s->bare.push_back(bare);
+    return NULL;
+}
+
+/* Thread function that computes the UIDs of a range of messages, many messages per call */
+static void *index_range(void *p)
+{
+    index_t *x = (index_t *) p;
+    Snapshot *snap = x->snap;
+    int n = x->end - x->begin;
+    vector<const char *> data(n);
+    vector<size_t> len(n);
+    for (int i = 0; i < n; i++)
+    {
+        data[i] = snap->content(x->begin + i);
+        len[i] = snap->len[x->begin + i];
+    }
+    digest_batch(data.data(), len.data(), n,
+                 &snap->uids[(size_t) x->begin * snap->uid_len]);
+    return NULL;
+}
+
+/* Helper function that runs func on each piece of work, one thread per piece */
+template <class T>
+static void run_parallel(vector<T> &work, void *(*func)(void *))
+{
+    vector<pthread_t> threads(work.size());
+    for (int i = 1; i < work.size(); i++)
+    {
+        pthread_create(&threads[i], NULL, func, &work[i]);
+    }
+    func(&work[0]); // the first piece runs in the calling thread
+    for (int i = 1; i < work.size(); i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+/* Helper function that decides how many threads should share a piece of work */
+static int parallelism(size_t bytes)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    long n = bytes / PARALLEL_MIN;
+    if (n > cpus)
+    {
+        n = cpus;
+    }
+    return n < 1 ? 1 : n;
+}
+
+/* Map the bytes of a mbox file from offset and add the messages in them to the snapshot. Content before the first title is ignored. */
+static void parse_mbox(int fd, off_t offset, off_t file_size, Snapshot *snap)
+{
+    if (fd < 0 || file_size <= offset)
+    {
+        return;
+    }
+    PROBE3(mbox__parse__start, fd, offset, file_size);
+    shared_ptr<Chunk> chunk = make_shared<Chunk>();
+    off_t base = offset - offset % sysconf(_SC_PAGESIZE);
+    chunk->map_len = file_size - base;
+    chunk->map = mmap(NULL, chunk->map_len, PROT_READ, MAP_PRIVATE, fd, base);
+    if (chunk->map == MAP_FAILED)
+    {
+        chunk->map = NULL;
+        perror("mmap() failed");
+        return;
+    }
+    chunk->data = (const char *) chunk->map + (offset - base);
+    chunk->size = file_size - offset;
+
+    /* Find the titles of each range concurrently */
+    int n = parallelism(chunk->size);
+    vector<scan_t> scans(n);
+    for (int i = 0; i < n; i++)
+    {
+        scans[i].data = chunk->data;
+        scans[i].size = chunk->size;
+        scans[i].begin = chunk->size / n * i;
+        scans[i].end = i == n - 1 ? chunk->size : chunk->size / n * (i + 1);
+    }
+    run_parallel(scans, scan_range);
+
+    /* Stitch the ranges together, a message may span several ranges */
+    vector<size_t> titles;
+    vector<uint64_t> bares;
+    uint64_t bare = 0;
+    if (chunk->size >= TITLE_LEN && memcmp(chunk->data, TITLE, TITLE_LEN) == 0)
+    {
+        titles.push_back(0); // the appended bytes start at a line
+    }
+    for (int i = 0; i < n; i++)
+    {
+        for (int k = 0; k < scans[i].titles.size(); k++)
+        {
+            bare += scans[i].bare[k];
+            if (!titles.empty())
+            {
+                bares.push_back(bare);
+            }
+            titles.push_back(scans[i].titles[k]);
+            bare = 0;
+        }
+        bare += scans[i].bare.back();
+    }
+    if (titles.empty())
+    {
+        return;
+    }
+    bares.push_back(bare);
+
+    /* Fill the message table */
+    uint32_t idx = snap->chunks.size();
+    int first = snap->count();
+    snap->chunks.push_back(chunk);
+    for (int k = 0; k < titles.size(); k++)
+    {
+        size_t end = k + 1 < titles.size() ? titles[k + 1] : chunk->size;
+        const char *title = chunk->data + titles[k];
+        const char *eol = (const char *) memchr(title, '\n', end - titles[k]);
+        uint32_t title_len = eol ? eol + 1 - title : end - titles[k];
+        uint64_t len = end - titles[k] - title_len;
+        uint64_t size = len + bares[k];
+        if (eol && (eol == title || eol[-1] != '\r'))
+        {
+            size--; // the LF of the title line is not part of the content
+        }
+        if (len > 0 && title[title_len + len - 1] != '\n')
+        {
+            size += 2; // the last line is sent with CRLF
+        }
+        uint64_t octets;
+        if (store_compressed(title + title_len, len, octets))
+        {
+            size = octets; // sent inflated
+        }
+        snap->chunk.push_back(idx);
+        snap->offset.push_back(titles[k]);
+        snap->title_len.push_back(title_len);
+        snap->len.push_back(len);
+        snap->size.push_back(size);
+    }
+
+    /* Compute the UIDs of the new messages concurrently */
+    snap->uids.resize((size_t) snap->count() * snap->uid_len);
+    n = parallelism(chunk->size);
+    if (n > snap->count() - first)
+    {
+        n = snap->count() - first;
+    }
+    vector<index_t> work(n);
+    for (int i = 0; i < n; i++)
+    {
+        work[i].snap = snap;
+        work[i].begin = first + (snap->count() - first) / n * i;
+        work[i].end = i == n - 1 ? snap->count() :
+                      first + (snap->count() - first) / n * (i + 1);
+    }
+    run_parallel(work, index_range);
+    PROBE2(mbox__parse__done, fd, snap->count());
+}
+
+/* Helper function that records which version of the file a snapshot covers */
+static void stamp(Snapshot *snap, const struct stat &st)
+{
+    snap->file_size = st.st_size;
+    snap->file_ino = st.st_ino;
+    snap->file_mtime = st.st_mtime;
+    pthread_mutex_lock(&cache_lock);
+    snap->version = ++VERSION;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/* Get the latest snapshot of a mailbox. A cached snapshot is reused if the file is unchanged, or extended by parsing only the appended bytes.
+ * If fd is given, it is the mailbox file already locked by the caller; otherwise the file is opened and share-locked while it is mapped. */
+snapshot_ptr mbox_acquire(const string &address, int fd)
+{
+    bool own = fd < 0;
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    if (own && (fd = open(address.c_str(), O_RDONLY)) >= 0)
+    {
+        flock(fd, LOCK_SH); // wait for an append in progress
+    }
+    if (fd >= 0)
+    {
+        fstat(fd, &st);
+    }
+    pthread_mutex_lock(&cache_lock);
+    snapshot_ptr old = CACHE[address].lock();
+    pthread_mutex_unlock(&cache_lock);
+
+    if (old && old->file_ino == st.st_ino && old->file_size == st.st_size
+            && old->file_mtime == st.st_mtime)
+    {
+        if (own && fd >= 0)
+        {
+            flock(fd, LOCK_UN);
+            close(fd);
+        }
+        return old; // nothing changed
+    }
+    shared_ptr<Snapshot> snap = make_shared<Snapshot>();
+    snap->uid_len = digest_current()->length;
+    off_t offset = 0;
+    if (old && old->file_ino == st.st_ino && old->file_size < st.st_size)
+    {
+        *snap = *old; // new mail was appended, share the old chunks and copy the table
+        offset = old->file_size;
+    }
+    parse_mbox(fd, offset, st.st_size, snap.get());
+    if (own && fd >= 0)
+    {
+        flock(fd, LOCK_UN); // a mapping keeps the file open, so the lock is not released by close()
+        close(fd);
+    }
+    stamp(snap.get(), st);
+    mbox_publish(address, snap);
+    return snap;
+}
+
+/* Make a snapshot as the latest version of a mailbox */
+void mbox_publish(const string &address, const snapshot_ptr &snap)
+{
+    pthread_mutex_lock(&cache_lock);
+    CACHE[address] = snap;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/* Build a snapshot with the kept messages of another one, for a mailbox file that was just rewritten with them. It is stamped from
+ * the new file, which the caller keeps locked until the snapshot is published, so an append cannot slip in between. */
+snapshot_ptr mbox_select(const snapshot_ptr &snap, const vector<int> &keep, int fd)
+{
+    shared_ptr<Snapshot> next = make_shared<Snapshot>();
+    next->uid_len = snap->uid_len;
+    vector<int> remap(snap->chunks.size(), -1); // only chunks still in use are shared
+    for (int k = 0; k < keep.size(); k++)
+    {
+        int i = keep[k];
+        if (remap[snap->chunk[i]] < 0)
+        {
+            remap[snap->chunk[i]] = next->chunks.size();
+            next->chunks.push_back(snap->chunks[snap->chunk[i]]);
+        }
+        next->chunk.push_back(remap[snap->chunk[i]]);
+        next->offset.push_back(snap->offset[i]);
+        next->title_len.push_back(snap->title_len[i]);
+        next->len.push_back(snap->len[i]);
+        next->size.push_back(snap->size[i]);
+        next->uids.insert(next->uids.end(), snap->uid(i), snap->uid(i) + snap->uid_len);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        memset(&st, 0, sizeof(st));
+    }
+    stamp(next.get(), st);
+    return next;
+}
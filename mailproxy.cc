@@ -0,0 +1,757 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <pthread.h>
+
+#include "ring.h"
+#include "command.h"
+#include "relay.h"
+
+using namespace std;
+
+/* Front proxy of a cluster of SMTP and POP3 servers, each holding the mailboxes the ring assigns to its node. SMTP is terminated
+ * here and every recipient is passed to the server of its node, a transaction opening one connection per node it needs. A copy of
+ * a message that one node did not take while another did waits in the queue of queue_dir/.queue and is sent again. A POP3
+ * session is passed whole to the server of the user's node after USER, and its bytes are spliced through from then on. */
+
+/* Const messages and global variables */
+const char *SMTP_READY = "220 localhost Service ready\r\n";
+const char *SMTP_CLOSE = "221 localhost Service closing transmission channel\r\n";
+const char *SMTP_HELO = "250 localhost\r\n";
+const char *SMTP_OK = "250 OK\r\n";
+const char *SMTP_START = "354 Start mail input; end with <CRLF>.<CRLF>\r\n";
+const char *SMTP_TIMEOUT = "421 localhost Timeout, closing transmission channel\r\n";
+const char *SMTP_BACKEND = "451 Requested action aborted: mailbox server unavailable\r\n";
+const char *SMTP_UNRECOGNIZED = "500 Syntax error, command unrecognized\r\n";
+const char *SMTP_SYN_ERR = "501 Syntax error in parameters or arguments\r\n";
+const char *SMTP_SEQ_ERR = "503 Bad sequence of commands\r\n";
+const char *SMTP_UNAVAIL = "550 Requested action not taken: mailbox unavailable\r\n";
+const char *POP3_READY = "+OK POP3 server ready [localhost]\r\n";
+const char *POP3_CAPA = "+OK Capability list follows\r\nUSER\r\nUIDL\r\nXSRCH\r\n.\r\n";
+const char *POP3_CLOSE = "+OK POP3 server signing off\r\n";
+const char *POP3_SEQ_ERR = "-ERR Bad sequence of commands\r\n";
+const char *POP3_BACKEND = "-ERR [SYS/TEMP] mailbox server unavailable\r\n";
+
+#define MAX_LINE (1024 * 8)
+#define BACKEND_TIMEOUT 60 // for connecting to a backend and for each of its replies
+#define FLUSH_SIZE (64 * 1024) // message content passed to the backends at a time
+
+/* SMTP commands, found with a perfect hash of the verb */
+enum command_t { CMD_HELO, CMD_EHLO, CMD_MAIL, CMD_RCPT, CMD_DATA, CMD_RSET, CMD_NOOP, CMD_QUIT, CMD_UNKNOWN };
+#define VERB_HASH 0x9e3779ccu
+#define VERB_BITS 4
+
+/* Commands accepted in each state: 0 new connect, 1 HELO/RSET, 2 MAIL, 3 RCPT */
+const bool ALLOWED[4][CMD_UNKNOWN + 1] =
+{
+    //  HELO   EHLO   MAIL   RCPT   DATA   RSET   NOOP   QUIT   unknown
+    {  true,  true, false, false, false, false, false,  true,  true },
+    {  true,  true,  true, false, false,  true,  true,  true,  true },
+    { false, false, false,  true, false,  true,  true,  true,  true },
+    { false, false, false,  true,  true,  true,  true,  true,  true },
+};
+
+/* A socket and the bytes read from it that were not used yet */
+struct stream_t
+{
+    int fd;
+    string in;
+};
+
+/* A connection to the SMTP server of a node for the current transaction */
+struct backend_t
+{
+    string node, host, port;
+    stream_t stream;
+    vector<string> rcpts; // taken by the node
+    bool failed;
+};
+
+string nodes_path;
+shared_ptr<const Ring> RING; // replaced on SIGHUP, sessions keep the one they started with
+pthread_mutex_t lock;
+int wake_fd[2] = { -1, -1 }; // written by the signal handlers, read by the accept loop
+unsigned int IDLE_TIMEOUT = 300;
+bool DEBUG;
+
+/* Signal handler for ctrl-c, wake the accept loop to stop */
+void sig_handler(int arg)
+{
+    char byte = 'i';
+    write(wake_fd[1], &byte, 1);
+}
+
+/* Signal handler for SIGHUP, wake the accept loop to read the nodes again */
+void reload_handler(int arg)
+{
+    char byte = 'h';
+    write(wake_fd[1], &byte, 1);
+}
+
+shared_ptr<const Ring> current_ring()
+{
+    pthread_mutex_lock(&lock);
+    shared_ptr<const Ring> ring = RING;
+    pthread_mutex_unlock(&lock);
+    return ring;
+}
+
+/* Read the nodes file and route new sessions with the ring it gives. Prints how much of the mailboxes a change moves. */
+bool load_ring()
+{
+    vector<Node> nodes;
+    if (!ring_load(nodes_path, nodes) || nodes.empty())
+    {
+        fprintf(stderr, "Cannot load nodes from %s\n", nodes_path.c_str());
+        return false;
+    }
+    shared_ptr<const Ring> ring(new Ring(nodes)), old = current_ring();
+    if (old)
+    {
+        fprintf(stderr, "Nodes reloaded: %d nodes, %.1f%% of mailboxes move\n", (int) ring->size(),
+                100 * old->moved(*ring));
+    }
+    pthread_mutex_lock(&lock);
+    RING = ring;
+    pthread_mutex_unlock(&lock);
+    return true;
+}
+
+bool write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, data, len);
+        if (n <= 0)
+        {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool write_all(int fd, const string &data)
+{
+    return write_all(fd, data.data(), data.size());
+}
+
+/* Helper function that takes a line, CRLF included, from a stream. Returns false on a closed connection, a timeout (errno is
+ * EAGAIN then) or a line too long. */
+bool read_line(stream_t &stream, string &line)
+{
+    size_t end;
+    errno = 0;
+    while ((end = stream.in.find("\r\n")) == string::npos)
+    {
+        char data[4096];
+        ssize_t n = stream.in.size() > MAX_LINE ? 0 : read(stream.fd, data, sizeof(data));
+        if (n <= 0)
+        {
+            return false;
+        }
+        stream.in.append(data, n);
+    }
+    line.assign(stream.in, 0, end + 2);
+    stream.in.erase(0, end + 2);
+    return true;
+}
+
+/* Helper function that reads an SMTP reply, the last line of it if it has several */
+bool read_reply(stream_t &stream, string &reply)
+{
+    do
+    {
+        if (!read_line(stream, reply) || reply.size() < 5)
+        {
+            return false;
+        }
+    }
+    while (reply[3] == '-');
+    return true;
+}
+
+/* Connect to a backend server, returns -1 if it cannot be reached within BACKEND_TIMEOUT */
+int connect_to(const string &host, int port)
+{
+    struct addrinfo hints = { }, *addrs;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &addrs) != 0)
+    {
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo *addr = addrs; addr != NULL && fd < 0; addr = addr->ai_next)
+    {
+        fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        struct timeval timeout = { BACKEND_TIMEOUT, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)); // also bounds connect()
+        if (fd >= 0 && connect(fd, addr->ai_addr, addr->ai_addrlen) < 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addrs);
+    return fd;
+}
+
+/* Map a command line to its command, one multiplication and a jump table */
+command_t lookup(const char *buffer)
+{
+    uint32_t code = read_verb(buffer);
+    switch (verb_slot(code, VERB_HASH, VERB_BITS))
+    {
+    case verb_slot(verb("HELO"), VERB_HASH, VERB_BITS):
+        return code == verb("HELO") ? CMD_HELO : CMD_UNKNOWN;
+    case verb_slot(verb("EHLO"), VERB_HASH, VERB_BITS):
+        return code == verb("EHLO") ? CMD_EHLO : CMD_UNKNOWN;
+    case verb_slot(verb("MAIL"), VERB_HASH, VERB_BITS):
+        return code == verb("MAIL") && read_verb(buffer + 5) == verb("FROM") ? CMD_MAIL : CMD_UNKNOWN;
+    case verb_slot(verb("RCPT"), VERB_HASH, VERB_BITS):
+        return code == verb("RCPT") && (read_verb(buffer + 5) & 0xffff) == (verb("TO  ") & 0xffff) ?
+               CMD_RCPT : CMD_UNKNOWN;
+    case verb_slot(verb("DATA"), VERB_HASH, VERB_BITS):
+        return code == verb("DATA") ? CMD_DATA : CMD_UNKNOWN;
+    case verb_slot(verb("RSET"), VERB_HASH, VERB_BITS):
+        return code == verb("RSET") ? CMD_RSET : CMD_UNKNOWN;
+    case verb_slot(verb("NOOP"), VERB_HASH, VERB_BITS):
+        return code == verb("NOOP") ? CMD_NOOP : CMD_UNKNOWN;
+    case verb_slot(verb("QUIT"), VERB_HASH, VERB_BITS):
+        return code == verb("QUIT") ? CMD_QUIT : CMD_UNKNOWN;
+    default:
+        return CMD_UNKNOWN;
+    }
+}
+
+/* Helper function that ends the transaction of a session on its backends */
+void close_backends(vector<backend_t> &backends)
+{
+    for (int i = 0; i < backends.size(); i++)
+    {
+        write_all(backends[i].stream.fd, "QUIT\r\n", 6);
+        close(backends[i].stream.fd);
+    }
+    backends.clear();
+}
+
+/* Helper function that connects to the SMTP server of a node and starts the transaction of the session there */
+bool open_backend(const Node *node, const string &mail, backend_t &backend)
+{
+    backend.node = node->name;
+    backend.host = node->host;
+    backend.port = to_string(node->smtp_port);
+    backend.rcpts.clear();
+    backend.failed = false;
+    backend.stream.fd = connect_to(node->host, node->smtp_port);
+    if (backend.stream.fd < 0)
+    {
+        return false;
+    }
+    string reply;
+    if (!read_reply(backend.stream, reply) || reply[0] != '2'
+            || !write_all(backend.stream.fd, "HELO localhost\r\n") || !read_reply(backend.stream, reply) || reply[0] != '2'
+            || !write_all(backend.stream.fd, mail) || !read_reply(backend.stream, reply) || reply[0] != '2')
+    {
+        close(backend.stream.fd);
+        return false;
+    }
+    return true;
+}
+
+/* RCPT TO command handler that passes the recipient to the server of its node, and its answer back */
+void do_rcpt(int fd, int &status, const string &line, const string &mail, const Ring &ring,
+             vector<backend_t> &backends)
+{
+    size_t at = line.find('@'), start = line.find('<'), end = line.find('>');
+    if (start == string::npos || at == string::npos || end == string::npos || !(start < at && at < end)
+            || line.compare(at + 1, end - at - 1, "localhost") != 0)
+    {
+        write_all(fd, SMTP_UNAVAIL, strlen(SMTP_UNAVAIL));
+        return;
+    }
+    const Node *node = ring.lookup(line.substr(start + 1, at - start - 1));
+    int i = 0;
+    while (i < backends.size() && backends[i].node != node->name)
+    {
+        i++;
+    }
+    if (i == backends.size())
+    {
+        backend_t backend;
+        if (!open_backend(node, mail, backend))
+        {
+            write_all(fd, SMTP_BACKEND, strlen(SMTP_BACKEND));
+            if (DEBUG)
+            {
+                fprintf(stderr, "[%d] Cannot reach SMTP server of node %s\n", fd, node->name.c_str());
+            }
+            return;
+        }
+        backends.push_back(backend);
+    }
+    string reply;
+    if (!write_all(backends[i].stream.fd, line) || !read_reply(backends[i].stream, reply))
+    {
+        write_all(fd, SMTP_BACKEND, strlen(SMTP_BACKEND));
+        return;
+    }
+    if (reply[0] == '2')
+    {
+        backends[i].rcpts.push_back(line.substr(start + 1, end - start - 1));
+        status = 3;
+    }
+    write_all(fd, reply);
+}
+
+/* Helper function that passes message content to the backends still taking it */
+void flush_content(vector<backend_t> &backends, string &content)
+{
+    for (int i = 0; i < backends.size(); i++)
+    {
+        if (!backends[i].failed && !write_all(backends[i].stream.fd, content))
+        {
+            backends[i].failed = true;
+        }
+    }
+    content.clear();
+}
+
+/* Helper function that queues the copies of a message for the nodes that did not take it, to be sent again later. Returns false
+ * if one cannot be queued. */
+bool queue_copies(const vector<backend_t> &backends, const vector<bool> &took, const string &mail, const string &message)
+{
+    size_t start = mail.find('<'), end = mail.find('>', start);
+    string sender = start == string::npos || end == string::npos ? "" : mail.substr(start + 1, end - start - 1);
+    for (int i = 0; i < backends.size(); i++)
+    {
+        if (took[i] || backends[i].rcpts.empty())
+        {
+            continue;
+        }
+        if (!relay_forward(backends[i].host, backends[i].port, sender, backends[i].rcpts, message))
+        {
+            return false;
+        }
+        if (DEBUG)
+        {
+            fprintf(stderr, "Message for node %s queued, it did not take it\n", backends[i].node.c_str());
+        }
+    }
+    return true;
+}
+
+/* DATA command handler that passes the message to every node with recipients. One reply covers all recipients in SMTP, so once a
+ * node took the message it is answered with 250 and the copies of the nodes that did not are queued and sent again later;
+ * answering with an error would have the client send it again to the nodes that have it. The reply is the first error if no
+ * node took it, or if a copy cannot be queued. Returns false if the client went away. */
+bool do_data(stream_t &client, vector<backend_t> &backends, const string &mail)
+{
+    string reply, error, line, content, message;
+    int taking = 0;
+    for (int i = 0; i < backends.size(); i++)
+    {
+        backend_t &backend = backends[i];
+        backend.failed = backend.rcpts.empty() || !write_all(backend.stream.fd, "DATA\r\n")
+                         || !read_reply(backend.stream, reply) || reply[0] != '3';
+        if (!backend.rcpts.empty() && backend.failed && error.empty())
+        {
+            error = reply[0] == '3' || reply.empty() ? SMTP_BACKEND : reply;
+        }
+        taking += !backend.failed;
+    }
+    if (taking == 0)
+    {
+        write_all(client.fd, error);
+        return true;
+    }
+    write_all(client.fd, SMTP_START, strlen(SMTP_START));
+    do
+    {
+        if (!read_line(client, line))
+        {
+            return false; // the backends drop the message when their connection closes
+        }
+        content += line;
+        if (line != ".\r\n")
+        {
+            message += line; // kept for the nodes that may not take it
+        }
+        if (content.size() >= FLUSH_SIZE)
+        {
+            flush_content(backends, content);
+        }
+    }
+    while (line != ".\r\n");
+    flush_content(backends, content);
+    vector<bool> took(backends.size(), false);
+    bool any = false;
+    for (int i = 0; i < backends.size(); i++)
+    {
+        if (backends[i].rcpts.empty())
+        {
+            continue;
+        }
+        if (backends[i].failed || !read_reply(backends[i].stream, reply))
+        {
+            reply = SMTP_BACKEND; // refused DATA, or broke while the message was passed on
+        }
+        took[i] = reply[0] == '2';
+        any = any || took[i];
+        if (reply[0] != '2' && error.empty())
+        {
+            error = reply;
+        }
+    }
+    if (any && !error.empty() && queue_copies(backends, took, mail, message))
+    {
+        error.clear();
+    }
+    write_all(client.fd, error.empty() ? SMTP_OK : error.c_str());
+    return true;
+}
+
+/* An SMTP session: the envelope is checked here and every recipient goes to the server of its node */
+void smtp_session(int fd)
+{
+    write_all(fd, SMTP_READY, strlen(SMTP_READY)); // greeting message
+    stream_t client = { fd, "" };
+    int status = 0; // status for a client: 0 new connect, 1 HELO/RSET, 2 MAIL, 3 RCPT
+    string line, mail;
+    vector<backend_t> backends;
+    shared_ptr<const Ring> ring;
+    while (read_line(client, line))
+    {
+        command_t cmd = lookup(line.c_str());
+        if (!ALLOWED[status][cmd])
+        {
+            write_all(fd, SMTP_SEQ_ERR, strlen(SMTP_SEQ_ERR));
+            continue;
+        }
+        switch (cmd)
+        {
+        case CMD_HELO:
+        case CMD_EHLO:
+            if (line.size() <= 7)
+            {
+                write_all(fd, SMTP_SYN_ERR, strlen(SMTP_SYN_ERR));
+                break;
+            }
+            close_backends(backends);
+            write_all(fd, SMTP_HELO, strlen(SMTP_HELO));
+            status = 1;
+            break;
+        case CMD_MAIL:
+            mail = line; // sent to each backend as the transaction reaches it
+            ring = current_ring();
+            write_all(fd, SMTP_OK, strlen(SMTP_OK));
+            status = 2;
+            break;
+        case CMD_RCPT:
+            do_rcpt(fd, status, line, mail, *ring, backends);
+            break;
+        case CMD_DATA:
+            if (!do_data(client, backends, mail))
+            {
+                close_backends(backends);
+                return;
+            }
+            close_backends(backends);
+            status = 1;
+            break;
+        case CMD_RSET:
+            close_backends(backends);
+            write_all(fd, SMTP_OK, strlen(SMTP_OK));
+            status = 1;
+            break;
+        case CMD_NOOP:
+            write_all(fd, SMTP_OK, strlen(SMTP_OK));
+            break;
+        case CMD_QUIT:
+            write_all(fd, SMTP_CLOSE, strlen(SMTP_CLOSE));
+            close_backends(backends);
+            return;
+        case CMD_UNKNOWN:
+            write_all(fd, SMTP_UNRECOGNIZED, strlen(SMTP_UNRECOGNIZED));
+            break;
+        }
+    }
+    if (errno == EAGAIN)
+    {
+        write_all(fd, SMTP_TIMEOUT, strlen(SMTP_TIMEOUT));
+    }
+    close_backends(backends);
+}
+
+/* Helper function that moves what one side sent to the other through a pipe, without copying it through the proxy. Returns false
+ * once the sender closed or either side failed. */
+bool forward(int from, int to, int pipe_fd[2])
+{
+    ssize_t n = splice(from, NULL, pipe_fd[1], NULL, 64 * 1024, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n <= 0)
+    {
+        return n < 0 && errno == EAGAIN;
+    }
+    while (n > 0)
+    {
+        ssize_t sent = splice(pipe_fd[0], NULL, to, NULL, n, SPLICE_F_MOVE);
+        if (sent <= 0)
+        {
+            return false;
+        }
+        n -= sent;
+    }
+    return true;
+}
+
+/* Pass the rest of a session between the client and its server until either side closes, or both are idle for IDLE_TIMEOUT */
+void relay(stream_t &client, stream_t &server)
+{
+    int up[2], down[2];
+    if (!write_all(server.fd, client.in) || !write_all(client.fd, server.in) || pipe(up) != 0)
+    {
+        return;
+    }
+    if (pipe(down) != 0)
+    {
+        close(up[0]);
+        close(up[1]);
+        return;
+    }
+    struct pollfd fds[2] = { { client.fd, POLLIN, 0 }, { server.fd, POLLIN, 0 } };
+    while (poll(fds, 2, IDLE_TIMEOUT * 1000) > 0)
+    {
+        if ((fds[0].revents && !forward(client.fd, server.fd, up))
+                || (fds[1].revents && !forward(server.fd, client.fd, down)))
+        {
+            break;
+        }
+    }
+    close(up[0]);
+    close(up[1]);
+    close(down[0]);
+    close(down[1]);
+}
+
+/* A POP3 session: USER picks the node, and the server there takes the session from the USER command on */
+void pop3_session(int fd)
+{
+    write_all(fd, POP3_READY, strlen(POP3_READY)); // greeting message
+    stream_t client = { fd, "" };
+    string line, reply;
+    while (read_line(client, line))
+    {
+        uint32_t code = read_verb(line.c_str());
+        if (code == verb("USER") && line.size() > 7)
+        {
+            const Node *node = current_ring()->lookup(line.substr(5, line.size() - 7));
+            stream_t server = { connect_to(node->host, node->pop3_port), "" };
+            if (server.fd < 0 || !read_line(server, reply) || reply[0] != '+'
+                    || !write_all(server.fd, line) || !read_line(server, reply))
+            {
+                write_all(fd, POP3_BACKEND, strlen(POP3_BACKEND));
+                if (DEBUG)
+                {
+                    fprintf(stderr, "[%d] Cannot reach POP3 server of node %s\n", fd, node->name.c_str());
+                }
+                if (server.fd >= 0)
+                {
+                    close(server.fd);
+                }
+                continue;
+            }
+            write_all(fd, reply);
+            if (reply[0] == '+')
+            {
+                relay(client, server);
+                close(server.fd);
+                return;
+            }
+            write_all(server.fd, "QUIT\r\n", 6); // unknown user, the client may name another
+            close(server.fd);
+        }
+        else if (code == verb("CAPA"))
+        {
+            write_all(fd, POP3_CAPA, strlen(POP3_CAPA));
+        }
+        else if (code == verb("QUIT"))
+        {
+            write_all(fd, POP3_CLOSE, strlen(POP3_CLOSE));
+            return;
+        }
+        else
+        {
+            write_all(fd, POP3_SEQ_ERR, strlen(POP3_SEQ_ERR));
+        }
+    }
+}
+
+/* Thread function for handling a client, the protocol is in the lowest bit of the argument */
+void *client_t(void *p)
+{
+    intptr_t arg = (intptr_t) p;
+    int fd = arg >> 1;
+    struct timeval timeout = { (time_t) IDLE_TIMEOUT, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (arg & 1)
+    {
+        pop3_session(fd);
+    }
+    else
+    {
+        smtp_session(fd);
+    }
+    close(fd);
+    if (DEBUG)
+    {
+        printf("[%d] Connection closed\n", fd);
+    }
+    return NULL;
+}
+
+/* Helper function that opens a listening socket on a port */
+int listen_on(unsigned int port)
+{
+    int listen_fd = socket(PF_INET, SOCK_STREAM, 0), reuse = 1;
+    struct sockaddr_in server_addr = { };
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    server_addr.sin_port = htons(port);
+    if (listen_fd == -1
+            || setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, (const char *) &reuse, sizeof(int)) == -1
+            || bind(listen_fd, (struct sockaddr *) &server_addr, sizeof(server_addr)) == -1
+            || listen(listen_fd, 100) == -1)
+    {
+        fprintf(stderr, "Unable to listen on port %d.\n", port);
+        exit(1);
+    }
+    return listen_fd;
+}
+
+int main(int argc, char *argv[])
+{
+    /* Parsing command line arguments */
+    int ch = 0;
+    unsigned int smtp_port = 2500, pop3_port = 11000;
+    string queue_dir = ".";
+    while ((ch = getopt(argc, argv, "s:p:t:q:v")) != -1)
+    {
+        switch (ch)
+        {
+        case 'v':
+            DEBUG = true;
+            break;
+        case 's':
+            smtp_port = atoi(optarg);
+            break;
+        case 'p':
+            pop3_port = atoi(optarg);
+            break;
+        case 'q':
+            queue_dir = optarg;
+            break;
+        case 't':
+            IDLE_TIMEOUT = atoi(optarg);
+            if (IDLE_TIMEOUT <= 0)
+            {
+                fprintf(stderr, "Invalid timeout: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        default:
+            fprintf(stderr, "Error: Please input [-s smtp_port] [-p pop3_port] [-t idle_seconds] [-q queue_dir] [-v] nodes_file\n");
+            exit(1);
+        }
+    }
+    if (optind == argc)
+    {
+        fprintf(stderr, "Error: Please input nodes_file\n");
+        exit(1);
+    }
+    nodes_path = argv[optind];
+    pthread_mutex_init(&lock, NULL);
+    if (!load_ring())
+    {
+        exit(1);
+    }
+    if (!relay_start(queue_dir, ""))
+    {
+        fprintf(stderr, "Cannot open the queue in %s\n", queue_dir.c_str());
+        exit(1);
+    }
+
+    int listen_fd[2] = { listen_on(smtp_port), listen_on(pop3_port) };
+    if (pipe2(wake_fd, O_CLOEXEC) != 0)
+    {
+        exit(1);
+    }
+    signal(SIGINT, sig_handler);
+    signal(SIGHUP, reload_handler);
+    signal(SIGPIPE, SIG_IGN); // a closed client or backend shows as a failed write
+    if (DEBUG)
+    {
+        printf("Proxy configured to listen on ports %d (SMTP) and %d (POP3), %d nodes\n", smtp_port, pop3_port,
+               (int) RING->size());
+    }
+    fflush(stdout);
+
+    struct pollfd fds[3] = { { listen_fd[0], POLLIN, 0 }, { listen_fd[1], POLLIN, 0 }, { wake_fd[0], POLLIN, 0 } };
+    while (true)
+    {
+        if (poll(fds, 3, -1) < 0 && errno != EINTR)
+        {
+            break;
+        }
+        if (fds[2].revents & POLLIN)
+        {
+            char byte;
+            read(wake_fd[0], &byte, 1);
+            if (byte == 'i')
+            {
+                break;
+            }
+            load_ring();
+        }
+        for (int i = 0; i < 2; i++)
+        {
+            if (!(fds[i].revents & POLLIN))
+            {
+                continue;
+            }
+            int comm_fd = accept(listen_fd[i], NULL, NULL);
+            if (comm_fd == -1)
+            {
+                continue;
+            }
+            if (DEBUG)
+            {
+                printf("[%d] New %s connection\n", comm_fd, i ? "POP3" : "SMTP");
+            }
+
+            /* Assign the client to a thread */
+            pthread_t thread;
+            pthread_create(&thread, NULL, &client_t, (void *)(intptr_t)(comm_fd << 1 | i)); // by value, comm_fd is reused
+            pthread_detach(thread);
+        }
+    }
+    close(listen_fd[0]);
+    close(listen_fd[1]);
+    return 0;
+}
@@ -0,0 +1,121 @@
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "store.h"
+
+using namespace std;
+
+static const char TITLE[] = "From <";
+static const int TITLE_LEN = 6;
+
+/* Count in how many messages of a mbox file each line appears. Compressed messages are skipped. */
+void count_lines(const string &path, unordered_map<string, int> &counts, int &messages)
+{
+    ifstream in(path.c_str(), ios::binary);
+    if (!in)
+    {
+        fprintf(stderr, "Cannot read %s (%s)\n", path.c_str(), strerror(errno));
+        exit(1);
+    }
+    stringstream buffer;
+    buffer << in.rdbuf();
+    string data = buffer.str();
+    unordered_set<string> seen;
+    bool skip = true;
+    for (size_t start = 0, end; start < data.size(); start = end)
+    {
+        end = data.find('\n', start);
+        end = end == string::npos ? data.size() : end + 1;
+        if (data.compare(start, TITLE_LEN, TITLE) == 0)
+        {
+            seen.clear(); // a new message, its content starts on the next line
+            skip = data.compare(end, STORE_MARK_LEN, STORE_MARK) == 0;
+            messages += !skip;
+            continue;
+        }
+        string line = data.substr(start, end - start);
+        if (!skip && line.size() > 2 && seen.insert(line).second)
+        {
+            counts[line]++;
+        }
+    }
+}
+
+/* Score of a line in a dictionary: the bytes it saves in the messages after the first one that has it */
+bool by_score(const pair<string, int> &a, const pair<string, int> &b)
+{
+    return (uint64_t)(a.second - 1) * a.first.size() < (uint64_t)(b.second - 1) * b.first.size();
+}
+
+int main(int argc, char *argv[])
+{
+    /* Parsing command line arguments */
+    int ch = 0;
+    size_t size = 32 * 1024;
+    while ((ch = getopt(argc, argv, "s:")) != -1)
+    {
+        switch (ch)
+        {
+        case 's':
+            size = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Error: Please input [-s dictionary_bytes] dictionary mbox...\n");
+            exit(1);
+        }
+    }
+    if (argc - optind < 2)
+    {
+        fprintf(stderr, "Error: Please input dictionary mbox...\n");
+        exit(1);
+    }
+
+    unordered_map<string, int> counts;
+    int messages = 0;
+    for (int i = optind + 1; i < argc; i++)
+    {
+        count_lines(argv[i], counts, messages);
+    }
+
+    /* Take the lines that save the most until the dictionary is full. Deflate codes near matches in fewer bits, so the best go last. */
+    vector<pair<string, int> > lines;
+    for (unordered_map<string, int>::iterator it = counts.begin(); it != counts.end(); it++)
+    {
+        if (it->second > 1)
+        {
+            lines.push_back(*it);
+        }
+    }
+    sort(lines.begin(), lines.end(), by_score);
+    size_t used = 0;
+    int first = lines.size();
+    while (first > 0 && used + lines[first - 1].first.size() <= size)
+    {
+        first--;
+        used += lines[first].first.size();
+    }
+    ofstream out(argv[optind], ios::binary | ios::trunc);
+    for (int i = first; i < lines.size(); i++)
+    {
+        out.write(lines[i].first.data(), lines[i].first.size());
+    }
+    out.close();
+    if (!out)
+    {
+        fprintf(stderr, "Cannot write %s\n", argv[optind]);
+        exit(1);
+    }
+    printf("Wrote %d lines (%d bytes) common to %d messages\n", (int) lines.size() - first, (int) used, messages);
+    return 0;
+}
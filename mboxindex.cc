@@ -0,0 +1,173 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <dirent.h>
+#include <string>
+#include <vector>
+
+#include "registry.h"
+
+using namespace std;
+
+/* Helper function that tells whether a directory entry is one level of the hashed layout */
+bool is_level(const char *name)
+{
+    return strlen(name) == 2 && isxdigit(name[0]) && isxdigit(name[1]);
+}
+
+/* Create the directories of a mailbox path in the hashed layout */
+void make_dirs(const string &path)
+{
+    int last = path.rfind('/'), mid = path.rfind('/', last - 1);
+    if ((mkdir(path.substr(0, mid).c_str(), 0755) != 0 && errno != EEXIST)
+            || (mkdir(path.substr(0, last).c_str(), 0755) != 0 && errno != EEXIST))
+    {
+        fprintf(stderr, "Cannot create directory for %s (%s)\n", path.c_str(), strerror(errno));
+        exit(1);
+    }
+}
+
+/* Move the mailboxes of the flat layout into the hashed one, each with the files kept next to it (user.mbox.dict, .usage, .search) */
+void migrate(const string &dir)
+{
+    DIR *d;
+    struct dirent *ptr;
+    vector<string> mboxes, sidecars;
+    if ((d = opendir(dir.c_str())) == NULL)
+    {
+        fprintf(stderr, "Mailbox directory open error.\n");
+        exit(1);
+    }
+    while ((ptr = readdir(d)) != NULL)
+    {
+        int len = strlen(ptr->d_name);
+        if (len > 5 && strcmp(ptr->d_name + len - 5, ".mbox") == 0)
+        {
+            mboxes.push_back(ptr->d_name);
+        }
+        else if (ptr->d_name[0] != '.' && strstr(ptr->d_name, ".mbox.") != NULL)
+        {
+            sidecars.push_back(ptr->d_name);
+        }
+    }
+    closedir(d);
+    for (int i = 0; i < mboxes.size() + sidecars.size(); i++)
+    {
+        string name = i < mboxes.size() ? mboxes[i] : sidecars[i - mboxes.size()];
+        size_t end = i < mboxes.size() ? name.size() : name.rfind(".mbox.") + 5; // sidecars go to the directory of their mailbox
+        string path = registry_hashed_path(dir, name.substr(0, end)) + name.substr(end);
+        make_dirs(path);
+        if (rename((dir + "/" + name).c_str(), path.c_str()) != 0)
+        {
+            fprintf(stderr, "Cannot move %s (%s)\n", name.c_str(), strerror(errno));
+            exit(1);
+        }
+    }
+    printf("Moved %d mailboxes and %d files kept with them\n", (int) mboxes.size(), (int) sidecars.size());
+}
+
+/* Find all mailboxes of the hashed layout */
+void walk(const string &dir, vector<string> &mboxes)
+{
+    DIR *top, *mid, *low;
+    struct dirent *a, *b, *c;
+    if ((top = opendir(dir.c_str())) == NULL)
+    {
+        fprintf(stderr, "Mailbox directory open error.\n");
+        exit(1);
+    }
+    while ((a = readdir(top)) != NULL)
+    {
+        if (!is_level(a->d_name) || (mid = opendir((dir + "/" + a->d_name).c_str())) == NULL)
+        {
+            continue;
+        }
+        while ((b = readdir(mid)) != NULL)
+        {
+            string sub = dir + "/" + a->d_name + "/" + b->d_name;
+            if (!is_level(b->d_name) || (low = opendir(sub.c_str())) == NULL)
+            {
+                continue;
+            }
+            while ((c = readdir(low)) != NULL)
+            {
+                int len = strlen(c->d_name);
+                if (len > 5 && strcmp(c->d_name + len - 5, ".mbox") == 0)
+                {
+                    mboxes.push_back(c->d_name);
+                }
+            }
+            closedir(low);
+        }
+        closedir(mid);
+    }
+    closedir(top);
+}
+
+int main(int argc, char *argv[])
+{
+    /* Parsing command line arguments */
+    int ch = 0;
+    bool move = false;
+    vector<string> users;
+    while ((ch = getopt(argc, argv, "ma:")) != -1)
+    {
+        switch (ch)
+        {
+        case 'm':
+            move = true;
+            break;
+        case 'a':
+            users.push_back(optarg);
+            break;
+        default:
+            fprintf(stderr,
+                    "Error: Please input [-m] [-a user]... [mailbox directory]\n");
+            exit(1);
+        }
+    }
+    if (optind == argc)
+    {
+        fprintf(stderr, "Error: Please input [mailbox directory]\n");
+        exit(1);
+    }
+    string dir = argv[optind];
+    if (move)
+    {
+        migrate(dir);
+    }
+
+    /* New users are added to the existing index, otherwise the index is rebuilt from the files */
+    vector<string> mboxes;
+    if (users.empty() || !registry_read_index(dir, mboxes))
+    {
+        mboxes.clear();
+        walk(dir, mboxes);
+    }
+    for (int i = 0; i < users.size(); i++)
+    {
+        string mbox = users[i] + ".mbox", path = registry_hashed_path(dir, mbox);
+        make_dirs(path);
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+        if (fd < 0)
+        {
+            fprintf(stderr, "Cannot create %s (%s)\n", path.c_str(), strerror(errno));
+            exit(1);
+        }
+        close(fd);
+        mboxes.push_back(mbox);
+    }
+    if (!registry_write_index(dir, mboxes))
+    {
+        fprintf(stderr, "Cannot write %s/%s (%s)\n", dir.c_str(), INDEX_NAME, strerror(errno));
+        exit(1);
+    }
+    printf("Indexed %d mailboxes\n", (int) mboxes.size());
+    return 0;
+}
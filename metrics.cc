@@ -0,0 +1,361 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <pthread.h>
+
+#include "metrics.h"
+
+using namespace std;
+
+/* Histogram buckets: latencies up to 1, 2, 4, ... 2^(BUCKETS-2) microseconds, then the rest */
+#define BUCKETS 26
+#define MAX_VERBS 16
+#define HISTOGRAMS (H_VERBS + MAX_VERBS)
+
+/* The counters of one thread at a time. Only that thread writes them. */
+struct block_t
+{
+    atomic<uint64_t> counters[M_COUNTERS];
+    atomic<uint64_t> buckets[HISTOGRAMS][BUCKETS];
+    atomic<uint64_t> sums[HISTOGRAMS]; // microseconds
+    block_t *next;
+    bool used;
+};
+
+/* Gives the block of a thread back when the thread exits */
+struct holder_t
+{
+    block_t *block;
+    ~holder_t();
+};
+
+bool METRICS = false;
+static string SERVER;
+static vector<string> VERBS;
+static block_t *BLOCKS = NULL; // every block ever made, for scrapes
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+static thread_local holder_t HOLDER;
+static int listen_fd = -1;
+static string SPEC;
+
+holder_t::~holder_t()
+{
+    if (block != NULL)
+    {
+        pthread_mutex_lock(&blocks_lock);
+        block->used = false;
+        pthread_mutex_unlock(&blocks_lock);
+    }
+}
+
+/* Helper function that returns the block of the calling thread, taking a free one or making one on first use */
+static block_t *mine()
+{
+    if (HOLDER.block == NULL)
+    {
+        pthread_mutex_lock(&blocks_lock);
+        block_t *block = BLOCKS;
+        while (block != NULL && block->used)
+        {
+            block = block->next;
+        }
+        if (block == NULL)
+        {
+            block = new block_t();
+            block->next = BLOCKS;
+            BLOCKS = block;
+        }
+        block->used = true;
+        pthread_mutex_unlock(&blocks_lock);
+        HOLDER.block = block;
+    }
+    return HOLDER.block;
+}
+
+/* Helper function that adds to a counter only this thread writes, so no atomic read-modify-write is needed */
+static inline void bump(atomic<uint64_t> &counter, uint64_t n)
+{
+    counter.store(counter.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+uint64_t metrics_clock()
+{
+    if (!METRICS)
+    {
+        return 0;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void metrics_add(metric_t counter, uint64_t n)
+{
+    if (METRICS)
+    {
+        bump(mine()->counters[counter], n);
+    }
+}
+
+/* Record the time since start, a value of metrics_clock(), in a histogram */
+void metrics_time(int histogram, uint64_t start)
+{
+    if (!METRICS || histogram < 0 || histogram >= H_VERBS + (int) VERBS.size())
+    {
+        return;
+    }
+    uint64_t us = (metrics_clock() - start) / 1000;
+    /* Bucket i takes 2^(i-1) < us <= 2^i, matching its le="2^i" label; clzll(0) is undefined, hence the guard */
+    int bucket = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+    block_t *block = mine();
+    bump(block->buckets[histogram][bucket < BUCKETS ? bucket : BUCKETS - 1], 1);
+    bump(block->sums[histogram], us);
+}
+
+/* Lock a mutex, timing the wait and counting the threads queued on it */
+void metrics_lock(pthread_mutex_t *lock)
+{
+    if (!METRICS)
+    {
+        pthread_mutex_lock(lock);
+        return;
+    }
+    block_t *block = mine();
+    uint64_t start = metrics_clock();
+    bump(block->counters[M_LOCK_WAITS], 1);
+    pthread_mutex_lock(lock);
+    bump(block->counters[M_LOCK_ACQUIRED], 1);
+    metrics_time(H_LOCK_WAIT, start);
+}
+
+/* Count a closed session and its traffic */
+void metrics_session_end(int fd)
+{
+    if (!METRICS)
+    {
+        return;
+    }
+    block_t *block = mine();
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    memset(&info, 0, sizeof(info));
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0)
+    {
+        bump(block->counters[M_BYTES_IN], info.tcpi_bytes_received);
+        bump(block->counters[M_BYTES_OUT], info.tcpi_bytes_acked);
+    }
+    bump(block->counters[M_CLOSES], 1);
+}
+
+/* Helper function that appends a formatted line to a scrape */
+static void line(string &out, const char *format, ...) __attribute__((format(printf, 2, 3)));
+static void line(string &out, const char *format, ...)
+{
+    char text[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    out += text;
+}
+
+/* Helper function that appends one histogram with cumulative buckets */
+static void histogram(string &out, const uint64_t *buckets, uint64_t sum, const char *name, const char *label)
+{
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS - 1; i++)
+    {
+        seen += buckets[i];
+        line(out, "%s_%s_us_bucket{%sle=\"%llu\"} %llu\n", SERVER.c_str(), name, label,
+             (unsigned long long) 1 << i, (unsigned long long) seen);
+    }
+    seen += buckets[BUCKETS - 1];
+    line(out, "%s_%s_us_bucket{%sle=\"+Inf\"} %llu\n", SERVER.c_str(), name, label, (unsigned long long) seen);
+    string plain = label;
+    if (!plain.empty())
+    {
+        plain = "{" + plain.substr(0, plain.size() - 1) + "}";
+    }
+    line(out, "%s_%s_us_sum%s %llu\n", SERVER.c_str(), name, plain.c_str(), (unsigned long long) sum);
+    line(out, "%s_%s_us_count%s %llu\n", SERVER.c_str(), name, plain.c_str(), (unsigned long long) seen);
+}
+
+/* Sum the blocks of all threads into the text of a scrape */
+static string scrape()
+{
+    static double last_time = 0, rate = 0;
+    static uint64_t last_accepts = 0;
+    uint64_t counters[M_COUNTERS] = { }, buckets[HISTOGRAMS][BUCKETS] = { }, sums[HISTOGRAMS] = { };
+    pthread_mutex_lock(&blocks_lock);
+    for (block_t *block = BLOCKS; block != NULL; block = block->next)
+    {
+        for (int i = 0; i < M_COUNTERS; i++)
+        {
+            counters[i] += block->counters[i].load(memory_order_relaxed);
+        }
+        for (int h = 0; h < HISTOGRAMS; h++)
+        {
+            for (int i = 0; i < BUCKETS; i++)
+            {
+                buckets[h][i] += block->buckets[h][i].load(memory_order_relaxed);
+            }
+            sums[h] += block->sums[h].load(memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&blocks_lock);
+
+    double now = metrics_clock() / 1e9;
+    if (now - last_time >= 1)
+    {
+        rate = last_time == 0 ? 0 : (counters[M_ACCEPTS] - last_accepts) / (now - last_time);
+        last_time = now;
+        last_accepts = counters[M_ACCEPTS];
+    }
+    const char *name = SERVER.c_str();
+    string out;
+    line(out, "# TYPE %s_sessions_active gauge\n", name);
+    line(out, "%s_sessions_active %lld\n", name, (long long)(counters[M_ACCEPTS] - counters[M_CLOSES]));
+    line(out, "# TYPE %s_accepts_total counter\n", name);
+    line(out, "%s_accepts_total %llu\n", name, (unsigned long long) counters[M_ACCEPTS]);
+    line(out, "# TYPE %s_accepts_per_second gauge\n", name);
+    line(out, "%s_accepts_per_second %.2f\n", name, rate);
+    line(out, "# TYPE %s_bytes_in_total counter\n", name);
+    line(out, "%s_bytes_in_total %llu\n", name, (unsigned long long) counters[M_BYTES_IN]);
+    line(out, "# TYPE %s_bytes_out_total counter\n", name);
+    line(out, "%s_bytes_out_total %llu\n", name, (unsigned long long) counters[M_BYTES_OUT]);
+    line(out, "# TYPE %s_lock_queue gauge\n", name);
+    line(out, "%s_lock_queue %lld\n", name, (long long)(counters[M_LOCK_WAITS] - counters[M_LOCK_ACQUIRED]));
+    line(out, "# TYPE %s_commands_total counter\n", name);
+    for (size_t v = 0; v < VERBS.size(); v++)
+    {
+        uint64_t count = 0;
+        for (int i = 0; i < BUCKETS; i++)
+        {
+            count += buckets[H_VERBS + v][i];
+        }
+        line(out, "%s_commands_total{verb=\"%s\"} %llu\n", name, VERBS[v].c_str(), (unsigned long long) count);
+    }
+    line(out, "# TYPE %s_command_latency_us histogram\n", name);
+    for (size_t v = 0; v < VERBS.size(); v++)
+    {
+        string label = "verb=\"" + VERBS[v] + "\",";
+        histogram(out, buckets[H_VERBS + v], sums[H_VERBS + v], "command_latency", label.c_str());
+    }
+    line(out, "# TYPE %s_lock_wait_us histogram\n", name);
+    histogram(out, buckets[H_LOCK_WAIT], sums[H_LOCK_WAIT], "lock_wait", "");
+    line(out, "# TYPE %s_mailbox_write_us histogram\n", name);
+    histogram(out, buckets[H_MAILBOX_WRITE], sums[H_MAILBOX_WRITE], "mailbox_write", "");
+    return out;
+}
+
+/* Helper function that opens the listening socket of a spec: a path for a UNIX socket, otherwise a port on the loopback */
+static int open_listener()
+{
+    int fd;
+    if (SPEC.find('/') != string::npos)
+    {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, SPEC.c_str(), sizeof(addr.sun_path) - 1);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        unlink(SPEC.c_str());
+        if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, 16) != 0)
+        {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(atoi(SPEC.c_str()));
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, 16) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Serve scrapes one at a time. The port may still be held by the server this one took over from, so binding is retried. */
+static void *serve(void *arg)
+{
+    while (listen_fd < 0)
+    {
+        sleep(1);
+        listen_fd = open_listener();
+    }
+    while (true)
+    {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0)
+        {
+            continue;
+        }
+        char request[1024];
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        ssize_t n = poll(&pfd, 1, 100) == 1 ? read(fd, request, sizeof(request)) : 0; // a plain client sends nothing
+        string body = scrape(), out;
+        if (n >= 3 && memcmp(request, "GET", 3) == 0)
+        {
+            char header[128];
+            snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                     "Content-Length: %zu\r\n\r\n", body.size());
+            out = header;
+        }
+        out += body;
+        for (size_t done = 0; done < out.size();)
+        {
+            ssize_t w = write(fd, out.data() + done, out.size() - done);
+            if (w <= 0)
+            {
+                break;
+            }
+            done += w;
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+/* Turn metrics on and serve them on spec. Returns false if there are too many verbs or the listener cannot be opened. */
+bool metrics_start(const char *server, const char *spec, const char *const *verbs, int verb_count)
+{
+    if (verb_count > MAX_VERBS)
+    {
+        return false;
+    }
+    SERVER = server;
+    SPEC = spec;
+    VERBS.assign(verbs, verbs + verb_count);
+    listen_fd = open_listener();
+    if (listen_fd < 0 && SPEC.find('/') != string::npos)
+    {
+        return false;
+    }
+    METRICS = true;
+    pthread_t thread;
+    pthread_create(&thread, NULL, &serve, NULL);
+    pthread_detach(thread);
+    return true;
+}
@@ -1,7 +1,9 @@
-#include <openssl/md5.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/file.h>
 #include <sys/socket.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <stdio.h>
@@ -14,10 +16,28 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <algorithm>
 #include <vector>
 #include <unordered_set>
 #include <pthread.h>
-#include <dirent.h>
+#include <atomic>
+
+#include "mailbox.h"
+#include "registry.h"
+#include "digest.h"
+#include "timer.h"
+#include "arena.h"
+#include "command.h"
+#include "handoff.h"
+#include "metrics.h"
+#include "log.h"
+#include "limiter.h"
+#include "quota.h"
+#include "store.h"
+#include "search.h"
+#include "tls.h"
+#include "repl.h"
+#include "probes.h"
 
 using namespace std;
 
@@ -32,63 +52,160 @@ const char *UNSUPPORTED = "-ERR Not supported\r\n";
 const char *SERV_UNAVAIL =
     "-ERR [localhost] Service not available, closing transmission channel\r\n";
 const char *OVER_SIZE = "-ERR Too much mail data\r\n";
+const char *DAMAGED = "-ERR message cannot be read\r\n";
+const char *NOT_REMOVED = "-ERR some deleted messages not removed\r\n";
+const char *TOO_MANY = "-ERR [SYS/TEMP] Too many connections, try again later\r\n";
+const char *TLS_READY = "+OK Begin TLS negotiation\r\n";
+const char *TLS_UNAVAIL = "-ERR TLS not available\r\n";
+const char *TLS_ACTIVE = "-ERR TLS already active\r\n";
+const char *CAPA = "+OK Capability list follows\r\nUSER\r\nUIDL\r\nXSRCH\r\n";
+
+/* Commands, found with a perfect hash of the verb */
+enum command_t { CMD_USER, CMD_PASS, CMD_QUIT, CMD_STAT, CMD_UIDL, CMD_RETR, CMD_DELE, CMD_LIST, CMD_RSET,
+                 CMD_NOOP, CMD_XSRCH, CMD_STLS, CMD_CAPA, CMD_UNKNOWN, CMD_REJECTED
+               };
+const char *const VERB_NAMES[] = { "USER", "PASS", "QUIT", "STAT", "UIDL", "RETR", "DELE", "LIST", "RSET", "NOOP",
+                                   "XSRCH", "STLS", "CAPA", "unknown", "rejected" };
+#define VERB_HASH 0x9e377ad3u
+#define VERB_BITS 4
+
+/* Commands accepted in each state: 0 authorization, 1 transaction. The update state closes the connection. */
+const bool ALLOWED[2][CMD_UNKNOWN + 1] =
+{
+    //  USER   PASS   QUIT   STAT   UIDL   RETR   DELE   LIST   RSET   NOOP  XSRCH   STLS   CAPA   unknown
+    {  true,  true,  true, false, false, false, false, false, false, false, false,  true,  true,  true },
+    { false, false,  true,  true,  true,  true,  true,  true,  true,  true,  true, false,  true,  true },
+};
+
+/* What the accept loop hands to the thread of a session */
+struct session_t
+{
+    int fd;
+    Client *client; // record of the peer's rate limits, or NULL
+};
 
 vector<pthread_t> THREADS;
 pthread_mutex_t lock;
-vector<unsigned int> SOCKETS;
-unordered_set<string> MBOXES;
-unsigned int listen_fd;
+int listen_fd;
+int wake_fd[2] = { -1, -1 }; // written by the signal handler and the handoff thread, read by the accept loop
 string user_dir;
 bool DEBUG;
-bool RUNNING;
+bool RUNNING; // accepting new connections
+bool DRAINING; // sessions close once idle, and at DRAIN_END at the latest
+uint64_t DRAIN_END;
+unsigned int DRAIN_TIMEOUT = 30;
+atomic<int> ACTIVE(0);
+unsigned int IDLE_TIMEOUT = 600; // autologout timer (RFC 1939 section 3)
+#define TLS_TIMEOUT 60 // for the handshake after STLS
 
-/* A class for the message that can check, set and reset deleted status and store message content.*/
-class Message
+/* A class for the session's maildrop that shares a mailbox snapshot with other sessions and keeps its own deleted marks in a bitset.*/
+class Maildrop
 {
 private:
-    string content;
-    bool deleted;
+    snapshot_ptr snap;
+    vector<uint64_t> deleted;
+    int live_count;
+    long live_size;
 public:
-    Message(string content)
-    {
-        this->content = content;
-        deleted = false;
-    }
-    string get_content();
-    bool is_deleted();
-    void set_delete();
+    void load(snapshot_ptr snap);
+    snapshot_ptr get_snapshot();
+    int size();
+    int count();
+    long octets();
+    uint32_t get_size(int i);
+    uint64_t get_len(int i);
+    const char *get_content(int i);
+    const unsigned char *get_uid(int i);
+    bool is_deleted(int i);
+    void set_delete(int i);
     void rset_delete();
+    void clear();
 };
 
-string Message::get_content()
+void Maildrop::load(snapshot_ptr snap)
 {
-    return content;
+    this->snap = snap;
+    rset_delete();
 }
 
-bool Message::is_deleted()
+snapshot_ptr Maildrop::get_snapshot()
 {
-    return deleted;
+    return snap;
 }
 
-void Message::set_delete()
+int Maildrop::size()
 {
-    deleted = true;
+    return snap ? snap->count() : 0;
 }
 
-void Message::rset_delete()
+int Maildrop::count()
 {
-    deleted = false;
+    return live_count;
 }
 
-void computeDigest(char *data, int dataLengthBytes,
-                   unsigned char *digestBuffer)
+long Maildrop::octets()
 {
-    /* The digest will be written to digestBuffer, which must be at least MD5_DIGEST_LENGTH bytes long */
+    return live_size;
+}
 
-    MD5_CTX c;
-    MD5_Init(&c);
-    MD5_Update(&c, data, dataLengthBytes);
-    MD5_Final(digestBuffer, &c);
+uint32_t Maildrop::get_size(int i)
+{
+    return snap->size[i];
+}
+
+uint64_t Maildrop::get_len(int i)
+{
+    return snap->len[i];
+}
+
+const char *Maildrop::get_content(int i)
+{
+    return snap->content(i);
+}
+
+const unsigned char *Maildrop::get_uid(int i)
+{
+    return snap->uid(i);
+}
+
+bool Maildrop::is_deleted(int i)
+{
+    return (deleted[i >> 6] >> (i & 63)) & 1;
+}
+
+void Maildrop::set_delete(int i)
+{
+    deleted[i >> 6] |= (uint64_t) 1 << (i & 63);
+    live_count--;
+    live_size -= snap->size[i];
+}
+
+void Maildrop::rset_delete()
+{
+    deleted.assign((size() + 63) / 64, 0);
+    live_count = size();
+    live_size = 0;
+    for (int i = 0; i < size(); i++)
+    {
+        live_size += snap->size[i];
+    }
+}
+
+void Maildrop::clear()
+{
+    snap.reset();
+    deleted.clear();
+    live_count = 0;
+    live_size = 0;
+}
+
+/* Helper function that formats the UID of a message in hex */
+void format_uid(const unsigned char *digest, int length, char *uid)
+{
+    for (int j = 0; j < length; j++)
+    {
+        sprintf(uid + j * 2, "%02x", digest[j]);
+    }
 }
 
 /* Set nonblocking read() function */
@@ -108,49 +225,11 @@ void set_nonblocking(unsigned int fd)
     }
 }
 
-/* Signal handler for ctrl-c, clean threads and quit */
+/* Signal handler for ctrl-c, wake the accept loop to drain. A second ctrl-c closes the remaining sessions. */
 void sig_handler(int arg)
 {
-    RUNNING = false;
-    for (int i = 0; i < SOCKETS.size(); i++)
-    {
-        write(SOCKETS[i], SERV_UNAVAIL, strlen(SERV_UNAVAIL));
-        close(SOCKETS[i]);
-    }
-    SOCKETS.clear();
-    close(listen_fd);
-    if (DEBUG)
-    {
-        printf("\nServer socket closed\n");
-    }
-    for (int i = 0; i < THREADS.size(); i++)
-    {
-        pthread_join(THREADS[i], NULL);
-        //pthread_kill(THREADS[i],0);
-    }
-    THREADS.clear();
-}
-
-/* Add the mailboxes of the local users to a set from a directory */
-void get_mboxes()
-{
-    DIR *dir;
-    struct dirent *ptr;
-    const char *file = user_dir.c_str();
-    if ((dir = opendir(file)) == NULL)
-    {
-        fprintf(stderr, "Mailbox directory open error.\n");
-        exit(1);
-    }
-    while ((ptr = readdir(dir)) != NULL)
-    {
-        if (strcmp(ptr->d_name, ".") == 0 || strcmp(ptr->d_name, "..") == 0)
-        {
-            continue; // current dir or parent dir
-        }
-        MBOXES.insert(ptr->d_name);
-    }
-    closedir(dir);
+    char byte = 'i';
+    write(wake_fd[1], &byte, 1);
 }
 
 /* Helper function used to parse command content */
@@ -170,43 +249,79 @@ void parse(char *buffer, char *dest, int limit)
     }
 }
 
-/* USER command handler that checks the state, user and send response. If user exists then sets user. */
+/* Map a command line to its command, one multiplication and a jump table */
+command_t lookup(const char *buffer)
+{
+    uint32_t code = read_verb(buffer);
+    switch (verb_slot(code, VERB_HASH, VERB_BITS))
+    {
+    case verb_slot(verb("USER"), VERB_HASH, VERB_BITS):
+        return code == verb("USER") ? CMD_USER : CMD_UNKNOWN;
+    case verb_slot(verb("PASS"), VERB_HASH, VERB_BITS):
+        return code == verb("PASS") ? CMD_PASS : CMD_UNKNOWN;
+    case verb_slot(verb("QUIT"), VERB_HASH, VERB_BITS):
+        return code == verb("QUIT") ? CMD_QUIT : CMD_UNKNOWN;
+    case verb_slot(verb("STAT"), VERB_HASH, VERB_BITS):
+        return code == verb("STAT") ? CMD_STAT : CMD_UNKNOWN;
+    case verb_slot(verb("UIDL"), VERB_HASH, VERB_BITS):
+        return code == verb("UIDL") ? CMD_UIDL : CMD_UNKNOWN;
+    case verb_slot(verb("RETR"), VERB_HASH, VERB_BITS):
+        return code == verb("RETR") ? CMD_RETR : CMD_UNKNOWN;
+    case verb_slot(verb("DELE"), VERB_HASH, VERB_BITS):
+        return code == verb("DELE") ? CMD_DELE : CMD_UNKNOWN;
+    case verb_slot(verb("LIST"), VERB_HASH, VERB_BITS):
+        return code == verb("LIST") ? CMD_LIST : CMD_UNKNOWN;
+    case verb_slot(verb("RSET"), VERB_HASH, VERB_BITS):
+        return code == verb("RSET") ? CMD_RSET : CMD_UNKNOWN;
+    case verb_slot(verb("NOOP"), VERB_HASH, VERB_BITS):
+        return code == verb("NOOP") ? CMD_NOOP : CMD_UNKNOWN;
+    case verb_slot(verb("XSRC"), VERB_HASH, VERB_BITS):
+        return code == verb("XSRC") && (buffer[4] | 0x20) == 'h' ? CMD_XSRCH : CMD_UNKNOWN;
+    case verb_slot(verb("STLS"), VERB_HASH, VERB_BITS):
+        return code == verb("STLS") ? CMD_STLS : CMD_UNKNOWN;
+    case verb_slot(verb("CAPA"), VERB_HASH, VERB_BITS):
+        return code == verb("CAPA") ? CMD_CAPA : CMD_UNKNOWN;
+    default:
+        return CMD_UNKNOWN;
+    }
+}
+
+/* USER command handler that checks the user and sends the response. If user exists then sets user. */
 void do_user(unsigned int fd, int &status, char *buffer, char *user,
-             string &message)
+             Arena &arena, const char *&message)
 {
-    if (status != 0 || strlen(user) != 0)
+    if (strlen(user) != 0)
     {
         message = SEQ_ERR;
-        write(fd, SEQ_ERR, strlen(SEQ_ERR));
+        tls_write(fd, SEQ_ERR, strlen(SEQ_ERR));
     }
     else
     {
         char one_user[65] = { };
+        Reply reply(arena, 128, fd);
         parse(buffer, one_user, 64);
-        string mbox = (string) one_user + ".mbox";
-        if (MBOXES.find(mbox) != MBOXES.end())
+        if (registry_has_user(one_user))
         {
             strcpy(user, one_user);
-            message = "+OK " + string(one_user) + " is a valid mailbox\r\n";
+            reply.add("+OK ").add(one_user).add(" is a valid mailbox\r\n");
         }
         else
         {
-            message = "-ERR Sorry, never heard of mailbox for "
-                      + string(one_user) + " here\r\n";
+            reply.add("-ERR Sorry, never heard of mailbox for ").add(one_user).add(" here\r\n");
         }
-        const char *res = message.c_str();
-        write(fd, res, strlen(res));
+        message = reply.c_str();
+        reply.send();
     }
 }
 
-/* PASS command handler that checks the state and password. If all correct then reads mail. */
+/* PASS command handler that checks the user and password. If all correct then takes the latest snapshot of the mailbox. */
 void do_pass(unsigned int fd, int &status, char *buffer, char *user,
-             vector<string> &titles, vector<Message> &messages, string &message)
+             Maildrop &maildrop, Arena &arena, const char *&message)
 {
-    if (status != 0 || strlen(user) == 0)
+    if (strlen(user) == 0)
     {
         message = SEQ_ERR;
-        write(fd, SEQ_ERR, strlen(SEQ_ERR));
+        tls_write(fd, SEQ_ERR, strlen(SEQ_ERR));
     }
     else
     {
@@ -215,464 +330,599 @@ void do_pass(unsigned int fd, int &status, char *buffer, char *user,
         if (strcmp(password, PASSW) == 0)
         {
             status = 1;
-            ifstream mail; // read from user's mail file
-            string address = user_dir + "/" + string(user) + ".mbox";
-            string content = "", line, title = "From <";
-            pthread_mutex_lock(&lock);
-            mail.open(address);
-            while (getline(mail, line))
-            {
-                if (line.compare(0, title.size(), title) != 0)
-                {
-                    content += line;
-                    content.pop_back();
-                    content += "\r\n";
-                }
-                else
-                {
-                    string one_title = line;
-                    one_title.pop_back();
-                    one_title += "\r\n";
-                    titles.push_back(one_title);
-                    Message m(content); // one new message
-                    messages.push_back(m);
-                    content.clear();
-                }
-            }
-            mail.close();
+            string address = registry_path(string(user) + ".mbox");
+            PROBE1(lock__acquire, fd);
+            metrics_lock(&lock);
+            PROBE1(lock__acquired, fd);
+            maildrop.load(mbox_acquire(address)); // shared with other sessions of the user
+            PROBE1(lock__release, fd);
             pthread_mutex_unlock(&lock);
-            if (messages.size() > 0)
-            {
-                messages.erase(messages.begin());
-                messages.push_back((Message(content))); // remove the first empty line and insert the last message
-            }
-            message = "+OK " + string(user) + "'s maildrop has "
-                      + to_string(messages.size()) + " messages\r\n";
+            log_command("[%d] Mailbox snapshot version %lu\n", fd, maildrop.get_snapshot()->version);
+            Reply reply(arena, 128, fd);
+            reply.add("+OK ").add(user).add("'s maildrop has ").num(maildrop.size())
+            .add(" messages\r\n");
+            message = reply.c_str();
+            reply.send();
         }
         else
         {
             message = "-ERR invalid password\r\n";
+            tls_write(fd, message, strlen(message));
         }
-        const char *res = message.c_str();
-        write(fd, res, strlen(res));
     }
 }
 
-/* STAT command handler that check the state, updates and displays the number and size of the mailbox. */
-void do_stat(unsigned int fd, int &status, char *user, vector<string> &titles, vector<Message> &messages,
-             string &message)
+/* STAT command handler that displays the number and size of the maildrop. */
+void do_stat(unsigned int fd, int &status, Maildrop &maildrop,
+             Arena &arena, const char *&message)
+{
+    Reply reply(arena, 64, fd);
+    reply.add("+OK ").num(maildrop.count()).add(" ").num(maildrop.octets()).add("\r\n");
+    message = reply.c_str();
+    reply.send();
+}
+
+/* UIDL command handler that shows a list of messages with unique IDs. */
+void do_uidl(unsigned int fd, int &status, char *buffer,
+             Maildrop &maildrop, Arena &arena, const char *&message)
 {
-    if (status != 1)
+    char comm[5] = { };
+    parse(buffer, comm, 4);
+    if (strlen(comm) == 0)
     {
-        message = SEQ_ERR;
-        write(fd, SEQ_ERR, strlen(SEQ_ERR));
+        Reply reply(arena, 16 * 1024, fd); // sent whenever it fills up
+        reply.add(OK);
+        for (int i = 0; i < maildrop.size(); i++)
+        {
+            if (!maildrop.is_deleted(i))
+            {
+                char uid[MAX_DIGEST_LENGTH * 2 + 1] = { };
+                format_uid(maildrop.get_uid(i), maildrop.get_snapshot()->uid_len, uid);
+                reply.num(i + 1).add(" ").add(uid).add("\r\n");
+            }
+        }
+        message = "+OK UIDL all\r\n";
+        reply.add(".\r\n");
+        reply.send();
     }
     else
     {
-        ifstream mail; // read from user's mail file
-        string address = user_dir + "/" + string(user) + ".mbox";
-        string content = "", line, title = "From <";
-        messages.clear();
-        pthread_mutex_lock(&lock);
-        mail.open(address);
-        while (getline(mail, line))
+        int idx = atoi(comm);
+        if (idx < 1)
         {
-            if (line.compare(0, title.size(), title) != 0)
-            {
-                content += line;
-                content.pop_back();
-                content += "\r\n";
-            }
-            else
-            {
-                string one_title = line;
-                one_title.pop_back();
-                one_title += "\r\n";
-                titles.push_back(one_title);
-                Message m(content); // one new message
-                messages.push_back(m);
-                content.clear();
-            }
+            message = SYN_ERR;
+            tls_write(fd, SYN_ERR, strlen(SYN_ERR));
         }
-        mail.close();
-        pthread_mutex_unlock(&lock);
-        if (messages.size() > 0)
+        else if (idx > maildrop.size()
+                 || maildrop.is_deleted(idx - 1))
         {
-            messages.erase(messages.begin());
-            messages.push_back((Message(content))); // remove the first empty line and insert the last message
+            message = NO_MESS;
+            tls_write(fd, NO_MESS, strlen(NO_MESS));
         }
-        int count = 0, size = 0;
-        for (int i = 0; i < messages.size(); i++)
+        else
         {
-            if (!messages[i].is_deleted())
-            {
-                count++;
-                size += messages[i].get_content().length();
-            }
+            char uid[MAX_DIGEST_LENGTH * 2 + 1] = { };
+            format_uid(maildrop.get_uid(idx - 1), maildrop.get_snapshot()->uid_len,
+                       uid);
+            Reply reply(arena, 64, fd);
+            reply.add("+OK ").num(idx).add(" ").add(uid).add("\r\n");
+            message = reply.c_str();
+            reply.send();
         }
-        message = "+OK " + to_string(count) + " " + to_string(size) + "\r\n";
-        const char *res = message.c_str();
-        write(fd, res, strlen(res));
     }
 }
 
-/* UIDL command handler that checks the state and shows a list of messages with unique IDs. */
-void do_uidl(unsigned int fd, int &status, char *buffer,
-             vector<Message> &messages, string &message)
+/* LIST command handler that shows the size of a message or all messages. */
+void do_list(unsigned int fd, int &status, char *buffer,
+             Maildrop &maildrop, Arena &arena, const char *&message)
 {
-    if (status != 1)
+    char comm[5] = { };
+    parse(buffer, comm, 4);
+    if (strlen(comm) == 0)
     {
-        message = SEQ_ERR;
-        write(fd, SEQ_ERR, strlen(SEQ_ERR));
+        Reply reply(arena, 16 * 1024, fd); // sent whenever it fills up
+        reply.add("+OK ").num(maildrop.count()).add(" messages (").num(maildrop.octets())
+        .add(" octets)\r\n");
+        for (int i = 0; i < maildrop.size(); i++)
+        {
+            if (!maildrop.is_deleted(i))
+            {
+                reply.num(i + 1).add(" ").num(maildrop.get_size(i)).add("\r\n");
+            }
+        }
+        message = "+OK LIST all\r\n";
+        reply.add(".\r\n");
+        reply.send();
     }
     else
     {
-        char comm[5] = { };
-        parse(buffer, comm, 4);
-        if (strlen(comm) == 0)
+        int idx = atoi(comm);
+        if (idx < 1)
         {
-            write(fd, OK, strlen(OK));
-            for (int i = 0; i < messages.size(); i++)
-            {
-                if (!messages[i].is_deleted())
-                {
-                    unsigned char digest[MD5_DIGEST_LENGTH] = { };
-                    char uid[MD5_DIGEST_LENGTH * 2 + 1] = { };
-                    char input[messages[i].get_content().length() + 1] = { };
-                    strcpy(input, messages[i].get_content().c_str());
-                    computeDigest(input, strlen(input), digest);
-                    for (int j = 0; j < MD5_DIGEST_LENGTH; j++)
-                    {
-                        sprintf(uid + j * 2, "%02x", digest[j]);
-                    }
-                    string one_id = to_string(i + 1) + " " + string(uid)
-                                    + "\r\n";
-                    const char *res_id = one_id.c_str();
-                    write(fd, res_id, strlen(res_id));
-                }
-            }
-            message = "+OK UIDL all\r\n";
-            string end = ".\r\n";
-            const char *res = end.c_str();
-            write(fd, res, strlen(res));
+            message = SYN_ERR;
+            tls_write(fd, SYN_ERR, strlen(SYN_ERR));
+        }
+        else if (idx > maildrop.size()
+                 || maildrop.is_deleted(idx - 1))
+        {
+            message = NO_MESS;
+            tls_write(fd, NO_MESS, strlen(NO_MESS));
         }
         else
         {
-            int idx = atoi(comm);
-            if (idx < 1)
-            {
-                message = SYN_ERR;
-                write(fd, SYN_ERR, strlen(SYN_ERR));
-            }
-            else if (idx > messages.size()
-                     || messages[idx - 1].is_deleted())
-            {
-                message = NO_MESS;
-                write(fd, NO_MESS, strlen(NO_MESS));
-            }
-            else
-            {
-                unsigned char digest[MD5_DIGEST_LENGTH] = { };
-                char uid[MD5_DIGEST_LENGTH * 2 + 1] = { };
-                char input[messages[idx - 1].get_content().length() + 1] = { };
-                strcpy(input, messages[idx - 1].get_content().c_str());
-                computeDigest(input, strlen(input), digest);
-                for (int j = 0; j < MD5_DIGEST_LENGTH; j++)
-                {
-                    sprintf(uid + j * 2, "%02x", digest[j]);
-                }
-                message = "+OK " + to_string(idx) + " " + string(uid) + "\r\n";
-                const char *res = message.c_str();
-                write(fd, res, strlen(res));
-            }
+            Reply reply(arena, 64, fd);
+            reply.add("+OK ").num(idx).add(" ").num(maildrop.get_size(idx - 1)).add("\r\n");
+            message = reply.c_str();
+            reply.send();
         }
     }
 }
 
-/* LIST command handler that checks the state and shows the size of a message or all messages. */
-void do_list(unsigned int fd, int &status, char *buffer,
-             vector<Message> &messages, string &message)
+/* Helper function that adds a piece of a message to a response, ending every line with CRLF. prev is the byte before the piece. */
+void add_lines(Reply &reply, const char *retrieve, const char *last, char &prev)
 {
-    if (status != 1)
+    const char *first = retrieve, *span = retrieve; // lines that already end with CRLF
+    while (retrieve < last)
     {
-        message = SEQ_ERR;
-        write(fd, SEQ_ERR, strlen(SEQ_ERR));
+        const char *eol = (const char *) memchr(retrieve, '\n', last - retrieve);
+        if (!eol)
+        {
+            break;
+        }
+        if ((eol == first ? prev : eol[-1]) != '\r')
+        {
+            reply.add(span, eol - span).add("\r\n", 2); // lines are always sent with CRLF
+            span = eol + 1;
+        }
+        retrieve = eol + 1;
+    }
+    reply.add(span, last - span);
+    if (last > first)
+    {
+        prev = last[-1];
+    }
+}
+
+/* RETR command handler that retrieves a particular message, inflating it on the way if it is stored compressed. A
+ * message that stops inflating after part of it was sent is never ended with the terminator; the connection is
+ * dropped instead, so the client cannot take the part for the whole message. */
+void do_retr(unsigned int fd, int &status, char *buffer, char *user,
+             Maildrop &maildrop, Arena &arena, const char *&message, bool &disconnect)
+{
+    char comm[5] = { };
+    parse(buffer, comm, 4);
+    if (strlen(comm) == 0)
+    {
+        message = SYN_ERR;
+        tls_write(fd, SYN_ERR, strlen(SYN_ERR));
     }
     else
     {
-        char comm[5] = { };
-        parse(buffer, comm, 4);
-        if (strlen(comm) == 0)
+        int idx = atoi(comm);
+        if (idx < 1)
         {
-            int count = 0, size = 0;
-            vector<int> one_sizes;
-            for (int i = 0; i < messages.size(); i++)
-            {
-                if (!messages[i].is_deleted())
-                {
-                    count++;
-                    size += messages[i].get_content().length();
-                    one_sizes.push_back(messages[i].get_content().length());
-                }
-            }
-            string total = "+OK " + to_string(count) + " messages ("
-                           + to_string(size) + " octets)\r\n";
-            const char *res = total.c_str();
-            write(fd, res, strlen(res));
-            for (int i = 0; i < one_sizes.size(); i++)
-            {
-                string one = to_string(i + 1) + " " + to_string(one_sizes[i])
-                             + "\r\n";
-                res = one.c_str();
-                write(fd, res, strlen(res));
-            }
-            message = "+OK LIST all\r\n";
-            string end = ".\r\n";
-            res = end.c_str();
-            write(fd, res, strlen(res));
+            message = SYN_ERR;
+            tls_write(fd, SYN_ERR, strlen(SYN_ERR));
+        }
+        else if (idx > maildrop.size()
+                 || maildrop.is_deleted(idx - 1))
+        {
+            message = NO_MESS;
+            tls_write(fd, NO_MESS, strlen(NO_MESS));
         }
         else
         {
-            int idx = atoi(comm);
-            if (idx < 1)
+            const char *content = maildrop.get_content(idx - 1);
+            uint64_t len = maildrop.get_len(idx - 1), octets;
+            bool compressed = store_compressed(content, len, octets);
+            Inflater inflater(registry_path(string(user) + ".mbox"), content, compressed ? len : 0);
+            const char *piece = content;
+            size_t piece_len = len;
+            if (compressed && !inflater.next(piece, piece_len))
             {
-                message = SYN_ERR;
-                write(fd, SYN_ERR, strlen(SYN_ERR));
+                message = DAMAGED;
+                tls_write(fd, DAMAGED, strlen(DAMAGED));
+                log_session("[%d] Message %d cannot be inflated\n", fd, idx);
+                return;
             }
-            else if (idx > messages.size()
-                     || messages[idx - 1].is_deleted())
+            Reply reply(arena, 16 * 1024, fd); // sent whenever it fills up
+            Reply status(arena, 64);
+            status.add("+OK ").num(maildrop.get_size(idx - 1)).add(" octets\r\n");
+            message = status.c_str();
+            reply.add(message, status.size());
+            char prev = '\n';
+            do
             {
-                message = NO_MESS;
-                write(fd, NO_MESS, strlen(NO_MESS));
+                add_lines(reply, piece, piece + piece_len, prev);
             }
-            else
+            while (compressed && inflater.next(piece, piece_len));
+            if (prev != '\n')
+            {
+                reply.add("\r\n", 2); // the last line is sent with CRLF
+            }
+            if (compressed && inflater.failed())
             {
-                message = "+OK " + to_string(idx) + " "
-                          + to_string(messages[idx - 1].get_content().length())
-                          + "\r\n";
-                const char *res = message.c_str();
-                write(fd, res, strlen(res));
+                log_session("[%d] Message %d cut short, it cannot be inflated, connection dropped\n", fd, idx);
+                disconnect = true;
+                return;
             }
+            reply.add(".\r\n", 3);
+            reply.send();
+            PROBE3(retr__sent, fd, idx, status.size() + maildrop.get_size(idx - 1) + 3);
         }
     }
 }
 
-/* RETR command handler that checks the state and retrieves a particular message. */
-void do_retr(unsigned int fd, int &status, char *buffer,
-             vector<Message> &messages, string &message)
+/* XSRCH command handler, an extension that lists the messages having all the words given. The mailbox's index is
+ * built from the session's messages if it is missing or out of date, and kept if they are still the whole file. */
+void do_xsrch(unsigned int fd, int &status, char *buffer, char *user,
+              Maildrop &maildrop, Arena &arena, const char *&message)
 {
-    if (status != 1)
+    vector<string> query;
+    search_parse(buffer + 5, query);
+    if (query.empty())
     {
-        message = SEQ_ERR;
-        write(fd, SEQ_ERR, strlen(SEQ_ERR));
+        message = SYN_ERR;
+        tls_write(fd, SYN_ERR, strlen(SYN_ERR));
+        return;
     }
-    else
+    string address = registry_path(string(user) + ".mbox");
+    snapshot_ptr snap = maildrop.get_snapshot();
+    vector<uint32_t> hits;
+    if (!search_lookup(address, snap->file_ino, snap->count(), query, hits))
     {
-        char comm[5] = { };
-        parse(buffer, comm, 4);
-        if (strlen(comm) == 0)
+        vector<vector<string> > terms(snap->count());
+        for (int i = 0; i < snap->count(); i++)
         {
-            message = SYN_ERR;
-            write(fd, SYN_ERR, strlen(SYN_ERR));
-        }
-        else
-        {
-            int idx = atoi(comm);
-            if (idx < 1)
+            uint64_t octets;
+            if (store_compressed(snap->content(i), snap->len[i], octets))
             {
-                message = SYN_ERR;
-                write(fd, SYN_ERR, strlen(SYN_ERR));
+                Inflater inflater(address, snap->content(i), snap->len[i]);
+                string content;
+                const char *piece;
+                size_t len;
+                while (inflater.next(piece, len))
+                {
+                    content.append(piece, len);
+                }
+                search_terms(content.data(), content.size(), terms[i]);
             }
-            else if (idx > messages.size()
-                     || messages[idx - 1].is_deleted())
+            else
             {
-                message = NO_MESS;
-                write(fd, NO_MESS, strlen(NO_MESS));
+                search_terms(snap->content(i), snap->len[i], terms[i]);
             }
-            else
+            if (includes(terms[i].begin(), terms[i].end(), query.begin(), query.end()))
             {
-                message = "+OK "
-                          + to_string(messages[idx - 1].get_content().length())
-                          + " octets\r\n";
-                const char *res = message.c_str();
-                write(fd, res, strlen(res));
-                string retrieve = messages[idx - 1].get_content();
-                int i = 0;
-                while (i < retrieve.length())
-                {
-                    int j = retrieve.find('\n', i);
-                    string line = retrieve.substr(i, j + 1 - i);
-                    const char *out = line.c_str();
-                    write(fd, out, strlen(out));
-                    i = j + 1;
-                }
-                string end = ".\r\n";
-                res = end.c_str();
-                write(fd, res, strlen(res));
+                hits.push_back(i);
             }
         }
+        int mail_fd = open(address.c_str(), O_RDONLY);
+        struct stat st;
+        if (mail_fd >= 0 && flock(mail_fd, LOCK_EX) == 0 && fstat(mail_fd, &st) == 0
+                && st.st_ino == snap->file_ino && st.st_size == snap->file_size)
+        {
+            search_write(address, address, terms);
+        }
+        if (mail_fd >= 0)
+        {
+            close(mail_fd); // closing also releases the lock
+        }
+        log_session("[%d] Search index of %s built\n", fd, user);
+    }
+    Reply reply(arena, 16 * 1024, fd);
+    int found = 0;
+    for (int i = 0; i < hits.size(); i++)
+    {
+        found += !maildrop.is_deleted(hits[i]);
+    }
+    Reply status_line(arena, 64);
+    status_line.add("+OK ").num(found).add(" messages\r\n");
+    message = status_line.c_str();
+    reply.add(message, status_line.size());
+    for (int i = 0; i < hits.size(); i++)
+    {
+        if (!maildrop.is_deleted(hits[i]))
+        {
+            reply.num(hits[i] + 1).add("\r\n", 2);
+        }
     }
+    reply.add(".\r\n", 3);
+    reply.send();
 }
 
-/* DELE command handler that checks the state and deletes a particular message. */
+/* DELE command handler that deletes a particular message. */
 void do_dele(unsigned int fd, int &status, char *buffer,
-             vector<Message> &messages, string &message)
+             Maildrop &maildrop, Arena &arena, const char *&message)
 {
-    if (status != 1)
+    char comm[5] = { };
+    parse(buffer, comm, 4);
+    if (strlen(comm) == 0)
     {
-        message = SEQ_ERR;
-        write(fd, SEQ_ERR, strlen(SEQ_ERR));
+        message = SYN_ERR;
+        tls_write(fd, SYN_ERR, strlen(SYN_ERR));
     }
     else
     {
-        char comm[5] = { };
-        parse(buffer, comm, 4);
-        if (strlen(comm) == 0)
+        int idx = atoi(comm);
+        if (idx < 1)
         {
             message = SYN_ERR;
-            write(fd, SYN_ERR, strlen(SYN_ERR));
+            tls_write(fd, SYN_ERR, strlen(SYN_ERR));
+        }
+        else if (idx > maildrop.size())
+        {
+            message = NO_MESS;
+            tls_write(fd, NO_MESS, strlen(NO_MESS));
+        }
+        else if (maildrop.is_deleted(idx - 1))
+        {
+            Reply reply(arena, 64, fd);
+            reply.add("-ERR message ").num(idx).add(" already deleted\r\n");
+            message = reply.c_str();
+            reply.send();
         }
         else
         {
-            int idx = atoi(comm);
-            if (idx < 1)
-            {
-                message = SYN_ERR;
-                write(fd, SYN_ERR, strlen(SYN_ERR));
-            }
-            else if (idx > messages.size())
-            {
-                message = NO_MESS;
-                write(fd, NO_MESS, strlen(NO_MESS));
-            }
-            else if (messages[idx - 1].is_deleted())
-            {
-                message = "-ERR message " + to_string(idx)
-                          + " already deleted\r\n";
-                const char *res = message.c_str();
-                write(fd, res, strlen(res));
-            }
-            else
-            {
-                messages[idx - 1].set_delete();
-                message = "+OK message " + to_string(idx) + " deleted\r\n";
-                const char *res = message.c_str();
-                write(fd, res, strlen(res));
-            }
+            maildrop.set_delete(idx - 1);
+            Reply reply(arena, 64, fd);
+            reply.add("+OK message ").num(idx).add(" deleted\r\n");
+            message = reply.c_str();
+            reply.send();
         }
     }
 }
 
-/* RSET command handler that checks the state and unmark all deleted messages. */
-void do_rset(unsigned int fd, int &status, vector<Message> &messages,
-             string &message)
+/* RSET command handler that unmarks all deleted messages. */
+void do_rset(unsigned int fd, int &status, Maildrop &maildrop,
+             const char *&message)
+{
+    maildrop.rset_delete();
+    message = OK;
+    tls_write(fd, OK, strlen(OK));
+}
+
+/* Helper function that logs a rewrite of a mailbox for the standby: the kept messages as ranges of the old file, merged where
+ * they touch, or the new file if the old one has bytes outside its messages */
+void log_rewrite(const string &address, const string &temp, const snapshot_ptr &cur, const vector<int> &keep)
 {
-    if (status != 1)
+    vector<uint64_t> start(cur->count());
+    uint64_t offset = 0;
+    for (int i = 0; i < cur->count(); i++)
     {
-        message = SEQ_ERR;
-        write(fd, SEQ_ERR, strlen(SEQ_ERR));
+        start[i] = offset;
+        offset += cur->title_len[i] + cur->len[i];
     }
-    else
+    if (offset != (uint64_t) cur->file_size)
+    {
+        repl_rewritten(address, cur->file_size, temp);
+        return;
+    }
+    vector<pair<uint64_t, uint64_t> > ranges;
+    for (int k = 0; k < keep.size(); k++)
+    {
+        int i = keep[k];
+        uint64_t len = cur->title_len[i] + cur->len[i];
+        if (!ranges.empty() && ranges.back().first + ranges.back().second == start[i])
+        {
+            ranges.back().second += len;
+        }
+        else
+        {
+            ranges.push_back(make_pair(start[i], len));
+        }
+    }
+    if (!repl_replaced(address, cur->file_size, ranges))
     {
-        for (int i = 0; i < messages.size(); i++)
+        repl_rewritten(address, cur->file_size, temp);
+    }
+}
+
+/* Helper function that writes the kept messages of a mailbox to a file and flushes it to the disk */
+bool write_kept(int fd, const snapshot_ptr &cur, const vector<int> &keep)
+{
+    for (int k = 0; k < keep.size(); k++)
+    {
+        const char *data = cur->title(keep[k]);
+        size_t len = cur->title_len[keep[k]] + cur->len[keep[k]];
+        while (len > 0)
         {
-            if (messages[i].is_deleted())
+            ssize_t n = write(fd, data, len);
+            if (n <= 0)
             {
-                messages[i].rset_delete();
+                return false;
             }
+            data += n;
+            len -= n;
         }
-        message = OK;
-        write(fd, OK, strlen(OK));
     }
+    return fsync(fd) == 0;
 }
 
-/* QUIT command handler that checks the state, removes all deleted messages and terminates the connection. */
-void do_quit(unsigned int fd, int &status, char *user, vector<string> &titles,
-             vector<Message> &messages, string &message)
+/* QUIT command handler that removes all deleted messages and terminates the connection. The kept messages are written to a new file
+ * that replaces the mailbox only once it is complete on the disk; if anything fails the old file stays as it was. */
+void do_quit(unsigned int fd, int &status, char *user, Maildrop &maildrop,
+             Arena &arena, const char *&message)
 {
+    Reply reply(arena, 128, fd);
     if (status == 0)
     {
-        message = "+OK " + string(user) + " POP3 server signing off\r\n";
+        reply.add("+OK ").add(user).add(" POP3 server signing off\r\n");
     }
     else
     {
-        int count = 0, pre = 0; // pre is counter for processed messages
-        ifstream mail_in;
-        ofstream mail_out;
-        string address = user_dir + "/" + string(user) + ".mbox";
-        string new_message = "", line, title = "From <"; // remember new unprocesed messages
-        pthread_mutex_lock(&lock);
-        mail_in.open(address);
-        while (getline(mail_in, line) && pre <= messages.size())
+        int count = 0;
+        string address = registry_path(string(user) + ".mbox");
+        snapshot_ptr snap = maildrop.get_snapshot();
+        unordered_multiset<string> removed; // the file may have changed since PASS, so deleted messages are found by UID
+        for (int i = 0; i < maildrop.size(); i++)
         {
-            if (line.compare(0, title.size(), title) == 0)
+            if (maildrop.is_deleted(i))
             {
-                pre++; // ignore processed messages
+                removed.insert(string((const char *) snap->uid(i), snap->uid_len));
             }
         }
-        if(pre > messages.size())
+        PROBE1(lock__acquire, fd);
+        metrics_lock(&lock);
+        PROBE1(lock__acquired, fd);
+        uint64_t started = metrics_clock();
+        int mail_fd = open(address.c_str(), O_RDONLY);
+        bool res = mail_fd >= 0 && flock(mail_fd, LOCK_EX) == 0; // SMTP appends are held off until the file is replaced
+        if (!res)
         {
-            new_message += line;
-            new_message.pop_back();
-            new_message += "\r\n";
-            while (getline(mail_in, line))
-            {
-                new_message += line;
-                new_message.pop_back();
-                new_message += "\r\n";
-            }
+            log_session("[%d] Cannot lock %s, deleted messages kept\n", fd, address.c_str());
         }
-        mail_in.close();
-        mail_out.open(address);
-        for (int i = 0; i < messages.size(); i++)
+        else if (removed.empty())
         {
-            if (!messages[i].is_deleted())
+            count = mbox_acquire(address, mail_fd)->count(); // latest version with new unprocessed messages
+            quota_replaced(address, address, count);
+        }
+        else
+        {
+            snapshot_ptr cur = mbox_acquire(address, mail_fd);
+            vector<int> keep;
+            for (int i = 0; i < cur->count(); i++)
             {
-                mail_out << titles[i]; // update content to mail file
-                mail_out << messages[i].get_content();
-                count++;
+                unordered_multiset<string>::iterator it =
+                    removed.find(string((const char *) cur->uid(i), cur->uid_len));
+                if (it != removed.end())
+                {
+                    removed.erase(it);
+                }
+                else
+                {
+                    keep.push_back(i);
+                }
+            }
+            count = keep.size();
+            string temp = address + ".tmp";
+            int temp_fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            res = temp_fd >= 0 && flock(temp_fd, LOCK_EX) == 0 // appends to the new file wait until it is published
+                  && write_kept(temp_fd, cur, keep) && rename(temp.c_str(), address.c_str()) == 0;
+            if (res)
+            {
+                quota_replaced(address, address, count);
+                search_remap(address, address, cur->file_ino, cur->count(), keep);
+                log_rewrite(address, address, cur, keep);
+                mbox_publish(address, mbox_select(cur, keep, temp_fd)); // sessions still map the old file
+            }
+            else
+            {
+                log_session("[%d] Cannot rewrite %s (%s), deleted messages kept\n", fd, address.c_str(), strerror(errno));
+                unlink(temp.c_str());
+            }
+            if (temp_fd >= 0)
+            {
+                close(temp_fd); // closing also releases the lock
             }
         }
-        mail_out << new_message;
-        mail_out.close();
+        if (mail_fd >= 0)
+        {
+            flock(mail_fd, LOCK_UN);
+            close(mail_fd);
+        }
+        metrics_time(H_MAILBOX_WRITE, started);
+        PROBE1(lock__release, fd);
         pthread_mutex_unlock(&lock);
-        message = "+OK " + string(user) + " POP3 server signing off (";
-        if (count == 0)
+        if (!res)
         {
-            message += "maildrop empty)\r\n";
+            reply.add(NOT_REMOVED);
+        }
+        else if (count == 0)
+        {
+            reply.add("+OK ").add(user).add(" POP3 server signing off (maildrop empty)\r\n");
         }
         else
         {
-            message += to_string(count) + " messages left)\r\n";
+            reply.add("+OK ").add(user).add(" POP3 server signing off (").num(count).add(" messages left)\r\n");
         }
         status = 2;
     }
-    messages.clear();
-    titles.clear();
-    const char *res = message.c_str();
-    write(fd, res, strlen(res));
+    maildrop.clear();
+    message = reply.c_str();
+    reply.send();
+}
+
+/* STLS command handler that runs the handshake (RFC 2595 4). Commands the client sent before it and a user it named are dropped.
+ * A connection whose handshake fails is closed. */
+void do_stls(unsigned int fd, char *user, char *tail, bool &disconnect, const char *&message)
+{
+    if (tls_active())
+    {
+        message = TLS_ACTIVE;
+        tls_write(fd, TLS_ACTIVE, strlen(TLS_ACTIVE));
+        return;
+    }
+    if (!tls_available())
+    {
+        message = TLS_UNAVAIL;
+        tls_write(fd, TLS_UNAVAIL, strlen(TLS_UNAVAIL));
+        return;
+    }
+    message = TLS_READY;
+    tls_write(fd, TLS_READY, strlen(TLS_READY));
+    memset(tail, 0, strlen(tail));
+    memset(user, 0, 65);
+    if (!tls_accept(fd, TLS_TIMEOUT))
+    {
+        log_session("[%d] TLS handshake failed\n", fd);
+        disconnect = true;
+    }
+}
+
+/* CAPA command handler that lists the extensions (RFC 2449). STLS is offered before login while the connection is not encrypted. */
+void do_capa(unsigned int fd, int status, Arena &arena, const char *&message)
+{
+    Reply reply(arena, 128, fd);
+    reply.add(CAPA);
+    if (status == 0 && tls_available() && !tls_active())
+    {
+        reply.add("STLS\r\n");
+    }
+    reply.add(".\r\n");
+    message = reply.c_str();
+    reply.send();
 }
 
 /* Thread function for handling a client */
 void *client_t(void *p)
 {
-    unsigned int fd = *(int *) p;
-    write(fd, READY, strlen(READY)); // greeting message
+    session_t *session = (session_t *) p;
+    unsigned int fd = session->fd;
+    Client *client = session->client;
+    delete session;
+    tls_write(fd, READY, strlen(READY)); // greeting message
 
     bool disconnect = false;
     char user[65] = { };
     char buffer[1024 * 8 + 1] = { };
     char *head = buffer;
-    vector<Message> messages;
-    vector<string> titles;
+    Maildrop maildrop;
+    Arena arena;
 
     int status = 0; // status for a client: 0 authorization, 1 transaction, 2 update
+    Timer timer;
+    timer_add(&timer, IDLE_TIMEOUT);
 
     /* Start to respond */
-    while (RUNNING)
+    while (true)
     {
+        if (DRAINING && (timer_now() >= DRAIN_END || (status == 0 && buffer[0] == '\0')))
+        {
+            tls_write(fd, SERV_UNAVAIL, strlen(SERV_UNAVAIL)); // not logged in yet, or the deadline passed
+            break;
+        }
+        if (timer.expired.load(memory_order_relaxed))
+        {
+            log_session("[%d] Autologout timer expired\n", fd);
+            break; // close without a response and without entering the update state
+        }
         int len = strlen(buffer);
-        int recv_len = read(fd, head, 1024 * 8 - len);
+        int recv_len = tls_read(fd, head, 1024 * 8 - len);
+        if (recv_len == 0)
+        {
+            log_session("[%d] Connection closed by client\n", fd);
+            break; // the session no longer counts against the limits of the client
+        }
         //		if (DEBUG) {
         //			if (recv_len > 0) {
         //				printf("Client %d received %d char, is %s\n", fd, recv_len,
@@ -689,132 +939,93 @@ void *client_t(void *p)
             {
                 command[i] = buffer[i];
             }
-            string message;
-            if (strcasecmp(command, "USER") == 0)
+            const char *message = "";
+            arena.reset();
+            uint64_t started = metrics_clock();
+            command_t cmd = lookup(buffer);
+            if (!ALLOWED[status][cmd])
             {
-                do_user(fd, status, buffer, user, message); // user response
-                if (DEBUG)
-                {
-                    fprintf(stderr, "GOOD [%d] Client sent user\n", fd);
-                }
-            }
-            else if (strcasecmp(command, "QUIT") == 0)
-            {
-                if (status == 0 || status == 1)
-                {
-                    do_quit(fd, status, user, titles, messages, message); // quit response
-                    disconnect = true;
-                    if (DEBUG)
-                    {
-                        fprintf(stderr,
-                                "GOOD [%d] Client request to close connection\n",
-                                fd);
-                    }
-                }
-                else
-                {
-                    message = SEQ_ERR;
-                    write(fd, SEQ_ERR, strlen(SEQ_ERR));
-                    if (DEBUG)
-                    {
-                        fprintf(stderr, "BAD [%d] Sequence error!\n", fd);
-                    }
-                }
-            }
-            else if (strcasecmp(command, "PASS") == 0)
-            {
-                do_pass(fd, status, buffer, user, titles, messages, message); // pass response
-                if (DEBUG)
-                {
-                    fprintf(stderr, "GOOD [%d] Client sent pass\n", fd);
-                }
-            }
-            else if (strcasecmp(command, "STAT") == 0)
-            {
-                do_stat(fd, status, user, titles, messages, message); // stat response
-                if (DEBUG)
-                {
-                    fprintf(stderr, "GOOD [%d] Client sent stat\n", fd);
-                }
-            }
-            else if (strcasecmp(command, "UIDL") == 0)
-            {
-                do_uidl(fd, status, buffer, messages, message); // uidl response
-                if (DEBUG)
-                {
-                    fprintf(stderr, "GOOD [%d] Client sent uidl\n", fd);
-                }
-            }
-            else if (strcasecmp(command, "RETR") == 0)
-            {
-                do_retr(fd, status, buffer, messages, message); // retr response
-                if (DEBUG)
-                {
-                    fprintf(stderr, "GOOD [%d] Client sent retr\n", fd);
-                }
+                message = SEQ_ERR;
+                tls_write(fd, SEQ_ERR, strlen(SEQ_ERR));
+                log_command("BAD [%d] Sequence error!\n", fd);
+                cmd = CMD_REJECTED;
             }
-            else if (strcasecmp(command, "DELE") == 0)
-            {
-                do_dele(fd, status, buffer, messages, message); // dele response
-                if (DEBUG)
-                {
-                    fprintf(stderr, "GOOD [%d] Client sent dele\n", fd);
-                }
-            }
-            else if (strcasecmp(command, "LIST") == 0)
-            {
-                do_list(fd, status, buffer, messages, message); // list response
-                if (DEBUG)
-                {
-                    fprintf(stderr, "GOOD [%d] Client sent list\n", fd);
-                }
-            }
-            else if (strcasecmp(command, "RSET") == 0)
-            {
-                do_rset(fd, status, messages, message); // rset response
-                if (DEBUG)
-                {
-                    fprintf(stderr, "GOOD [%d] Client sent rset\n", fd);
-                }
-            }
-            else if (strcasecmp(command, "NOOP") == 0)
-            {
-                if (status != 1)
-                {
-                    message = SEQ_ERR;
-                    write(fd, SEQ_ERR, strlen(SEQ_ERR));
-                    if (DEBUG)
-                    {
-                        fprintf(stderr, "BAD [%d] Sequence error!\n", fd);
-                    }
-                }
-                else
-                {
-                    message = OK;
-                    write(fd, OK, strlen(OK)); // noop response
-                    if (DEBUG)
-                    {
-                        fprintf(stderr, "GOOD [%d] Client sent noop\n", fd);
-                    }
-                }
-            }
-            else
+            PROBE3(command__start, fd, VERB_NAMES[cmd], status);
+            switch (cmd)
             {
+            case CMD_USER:
+                do_user(fd, status, buffer, user, arena, message); // user response
+                log_command("GOOD [%d] Client sent user\n", fd);
+                break;
+            case CMD_QUIT:
+                do_quit(fd, status, user, maildrop, arena, message); // quit response
+                disconnect = true;
+                log_command("GOOD [%d] Client request to close connection\n", fd);
+                break;
+            case CMD_PASS:
+                do_pass(fd, status, buffer, user, maildrop, arena, message); // pass response
+                log_command("GOOD [%d] Client sent pass\n", fd);
+                break;
+            case CMD_STAT:
+                do_stat(fd, status, maildrop, arena, message); // stat response
+                log_command("GOOD [%d] Client sent stat\n", fd);
+                break;
+            case CMD_UIDL:
+                do_uidl(fd, status, buffer, maildrop, arena, message); // uidl response
+                log_command("GOOD [%d] Client sent uidl\n", fd);
+                break;
+            case CMD_RETR:
+                do_retr(fd, status, buffer, user, maildrop, arena, message, disconnect); // retr response
+                log_command("GOOD [%d] Client sent retr\n", fd);
+                break;
+            case CMD_DELE:
+                do_dele(fd, status, buffer, maildrop, arena, message); // dele response
+                log_command("GOOD [%d] Client sent dele\n", fd);
+                break;
+            case CMD_LIST:
+                do_list(fd, status, buffer, maildrop, arena, message); // list response
+                log_command("GOOD [%d] Client sent list\n", fd);
+                break;
+            case CMD_RSET:
+                do_rset(fd, status, maildrop, message); // rset response
+                log_command("GOOD [%d] Client sent rset\n", fd);
+                break;
+            case CMD_NOOP:
+                message = OK;
+                tls_write(fd, OK, strlen(OK)); // noop response
+                log_command("GOOD [%d] Client sent noop\n", fd);
+                break;
+            case CMD_XSRCH:
+                do_xsrch(fd, status, buffer, user, maildrop, arena, message); // search response
+                log_command("GOOD [%d] Client sent xsrch\n", fd);
+                break;
+            case CMD_STLS:
+                do_stls(fd, user, tail, disconnect, message); // stls response and handshake
+                log_command("GOOD [%d] Client sent stls\n", fd);
+                break;
+            case CMD_CAPA:
+                do_capa(fd, status, arena, message); // capa response
+                log_command("GOOD [%d] Client sent capa\n", fd);
+                break;
+            case CMD_UNKNOWN:
                 message = UNSUPPORTED;
-                write(fd, UNSUPPORTED, strlen(UNSUPPORTED)); // unknown command
-                if (DEBUG)
-                {
-                    fprintf(stderr,
-                            "BAD [%d] Client sent unknown or unsupported command\n",
-                            fd);
-                }
+                tls_write(fd, UNSUPPORTED, strlen(UNSUPPORTED)); // unknown command
+                log_command("BAD [%d] Client sent unknown or unsupported command\n", fd);
+                break;
+            case CMD_REJECTED:
+                break;
             }
 
-            if (DEBUG)
+            log_command("[%d] C: %s\n", fd, command);
+            log_command("[%d] S: %s", fd, message);
+            if (TRANSCRIPT)
             {
-                fprintf(stderr, "[%d] C: %s\n", fd, command);
-                fprintf(stderr, "[%d] S: %s", fd, message.c_str());
+                log_transcript(fd, buffer, read_verb(buffer) == verb("PASS") ? 4 : tail - buffer, message); // not the password
             }
+            metrics_time(H_VERBS + cmd, started);
+            PROBE3(command__end, fd, VERB_NAMES[cmd], status);
+
+            timer_reset(&timer, IDLE_TIMEOUT);
 
             /* Move remain messages to the head */
             char *new_head = buffer;
@@ -844,12 +1055,9 @@ void *client_t(void *p)
             i++;
             if (i >= 1024 * 8)   // buffer is full
             {
-                if (DEBUG)
-                {
-                    fprintf(stderr, "Out of buffer bound.\n");
-                }
-                write(fd, OVER_SIZE, strlen(OVER_SIZE));
-                write(fd, buffer, 1024 * 8);
+                log_session("Out of buffer bound.\n");
+                tls_write(fd, OVER_SIZE, strlen(OVER_SIZE));
+                tls_write(fd, buffer, 1024 * 8);
                 memset(buffer, 0, 1024 * 8);
                 head = buffer;
                 break;
@@ -858,14 +1066,14 @@ void *client_t(void *p)
     }
 
     /* Close client connection */
-    if (RUNNING)
-    {
-        close(fd);
-    }
-    if (DEBUG)
-    {
-        fprintf(stderr, "[%d] Connection closed\n", fd);
-    }
+    timer_cancel(&timer);
+    metrics_session_end(fd);
+    PROBE1(session__close, fd);
+    limiter_close(client);
+    tls_end();
+    close(fd);
+    ACTIVE--;
+    log_session("[%d] Connection closed\n", fd);
     return NULL;
 }
 
@@ -878,8 +1086,10 @@ int main(int argc, char *argv[])
 
     /* Parsing command line arguments */
     int ch = 0;
+    bool hashed = false;
+    string handoff, metrics, transcript, replicate, follow;
     unsigned int port_N = 11000;
-    while ((ch = getopt(argc, argv, "p:av")) != -1)
+    while ((ch = getopt(argc, argv, "p:u:t:s:d:m:l:r:T:R:F:aHv")) != -1)
     {
         switch (ch)
         {
@@ -889,6 +1099,36 @@ int main(int argc, char *argv[])
         case 'v':
             DEBUG = true;
             break;
+        case 'H':
+            hashed = true;
+            break;
+        case 's':
+            handoff = optarg;
+            break;
+        case 'd':
+            DRAIN_TIMEOUT = atoi(optarg);
+            break;
+        case 'm':
+            metrics = optarg;
+            break;
+        case 'l':
+            transcript = optarg;
+            break;
+        case 'r':
+            if (!limiter_configure(optarg))
+            {
+                fprintf(stderr, "Invalid limits: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 't':
+            IDLE_TIMEOUT = atoi(optarg);
+            if (IDLE_TIMEOUT <= 0)
+            {
+                fprintf(stderr, "Invalid timeout: %s\n", optarg);
+                exit(1);
+            }
+            break;
         case 'p':
             port_N = atoi(optarg);
             if (port_N <= 0)
@@ -897,12 +1137,32 @@ int main(int argc, char *argv[])
                 exit(1);
             }
             break;
+        case 'R':
+            replicate = optarg;
+            break;
+        case 'F':
+            follow = optarg;
+            break;
+        case 'T':
+            if (!tls_start(optarg))
+            {
+                fprintf(stderr, "Cannot use certificate and key: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'u':
+            if (!digest_select(optarg))
+            {
+                fprintf(stderr, "Invalid UID digest: %s (xxh64 or md5)\n", optarg);
+                exit(1);
+            }
+            break;
         case '?':
             fprintf(stderr, "Error: Invalid choose: %c\n", (char) optopt);
             exit(1);
         default:
             fprintf(stderr,
-                    "Error: Please input [-p port_num] [-a] [-v] [mailbox directory]\n");
+                    "Error: Please input [-p port_num] [-u digest] [-t idle_seconds] [-s handoff_path] [-d drain_seconds] [-m metrics_port|path] [-l transcript_file] [-r limits] [-T cert,key] [-R standby|log] [-F [address:]repl_port] [-H] [-a] [-v] [mailbox directory]\n");
             exit(1);
         }
     }
@@ -912,43 +1172,77 @@ int main(int argc, char *argv[])
         exit(1);
     }
     user_dir = argv[optind];
-    get_mboxes();
-
-    struct sockaddr_in server_addr, client_addr; // Structures to represent the server and client
-
-    /* Create a new socket */
-    if ((listen_fd = socket(PF_INET, SOCK_STREAM, 0)) == -1)
+    reply_write = tls_write; // listings and messages are encrypted on connections that asked for it
+    registry_start(user_dir, hashed);
+    store_start(user_dir, -1);
+    if ((!replicate.empty() && !repl_start(user_dir, replicate.c_str())) || (!follow.empty() && !repl_follow(user_dir, follow.c_str())))
     {
-        fprintf(stderr, "Socket open error.\n");
+        fprintf(stderr, "Cannot replicate %s\n", user_dir.c_str());
         exit(1);
     }
-    int reuse = 1;
-    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, (const char *) &reuse,
-                   sizeof(int)) == -1)
+    timer_start();
+    if (!metrics.empty() && !metrics_start("pop3", metrics.c_str(), VERB_NAMES, CMD_REJECTED + 1))
     {
-        fprintf(stderr, "Socket set error.\n");
+        fprintf(stderr, "Cannot serve metrics on %s\n", metrics.c_str());
+        exit(1);
+    }
+    if (!log_start("pop3", transcript.empty() ? NULL : transcript.c_str()))
+    {
+        fprintf(stderr, "Cannot open transcript %s\n", transcript.c_str());
         exit(1);
     }
-    //set_nonblocking(listen_fd);
 
-    /* Configure the server */
-    bzero(&server_addr, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = htons(INADDR_ANY);
-    server_addr.sin_port = htons(port_N);
+    struct sockaddr_in server_addr, client_addr; // Structures to represent the server and client
 
-    /* Use the socket and associate it with the port number */
-    if (bind(listen_fd, (struct sockaddr *) &server_addr,
-             sizeof(struct sockaddr)) == -1)
+    /* Take over the listening socket of a running server, or create a new one */
+    listen_fd = handoff.empty() ? -1 : handoff_receive(handoff);
+    if (listen_fd >= 0)
+    {
+        if (DEBUG)
+        {
+            printf("Listening socket taken over from %s\n", handoff.c_str());
+        }
+    }
+    else if ((listen_fd = socket(PF_INET, SOCK_STREAM, 0)) == -1)
     {
-        fprintf(stderr, "Unable to bind.\n");
+        fprintf(stderr, "Socket open error.\n");
         exit(1);
     }
+    else
+    {
+        int reuse = 1;
+        if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, (const char *) &reuse,
+                       sizeof(int)) == -1)
+        {
+            fprintf(stderr, "Socket set error.\n");
+            exit(1);
+        }
+
+        /* Configure the server */
+        bzero(&server_addr, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_addr.s_addr = htons(INADDR_ANY);
+        server_addr.sin_port = htons(port_N);
+
+        /* Use the socket and associate it with the port number */
+        if (bind(listen_fd, (struct sockaddr *) &server_addr,
+                 sizeof(struct sockaddr)) == -1)
+        {
+            fprintf(stderr, "Unable to bind.\n");
+            exit(1);
+        }
 
-    /* Start to listen client connections */
-    if (listen(listen_fd, 100) == -1)
+        /* Start to listen client connections */
+        if (listen(listen_fd, 100) == -1)
+        {
+            fprintf(stderr, "Unable to listen.\n");
+            exit(1);
+        }
+    }
+    set_nonblocking(listen_fd); // shared with the server it is handed to, which may take a pending connection first
+    if (pipe2(wake_fd, O_CLOEXEC) != 0
+            || (!handoff.empty() && !handoff_start(handoff, listen_fd, wake_fd[1])))
     {
-        fprintf(stderr, "Unable to listen.\n");
         exit(1);
     }
     RUNNING = true;
@@ -959,47 +1253,80 @@ int main(int argc, char *argv[])
     fflush(stdout);
     pthread_mutex_init(&lock, NULL);
 
-    //	fd_set readfds;
-    //	int maxfd = 1;
-    //	struct timeval timeout;
-
+    struct pollfd fds[2] = { { listen_fd, POLLIN, 0 }, { wake_fd[0], POLLIN, 0 } };
     while (RUNNING)
     {
         /* Set up client connections */
         socklen_t clientaddrlen = sizeof(client_addr);
 
-        /* Set the accept function to nonblock */
-        //		FD_ZERO(&readfds);
-        //		FD_SET(listen_fd, &readfds);
-        //		timeout.tv_sec = 5;
-        //		timeout.tv_usec = 0;
-        //		int res = select(maxfd, &readfds, NULL, NULL, &timeout);
-        //		if (res <= 0) {
-        //			printf("No coming...\n");
-        //			continue;
-        //		}
-        unsigned int comm_fd = accept(listen_fd,
-                                      (struct sockaddr *) &client_addr, &clientaddrlen);
-        if (!RUNNING || comm_fd == -1)
+        /* Wait for a connection, or for a signal or the handoff to stop accepting */
+        if (poll(fds, 2, -1) < 0 && errno != EINTR)
         {
             break;
         }
-        set_nonblocking(comm_fd);
-        SOCKETS.push_back(comm_fd);
-        if (DEBUG)
+        if (fds[1].revents & POLLIN)
+        {
+            char byte;
+            read(wake_fd[0], &byte, 1);
+            RUNNING = false;
+            break;
+        }
+        int comm_fd = accept(listen_fd, (struct sockaddr *) &client_addr,
+                             &clientaddrlen);
+        if (comm_fd == -1)
+        {
+            continue; // taken by the other server during a handoff, or aborted
+        }
+        Client *client;
+        if (!limiter_accept(ntohl(client_addr.sin_addr.s_addr), client))
         {
-            fprintf(stderr, "[%d] New connection\n", comm_fd);
+            write(comm_fd, TOO_MANY, strlen(TOO_MANY));
+            close(comm_fd);
+            log_session("Connection refused by rate limit\n");
+            continue;
         }
+        set_nonblocking(comm_fd);
+        ACTIVE++;
+        metrics_add(M_ACCEPTS);
+        PROBE1(session__accept, comm_fd);
+        log_session("[%d] New connection\n", comm_fd);
 
         /* Assign the client to a thread */
         pthread_t thread;
-        pthread_create(&thread, NULL, &client_t, &comm_fd);
+        session_t *session = new session_t;
+        session->fd = comm_fd;
+        session->client = client;
+        pthread_create(&thread, NULL, &client_t, session);
         THREADS.push_back(thread);
     }
 
+    /* Drain: the sessions finish what they are doing until the deadline, a second signal cuts it short */
+    close(listen_fd);
+    DRAIN_END = timer_now() + DRAIN_TIMEOUT + 1;
+    DRAINING = true;
+    if (DEBUG)
+    {
+        printf("\nServer socket closed, draining %d sessions\n", ACTIVE.load());
+    }
+    while (ACTIVE > 0)
+    {
+        if (poll(&fds[1], 1, 100) > 0)
+        {
+            char byte;
+            read(wake_fd[0], &byte, 1);
+            DRAIN_END = timer_now();
+        }
+    }
+    for (int i = 0; i < THREADS.size(); i++)
+    {
+        pthread_join(THREADS[i], NULL);
+    }
+    THREADS.clear();
+
     if (DEBUG)
     {
         printf("Server successfully shut down.\n");
     }
+    log_flush();
     return 0;
 }
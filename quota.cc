@@ -0,0 +1,182 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string>
+
+#include "quota.h"
+
+using namespace std;
+
+static const char TITLE[] = "From <";
+static const int TITLE_LEN = 6;
+
+static bool ENABLED = false;
+static uint64_t MAX_BYTES = 0, MAX_MESSAGES = 0; // 0 if unlimited
+
+/* Helper function that parses a number with an optional K, M or G suffix */
+static bool parse_size(const string &value, uint64_t &size)
+{
+    char *end;
+    size = strtoull(value.c_str(), &end, 10);
+    switch (*end)
+    {
+    case 'G':
+        size <<= 10;
+        // fall through
+    case 'M':
+        size <<= 10;
+        // fall through
+    case 'K':
+        size <<= 10;
+        end++;
+    }
+    return *end == '\0' && size > 0;
+}
+
+/* Parse the quotas of a comma separated list of key=value, returns false if it has an unknown key or bad value */
+bool quota_configure(const char *spec)
+{
+    string list = spec;
+    for (size_t start = 0, end; start < list.size(); start = end + 1)
+    {
+        end = list.find(',', start);
+        end = end == string::npos ? list.size() : end;
+        string item = list.substr(start, end - start);
+        size_t eq = item.find('=');
+        if (eq == string::npos)
+        {
+            return false;
+        }
+        string key = item.substr(0, eq), value = item.substr(eq + 1);
+        if (!(key == "bytes" && parse_size(value, MAX_BYTES)) && !(key == "messages" && parse_size(value, MAX_MESSAGES)))
+        {
+            return false;
+        }
+    }
+    ENABLED = MAX_BYTES || MAX_MESSAGES;
+    return true;
+}
+
+/* Helper function that reads the usage record of a mailbox, returns false if it has none */
+static bool read_usage(const string &address, Usage &usage)
+{
+    int fd = open((address + USAGE_SUFFIX).c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    bool res = pread(fd, &usage, sizeof(usage), 0) == sizeof(usage);
+    close(fd);
+    return res;
+}
+
+/* Helper function that writes the usage record of a mailbox, if it has one or create is set */
+static void write_usage(const string &address, const Usage &usage, bool create)
+{
+    int fd = open((address + USAGE_SUFFIX).c_str(), create ? O_WRONLY | O_CREAT : O_WRONLY, 0644);
+    if (fd >= 0)
+    {
+        pwrite(fd, &usage, sizeof(usage), 0);
+        close(fd);
+    }
+}
+
+/* Helper function that counts the messages of a mailbox file, the same way the POP3 server finds them */
+static uint64_t count_messages(const string &file, off_t size)
+{
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0 || size < TITLE_LEN)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return 0;
+    }
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        return 0;
+    }
+    const char *data = (const char *) map, *end = data + size;
+    uint64_t count = memcmp(data, TITLE, TITLE_LEN) == 0;
+    for (const char *p = data; (p = (const char *) memchr(p, '\n', end - p)) != NULL; p++)
+    {
+        if (end - p > TITLE_LEN && memcmp(p + 1, TITLE, TITLE_LEN) == 0)
+        {
+            count++;
+        }
+    }
+    munmap(map, size);
+    return count;
+}
+
+/* Check if a mailbox may take another message. Only reads its usage record and the size of the file. */
+bool quota_check(const string &address)
+{
+    if (!ENABLED)
+    {
+        return true;
+    }
+    struct stat st;
+    if (stat(address.c_str(), &st) != 0)
+    {
+        return true; // empty, the first message makes it
+    }
+    Usage usage;
+    if (!read_usage(address, usage))
+    {
+        memset(&usage, 0, sizeof(usage));
+    }
+    if (usage.file_size != (uint64_t) st.st_size || usage.file_ino != (uint64_t) st.st_ino)
+    {
+        usage.bytes = st.st_size; // stale, the count is the last one known
+    }
+    return !(MAX_BYTES && usage.bytes >= MAX_BYTES) && !(MAX_MESSAGES && usage.messages >= MAX_MESSAGES);
+}
+
+/* Account for a message of bytes appended to a mailbox. fd is the mailbox file, locked by the caller. */
+void quota_appended(const string &address, int fd, uint64_t bytes)
+{
+    struct stat st;
+    if (!ENABLED || fstat(fd, &st) != 0)
+    {
+        return;
+    }
+    Usage usage;
+    if (read_usage(address, usage) && usage.file_ino == (uint64_t) st.st_ino
+            && usage.file_size + bytes == (uint64_t) st.st_size)
+    {
+        usage.messages++;
+    }
+    else
+    {
+        usage.messages = count_messages(address, st.st_size); // no record yet, or the mailbox was changed by something else
+    }
+    usage.bytes = st.st_size;
+    usage.file_size = st.st_size;
+    usage.file_ino = st.st_ino;
+    write_usage(address, usage, true);
+}
+
+/* Record the totals of a mailbox that is replaced by file (or is file itself), holding the mailbox lock until it is */
+void quota_replaced(const string &address, const string &file, uint64_t messages)
+{
+    struct stat st;
+    if (stat(file.c_str(), &st) != 0)
+    {
+        return;
+    }
+    Usage usage;
+    usage.bytes = st.st_size;
+    usage.messages = messages;
+    usage.file_size = st.st_size;
+    usage.file_ino = st.st_ino;
+    write_usage(address, usage, false);
+}
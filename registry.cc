@@ -0,0 +1,496 @@
+#include <sys/inotify.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sched.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unordered_set>
+#include <atomic>
+#include <pthread.h>
+
+#include "registry.h"
+
+using namespace std;
+
+/* Layout of users.idx: a header, the offsets of the names, then the sorted NUL-terminated names */
+struct index_header
+{
+    char magic[4];
+    uint32_t count;
+};
+
+static const char INDEX_MAGIC[4] = { 'M', 'B', 'X', '1' };
+
+/* Bits per local part in the Bloom filter and bits set per local part, for a false positive rate of about 1% */
+#define FILTER_BITS 10
+#define FILTER_PROBES 7
+
+/* What readers see: the mailbox set of the flat layout, or the mapped index of the hashed layout.
+ * A blocked Bloom filter over the local parts rejects most unknown users before the exact lookup; all bits of a local
+ * part are in one 512-bit block, so a probe touches one cache line. */
+struct view_t
+{
+    unordered_set<string> mboxes;
+    vector<uint64_t> filter;
+    uint64_t blocks;
+    uint64_t users;
+    double expected; // false positive rate for an unknown user, from the fill of the blocks
+    void *map;
+    size_t map_len;
+    uint32_t count;
+    const uint32_t *offsets;
+    const char *names;
+
+    view_t() : blocks(0), users(0), expected(0), map(NULL), map_len(0), count(0), offsets(NULL),
+        names(NULL) {}
+    ~view_t()
+    {
+        if (map != NULL)
+        {
+            munmap(map, map_len);
+        }
+    }
+};
+
+/* The published view. Readers register in the counter of the current generation before loading it, and the writer frees
+ * an old view only after every reader of the generation it was published in is gone. */
+static atomic<const view_t *> CURRENT(NULL);
+static atomic<int> GENERATION(0);
+static atomic<long> READERS[2];
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static string DIRECTORY;
+static bool HASHED;
+static int inotify_fd = -1;
+static atomic<unsigned long> PROBES(0), REJECTED(0), FALSE_POSITIVES(0);
+
+/* Helper function that tells whether a directory entry is a mailbox */
+static bool is_mbox(const char *name)
+{
+    int len = strlen(name);
+    return len > 5 && strcmp(name + len - 5, ".mbox") == 0;
+}
+
+/* Helper function that hashes a local part for the filter */
+static uint64_t hash_user(const char *user, int len)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < len; i++)
+    {
+        hash = (hash ^ (unsigned char) user[i]) * 0x100000001b3ULL;
+    }
+    hash ^= hash >> 29; // FNV-1a mixes the low bits poorly
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    return hash ^ (hash >> 32);
+}
+
+/* Helper function that sets or tests the bits of a local part, returns whether all of them were set */
+static bool filter_bits(const view_t *view, uint64_t *bits, const char *user, int len)
+{
+    uint64_t hash = hash_user(user, len);
+    const uint64_t *block = &view->filter[(hash % view->blocks) * 8];
+    hash = (hash ^ (hash >> 31)) * 0x94d049bb133111ebULL; // bits independent of the block
+    uint32_t h1 = hash >> 32, h2 = (uint32_t) hash | 1;
+    bool all = true;
+    for (int i = 0; i < FILTER_PROBES; i++)
+    {
+        uint32_t bit = (h1 + i * h2) & 511;
+        if (bits != NULL)
+        {
+            bits[block - &view->filter[0] + bit / 64] |= (uint64_t) 1 << (bit & 63);
+        }
+        else if (!(block[bit / 64] & ((uint64_t) 1 << (bit & 63))))
+        {
+            all = false;
+            break;
+        }
+    }
+    return all;
+}
+
+/* Build the filter of a view from its mailbox names */
+static void build_filter(view_t *view)
+{
+    view->users = HASHED ? view->count : view->mboxes.size();
+    if (HASHED && view->map == NULL)
+    {
+        return; // no index, every lookup checks the file
+    }
+    view->blocks = (view->users * FILTER_BITS + 511) / 512 + 1;
+    view->filter.assign(view->blocks * 8, 0);
+    uint64_t *bits = &view->filter[0];
+    if (HASHED)
+    {
+        for (uint32_t i = 0; i < view->count; i++)
+        {
+            const char *name = view->names + view->offsets[i];
+            filter_bits(view, bits, name, strlen(name) - 5);
+        }
+    }
+    else
+    {
+        for (unordered_set<string>::const_iterator it = view->mboxes.begin();
+                it != view->mboxes.end(); it++)
+        {
+            filter_bits(view, bits, it->c_str(), it->size() - 5);
+        }
+    }
+    for (uint64_t i = 0; i < view->blocks; i++)
+    {
+        int set = 0;
+        for (int j = 0; j < 8; j++)
+        {
+            set += __builtin_popcountll(bits[i * 8 + j]);
+        }
+        view->expected += pow(set / 512.0, FILTER_PROBES) / view->blocks;
+    }
+}
+
+/* Replace the published view and wait until no reader can still see the old one */
+static void publish(view_t *next)
+{
+    build_filter(next);
+    pthread_mutex_lock(&writer_lock);
+    const view_t *old = CURRENT.exchange(next);
+    int gen = GENERATION.fetch_xor(1);
+    while (READERS[gen].load() != 0)
+    {
+        sched_yield();
+    }
+    pthread_mutex_unlock(&writer_lock);
+    delete old;
+}
+
+/* Add the mailboxes of the local users to a set from a directory */
+static view_t *scan()
+{
+    DIR *dir;
+    struct dirent *ptr;
+    view_t *view = new view_t();
+    if ((dir = opendir(DIRECTORY.c_str())) == NULL)
+    {
+        fprintf(stderr, "Mailbox directory open error.\n");
+        exit(1);
+    }
+    while ((ptr = readdir(dir)) != NULL)
+    {
+        if (is_mbox(ptr->d_name))
+        {
+            view->mboxes.insert(ptr->d_name);
+        }
+    }
+    closedir(dir);
+    return view;
+}
+
+/* Map the index of the hashed layout. Without a valid index, the view is empty and lookups check the files. */
+static view_t *load_index()
+{
+    view_t *view = new view_t();
+    string address = DIRECTORY + "/" + INDEX_NAME;
+    int fd = open(address.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < sizeof(index_header))
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return view;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        perror("mmap() of the user index failed");
+        return view;
+    }
+    const index_header *header = (const index_header *) map;
+    size_t names = sizeof(index_header) + (size_t) header->count * 4;
+    bool valid = memcmp(header->magic, INDEX_MAGIC, 4) == 0 && names <= st.st_size
+                 && (header->count == 0 || ((const char *) map)[st.st_size - 1] == '\0'); // the last name ends in the file
+    for (uint32_t i = 0; valid && i < header->count; i++)
+    {
+        valid = names + ((const uint32_t *)(header + 1))[i] < st.st_size; // every name starts in the file
+    }
+    if (!valid)
+    {
+        fprintf(stderr, "Invalid user index %s\n", address.c_str());
+        munmap(map, st.st_size);
+        return view;
+    }
+    view->map = map;
+    view->map_len = st.st_size;
+    view->count = header->count;
+    view->offsets = (const uint32_t *)(header + 1);
+    view->names = (const char *)(view->offsets + header->count);
+    return view;
+}
+
+/* Thread function that applies directory changes to a copy of the set and publishes it, one copy per batch of events.
+ * In the hashed layout it only remaps the index when it is replaced. */
+static void *watch_t(void *p)
+{
+    char buffer[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (true)
+    {
+        int len = read(inotify_fd, buffer, sizeof(buffer));
+        if (len <= 0)
+        {
+            break;
+        }
+        view_t *next = NULL;
+        for (char *ptr = buffer; ptr < buffer + len;)
+        {
+            struct inotify_event *event = (struct inotify_event *) ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
+            if (HASHED)
+            {
+                if ((event->mask & IN_Q_OVERFLOW)
+                        || (event->len > 0 && strcmp(event->name, INDEX_NAME) == 0))
+                {
+                    delete next;
+                    next = load_index();
+                }
+                continue;
+            }
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                delete next;
+                next = scan(); // events were lost
+                break;
+            }
+            if (event->len == 0 || !is_mbox(event->name))
+            {
+                continue;
+            }
+            if (next == NULL)
+            {
+                next = new view_t();
+                next->mboxes = CURRENT.load()->mboxes;
+            }
+            if (event->mask & (IN_CREATE | IN_MOVED_TO))
+            {
+                next->mboxes.insert(event->name);
+            }
+            else
+            {
+                next->mboxes.erase(event->name);
+            }
+        }
+        if (next != NULL)
+        {
+            publish(next);
+        }
+    }
+    return NULL;
+}
+
+/* Load the mailboxes of a directory and keep watching it. Without inotify the view stays as loaded. */
+void registry_start(const string &dir, bool hashed)
+{
+    DIRECTORY = dir;
+    HASHED = hashed;
+    READERS[0] = 0;
+    READERS[1] = 0;
+    uint32_t mask = hashed ? IN_MOVED_TO | IN_CLOSE_WRITE :
+                    IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+    if ((inotify_fd = inotify_init1(IN_CLOEXEC)) < 0
+            || inotify_add_watch(inotify_fd, dir.c_str(), mask) < 0)
+    {
+        perror("inotify failed, mailboxes will not be updated");
+        publish(hashed ? load_index() : scan());
+        return;
+    }
+    publish(hashed ? load_index() : scan()); // events since the watch was added are queued, so nothing is missed
+    pthread_t thread;
+    pthread_create(&thread, NULL, &watch_t, NULL);
+    pthread_detach(thread);
+}
+
+/* Helper function that binary searches the mapped index, whose offsets load_index() checked */
+static bool index_has(const view_t *view, const string &mbox)
+{
+    uint32_t low = 0, high = view->count;
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        int cmp = strcmp(mbox.c_str(), view->names + view->offsets[mid]);
+        if (cmp == 0)
+        {
+            return true;
+        }
+        if (cmp < 0)
+        {
+            high = mid;
+        }
+        else
+        {
+            low = mid + 1;
+        }
+    }
+    return false;
+}
+
+/* Helper function that registers a reader and returns the view it may use until leave() */
+static const view_t *enter(int &gen)
+{
+    while (true)
+    {
+        gen = GENERATION.load();
+        READERS[gen]++;
+        if (GENERATION.load() == gen)
+        {
+            break; // any writer from now on waits for this reader
+        }
+        READERS[gen]--;
+    }
+    return CURRENT.load();
+}
+
+static void leave(int gen)
+{
+    READERS[gen]--;
+}
+
+/* Helper function for the exact lookup of a mailbox in a view. A name with a slash or a leading dot is no mailbox of the
+ * directory, whatever file it reaches. */
+static bool view_has(const view_t *view, const string &mbox)
+{
+    if (view == NULL || mbox.empty() || mbox[0] == '.' || mbox.find('/') != string::npos)
+    {
+        return false;
+    }
+    if (!HASHED)
+    {
+        return view->mboxes.find(mbox) != view->mboxes.end();
+    }
+    if (view->map != NULL)
+    {
+        return index_has(view, mbox);
+    }
+    return access(registry_path(mbox).c_str(), F_OK) == 0; // no index, check the file itself
+}
+
+/* Check if a mailbox exists, without taking a lock */
+bool registry_has(const string &mbox)
+{
+    int gen;
+    bool has = view_has(enter(gen), mbox);
+    leave(gen);
+    return has;
+}
+
+/* Check if a local user has a mailbox. Most unknown users are rejected by the filter before the name is even copied. */
+bool registry_has_user(const char *user)
+{
+    int gen, len = strlen(user);
+    if (len == 0 || user[0] == '.' || strchr(user, '/') != NULL)
+    {
+        return false; // a path, not a local part
+    }
+    const view_t *view = enter(gen);
+    bool has;
+    PROBES.fetch_add(1, memory_order_relaxed);
+    if (view != NULL && view->blocks > 0 && !filter_bits(view, NULL, user, len))
+    {
+        REJECTED.fetch_add(1, memory_order_relaxed);
+        has = false;
+    }
+    else
+    {
+        has = view_has(view, string(user, len) + ".mbox");
+        if (!has && view != NULL && view->blocks > 0)
+        {
+            FALSE_POSITIVES.fetch_add(1, memory_order_relaxed);
+        }
+    }
+    leave(gen);
+    return has;
+}
+
+/* Statistics of the filter: lookups, users rejected by it, and unknown users it let through.
+ * The observed false positive rate is false_positives / (rejected + false_positives). */
+void registry_filter_stats(unsigned long &probes, unsigned long &rejected,
+                           unsigned long &false_positives, double &expected)
+{
+    int gen;
+    const view_t *view = enter(gen);
+    probes = PROBES.load(memory_order_relaxed);
+    rejected = REJECTED.load(memory_order_relaxed);
+    false_positives = FALSE_POSITIVES.load(memory_order_relaxed);
+    expected = view != NULL ? view->expected : 0;
+    leave(gen);
+}
+
+/* Path of a mailbox file in the hashed layout, two levels of directories from the FNV-1a hash of its name */
+string registry_hashed_path(const string &dir, const string &mbox)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < mbox.size(); i++)
+    {
+        hash = (hash ^ (unsigned char) mbox[i]) * 0x100000001b3ULL;
+    }
+    char sub[8];
+    snprintf(sub, sizeof(sub), "%02x/%02x/", (unsigned int)(hash >> 56),
+             (unsigned int)(hash >> 48) & 0xff);
+    return dir + "/" + sub + mbox;
+}
+
+/* Path of a mailbox file in the layout in use */
+string registry_path(const string &mbox)
+{
+    return HASHED ? registry_hashed_path(DIRECTORY, mbox) : DIRECTORY + "/" + mbox;
+}
+
+/* Read all names of the index of a directory */
+bool registry_read_index(const string &dir, vector<string> &mboxes)
+{
+    DIRECTORY = dir;
+    view_t *view = load_index();
+    bool res = view->map != NULL;
+    for (uint32_t i = 0; i < view->count; i++)
+    {
+        mboxes.push_back(view->names + view->offsets[i]);
+    }
+    delete view;
+    return res;
+}
+
+/* Sort the names and replace the index of a directory with them. The new index is renamed into place, so servers remap it at once. */
+bool registry_write_index(const string &dir, vector<string> &mboxes)
+{
+    sort(mboxes.begin(), mboxes.end());
+    mboxes.erase(unique(mboxes.begin(), mboxes.end()), mboxes.end());
+    index_header header;
+    memcpy(header.magic, INDEX_MAGIC, 4);
+    header.count = mboxes.size();
+    vector<uint32_t> offsets;
+    string names;
+    for (int i = 0; i < mboxes.size(); i++)
+    {
+        offsets.push_back(names.size());
+        names += mboxes[i];
+        names += '\0';
+    }
+    string address = dir + "/" + INDEX_NAME, temp = address + ".tmp";
+    FILE *out = fopen(temp.c_str(), "wb");
+    if (out == NULL)
+    {
+        return false;
+    }
+    bool res = fwrite(&header, sizeof(header), 1, out) == 1
+               && fwrite(offsets.data(), 4, offsets.size(), out) == offsets.size()
+               && fwrite(names.data(), 1, names.size(), out) == names.size();
+    res = fclose(out) == 0 && res;
+    return res && rename(temp.c_str(), address.c_str()) == 0;
+}
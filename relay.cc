@@ -0,0 +1,873 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include "relay.h"
+
+using namespace std;
+
+#define RELAY_SESSIONS 2                 // per destination
+#define RELAY_IDLE 30                    // seconds a session waits for more mail before it quits
+#define REPLY_TIMEOUT 300                // seconds for a reply of the server (RFC 5321 4.5.3.2 asks for 5 to 10 minutes)
+#define RETRY_FIRST 60                   // seconds, doubled with every failed attempt
+#define RETRY_MAX 3600
+#define QUEUE_LIFETIME (5 * 24 * 3600)
+#define TEMP_PREFIX "tmp."
+#define MAX_HOPS 100                     // Received: headers a relayed message may carry (RFC 5321 6.3)
+
+struct route_t
+{
+    string domain, host, port;
+};
+
+/* A message for one destination, as kept in its queue file: a line "created next tries [host port]", the sender, the recipients,
+ * an empty line and the message */
+struct entry_t
+{
+    uint64_t created, next; // milliseconds since the epoch
+    unsigned int tries;
+    string host, port; // empty if the route of the recipients' domain is taken
+    string sender;
+    vector<string> rcpts;
+    string content;
+};
+
+/* A server mail is relayed to, with its messages that are due and the sessions sending them */
+struct destination_t
+{
+    string host, port;
+    deque<string> due; // names of queue files
+    int sessions, waiting;
+    pthread_cond_t wake;
+};
+
+/* An SMTP session with a destination */
+struct session_t
+{
+    int fd;
+    bool pipelining;
+    string buffer; // read and not taken as a reply yet
+};
+
+/* Clients on a trusted network may relay, as network and mask in host order */
+struct network_t
+{
+    uint32_t network, mask;
+};
+
+static string QUEUE_PATH;
+static vector<route_t> ROUTES; // read once at the start
+static vector<network_t> TRUSTED;
+
+/* Every message not being sent waits in SCHEDULE for its next attempt */
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scheduled = PTHREAD_COND_INITIALIZER;
+static multimap<uint64_t, pair<string, destination_t *> > SCHEDULE;
+static map<string, destination_t *> DESTINATIONS; // by host and port
+static bool STOPPING = false;                      // draining, no message is started any more
+static int SENDING = 0;                            // messages being sent
+
+static atomic<unsigned long> QUEUED(0), SENT(0), DEFERRED(0), BOUNCED(0), OPENED(0), REUSED(0);
+static atomic<unsigned int> COUNTER(0);
+
+static uint64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static struct timespec deadline(uint64_t ms)
+{
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000;
+    return ts;
+}
+
+static bool write_all(int fd, const void *data, size_t len)
+{
+    const char *p = (const char *) data;
+    while (len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static string domain_of(const string &rcpt)
+{
+    size_t at = rcpt.rfind('@');
+    return at == string::npos ? "" : rcpt.substr(at + 1);
+}
+
+/* Helper function that finds the route of a domain, NULL if it is not relayed */
+static const route_t *find_route(const string &domain)
+{
+    const route_t *any = NULL;
+    for (size_t i = 0; i < ROUTES.size(); i++)
+    {
+        if (strcasecmp(ROUTES[i].domain.c_str(), domain.c_str()) == 0)
+        {
+            return &ROUTES[i];
+        }
+        if (ROUTES[i].domain == "*")
+        {
+            any = &ROUTES[i];
+        }
+    }
+    return any;
+}
+
+/* Helper function that finds the destination of a route, made on first use. Called with queue_lock held. */
+static destination_t *destination(const route_t *route)
+{
+    string key = route->host + ":" + route->port;
+    map<string, destination_t *>::iterator it = DESTINATIONS.find(key);
+    if (it != DESTINATIONS.end())
+    {
+        return it->second;
+    }
+    destination_t *dest = new destination_t();
+    dest->host = route->host;
+    dest->port = route->port;
+    dest->sessions = dest->waiting = 0;
+    pthread_cond_init(&dest->wake, NULL);
+    DESTINATIONS[key] = dest;
+    return dest;
+}
+
+/* Helper function that writes a queue file under a temporary name and renames it, so a queue file is always complete */
+static bool write_entry(const string &name, const entry_t &entry)
+{
+    char header[64];
+    snprintf(header, sizeof(header), "%llu %llu %u", (unsigned long long) entry.created,
+             (unsigned long long) entry.next, entry.tries);
+    string data = header;
+    if (!entry.host.empty())
+    {
+        data += " " + entry.host + " " + entry.port;
+    }
+    data += "\n";
+    data += entry.sender + "\n";
+    for (size_t i = 0; i < entry.rcpts.size(); i++)
+    {
+        data += entry.rcpts[i] + "\n";
+    }
+    data += "\n";
+    data += entry.content;
+    string temp = QUEUE_PATH + "/" TEMP_PREFIX + name;
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+    bool res = write_all(fd, data.data(), data.size());
+    close(fd);
+    if (!res || rename(temp.c_str(), (QUEUE_PATH + "/" + name).c_str()) != 0)
+    {
+        unlink(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+static bool read_entry(const string &name, entry_t &entry)
+{
+    ifstream in((QUEUE_PATH + "/" + name).c_str(), ios::binary);
+    unsigned long long created, next;
+    char host[256], port[16];
+    string line;
+    int fields = 0;
+    if (!in || !getline(in, line)
+            || (fields = sscanf(line.c_str(), "%llu %llu %u %255s %15s", &created, &next, &entry.tries, host, port)) < 3
+            || !getline(in, entry.sender))
+    {
+        return false;
+    }
+    entry.created = created;
+    entry.next = next;
+    entry.host = fields == 5 ? host : "";
+    entry.port = fields == 5 ? port : "";
+    entry.rcpts.clear();
+    while (getline(in, line) && !line.empty())
+    {
+        entry.rcpts.push_back(line);
+    }
+    stringstream content;
+    content << in.rdbuf();
+    entry.content = content.str();
+    return !entry.rcpts.empty();
+}
+
+/* Helper function that removes a queue file whose recipients all took the message or refused it for good */
+static void remove_entry(const string &name)
+{
+    unlink((QUEUE_PATH + "/" + name).c_str());
+    QUEUED--;
+}
+
+/* Helper function that reads one reply, the lines of a multiline one into lines if given. Returns its code, 0 if the connection
+ * broke or the server took too long. */
+static int read_reply(session_t &session, vector<string> *lines = NULL)
+{
+    while (true)
+    {
+        size_t end;
+        while ((end = session.buffer.find("\r\n")) != string::npos)
+        {
+            string line = session.buffer.substr(0, end);
+            session.buffer.erase(0, end + 2);
+            if (lines != NULL)
+            {
+                lines->push_back(line);
+            }
+            if (line.size() < 3)
+            {
+                return 0;
+            }
+            if (line.size() == 3 || line[3] != '-')
+            {
+                return atoi(line.c_str());
+            }
+        }
+        struct pollfd pfd = { session.fd, POLLIN, 0 };
+        char chunk[4096];
+        ssize_t n;
+        if (poll(&pfd, 1, REPLY_TIMEOUT * 1000) <= 0 || (n = read(session.fd, chunk, sizeof(chunk))) <= 0)
+        {
+            return 0;
+        }
+        session.buffer.append(chunk, n);
+    }
+}
+
+static void close_session(session_t &session, bool quit)
+{
+    if (session.fd < 0)
+    {
+        return;
+    }
+    if (quit)
+    {
+        write_all(session.fd, "QUIT\r\n", 6); // the 221 is not waited for
+    }
+    close(session.fd);
+    session.fd = -1;
+    session.buffer.clear();
+}
+
+/* Helper function that connects to a destination and greets it, with EHLO to learn whether it takes pipelined commands, or with
+ * HELO if it does not know EHLO */
+static bool open_session(session_t &session, destination_t *dest)
+{
+    struct addrinfo hints = { }, *addrs;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(dest->host.c_str(), dest->port.c_str(), &hints, &addrs) != 0)
+    {
+        return false;
+    }
+    int fd = socket(addrs->ai_family, SOCK_STREAM, 0), one = 1;
+    if (fd >= 0 && connect(fd, addrs->ai_addr, addrs->ai_addrlen) != 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addrs);
+    if (fd < 0)
+    {
+        return false;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // every write ends a turn of the dialogue
+    session.fd = fd;
+    session.pipelining = false;
+    session.buffer.clear();
+    vector<string> lines;
+    int code = 0;
+    if (read_reply(session) == 220 && write_all(fd, "EHLO localhost\r\n", 16))
+    {
+        code = read_reply(session, &lines);
+        if (code / 100 == 5 && write_all(fd, "HELO localhost\r\n", 16))
+        {
+            code = read_reply(session);
+        }
+    }
+    if (code != 250)
+    {
+        close_session(session, code != 0);
+        return false;
+    }
+    for (size_t i = 1; i < lines.size(); i++) // the first line names the server
+    {
+        if (strncasecmp(lines[i].c_str() + 4, "PIPELINING", 10) == 0 && lines[i].size() >= 14)
+        {
+            session.pipelining = true;
+        }
+    }
+    OPENED++;
+    return true;
+}
+
+/* Helper function that runs one transaction. Returns the reply to MAIL, then one per recipient, then to DATA and to the end of the
+ * message, as far as it got; 0 stands for a broken connection. With pipelining every command up to DATA is sent at once, and DATA
+ * is answered even when every recipient was refused, so the server gets an empty message then (RFC 2920 3.1). */
+static vector<int> transaction(session_t &session, const entry_t &entry)
+{
+    vector<string> commands(1, "MAIL FROM:<" + entry.sender + ">\r\n");
+    for (size_t i = 0; i < entry.rcpts.size(); i++)
+    {
+        commands.push_back("RCPT TO:<" + entry.rcpts[i] + ">\r\n");
+    }
+    commands.push_back("DATA\r\n");
+    vector<int> codes;
+    bool accepted = false;
+    if (session.pipelining)
+    {
+        string all;
+        for (size_t i = 0; i < commands.size(); i++)
+        {
+            all += commands[i];
+        }
+        if (!write_all(session.fd, all.data(), all.size()))
+        {
+            return codes;
+        }
+        for (size_t i = 0; i < commands.size(); i++)
+        {
+            codes.push_back(read_reply(session));
+            if (codes.back() == 0)
+            {
+                return codes;
+            }
+            accepted = accepted || (i > 0 && i + 1 < commands.size() && codes.back() / 100 == 2);
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < commands.size(); i++)
+        {
+            if (i + 1 == commands.size() && !accepted)
+            {
+                return codes; // no recipient, no DATA
+            }
+            if (!write_all(session.fd, commands[i].data(), commands[i].size()))
+            {
+                codes.push_back(0);
+                return codes;
+            }
+            codes.push_back(read_reply(session));
+            if (codes.back() == 0 || (i == 0 && codes.back() / 100 != 2))
+            {
+                return codes;
+            }
+            accepted = accepted || (i > 0 && codes.back() / 100 == 2);
+        }
+    }
+    if (codes.back() != 354)
+    {
+        return codes;
+    }
+    if ((accepted && !write_all(session.fd, entry.content.data(), entry.content.size()))
+            || !write_all(session.fd, ".\r\n", 3))
+    {
+        codes.push_back(0);
+        return codes;
+    }
+    codes.push_back(read_reply(session));
+    return codes;
+}
+
+/* Helper function that sends one queued message through the session, which is opened first if it is not open or the server
+ * closed it meanwhile. Returns when to try again, 0 once every recipient took the message or refused it for good. */
+static uint64_t send_entry(session_t &session, destination_t *dest, const string &name, entry_t &entry)
+{
+    struct pollfd pfd = { session.fd, POLLIN, 0 };
+    if (session.fd >= 0 && poll(&pfd, 1, 0) > 0)
+    {
+        close_session(session, false); // closed by the server, or a 421 before it does
+    }
+    vector<int> codes;
+    if (session.fd >= 0)
+    {
+        REUSED++;
+        codes = transaction(session, entry);
+    }
+    else if (open_session(session, dest))
+    {
+        codes = transaction(session, entry);
+    }
+    size_t rcpts = entry.rcpts.size();
+    int mail = codes.empty() ? 0 : codes[0];
+    int data = codes.size() > rcpts + 1 ? codes[rcpts + 1] : 0;
+    int end = codes.size() > rcpts + 2 ? codes[rcpts + 2] : 0;
+    if (find(codes.begin(), codes.end(), 0) != codes.end() || (codes.empty() && session.fd >= 0))
+    {
+        close_session(session, false);
+    }
+    else if (session.fd >= 0 && end / 100 != 2)
+    {
+        if (!write_all(session.fd, "RSET\r\n", 6) || read_reply(session) != 250)
+        {
+            close_session(session, false);
+        }
+    }
+
+    /* Each recipient has the reply to MAIL if that failed, else its own if that failed, else the one to the end of the message */
+    vector<string> remaining;
+    for (size_t i = 0; i < rcpts; i++)
+    {
+        int code = mail / 100 != 2 ? mail : codes.size() > i + 1 ? codes[i + 1] : 0;
+        if (code / 100 == 2)
+        {
+            code = data == 354 ? end : data;
+        }
+        if (code / 100 == 2)
+        {
+            SENT++;
+        }
+        else if (code / 100 == 5)
+        {
+            BOUNCED++;
+            fprintf(stderr, "Relay: %s:%s refused %s for good (%d)\n", dest->host.c_str(), dest->port.c_str(),
+                    entry.rcpts[i].c_str(), code);
+        }
+        else
+        {
+            remaining.push_back(entry.rcpts[i]);
+        }
+    }
+    if (remaining.empty())
+    {
+        remove_entry(name);
+        return 0;
+    }
+    uint64_t now = now_ms();
+    if (now - entry.created > QUEUE_LIFETIME * 1000ULL)
+    {
+        BOUNCED += remaining.size();
+        fprintf(stderr, "Relay: gave up on %zu recipients of %s after %u attempts\n", remaining.size(), name.c_str(),
+                entry.tries + 1);
+        remove_entry(name);
+        return 0;
+    }
+    DEFERRED += remaining.size();
+    entry.rcpts = remaining;
+    entry.next = now + min(RETRY_FIRST << min(entry.tries, 16u), RETRY_MAX) * 1000ULL;
+    entry.tries++;
+    if (!write_entry(name, entry))
+    {
+        fprintf(stderr, "Relay: cannot update queued message %s\n", name.c_str());
+    }
+    return entry.next;
+}
+
+/* Helper function that sends a queued message while holding the flock of its file. During a handoff both servers of the
+ * directory have the queue, so a message the other one is sending is tried again later, and one it sent or deferred meanwhile
+ * is taken as it left it. */
+static uint64_t attempt(session_t &session, destination_t *dest, const string &name)
+{
+    string path = QUEUE_PATH + "/" + name;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        QUEUED--; // sent by the other server
+        return 0;
+    }
+    uint64_t next;
+    struct stat locked, named;
+    entry_t entry;
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0)
+    {
+        next = now_ms() + RETRY_FIRST * 1000ULL; // being sent by the other server
+    }
+    else if (fstat(fd, &locked) != 0 || stat(path.c_str(), &named) != 0)
+    {
+        QUEUED--;
+        next = 0;
+    }
+    else if (locked.st_ino != named.st_ino)
+    {
+        next = now_ms(); // rewritten after a deferral before the lock was taken, lock the new file
+    }
+    else if (!read_entry(name, entry))
+    {
+        fprintf(stderr, "Relay: cannot read queued message %s\n", name.c_str());
+        next = 0;
+    }
+    else if (entry.next > now_ms())
+    {
+        next = entry.next; // deferred by the other server
+    }
+    else
+    {
+        next = send_entry(session, dest, name, entry);
+    }
+    close(fd); // closing also releases the lock
+    return next;
+}
+
+/* Thread function for a session with a destination, which sends its due messages one after another and quits when there were none
+ * for RELAY_IDLE seconds */
+static void *sender_t(void *arg)
+{
+    destination_t *dest = (destination_t *) arg;
+    session_t session = { -1, false, "" };
+    pthread_mutex_lock(&queue_lock);
+    while (!STOPPING)
+    {
+        if (dest->due.empty())
+        {
+            struct timespec until = deadline(now_ms() + RELAY_IDLE * 1000);
+            dest->waiting++;
+            int res = pthread_cond_timedwait(&dest->wake, &queue_lock, &until);
+            dest->waiting--;
+            if (res == ETIMEDOUT && dest->due.empty())
+            {
+                break;
+            }
+            continue;
+        }
+        string name = dest->due.front();
+        dest->due.pop_front();
+        SENDING++;
+        pthread_mutex_unlock(&queue_lock);
+        uint64_t next = attempt(session, dest, name);
+        pthread_mutex_lock(&queue_lock);
+        SENDING--;
+        if (next > 0)
+        {
+            SCHEDULE.insert(make_pair(next, make_pair(name, dest)));
+            pthread_cond_signal(&scheduled);
+        }
+    }
+    dest->sessions--;
+    pthread_mutex_unlock(&queue_lock);
+    close_session(session, true);
+    return NULL;
+}
+
+/* Thread function that hands every message to its destination when it is due, to a waiting session or to a new one */
+static void *scheduler_t(void *arg)
+{
+    pthread_mutex_lock(&queue_lock);
+    while (true)
+    {
+        uint64_t now = now_ms();
+        while (!SCHEDULE.empty() && SCHEDULE.begin()->first <= now)
+        {
+            destination_t *dest = SCHEDULE.begin()->second.second;
+            dest->due.push_back(SCHEDULE.begin()->second.first);
+            SCHEDULE.erase(SCHEDULE.begin());
+            if (dest->waiting > 0)
+            {
+                pthread_cond_signal(&dest->wake);
+            }
+            else if (dest->sessions < RELAY_SESSIONS)
+            {
+                pthread_t thread;
+                if (pthread_create(&thread, NULL, &sender_t, dest) == 0)
+                {
+                    pthread_detach(thread);
+                    dest->sessions++;
+                }
+            }
+        }
+        if (SCHEDULE.empty())
+        {
+            pthread_cond_wait(&scheduled, &queue_lock);
+        }
+        else
+        {
+            struct timespec until = deadline(SCHEDULE.begin()->first);
+            pthread_cond_timedwait(&scheduled, &queue_lock, &until);
+        }
+    }
+    return NULL;
+}
+
+/* Helper function that adds a trusted network written as address/bits, or a single address */
+static bool parse_network(const string &spec)
+{
+    size_t slash = spec.find('/');
+    int bits = slash == string::npos ? 32 : atoi(spec.c_str() + slash + 1);
+    struct in_addr addr;
+    if (bits < 0 || bits > 32 || inet_pton(AF_INET, spec.substr(0, slash).c_str(), &addr) != 1)
+    {
+        return false;
+    }
+    network_t network;
+    network.mask = bits == 0 ? 0 : ~0u << (32 - bits);
+    network.network = ntohl(addr.s_addr) & network.mask;
+    TRUSTED.push_back(network);
+    return true;
+}
+
+/* Helper function that reads the routes and trusted networks, returns false if the file cannot be read or a line is malformed.
+ * Without a file nothing is relayed by domain. */
+static bool load_routes(const string &path)
+{
+    parse_network("127.0.0.0/8");
+    if (path.empty())
+    {
+        return true;
+    }
+    ifstream in(path.c_str());
+    if (!in)
+    {
+        return false;
+    }
+    string line;
+    while (getline(in, line))
+    {
+        istringstream fields(line);
+        route_t route;
+        if (!(fields >> route.domain) || route.domain[0] == '#')
+        {
+            continue;
+        }
+        if (route.domain == "trust")
+        {
+            string network;
+            if (!(fields >> network) || !parse_network(network))
+            {
+                fprintf(stderr, "Invalid trusted network: %s\n", line.c_str());
+                return false;
+            }
+            continue;
+        }
+        if (!(fields >> route.host >> route.port) || atoi(route.port.c_str()) <= 0)
+        {
+            fprintf(stderr, "Invalid route: %s\n", line.c_str());
+            return false;
+        }
+        ROUTES.push_back(route);
+    }
+    return true;
+}
+
+/* Read the routes and take up the messages left in the queue, with their attempts due as planned */
+bool relay_start(const string &dir, const string &routes)
+{
+    if (!load_routes(routes))
+    {
+        return false;
+    }
+    QUEUE_PATH = dir + "/" QUEUE_DIR;
+    if (mkdir(QUEUE_PATH.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        return false;
+    }
+    DIR *queue = opendir(QUEUE_PATH.c_str());
+    if (queue == NULL)
+    {
+        return false;
+    }
+    struct dirent *file;
+    while ((file = readdir(queue)) != NULL)
+    {
+        string name = file->d_name;
+        entry_t entry;
+        if (name[0] == '.')
+        {
+            continue;
+        }
+        if (name.compare(0, strlen(TEMP_PREFIX), TEMP_PREFIX) == 0)
+        {
+            unlink((QUEUE_PATH + "/" + name).c_str()); // left by a crash, the message was not accepted
+            continue;
+        }
+        route_t given;
+        const route_t *route = NULL;
+        if (read_entry(name, entry))
+        {
+            given.host = entry.host;
+            given.port = entry.port;
+            route = entry.host.empty() ? find_route(domain_of(entry.rcpts[0])) : &given;
+        }
+        if (route == NULL)
+        {
+            fprintf(stderr, "Relay: no route for queued message %s, left in the queue\n", name.c_str());
+            continue;
+        }
+        SCHEDULE.insert(make_pair(entry.next, make_pair(name, destination(route))));
+        QUEUED++;
+    }
+    closedir(queue);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, &scheduler_t, NULL) != 0)
+    {
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+/* Whether mail for a domain is relayed for a client, by its address in host order */
+bool relay_accepts(const char *domain, uint32_t peer)
+{
+    bool trusted = false;
+    for (size_t i = 0; i < TRUSTED.size() && !trusted; i++)
+    {
+        trusted = (peer & TRUSTED[i].mask) == TRUSTED[i].network;
+    }
+    return trusted && find_route(domain) != NULL;
+}
+
+/* Whether a message has been relayed too often to be relayed again, which happens when a route leads back to this server or
+ * two servers route a domain to each other. Only the header is searched. */
+bool relay_looping(const string &content)
+{
+    int hops = 0;
+    for (size_t line = 0; line < content.size() && content.compare(line, 2, "\r\n") != 0; )
+    {
+        if (strncasecmp(content.c_str() + line, "Received:", 9) == 0)
+        {
+            hops++;
+        }
+        size_t end = content.find("\r\n", line);
+        line = end == string::npos ? content.size() : end + 2;
+    }
+    return hops >= MAX_HOPS;
+}
+
+/* Queue a message from a client for recipients of relayed domains, one file for each destination, and return false if it cannot be
+ * stored. A Received: line naming the client goes in front of it. */
+bool relay_enqueue(const string &sender, const vector<string> &rcpts, const string &content, uint32_t peer)
+{
+    map<const route_t *, vector<string> > groups;
+    for (size_t i = 0; i < rcpts.size(); i++)
+    {
+        const route_t *route = find_route(domain_of(rcpts[i]));
+        if (route == NULL)
+        {
+            return false;
+        }
+        groups[route].push_back(rcpts[i]);
+    }
+    uint64_t now = now_ms();
+    time_t seconds = now / 1000;
+    struct tm tm;
+    struct in_addr addr;
+    char date[64], from[INET_ADDRSTRLEN];
+    addr.s_addr = htonl(peer);
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S %z", localtime_r(&seconds, &tm));
+    string trace = (string) "Received: from [" + inet_ntop(AF_INET, &addr, from, sizeof(from)) + "] by localhost with SMTP; "
+                   + date + "\r\n";
+    vector<pair<string, const route_t *> > queued;
+    for (map<const route_t *, vector<string> >::iterator it = groups.begin(); it != groups.end(); it++)
+    {
+        entry_t entry = { now, now, 0, "", "", sender, it->second, trace + content };
+        char name[64];
+        snprintf(name, sizeof(name), "%013llx.%d.%u", (unsigned long long) now, (int) getpid(), COUNTER++);
+        if (!write_entry(name, entry))
+        {
+            for (size_t i = 0; i < queued.size(); i++)
+            {
+                unlink((QUEUE_PATH + "/" + queued[i].first).c_str());
+            }
+            return false;
+        }
+        queued.push_back(make_pair(string(name), it->first));
+    }
+    pthread_mutex_lock(&queue_lock);
+    for (size_t i = 0; i < queued.size(); i++)
+    {
+        SCHEDULE.insert(make_pair(now, make_pair(queued[i].first, destination(queued[i].second))));
+        QUEUED++;
+    }
+    pthread_cond_signal(&scheduled);
+    pthread_mutex_unlock(&queue_lock);
+    return true;
+}
+
+/* Queue a message for a given server, for recipients it could not take now although the client was told the message was
+ * delivered. No Received: line is added, the message is sent on as it would have been. */
+bool relay_forward(const string &host, const string &port, const string &sender, const vector<string> &rcpts,
+                   const string &content)
+{
+    uint64_t now = now_ms();
+    entry_t entry = { now, now, 0, host, port, sender, rcpts, content };
+    char name[64];
+    snprintf(name, sizeof(name), "%013llx.%d.%u", (unsigned long long) now, (int) getpid(), COUNTER++);
+    if (!write_entry(name, entry))
+    {
+        return false;
+    }
+    route_t route;
+    route.host = host;
+    route.port = port;
+    pthread_mutex_lock(&queue_lock);
+    SCHEDULE.insert(make_pair(now, make_pair(string(name), destination(&route))));
+    QUEUED++;
+    pthread_cond_signal(&scheduled);
+    pthread_mutex_unlock(&queue_lock);
+    return true;
+}
+
+/* Stop starting messages, for a drain. The ones being sent are finished, relay_busy() tells when; the rest stay in the queue for
+ * the server that takes over. */
+void relay_stop()
+{
+    pthread_mutex_lock(&queue_lock);
+    STOPPING = true;
+    for (map<string, destination_t *>::iterator it = DESTINATIONS.begin(); it != DESTINATIONS.end(); it++)
+    {
+        pthread_cond_broadcast(&it->second->wake);
+    }
+    pthread_mutex_unlock(&queue_lock);
+}
+
+bool relay_busy()
+{
+    pthread_mutex_lock(&queue_lock);
+    bool busy = SENDING > 0;
+    pthread_mutex_unlock(&queue_lock);
+    return busy;
+}
+
+/* Messages in the queue, recipients that took a message, were deferred and refused it for good, sessions opened and reused */
+void relay_stats(unsigned long &queued, unsigned long &sent, unsigned long &deferred, unsigned long &bounced,
+                 unsigned long &sessions, unsigned long &reused)
+{
+    queued = QUEUED;
+    sent = SENT;
+    deferred = DEFERRED;
+    bounced = BOUNCED;
+    sessions = OPENED;
+    reused = REUSED;
+}
@@ -0,0 +1,830 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <atomic>
+#include <deque>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "repl.h"
+
+using namespace std;
+
+#define REPL_MAGIC "MBXREPL1"
+#define SEGMENT_SIZE (64 * 1024 * 1024) // a segment takes no more records once it is this large
+#define BATCH_SIZE (256 * 1024)         // log bytes read and sent at a time
+#define WINDOW (4 * 1024 * 1024)        // bytes sent and not acknowledged yet
+#define REPL_SYNC_TIMEOUT 5
+#define RETRY_MS 1000                   // between attempts to reach the standby
+#define POLL_MS 10                      // for records of the other server of the directory
+#define CHUNK_SIZE (16 * 1024 * 1024)   // payload of a record at most, larger appends and files are split
+#define MAX_RECORD (CHUNK_SIZE + 65536 + 64)
+
+enum record_type_t { R_APPEND, R_REPLACE, R_FILE, R_PART };
+
+/* Header of a log record. The name of the mailbox, relative to the directory, follows, then the appended bytes (base is their
+ * offset), the kept ranges of the old file as pairs of offset and length (base is the size of the old file), or a part of a new
+ * file (base is its offset in the file). The parts of a new file are followed by a record of the size of the old file as base and
+ * the size of the new one as payload, which replaces the mailbox. */
+struct record_t
+{
+    uint32_t size;      // of the whole record
+    uint16_t type;
+    uint16_t name_len;
+    uint64_t time;      // milliseconds since the epoch
+    uint64_t base;
+};
+
+static string DIR_PATH, LOG_PATH;
+static bool LOGGING = false, SHIPPING = false, SYNC = false;
+static string HOST, PORT;
+
+/* The segment records are written to, shared by the session threads */
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+static int SEG_FD = -1;
+static uint64_t SEG_START = 0;
+static thread_local uint64_t LAST = 0; // end of the last record of the thread
+static int wake_fd[2] = { -1, -1 };    // tells the shipper about new records of this process
+
+/* Progress of the standby */
+static pthread_mutex_t ack_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t acked = PTHREAD_COND_INITIALIZER;
+static atomic<uint64_t> ACKED(0), LOG_END(0), OLDEST(0), LAG(0);
+static atomic<unsigned long> TIMEOUTS(0);
+static uint64_t APPLIED = 0;
+static int APPLIED_FD = -1;
+
+static uint64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/* Helper function that moves a position forward, never back */
+static void raise_to(atomic<uint64_t> &value, uint64_t to)
+{
+    uint64_t cur = value;
+    while (cur < to && !value.compare_exchange_weak(cur, to))
+    {
+    }
+}
+
+static string segment_path(uint64_t start)
+{
+    char name[20];
+    snprintf(name, sizeof(name), "/%016llx", (unsigned long long) start);
+    return LOG_PATH + name;
+}
+
+/* Helper function that lists the starts of the log segments, in order */
+static vector<uint64_t> segments()
+{
+    vector<uint64_t> starts;
+    DIR *dir = opendir(LOG_PATH.c_str());
+    struct dirent *entry;
+    while (dir != NULL && (entry = readdir(dir)) != NULL)
+    {
+        char *end;
+        unsigned long long start = strtoull(entry->d_name, &end, 16);
+        if (strlen(entry->d_name) == 16 && *end == '\0')
+        {
+            starts.push_back(start);
+        }
+    }
+    if (dir != NULL)
+    {
+        closedir(dir);
+    }
+    sort(starts.begin(), starts.end());
+    return starts;
+}
+
+static bool write_all(int fd, const void *data, size_t len)
+{
+    const char *p = (const char *) data;
+    while (len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n <= 0)
+        {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool read_full(int fd, void *data, size_t len)
+{
+    char *p = (char *) data;
+    while (len > 0)
+    {
+        ssize_t n = read(fd, p, len);
+        if (n <= 0)
+        {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* Helper function that starts a record of a mailbox, the payload is appended by the caller */
+static string make_record(record_type_t type, const string &address, uint64_t base, size_t payload)
+{
+    string name = address.compare(0, DIR_PATH.size() + 1, DIR_PATH + "/") == 0 ?
+                  address.substr(DIR_PATH.size() + 1) : address;
+    record_t header = { (uint32_t)(sizeof(record_t) + name.size() + payload), (uint16_t) type,
+                        (uint16_t) name.size(), now_ms(), base
+                      };
+    string record((const char *) &header, sizeof(header));
+    record.reserve(header.size);
+    record += name;
+    return record;
+}
+
+/* Helper function that appends a record to the newest segment. The other server of the directory may be writing too, the flock
+ * of the segment orders them, and a full segment sends both on to the next one. */
+static void write_log(const string &record)
+{
+    pthread_mutex_lock(&write_lock);
+    struct stat st;
+    while (true)
+    {
+        if (SEG_FD < 0)
+        {
+            vector<uint64_t> starts = segments(); // the segment last used may be gone, the newest never is
+            if (!starts.empty() && starts.back() > SEG_START)
+            {
+                SEG_START = starts.back();
+            }
+            SEG_FD = open(segment_path(SEG_START).c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+            if (SEG_FD < 0)
+            {
+                pthread_mutex_unlock(&write_lock);
+                fprintf(stderr, "Cannot write replication log %s (%s)\n", segment_path(SEG_START).c_str(), strerror(errno));
+                return;
+            }
+        }
+        flock(SEG_FD, LOCK_EX);
+        fstat(SEG_FD, &st);
+        if (st.st_size < SEGMENT_SIZE)
+        {
+            break;
+        }
+        flock(SEG_FD, LOCK_UN);
+        close(SEG_FD);
+        SEG_FD = -1;
+        SEG_START += st.st_size;
+    }
+    bool res = write_all(SEG_FD, record.data(), record.size());
+    flock(SEG_FD, LOCK_UN);
+    uint64_t end = SEG_START + st.st_size + record.size();
+    pthread_mutex_unlock(&write_lock);
+    if (res)
+    {
+        LAST = end;
+        raise_to(LOG_END, end);
+        record_t header;
+        memcpy(&header, record.data(), sizeof(header));
+        uint64_t none = 0;
+        OLDEST.compare_exchange_strong(none, header.time); // the first record the standby is missing
+        if (SHIPPING)
+        {
+            char byte = 'w';
+            write(wake_fd[1], &byte, 1); // nonblocking, a full pipe already wakes the shipper
+        }
+    }
+}
+
+/* Record an append to a mailbox at offset, made under its lock. A large message goes in several records, of a chunk each. */
+void repl_appended(const string &address, uint64_t offset, const char *title, size_t title_len, const string &body)
+{
+    if (!LOGGING)
+    {
+        return;
+    }
+    size_t total = title_len + body.size();
+    for (size_t done = 0; done < total; done += CHUNK_SIZE)
+    {
+        size_t take = min(total - done, (size_t) CHUNK_SIZE);
+        size_t in_title = done < title_len ? min(take, title_len - done) : 0;
+        string record = make_record(R_APPEND, address, offset + done, take);
+        record.append(title + done, in_title);
+        if (take > in_title)
+        {
+            record.append(body, done + in_title - title_len, take - in_title);
+        }
+        write_log(record);
+    }
+}
+
+/* Record a rewrite of a mailbox of old_size bytes that kept the given ranges of it, made under its lock. Returns false if there are
+ * too many ranges for a record, the new file has to be recorded then. */
+bool repl_replaced(const string &address, uint64_t old_size, const vector<pair<uint64_t, uint64_t> > &ranges)
+{
+    if (!LOGGING)
+    {
+        return true;
+    }
+    if (ranges.size() * 16 > CHUNK_SIZE)
+    {
+        return false;
+    }
+    string record = make_record(R_REPLACE, address, old_size, ranges.size() * 16);
+    for (size_t i = 0; i < ranges.size(); i++)
+    {
+        record.append((const char *) &ranges[i].first, 8);
+        record.append((const char *) &ranges[i].second, 8);
+    }
+    write_log(record);
+    return true;
+}
+
+/* Record a rewrite of a mailbox of old_size bytes as the whole new file, for one that is not a plain run of messages. The file goes
+ * in parts of a chunk each. */
+void repl_rewritten(const string &address, uint64_t old_size, const string &file)
+{
+    if (!LOGGING)
+    {
+        return;
+    }
+    int fd = open(file.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        fprintf(stderr, "Cannot read %s for replication\n", file.c_str());
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return;
+    }
+    uint64_t size = st.st_size;
+    for (uint64_t done = 0; done < size; done += CHUNK_SIZE)
+    {
+        size_t take = min(size - done, (uint64_t) CHUNK_SIZE);
+        string record = make_record(R_PART, address, done, take);
+        size_t header = record.size();
+        record.resize(header + take);
+        if (!read_full(fd, &record[header], take))
+        {
+            fprintf(stderr, "Cannot read %s for replication\n", file.c_str());
+            close(fd);
+            return; // without the last record the parts are never used
+        }
+        write_log(record);
+    }
+    close(fd);
+    string record = make_record(R_FILE, address, old_size, 8);
+    record.append((const char *) &size, 8);
+    write_log(record);
+}
+
+/* Wait until the standby has every record of the calling thread, in sync mode. Returns false if it did not within the timeout. */
+bool repl_sync()
+{
+    if (!SYNC || LAST == 0)
+    {
+        return true;
+    }
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += REPL_SYNC_TIMEOUT;
+    pthread_mutex_lock(&ack_lock);
+    while (ACKED < LAST && pthread_cond_timedwait(&acked, &ack_lock, &deadline) != ETIMEDOUT)
+    {
+    }
+    bool res = ACKED >= LAST;
+    pthread_mutex_unlock(&ack_lock);
+    if (!res)
+    {
+        TIMEOUTS++;
+    }
+    return res;
+}
+
+/* On a primary, the log bytes the standby does not have yet and the age of the oldest record it is missing. On a
+ * standby, how old the last record applied was by then. */
+void repl_stats(uint64_t &behind, uint64_t &lag_ms, unsigned long &timeouts)
+{
+    uint64_t end = LOG_END, ack = ACKED, oldest = OLDEST;
+    behind = end > ack ? end - ack : 0;
+    lag_ms = SHIPPING ? (oldest && behind ? now_ms() - oldest : 0) : LAG.load();
+    timeouts = TIMEOUTS;
+}
+
+/* Reading end of the log */
+struct reader_t
+{
+    int fd;
+    uint64_t start;
+};
+
+/* Helper function that reads log bytes from a position, going on to the next segment after a full one. Returns 0 if there is
+ * nothing new, -1 if the position is no longer in the log. */
+static ssize_t read_log(reader_t &reader, uint64_t position, char *data, size_t len)
+{
+    if (reader.fd < 0)
+    {
+        vector<uint64_t> starts = segments();
+        int i = starts.size() - 1;
+        while (i >= 0 && starts[i] > position)
+        {
+            i--;
+        }
+        if (i < 0 || (reader.fd = open(segment_path(starts[i]).c_str(), O_RDONLY)) < 0)
+        {
+            return -1;
+        }
+        reader.start = starts[i];
+    }
+    ssize_t n = pread(reader.fd, data, len, position - reader.start);
+    struct stat st;
+    if (n == 0 && fstat(reader.fd, &st) == 0 && st.st_size >= SEGMENT_SIZE && reader.start + st.st_size == position)
+    {
+        vector<uint64_t> starts = segments();
+        if (binary_search(starts.begin(), starts.end(), position))
+        {
+            close(reader.fd);
+            reader.fd = -1; // the next read opens the segment after it
+        }
+    }
+    return n;
+}
+
+/* Helper function that connects to the standby and learns the position it needs next */
+static int connect_standby(uint64_t &position)
+{
+    struct addrinfo hints = { }, *addrs;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(HOST.c_str(), PORT.c_str(), &hints, &addrs) != 0)
+    {
+        return -1;
+    }
+    int fd = socket(addrs->ai_family, SOCK_STREAM, 0), one = 1;
+    if (fd >= 0 && (connect(fd, addrs->ai_addr, addrs->ai_addrlen) != 0 || !write_all(fd, REPL_MAGIC, 8)
+                    || !read_full(fd, &position, 8)))
+    {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addrs);
+    if (fd >= 0)
+    {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // batches are large, the last one should not wait
+    }
+    return fd;
+}
+
+/* Helper function that takes the acknowledgements the standby sent. Returns false once it closed the connection. */
+static bool read_acks(int fd, string &pending, deque<pair<uint64_t, uint64_t> > &unacked, reader_t &reader)
+{
+    char data[512];
+    ssize_t n = read(fd, data, sizeof(data));
+    if (n <= 0)
+    {
+        return false;
+    }
+    pending.append(data, n);
+    size_t whole = pending.size() / 8 * 8;
+    if (whole == 0)
+    {
+        return true;
+    }
+    uint64_t ack;
+    memcpy(&ack, pending.data() + whole - 8, 8); // positions only grow, the last one says it all
+    pending.erase(0, whole);
+    while (!unacked.empty() && unacked.front().first <= ack)
+    {
+        unacked.pop_front();
+    }
+    OLDEST = !unacked.empty() ? unacked.front().second : ack >= LOG_END ? 0 : OLDEST.load(); // unsent ones keep theirs
+    pthread_mutex_lock(&ack_lock);
+    ACKED = ack;
+    pthread_cond_broadcast(&acked);
+    pthread_mutex_unlock(&ack_lock);
+    vector<uint64_t> starts = segments();
+    for (size_t i = 0; i + 1 < starts.size() && starts[i + 1] <= ack && starts[i + 1] <= reader.start; i++)
+    {
+        unlink(segment_path(starts[i]).c_str()); // wholly acknowledged, and not the newest
+    }
+    return true;
+}
+
+/* Thread function that ships the log to the standby: batches of whole records, sent while fewer than WINDOW bytes wait for
+ * their acknowledgement */
+static void *shipper(void *arg)
+{
+    vector<char> batch(BATCH_SIZE);
+    while (true)
+    {
+        uint64_t position;
+        int fd = connect_standby(position);
+        if (fd < 0)
+        {
+            usleep(RETRY_MS * 1000);
+            continue;
+        }
+        reader_t reader = { -1, 0 };
+        if (read_log(reader, position, batch.data(), 0) < 0)
+        {
+            fprintf(stderr, "Replication: the standby needs position %llu, which is not in the log\n",
+                    (unsigned long long) position);
+            close(fd);
+            usleep(RETRY_MS * 10000);
+            continue;
+        }
+        pthread_mutex_lock(&ack_lock);
+        ACKED = position;
+        pthread_mutex_unlock(&ack_lock);
+        uint64_t sent = position;
+        deque<pair<uint64_t, uint64_t> > unacked; // end and time of the records sent
+        string pending;
+        bool connected = true;
+        while (connected)
+        {
+            ssize_t n = 0;
+            if (sent - ACKED < WINDOW)
+            {
+                n = read_log(reader, sent, batch.data(), batch.size());
+                if (n < 0)
+                {
+                    fprintf(stderr, "Replication: position %llu is no longer in the log\n", (unsigned long long) sent);
+                    break;
+                }
+                size_t whole = 0;
+                record_t header;
+                while ((size_t) n - whole >= sizeof(header))
+                {
+                    memcpy(&header, batch.data() + whole, sizeof(header));
+                    if (header.size > (size_t) n - whole)
+                    {
+                        break;
+                    }
+                    whole += header.size;
+                    unacked.push_back(make_pair(sent + whole, header.time));
+                }
+                if (whole == 0 && n >= (ssize_t) sizeof(header) && header.size > batch.size())
+                {
+                    batch.resize(header.size); // a record larger than a batch goes alone
+                    continue;
+                }
+                n = whole;
+                if (n > 0 && !write_all(fd, batch.data(), n))
+                {
+                    break;
+                }
+                sent += n;
+                raise_to(LOG_END, sent); // includes records of the other server
+                if (OLDEST == 0 && !unacked.empty())
+                {
+                    OLDEST = unacked.front().second;
+                }
+            }
+            struct pollfd fds[2] = { { fd, POLLIN, 0 }, { wake_fd[0], POLLIN, 0 } };
+            if (poll(fds, 2, n > 0 ? 0 : POLL_MS) > 0)
+            {
+                if (fds[1].revents & POLLIN)
+                {
+                    char bytes[64];
+                    read(wake_fd[0], bytes, sizeof(bytes));
+                }
+                if (fds[0].revents)
+                {
+                    connected = read_acks(fd, pending, unacked, reader);
+                }
+            }
+        }
+        fprintf(stderr, "Replication: standby disconnected at position %llu\n", (unsigned long long) ACKED.load());
+        close(fd);
+        if (reader.fd >= 0)
+        {
+            close(reader.fd);
+        }
+    }
+    return NULL;
+}
+
+/* Record in this directory, and ship the log if spec names a standby, "host:port" or "host:port,sync". "log" only records. */
+bool repl_start(const string &dir, const char *spec)
+{
+    string target = spec;
+    if (target != "log")
+    {
+        size_t comma = target.find(',');
+        if (comma != string::npos)
+        {
+            if (target.substr(comma + 1) != "sync")
+            {
+                return false;
+            }
+            SYNC = true;
+            target.erase(comma);
+        }
+        size_t colon = target.rfind(':');
+        if (colon == string::npos || colon == 0 || atoi(target.c_str() + colon + 1) <= 0)
+        {
+            return false;
+        }
+        HOST = target.substr(0, colon);
+        PORT = target.substr(colon + 1);
+        SHIPPING = true;
+    }
+    DIR_PATH = dir;
+    LOG_PATH = dir + "/" REPL_DIR;
+    if (mkdir(LOG_PATH.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        return false;
+    }
+    vector<uint64_t> starts = segments();
+    int fd = open(segment_path(starts.empty() ? 0 : starts.back()).c_str(), O_WRONLY | O_CREAT, 0644); // the log starts out empty
+    if (fd < 0)
+    {
+        return false;
+    }
+    close(fd);
+    LOGGING = true;
+    if (SHIPPING)
+    {
+        if (pipe2(wake_fd, O_NONBLOCK | O_CLOEXEC) != 0)
+        {
+            return false;
+        }
+        pthread_t thread;
+        pthread_create(&thread, NULL, &shipper, NULL);
+        pthread_detach(thread);
+    }
+    return true;
+}
+
+/* Helper function that makes the directories of a mailbox path that do not exist yet */
+static void make_parents(const string &path)
+{
+    for (size_t slash = path.find('/', DIR_PATH.size() + 1); slash != string::npos; slash = path.find('/', slash + 1))
+    {
+        mkdir(path.substr(0, slash).c_str(), 0755);
+    }
+}
+
+/* Helper function that checks the header of a record from the network before the rest is read: its size holds the header and the
+ * name and is not larger than a record can be */
+static bool valid_header(const record_t &header)
+{
+    return header.size >= sizeof(record_t) + header.name_len && header.size <= MAX_RECORD && header.type <= R_PART;
+}
+
+/* Helper function that checks a whole record from the network: the name is a mailbox file in the directory, not a file outside of
+ * it or one of another kind, and the payload fits the type */
+static bool valid_record(const char *data)
+{
+    record_t header;
+    memcpy(&header, data, sizeof(header));
+    string name(data + sizeof(header), header.name_len);
+    size_t len = header.size - sizeof(header) - header.name_len;
+    if (name.empty() || name[0] == '/' || name.find('\0') != string::npos || ("/" + name + "/").find("/../") != string::npos
+            || name.size() < 5 || name.compare(name.size() - 5, 5, ".mbox") != 0)
+    {
+        return false;
+    }
+    return (header.type != R_REPLACE || len % 16 == 0) && (header.type != R_FILE || len == 8);
+}
+
+/* Helper function that applies a record to the mailbox files of the standby. The records of a mailbox come in the order they
+ * were made, and one applied again after a restart finds its bytes already there. The parts of a new file are put together
+ * next to the mailbox. */
+static void apply(const char *data)
+{
+    record_t header;
+    memcpy(&header, data, sizeof(header));
+    string path = DIR_PATH + "/" + string(data + sizeof(header), header.name_len), temp = path + ".repl";
+    const char *payload = data + sizeof(header) + header.name_len;
+    size_t len = header.size - sizeof(header) - header.name_len;
+    if (header.type == R_PART)
+    {
+        int out = open(temp.c_str(), O_WRONLY | O_CREAT | (header.base == 0 ? O_TRUNC : 0), 0644);
+        if (out < 0)
+        {
+            make_parents(temp);
+            out = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        }
+        if (out < 0 || pwrite(out, payload, len, header.base) != (ssize_t) len)
+        {
+            fprintf(stderr, "Replication: cannot write %s (%s)\n", temp.c_str(), strerror(errno));
+        }
+        if (out >= 0)
+        {
+            close(out);
+        }
+        return;
+    }
+    int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        make_parents(path);
+        fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    }
+    if (fd < 0)
+    {
+        fprintf(stderr, "Replication: cannot open %s (%s)\n", path.c_str(), strerror(errno));
+        return;
+    }
+    flock(fd, LOCK_EX); // against a POP3 server of the standby rewriting it
+    struct stat st;
+    fstat(fd, &st);
+    if (header.type == R_APPEND)
+    {
+        if ((uint64_t) st.st_size < header.base)
+        {
+            fprintf(stderr, "Replication: %s has %lld bytes, a record appends at %llu\n", path.c_str(),
+                    (long long) st.st_size, (unsigned long long) header.base);
+        }
+        else if (pwrite(fd, payload, len, header.base) != (ssize_t) len)
+        {
+            fprintf(stderr, "Replication: cannot write %s (%s)\n", path.c_str(), strerror(errno));
+        }
+    }
+    else if ((uint64_t) st.st_size == header.base) // otherwise the rewrite was applied before
+    {
+        uint64_t size = 0;
+        if (header.type == R_FILE)
+        {
+            memcpy(&size, payload, 8);
+        }
+        int out = open(temp.c_str(), O_WRONLY | O_CREAT | (header.type == R_REPLACE || size == 0 ? O_TRUNC : 0), 0644);
+        struct stat parts;
+        bool res = out >= 0 && (header.type == R_REPLACE || (fstat(out, &parts) == 0 && (uint64_t) parts.st_size == size));
+        for (size_t i = 0; res && header.type == R_REPLACE && i + 16 <= len; i += 16)
+        {
+            uint64_t range[2];
+            memcpy(range, payload + i, 16);
+            loff_t offset = range[0];
+            while (res && range[1] > 0)
+            {
+                ssize_t n = copy_file_range(fd, &offset, out, NULL, range[1], 0);
+                res = n > 0;
+                range[1] -= res ? n : 0;
+            }
+        }
+        if (out >= 0)
+        {
+            close(out);
+        }
+        if (!res || rename(temp.c_str(), path.c_str()) != 0)
+        {
+            fprintf(stderr, "Replication: cannot rewrite %s\n", path.c_str());
+            unlink(temp.c_str());
+        }
+    }
+    else if (header.type == R_FILE)
+    {
+        unlink(temp.c_str()); // parts of a rewrite applied before
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
+/* Thread function that applies what a primary ships. A new connection replaces the one before, it comes from a primary that
+ * restarted. */
+static void *receiver(void *arg)
+{
+    int listen_fd = (intptr_t) arg, fd = -1;
+    vector<char> data(BATCH_SIZE);
+    string buffer;
+    while (true)
+    {
+        struct pollfd fds[2] = { { listen_fd, POLLIN, 0 }, { fd, POLLIN, 0 } };
+        if (poll(fds, fd >= 0 ? 2 : 1, -1) <= 0)
+        {
+            continue;
+        }
+        if (fds[0].revents & POLLIN)
+        {
+            int next = accept(listen_fd, NULL, NULL);
+            char magic[8];
+            if (next >= 0 && (!read_full(next, magic, 8) || memcmp(magic, REPL_MAGIC, 8) != 0
+                              || !write_all(next, &APPLIED, 8)))
+            {
+                close(next);
+                next = -1;
+            }
+            if (next >= 0)
+            {
+                if (fd >= 0)
+                {
+                    close(fd);
+                }
+                fd = next;
+                buffer.clear();
+            }
+            continue;
+        }
+        ssize_t n = read(fd, data.data(), data.size());
+        if (n <= 0)
+        {
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        buffer.append(data.data(), n);
+        size_t used = 0;
+        record_t header;
+        bool valid = true;
+        while (buffer.size() - used >= sizeof(header))
+        {
+            memcpy(&header, buffer.data() + used, sizeof(header));
+            if (!(valid = valid_header(header)) || buffer.size() - used < header.size)
+            {
+                break;
+            }
+            if (!(valid = valid_record(buffer.data() + used)))
+            {
+                break;
+            }
+            apply(buffer.data() + used);
+            used += header.size;
+            uint64_t now = now_ms();
+            LAG = now > header.time ? now - header.time : 0;
+        }
+        if (used > 0)
+        {
+            buffer.erase(0, used);
+            APPLIED += used;
+            pwrite(APPLIED_FD, &APPLIED, 8, 0);
+            write_all(fd, &APPLIED, 8);
+        }
+        if (!valid)
+        {
+            fprintf(stderr, "Replication: invalid record at position %llu, connection dropped\n", (unsigned long long) APPLIED);
+            close(fd);
+            fd = -1;
+        }
+    }
+    return NULL;
+}
+
+/* Take the records of a primary on "port" or "address:port" and apply them to this directory. Without an address only a primary
+ * on this host can connect. */
+bool repl_follow(const string &dir, const char *spec)
+{
+    string target = spec, address = "127.0.0.1";
+    size_t colon = target.rfind(':');
+    if (colon != string::npos)
+    {
+        address = target.substr(0, colon);
+        target.erase(0, colon + 1);
+    }
+    int port = atoi(target.c_str());
+    struct sockaddr_in addr = { };
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (port <= 0 || inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1)
+    {
+        return false;
+    }
+    DIR_PATH = dir;
+    LOG_PATH = dir + "/" REPL_DIR;
+    if (mkdir(LOG_PATH.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        return false;
+    }
+    APPLIED_FD = open((LOG_PATH + "/applied").c_str(), O_RDWR | O_CREAT, 0644);
+    if (APPLIED_FD < 0)
+    {
+        return false;
+    }
+    if (pread(APPLIED_FD, &APPLIED, 8, 0) != 8)
+    {
+        APPLIED = 0;
+    }
+    int listen_fd = socket(PF_INET, SOCK_STREAM, 0), reuse = 1;
+    if (listen_fd < 0 || setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0
+            || bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(listen_fd, 4) != 0)
+    {
+        return false;
+    }
+    pthread_t thread;
+    pthread_create(&thread, NULL, &receiver, (void *)(intptr_t) listen_fd);
+    pthread_detach(thread);
+    return true;
+}
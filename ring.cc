@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include "ring.h"
+
+using namespace std;
+
+#define POINTS_PER_WEIGHT 128
+
+/* FNV-1a, then the finalizer of MurmurHash3 so that names differing in one letter land far apart */
+uint64_t ring_hash(const char *data, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash = (hash ^ (unsigned char) data[i]) * 0x100000001b3ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+Ring::Ring(const vector<Node> &nodes) : nodes(nodes)
+{
+    for (int i = 0; i < (int) nodes.size(); i++)
+    {
+        for (int j = 0; j < POINTS_PER_WEIGHT * nodes[i].weight; j++)
+        {
+            string point = nodes[i].name + "#" + to_string(j);
+            points.push_back(make_pair(ring_hash(point.data(), point.size()), i));
+        }
+    }
+    sort(points.begin(), points.end());
+}
+
+/* Helper function that finds the node of the first point at or after a hash, the first point of all past the last one */
+int Ring::owner(uint64_t hash) const
+{
+    vector<pair<uint64_t, int> >::const_iterator it =
+        lower_bound(points.begin(), points.end(), make_pair(hash, -1));
+    return it == points.end() ? points[0].second : it->second;
+}
+
+/* The node that holds a mailbox, NULL if the ring is empty */
+const Node *Ring::lookup(const string &key) const
+{
+    if (points.empty())
+    {
+        return NULL;
+    }
+    return &nodes[owner(ring_hash(key.data(), key.size()))];
+}
+
+/* Share of the mailboxes that belong to another node in other, by name. Between two neighbouring points of either ring both
+ * rings keep one owner, so comparing the owners of those arcs is exact. */
+double Ring::moved(const Ring &other) const
+{
+    if (points.empty() || other.points.empty())
+    {
+        return 1.0;
+    }
+    vector<uint64_t> bounds;
+    for (size_t i = 0; i < points.size(); i++)
+    {
+        bounds.push_back(points[i].first);
+    }
+    for (size_t i = 0; i < other.points.size(); i++)
+    {
+        bounds.push_back(other.points[i].first);
+    }
+    sort(bounds.begin(), bounds.end());
+    double moved = 0;
+    for (size_t i = 0; i < bounds.size(); i++)
+    {
+        uint64_t end = bounds[i], start = bounds[i == 0 ? bounds.size() - 1 : i - 1];
+        if (nodes[owner(end)].name != other.nodes[other.owner(end)].name)
+        {
+            moved += (double)(uint64_t)(end - start); // the first arc wraps around from the last bound
+        }
+    }
+    return moved / 18446744073709551616.0;
+}
+
+/* Read the nodes of a cluster, returns false if the file cannot be read or a line is malformed */
+bool ring_load(const string &path, vector<Node> &nodes)
+{
+    ifstream in(path.c_str());
+    if (!in)
+    {
+        return false;
+    }
+    nodes.clear();
+    string line;
+    while (getline(in, line))
+    {
+        istringstream fields(line);
+        Node node;
+        if (!(fields >> node.name) || node.name[0] == '#')
+        {
+            continue;
+        }
+        if (!(fields >> node.host >> node.smtp_port >> node.pop3_port))
+        {
+            fprintf(stderr, "Invalid node: %s\n", line.c_str());
+            return false;
+        }
+        if (!(fields >> node.weight))
+        {
+            node.weight = 1;
+        }
+        if (node.weight <= 0)
+        {
+            fprintf(stderr, "Invalid node weight: %s\n", line.c_str());
+            return false;
+        }
+        nodes.push_back(node);
+    }
+    return true;
+}
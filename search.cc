@@ -0,0 +1,575 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+
+#include "search.h"
+
+using namespace std;
+
+#define MAGIC "MBXSRCH1"
+#define MIN_TERM 2
+#define MAX_TERM 32
+#define ENCODED_LINE 60
+#define MAX_MERGE 16384 // messages, the last segments are not merged beyond this
+
+/* The start of an index file */
+struct header_t
+{
+    char magic[8];
+    uint64_t file_ino;
+    uint64_t file_size;
+    uint64_t messages;
+    uint64_t end; // bytes of the index in use
+};
+
+/* The start of a segment, followed by its term table, the terms and the postings. Offsets are from the start of the segment. */
+struct segment_t
+{
+    uint32_t size; // of the whole segment, a multiple of 8
+    uint32_t terms;
+    uint32_t first; // messages [first, first + count)
+    uint32_t count;
+};
+
+struct entry_t
+{
+    uint32_t term;
+    uint32_t postings;
+    uint32_t length; // bytes of the postings
+    uint16_t term_len;
+    uint16_t pad;
+};
+
+typedef map<string, vector<uint32_t> > postings_t;
+
+static const char *const FIELDS[] = { "from", "to", "cc", "subject" };
+
+/* Helper function that adds the terms of a range of text, with a prefix */
+static void add_terms(const char *p, const char *end, const string &prefix, set<string> &terms)
+{
+    while (p < end)
+    {
+        while (p < end && !isalnum((unsigned char) *p))
+        {
+            p++;
+        }
+        const char *start = p;
+        while (p < end && isalnum((unsigned char) *p))
+        {
+            p++;
+        }
+        if (p - start >= MIN_TERM && p - start <= MAX_TERM)
+        {
+            string term = prefix;
+            for (const char *c = start; c < p; c++)
+            {
+                term += tolower((unsigned char) *c);
+            }
+            terms.insert(term);
+        }
+    }
+}
+
+/* Find the terms of a message, sorted and without duplicates */
+void search_terms(const char *content, size_t len, vector<string> &terms)
+{
+    set<string> found;
+    const char *end = content + len;
+    bool header = true;
+    string field; // prefix of the header field being read, empty if it is not indexed
+    for (const char *line = content; line < end;)
+    {
+        const char *eol = (const char *) memchr(line, '\n', end - line);
+        const char *next = eol ? eol + 1 : end;
+        const char *stop = eol && eol > line && eol[-1] == '\r' ? eol - 1 : (eol ? eol : end);
+        if (header && stop == line)
+        {
+            header = false; // the body starts after the first empty line
+        }
+        else if (header)
+        {
+            if (*line != ' ' && *line != '\t')
+            {
+                const char *colon = (const char *) memchr(line, ':', stop - line);
+                string name;
+                for (const char *c = line; colon && c < colon; c++)
+                {
+                    name += tolower((unsigned char) *c);
+                }
+                field.clear();
+                for (int i = 0; i < sizeof(FIELDS) / sizeof(FIELDS[0]); i++)
+                {
+                    if (name == FIELDS[i])
+                    {
+                        field = name + ":";
+                    }
+                }
+            }
+            if (!field.empty())
+            {
+                add_terms(line, stop, field, found);
+            }
+        }
+        if (stop - line < ENCODED_LINE || memchr(line, ' ', stop - line) != NULL)
+        {
+            add_terms(line, stop, "", found);
+        }
+        line = next;
+    }
+    terms.assign(found.begin(), found.end());
+}
+
+/* Turn the words of a search command into terms. A word may be "field:word" for a word of that header field. */
+void search_parse(const char *query, vector<string> &terms)
+{
+    set<string> found;
+    const char *end = query + strlen(query);
+    while (query < end)
+    {
+        while (query < end && isspace((unsigned char) *query))
+        {
+            query++;
+        }
+        const char *start = query;
+        while (query < end && !isspace((unsigned char) *query))
+        {
+            query++;
+        }
+        const char *colon = (const char *) memchr(start, ':', query - start);
+        string prefix;
+        for (int i = 0; colon && i < sizeof(FIELDS) / sizeof(FIELDS[0]); i++)
+        {
+            if (colon - start == strlen(FIELDS[i]) && strncasecmp(start, FIELDS[i], colon - start) == 0)
+            {
+                prefix = string(FIELDS[i]) + ":";
+                start = colon + 1;
+            }
+        }
+        add_terms(start, query, prefix, found);
+    }
+    terms.assign(found.begin(), found.end());
+}
+
+/* Helper function that appends a number as a varint */
+static void put_varint(string &out, uint32_t value)
+{
+    while (value >= 0x80)
+    {
+        out += (char)(value | 0x80);
+        value >>= 7;
+    }
+    out += (char) value;
+}
+
+/* Helper function that reads the postings of an entry, returns false if they run past the segment */
+static bool get_postings(const char *seg, const entry_t &entry, vector<uint32_t> &out)
+{
+    const segment_t *head = (const segment_t *) seg;
+    if ((uint64_t) entry.postings + entry.length > head->size)
+    {
+        return false;
+    }
+    const unsigned char *p = (const unsigned char *) seg + entry.postings, *end = p + entry.length;
+    uint32_t value = 0;
+    while (p < end)
+    {
+        uint32_t delta = 0;
+        for (int shift = 0; p < end; shift += 7)
+        {
+            delta |= (uint32_t)(*p & 0x7f) << shift;
+            if (!(*p++ & 0x80))
+            {
+                break;
+            }
+        }
+        value += delta;
+        out.push_back(value);
+    }
+    return true;
+}
+
+/* Helper function that builds a segment for messages [first, first + count) */
+static string encode(const postings_t &postings, uint32_t first, uint32_t count)
+{
+    vector<entry_t> entries;
+    string names, lists;
+    for (postings_t::const_iterator it = postings.begin(); it != postings.end(); it++)
+    {
+        entry_t entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.term = names.size();
+        entry.term_len = it->first.size();
+        entry.postings = lists.size();
+        names += it->first;
+        uint32_t prev = 0;
+        for (int i = 0; i < it->second.size(); i++)
+        {
+            put_varint(lists, it->second[i] - prev);
+            prev = it->second[i];
+        }
+        entry.length = lists.size() - entry.postings;
+        entries.push_back(entry);
+    }
+    uint32_t table = sizeof(segment_t) + entries.size() * sizeof(entry_t);
+    for (int i = 0; i < entries.size(); i++)
+    {
+        entries[i].term += table;
+        entries[i].postings += table + names.size();
+    }
+    segment_t head;
+    head.size = (table + names.size() + lists.size() + 7) & ~7u;
+    head.terms = entries.size();
+    head.first = first;
+    head.count = count;
+    string seg((const char *) &head, sizeof(head));
+    seg.append((const char *) entries.data(), entries.size() * sizeof(entry_t));
+    seg += names;
+    seg += lists;
+    seg.resize(head.size, '\0');
+    return seg;
+}
+
+/* Helper function that checks that the term table of a segment fits in it */
+static bool valid_table(const char *seg)
+{
+    const segment_t *head = (const segment_t *) seg;
+    return sizeof(segment_t) + (uint64_t) head->terms * sizeof(entry_t) <= head->size;
+}
+
+/* Helper function that reads the term of an entry, returns false if it runs past the segment */
+static bool get_term(const char *seg, const entry_t &entry, string &term)
+{
+    const segment_t *head = (const segment_t *) seg;
+    if ((uint64_t) entry.term + entry.term_len > head->size)
+    {
+        return false;
+    }
+    term.assign(seg + entry.term, entry.term_len);
+    return true;
+}
+
+/* Helper function that adds the postings of a segment to a map, after those already there. Returns false if the segment is damaged. */
+static bool decode(const char *seg, postings_t &postings)
+{
+    const segment_t *head = (const segment_t *) seg;
+    const entry_t *entries = (const entry_t *)(seg + sizeof(segment_t));
+    if (!valid_table(seg))
+    {
+        return false;
+    }
+    string term;
+    for (uint32_t i = 0; i < head->terms; i++)
+    {
+        if (!get_term(seg, entries[i], term) || !get_postings(seg, entries[i], postings[term]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Helper function that finds the segments of an index in memory, returns false if they do not add up to its end */
+static bool walk(const char *data, const header_t &header, vector<uint64_t> &segments)
+{
+    uint64_t offset = sizeof(header_t);
+    while (offset + sizeof(segment_t) <= header.end)
+    {
+        const segment_t *seg = (const segment_t *)(data + offset);
+        if (seg->size < sizeof(segment_t) || offset + seg->size > header.end)
+        {
+            return false;
+        }
+        segments.push_back(offset);
+        offset += seg->size;
+    }
+    return offset == header.end;
+}
+
+/* Helper function that maps an index file and checks its header, returns NULL if it is not one */
+static const char *map_index(int fd, header_t &header, size_t &map_len)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < sizeof(header_t)
+            || pread(fd, &header, sizeof(header), 0) != sizeof(header)
+            || memcmp(header.magic, MAGIC, sizeof(header.magic)) != 0 || header.end > (uint64_t) st.st_size)
+    {
+        return NULL;
+    }
+    map_len = header.end;
+    void *map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, 0);
+    return map == MAP_FAILED ? NULL : (const char *) map;
+}
+
+/* Helper function that writes an index of a mailbox file with one segment, replacing the old one */
+static void write_index(const string &address, const string &file, const postings_t &postings, uint32_t messages)
+{
+    struct stat st;
+    if (stat(file.c_str(), &st) != 0)
+    {
+        return;
+    }
+    string seg = encode(postings, 0, messages);
+    header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MAGIC, sizeof(header.magic));
+    header.file_ino = st.st_ino;
+    header.file_size = st.st_size;
+    header.messages = messages;
+    header.end = sizeof(header) + seg.size();
+    string temp = address + SEARCH_SUFFIX ".tmp", path = address + SEARCH_SUFFIX;
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return;
+    }
+    bool res = write(fd, &header, sizeof(header)) == sizeof(header)
+               && write(fd, seg.data(), seg.size()) == (ssize_t) seg.size();
+    close(fd);
+    if (!res || rename(temp.c_str(), path.c_str()) != 0)
+    {
+        unlink(temp.c_str());
+    }
+}
+
+/* Add a message of bytes, just appended to a mailbox, to its index. fd is the mailbox file, locked by the caller.
+ * The terms of the content are found on first use and kept, for the next recipient. */
+void search_appended(const string &address, int fd, uint64_t bytes, const string &content, vector<string> &terms)
+{
+    int index_fd = open((address + SEARCH_SUFFIX).c_str(), O_RDWR);
+    if (index_fd < 0)
+    {
+        return;
+    }
+    flock(index_fd, LOCK_EX);
+    struct stat st;
+    header_t header;
+    size_t map_len = 0;
+    const char *data = fstat(fd, &st) == 0 ? map_index(index_fd, header, map_len) : NULL;
+    vector<uint64_t> segments;
+    if (data != NULL && header.file_ino == (uint64_t) st.st_ino && header.file_size + bytes == (uint64_t) st.st_size
+            && walk(data, header, segments))
+    {
+        if (terms.empty())
+        {
+            search_terms(content.data(), content.size(), terms);
+        }
+        postings_t postings;
+        for (int i = 0; i < terms.size(); i++)
+        {
+            postings[terms[i]].push_back(header.messages);
+        }
+
+        /* Merge the last segments while they are no larger than the new one, like a binary counter */
+        uint32_t first = header.messages, count = 1;
+        uint64_t cut = header.end;
+        bool ok = true;
+        while (ok && !segments.empty())
+        {
+            const segment_t *last = (const segment_t *)(data + segments.back());
+            if (last->count > count || last->count + count > MAX_MERGE)
+            {
+                break;
+            }
+            postings_t older;
+            ok = decode(data + segments.back(), older);
+            for (postings_t::iterator it = postings.begin(); it != postings.end(); it++)
+            {
+                vector<uint32_t> &list = older[it->first];
+                list.insert(list.end(), it->second.begin(), it->second.end());
+            }
+            postings.swap(older);
+            first = last->first;
+            count += last->count;
+            cut = segments.back();
+            segments.pop_back();
+        }
+        /* The old header is made stale before the segment is written over, so an index cut short by a crash is
+         * rebuilt rather than read with segments that do not match its header */
+        string seg = encode(postings, first, count);
+        header_t stale = header;
+        stale.file_ino = 0;
+        if (ok && pwrite(index_fd, &stale, sizeof(stale), 0) == sizeof(stale)
+                && pwrite(index_fd, seg.data(), seg.size(), cut) == (ssize_t) seg.size())
+        {
+            header.messages++;
+            header.file_size = st.st_size;
+            header.end = cut + seg.size();
+            pwrite(index_fd, &header, sizeof(header), 0);
+            ftruncate(index_fd, header.end);
+        }
+    }
+    if (data != NULL)
+    {
+        munmap((void *) data, map_len);
+    }
+    flock(index_fd, LOCK_UN);
+    close(index_fd);
+}
+
+/* Find the messages among the first of a mailbox file that have all the terms of a query.
+ * Returns false if the index is missing or does not cover those messages of that file. */
+bool search_lookup(const string &address, uint64_t file_ino, uint32_t messages,
+                   const vector<string> &query, vector<uint32_t> &hits)
+{
+    int fd = open((address + SEARCH_SUFFIX).c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    flock(fd, LOCK_SH); // held off while a delivery rewrites the last segments
+    header_t header;
+    size_t map_len = 0;
+    const char *data = map_index(fd, header, map_len);
+    vector<uint64_t> segments;
+    bool res = data != NULL && header.file_ino == file_ino && header.messages >= messages && walk(data, header, segments);
+    for (int s = 0; res && s < segments.size(); s++)
+    {
+        const char *seg = data + segments[s];
+        const segment_t *head = (const segment_t *) seg;
+        const entry_t *entries = (const entry_t *)(seg + sizeof(segment_t));
+        if (head->first >= messages)
+        {
+            break;
+        }
+        if (!valid_table(seg))
+        {
+            res = false;
+            break;
+        }
+        vector<uint32_t> found;
+        string term;
+        for (int q = 0; q < query.size(); q++)
+        {
+            /* Binary search of the term table */
+            uint32_t low = 0, high = head->terms;
+            while (low < high)
+            {
+                uint32_t mid = low + (high - low) / 2;
+                if (!get_term(seg, entries[mid], term))
+                {
+                    res = false;
+                    break;
+                }
+                if (term < query[q])
+                {
+                    low = mid + 1;
+                }
+                else
+                {
+                    high = mid;
+                }
+            }
+            vector<uint32_t> list;
+            if (!res || low == head->terms || !get_term(seg, entries[low], term) || term != query[q])
+            {
+                found.clear();
+                break;
+            }
+            res = get_postings(seg, entries[low], list);
+            if (q == 0)
+            {
+                found.swap(list);
+            }
+            else
+            {
+                vector<uint32_t> both;
+                set_intersection(found.begin(), found.end(), list.begin(), list.end(), back_inserter(both));
+                found.swap(both);
+            }
+            if (found.empty())
+            {
+                break;
+            }
+        }
+        for (int i = 0; i < found.size() && found[i] < messages; i++)
+        {
+            hits.push_back(found[i]);
+        }
+    }
+    if (data != NULL)
+    {
+        munmap((void *) data, map_len);
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+    return res;
+}
+
+/* Write the index of a mailbox from the terms of each of its messages. file is the mailbox file, locked by the caller. */
+void search_write(const string &address, const string &file, const vector<vector<string> > &terms)
+{
+    postings_t postings;
+    for (uint32_t i = 0; i < terms.size(); i++)
+    {
+        for (int k = 0; k < terms[i].size(); k++)
+        {
+            postings[terms[i][k]].push_back(i);
+        }
+    }
+    write_index(address, file, postings, terms.size());
+}
+
+/* Renumber the index of a mailbox whose messages at keep are moved to file, which replaces it. The caller holds the mailbox lock.
+ * An index that does not cover all the messages of the old file is removed, the next search builds it. */
+void search_remap(const string &address, const string &file, uint64_t file_ino, uint32_t messages, const vector<int> &keep)
+{
+    string path = address + SEARCH_SUFFIX;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return;
+    }
+    header_t header;
+    size_t map_len = 0;
+    const char *data = map_index(fd, header, map_len);
+    vector<uint64_t> segments;
+    postings_t postings;
+    bool res = data != NULL && header.file_ino == file_ino && header.messages == messages && walk(data, header, segments);
+    for (int s = 0; res && s < segments.size(); s++)
+    {
+        res = decode(data + segments[s], postings);
+    }
+    if (data != NULL)
+    {
+        munmap((void *) data, map_len);
+    }
+    close(fd);
+    if (!res)
+    {
+        unlink(path.c_str());
+        return;
+    }
+    vector<int> moved(messages, -1);
+    for (int k = 0; k < keep.size(); k++)
+    {
+        moved[keep[k]] = k;
+    }
+    postings_t kept;
+    for (postings_t::iterator it = postings.begin(); it != postings.end(); it++)
+    {
+        vector<uint32_t> list;
+        for (int i = 0; i < it->second.size(); i++)
+        {
+            if (it->second[i] < messages && moved[it->second[i]] >= 0)
+            {
+                list.push_back(moved[it->second[i]]);
+            }
+        }
+        if (!list.empty())
+        {
+            kept[it->first].swap(list);
+        }
+    }
+    write_index(address, file, kept, keep.size());
+}
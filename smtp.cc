@@ -1,6 +1,10 @@
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <stdio.h>
@@ -16,7 +20,23 @@
 #include <vector>
 #include <unordered_set>
 #include <pthread.h>
-#include <dirent.h>
+#include <atomic>
+
+#include "registry.h"
+#include "arena.h"
+#include "command.h"
+#include "timer.h"
+#include "handoff.h"
+#include "metrics.h"
+#include "log.h"
+#include "limiter.h"
+#include "quota.h"
+#include "store.h"
+#include "search.h"
+#include "tls.h"
+#include "repl.h"
+#include "relay.h"
+#include "probes.h"
 
 using namespace std;
 
@@ -24,6 +44,9 @@ using namespace std;
 const char *READY = "220 localhost Service ready\r\n";
 const char *CLOSE = "221 localhost Service closing transmission channel\r\n";
 const char *HELO = "250 localhost\r\n";
+const char *EHLO = "250-localhost\r\n250 PIPELINING\r\n";
+const char *EHLO_TLS = "250-localhost\r\n250-PIPELINING\r\n250 STARTTLS\r\n";
+const char *TLS_READY = "220 Ready to start TLS\r\n";
 const char *OK = "250 OK\r\n";
 const char *START = "354 Start mail input; end with <CRLF>.<CRLF>\r\n";
 const char *SERV_UNAVAIL =
@@ -34,15 +57,59 @@ const char *SEQ_ERR = "503 Bad sequence of commands\r\n";
 const char *MAIL_UNAVAIL =
     "550 Requested action not taken: mailbox unavailable\r\n";
 const char *OVER_SIZE = "552 Too much mail data\r\n";
+const char *OVER_QUOTA = "552 Requested mail action aborted: exceeded storage allocation\r\n";
+const char *TIMEOUT = "421 localhost Timeout, closing transmission channel\r\n";
+const char *TOO_MANY = "421 localhost Too many connections, try again later\r\n";
+const char *RATE_LIMITED = "451 Requested action aborted: rate limit exceeded\r\n";
+const char *LOCAL_ERR = "451 Requested action aborted: local error in processing\r\n";
+const char *MAIL_LOOP = "554 Transaction failed: mail loop detected\r\n";
+const char *TLS_UNAVAIL = "454 TLS not available due to temporary reason\r\n";
+const char *TLS_ACTIVE = "503 TLS already active\r\n";
+
+/* Timeouts in seconds (RFC 5321 4.5.3.2): waiting for a command, for each line of the message, and for the whole message */
+#define DATA_BLOCK_TIMEOUT 180
+#define DATA_TIMEOUT 600
+#define TLS_TIMEOUT 60 // for the handshake after STARTTLS
+
+/* Commands, found with a perfect hash of the verb */
+enum command_t { CMD_HELO, CMD_EHLO, CMD_MAIL, CMD_RCPT, CMD_DATA, CMD_RSET, CMD_NOOP, CMD_QUIT, CMD_STARTTLS,
+                 CMD_UNKNOWN, CMD_REJECTED
+               };
+const char *const VERB_NAMES[] = { "HELO", "EHLO", "MAIL", "RCPT", "DATA", "RSET", "NOOP", "QUIT", "STARTTLS",
+                                   "unknown", "rejected" };
+#define VERB_HASH 0x9e3779ccu
+#define VERB_BITS 4
+
+/* Commands accepted in each state: 0 new connect, 1 HELO/RSET, 2 MAIL, 3 RCPT. In state 4 every line is message content. */
+const bool ALLOWED[4][CMD_UNKNOWN + 1] =
+{
+    //  HELO   EHLO   MAIL   RCPT   DATA   RSET   NOOP   QUIT  STARTTLS unknown
+    {  true,  true, false, false, false, false, false,  true, false,  true },
+    {  true,  true,  true, false, false,  true,  true,  true,  true,  true },
+    { false, false, false,  true, false,  true,  true,  true, false,  true },
+    { false, false, false,  true,  true,  true,  true,  true, false,  true },
+};
+
+/* What the accept loop hands to the thread of a session */
+struct session_t
+{
+    int fd;
+    uint32_t peer; // host order, may relay if trusted
+    Client *client; // record of the peer's rate limits, or NULL
+};
 
 vector<pthread_t> THREADS;
 pthread_mutex_t lock;
-vector<unsigned int> SOCKETS;
-unordered_set<string> MBOXES;
-unsigned int listen_fd;
+int listen_fd;
+int wake_fd[2] = { -1, -1 }; // written by the signal handlers and the handoff thread, read by the accept loop
 string user_dir;
 bool DEBUG;
-bool RUNNING;
+bool RUNNING; // accepting new connections
+bool DRAINING; // sessions close once idle, and at DRAIN_END at the latest
+uint64_t DRAIN_END;
+unsigned int DRAIN_TIMEOUT = 30;
+atomic<int> ACTIVE(0);
+unsigned int IDLE_TIMEOUT = 300;
 
 /* Set nonblocking read() function */
 void set_nonblocking(unsigned int fd)
@@ -61,262 +128,415 @@ void set_nonblocking(unsigned int fd)
     }
 }
 
-/* Signal handler for ctrl-c, clean threads and quit */
+/* Signal handler for ctrl-c, wake the accept loop to drain. A second ctrl-c closes the remaining sessions. */
 void sig_handler(int arg)
 {
-    RUNNING = false;
-    for (int i = 0; i < SOCKETS.size(); i++)
-    {
-        write(SOCKETS[i], SERV_UNAVAIL, strlen(SERV_UNAVAIL));
-        close(SOCKETS[i]);
-    }
-    SOCKETS.clear();
-    close(listen_fd);
-    if (DEBUG)
+    char byte = 'i';
+    write(wake_fd[1], &byte, 1);
+}
+
+/* Signal handler for SIGUSR1, wake the accept loop to print the statistics. Nothing is formatted here, as snprintf is not
+ * async-signal-safe. */
+void stats_handler(int arg)
+{
+    char byte = 's';
+    write(wake_fd[1], &byte, 1);
+}
+
+/* Print how well the recipient filter works, and the counters of the rate limits, replication, relay and TLS */
+void print_stats()
+{
+    unsigned long probes, rejected, false_positives;
+    double expected;
+    registry_filter_stats(probes, rejected, false_positives, expected);
+    fprintf(stderr, "Recipient filter: %lu lookups, %lu rejected, %lu false positives (%.4f observed, %.4f expected)\n",
+            probes, rejected, false_positives,
+            rejected + false_positives ? (double) false_positives / (rejected + false_positives) : 0.0, expected);
+    unsigned long connections, messages, bytes;
+    limiter_stats(connections, messages, bytes);
+    fprintf(stderr, "Rate limits: %lu connections, %lu recipients, %lu messages refused\n", connections, messages, bytes);
+    uint64_t behind, lag;
+    unsigned long timeouts;
+    repl_stats(behind, lag, timeouts);
+    fprintf(stderr, "Replication: %llu bytes behind, lag %llu ms, %lu sync waits timed out\n",
+            (unsigned long long) behind, (unsigned long long) lag, timeouts);
+    unsigned long queued, sent, deferred, bounced, sessions, reused;
+    relay_stats(queued, sent, deferred, bounced, sessions, reused);
+    fprintf(stderr, "Relay: %lu messages queued, %lu recipients sent, %lu deferred, %lu bounced, "
+            "%lu sessions opened, %lu reused\n", queued, sent, deferred, bounced, sessions, reused);
+    unsigned long handshakes, resumed, offloaded;
+    tls_stats(handshakes, resumed, offloaded);
+    fprintf(stderr, "TLS: %lu handshakes, %lu resumed, %lu sending through kTLS\n", handshakes, resumed, offloaded);
+}
+
+/* Append a message, stored as body, to a mailbox file. The file is locked against a POP3 server rewriting it, and reopened if it was
+ * replaced meanwhile. The usage and search index of the mailbox are updated, and the append is logged for the standby, under the
+ * same lock. */
+bool deliver(const string &address, const char *title, size_t title_len, const string &body,
+             const string &content, vector<string> &terms)
+{
+    while (true)
     {
-        printf("\nServer socket closed\n");
+        int mail_fd = open(address.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+        if (mail_fd < 0)
+        {
+            return false;
+        }
+        flock(mail_fd, LOCK_EX);
+        struct stat opened, named;
+        if (fstat(mail_fd, &opened) == 0 && stat(address.c_str(), &named) == 0
+                && opened.st_ino == named.st_ino)
+        {
+            struct iovec iov[2];
+            iov[0].iov_base = (void *) title;
+            iov[0].iov_len = title_len;
+            iov[1].iov_base = (void *) body.data();
+            iov[1].iov_len = body.size();
+            bool res = writev(mail_fd, iov, 2) == (ssize_t)(title_len + body.size());
+            if (!res)
+            {
+                ftruncate(mail_fd, opened.st_size); // no part of the message is left behind, e.g. on a full disk
+            }
+            else
+            {
+                quota_appended(address, mail_fd, title_len + body.size());
+                repl_appended(address, opened.st_size, title, title_len, body);
+                search_appended(address, mail_fd, title_len + body.size(), content, terms);
+            }
+            close(mail_fd); // closing also releases the lock
+            PROBE3(mail__deliver, address.c_str(), title_len + body.size(), res);
+            return res;
+        }
+        close(mail_fd); // the file was replaced, append to the new one
     }
-    for (int i = 0; i < THREADS.size(); i++)
+}
+
+/* Map a command line to its command, one multiplication and a jump table */
+command_t lookup(const char *buffer)
+{
+    uint32_t code = read_verb(buffer);
+    switch (verb_slot(code, VERB_HASH, VERB_BITS))
     {
-        pthread_join(THREADS[i], NULL);
-        //pthread_kill(THREADS[i],0);
+    case verb_slot(verb("HELO"), VERB_HASH, VERB_BITS):
+        return code == verb("HELO") ? CMD_HELO : CMD_UNKNOWN;
+    case verb_slot(verb("EHLO"), VERB_HASH, VERB_BITS):
+        return code == verb("EHLO") ? CMD_EHLO : CMD_UNKNOWN;
+    case verb_slot(verb("MAIL"), VERB_HASH, VERB_BITS):
+        return code == verb("MAIL") && read_verb(buffer + 5) == verb("FROM") ? CMD_MAIL : CMD_UNKNOWN;
+    case verb_slot(verb("RCPT"), VERB_HASH, VERB_BITS):
+        return code == verb("RCPT") && (read_verb(buffer + 5) & 0xffff) == (verb("TO  ") & 0xffff) ?
+               CMD_RCPT : CMD_UNKNOWN;
+    case verb_slot(verb("DATA"), VERB_HASH, VERB_BITS):
+        return code == verb("DATA") ? CMD_DATA : CMD_UNKNOWN;
+    case verb_slot(verb("RSET"), VERB_HASH, VERB_BITS):
+        return code == verb("RSET") ? CMD_RSET : CMD_UNKNOWN;
+    case verb_slot(verb("NOOP"), VERB_HASH, VERB_BITS):
+        return code == verb("NOOP") ? CMD_NOOP : CMD_UNKNOWN;
+    case verb_slot(verb("QUIT"), VERB_HASH, VERB_BITS):
+        return code == verb("QUIT") ? CMD_QUIT : CMD_UNKNOWN;
+    case verb_slot(verb("STAR"), VERB_HASH, VERB_BITS):
+        return code == verb("STAR") && read_verb(buffer + 4) == verb("TTLS") ? CMD_STARTTLS : CMD_UNKNOWN;
+    default:
+        return CMD_UNKNOWN;
     }
-    THREADS.clear();
 }
 
-/* Add the mailboxes of the local users to a set from a directory */
-void get_mboxes()
+/* HELO and EHLO command handler that sends the response. If no argument is after HELO then send 501 error. EHLO offers
+ * PIPELINING, since commands that arrive together are answered in order anyway, and STARTTLS while the connection is not encrypted
+ * yet. */
+void do_helo(unsigned int fd, int &status, char *buffer, bool extended, const char *&message)
 {
-    DIR *dir;
-    struct dirent *ptr;
-    const char *file = user_dir.c_str();
-    if ((dir = opendir(file)) == NULL)
+    char *head = buffer, *tail = strstr(buffer, "\r\n");
+    if (tail - head <= 5)
     {
-        fprintf(stderr, "Mailbox directory open error.\n");
-        exit(1);
+        message = SYN_ERR;
     }
-    while ((ptr = readdir(dir)) != NULL)
+    else
     {
-        if (strcmp(ptr->d_name, ".") == 0 || strcmp(ptr->d_name, "..") == 0)
-        {
-            continue; // current dir or parent dir
-        }
-        MBOXES.insert(ptr->d_name);
+        message = !extended ? HELO : tls_available() && !tls_active() ? EHLO_TLS : EHLO;
+        status = 1;
     }
-    closedir(dir);
+    tls_write(fd, message, strlen(message));
 }
 
-/* ECHO command handler that checks the state and send response. If no argument is after HELO then send 501 error. */
-void do_helo(unsigned int fd, int &status, char *buffer, string &message)
+/* STARTTLS command handler that runs the handshake. Commands the client sent before it are dropped (RFC 3207 4.2), and the
+ * session starts over, so the client says EHLO again. A connection whose handshake fails is closed. */
+void do_starttls(unsigned int fd, int &status, char *tail, bool &disconnect, const char *&message)
 {
-    if (status > 1)
+    if (tls_active())
     {
-        message = SEQ_ERR;
-        write(fd, SEQ_ERR, strlen(SEQ_ERR));
+        message = TLS_ACTIVE;
+        tls_write(fd, TLS_ACTIVE, strlen(TLS_ACTIVE));
+        return;
     }
-    else
+    if (!tls_available())
     {
-        char *head = buffer, *tail = strstr(buffer, "\r\n");
-        if (tail - head <= 5)
-        {
-            message = SYN_ERR;
-            write(fd, SYN_ERR, strlen(SYN_ERR));
-        }
-        else
-        {
-            message = HELO;
-            write(fd, HELO, strlen(HELO));
-            status = 1;
-        }
+        message = TLS_UNAVAIL;
+        tls_write(fd, TLS_UNAVAIL, strlen(TLS_UNAVAIL));
+        return;
     }
+    message = TLS_READY;
+    tls_write(fd, TLS_READY, strlen(TLS_READY));
+    memset(tail, 0, strlen(tail));
+    if (!tls_accept(fd, TLS_TIMEOUT))
+    {
+        log_session("[%d] TLS handshake failed\n", fd);
+        disconnect = true;
+        return;
+    }
+    status = 0;
 }
 
-/* MAIL FROM command handler that checks the state and set the sender. */
+/* MAIL FROM command handler that sets the sender, replacing the one of an earlier transaction of the session. */
 void do_mail(unsigned int fd, int &status, char *buffer, char *sender,
-             string &message)
+             const char *&message)
 {
-    if (status != 1)
+    int i = 0, j = 0, len = strlen(buffer);
+    memset(sender, 0, 64);
+    while (buffer[i] != '<' && i < len)
     {
-        message = SEQ_ERR;
-        write(fd, SEQ_ERR, strlen(SEQ_ERR));
+        i++;
     }
-    else
+    i++;
+    while (buffer[i] != '>' && i < len && j < 64)
     {
-        int i = 0, j = 0, len = strlen(buffer);
-        while (buffer[i] != '<' && i < len)
-        {
-            i++;
-        }
+        sender[j] = buffer[i];
+        j++;
         i++;
-        while (buffer[i] != '>' && i < len)
-        {
-            sender[j] = buffer[i];
-            j++;
-            i++;
-        }
-        message = OK;
-        write(fd, OK, strlen(OK));
-        status = 2;
     }
+    message = OK;
+    tls_write(fd, OK, strlen(OK));
+    status = 2;
 }
 
-/* RCPT TO command handler that checks the state and checks if the recipients and hosts exist, then set the recipients. */
-void do_rcpt(unsigned int fd, int &status, char *buffer, vector<string> &rcpts,
-             string &message)
+/* RCPT TO command handler that checks if the recipients and hosts exist, have room and the client may send more mail, then set the recipients.
+ * Recipients of other hosts are taken if their domain is relayed for the client, by its address. */
+void do_rcpt(unsigned int fd, int &status, char *buffer, vector<string> &rcpts, vector<string> &relays,
+             Client *client, uint32_t peer, const char *&message)
 {
-    if (status < 2 || status > 3)
+    char one_rcpt[65] = { }, one_host[65] = { };
+    int i = 0, j = 0, len = strlen(buffer);
+    while (i < len && buffer[i] != '<')
     {
-        message = SEQ_ERR;
-        write(fd, SEQ_ERR, strlen(SEQ_ERR));
+        i++;
     }
-    else
+    i++;
+    while (i < len && buffer[i] != '@' && j < 64)
     {
-        char one_rcpt[65] = { }, one_host[65] = { };
-        int i = 0, j = 0, len = strlen(buffer);
-        while (buffer[i] != '<' && i < len)
-        {
-            i++;
-        }
+        one_rcpt[j] = buffer[i];
+        j++;
         i++;
-        while (buffer[i] != '@' && i < len)
-        {
-            one_rcpt[j] = buffer[i];
-            j++;
-            i++;
-        }
+    }
+    bool overlong = i < len && buffer[i] != '@'; // local part of more than 64 bytes
+    i++;
+    j = 0;
+    while (i < len && buffer[i] != '>' && j < 64)
+    {
+        one_host[j] = buffer[i];
+        j++;
         i++;
-        j = 0;
-        while (buffer[i] != '>' && i < len)
-        {
-            one_host[j] = buffer[i];
-            j++;
-            i++;
-        }
-        string mbox = (string) one_rcpt + ".mbox";
-        if (strcmp(one_host, "localhost") != 0
-                || MBOXES.find(mbox) == MBOXES.end())
-        {
-            message = MAIL_UNAVAIL;
-            write(fd, MAIL_UNAVAIL, strlen(MAIL_UNAVAIL));
-        }
-        else
+    }
+    overlong = overlong || (i < len && buffer[i] != '>'); // domain of more than 64 bytes
+    bool local = strcmp(one_host, "localhost") == 0;
+    if (overlong)
+    {
+        message = SYN_ERR;
+        tls_write(fd, SYN_ERR, strlen(SYN_ERR));
+    }
+    else if (local ? !registry_has_user(one_rcpt) : !relay_accepts(one_host, peer))
+    {
+        message = MAIL_UNAVAIL;
+        tls_write(fd, MAIL_UNAVAIL, strlen(MAIL_UNAVAIL));
+    }
+    else if (local && !quota_check(registry_path((string) one_rcpt + ".mbox")))
+    {
+        message = OVER_QUOTA;
+        tls_write(fd, OVER_QUOTA, strlen(OVER_QUOTA));
+        log_command("[%d] Recipient over quota\n", fd);
+    }
+    else if (!limiter_message(client))
+    {
+        message = RATE_LIMITED;
+        tls_write(fd, RATE_LIMITED, strlen(RATE_LIMITED));
+        log_command("[%d] Recipient refused by rate limit\n", fd);
+    }
+    else
+    {
+        vector<string> &list = local ? rcpts : relays;
+        string mbox = local ? (string) one_rcpt + ".mbox" : (string) one_rcpt + "@" + one_host;
+        bool has = false;
+        for (int i = 0; i < list.size(); i++)
         {
-            bool has = false;
-            for (int i = 0; i < rcpts.size(); i++)
-            {
-                if (rcpts[i] == mbox)
-                {
-                    has = true;
-                    if (DEBUG)
-                    {
-                        fprintf(stderr, "[%d] Duplicate recipients\n", fd);
-                    }
-                    break;
-                }
-            }
-            if (!has)
+            if (list[i] == mbox)
             {
-                rcpts.push_back(mbox);
+                has = true;
+                log_command("[%d] Duplicate recipients\n", fd);
+                break;
             }
-            message = OK;
-            write(fd, OK, strlen(OK));
-            status = 3;
         }
+        if (!has)
+        {
+            list.push_back(mbox);
+        }
+        message = OK;
+        tls_write(fd, OK, strlen(OK));
+        status = 3;
     }
 }
 
-/* DATA command handler that checks the state and read full message and write to recipients' files. */
+/* DATA command handler that reads the full message, queues it for the recipients of other hosts and writes it to the recipients' files,
+ * unless the client sent too many bytes. The transaction ends with it. */
 void do_data(unsigned int fd, int &status, char *buffer, char *sender,
-             vector<string> &rcpts, string &content, char *tail, bool &data,
-             string &message)
+             vector<string> &rcpts, vector<string> &relays, string &content, char *tail, bool &data,
+             Client *client, uint32_t peer, Arena &arena, const char *&message)
 {
-    if (status < 3 || status > 4)
-    {
-        message = SEQ_ERR;
-        write(fd, SEQ_ERR, strlen(SEQ_ERR));
-    }
-    else if (!data)
+    if (!data)
     {
         message = START;
-        write(fd, START, strlen(START));
+        tls_write(fd, START, strlen(START));
         data = true;
         status = 4;
     }
+    else if (strcmp(buffer, ".\r\n") == 0 && !limiter_bytes(client, content.size() * (rcpts.size() + relays.size())))
+    {
+        message = RATE_LIMITED;
+        tls_write(fd, RATE_LIMITED, strlen(RATE_LIMITED));
+        log_command("[%d] Message refused by rate limit\n", fd);
+        rcpts.clear();
+        relays.clear();
+        content.clear();
+        data = false;
+        status = 1;
+    }
+    else if (strcmp(buffer, ".\r\n") == 0 && !relays.empty() && relay_looping(content))
+    {
+        message = MAIL_LOOP;
+        tls_write(fd, MAIL_LOOP, strlen(MAIL_LOOP));
+        log_session("[%d] Message refused, it was relayed too often\n", fd);
+        rcpts.clear();
+        relays.clear();
+        content.clear();
+        data = false;
+        status = 1;
+    }
+    else if (strcmp(buffer, ".\r\n") == 0 && !relays.empty() && !relay_enqueue(sender, relays, content, peer))
+    {
+        message = LOCAL_ERR;
+        tls_write(fd, LOCAL_ERR, strlen(LOCAL_ERR));
+        log_session("[%d] Cannot queue a message for relaying\n", fd);
+        rcpts.clear();
+        relays.clear();
+        content.clear();
+        data = false;
+        status = 1;
+    }
     else if (strcmp(buffer, ".\r\n") == 0)
     {
+        vector<string> terms; // of the search index, found on the first delivery that needs them
+        bool delivered = true;
         for (int i = 0; i < rcpts.size(); i++)
         {
-            ofstream mail;
             time_t cur = time(NULL);
-            string address = user_dir + "/" + rcpts[i];
-            pthread_mutex_lock(&lock);
-            mail.open(address, ios::app);
-            string title = "From <" + (string) sender + "> " + ctime(&cur);
-            mail << title << content;
-            mail.close();
+            char date[26];
+            string address = registry_path(rcpts[i]);
+            string stored; // compressed before taking the lock, with the dictionary of the mailbox
+            const string &body = store_encode(address, content, stored) ? stored : content;
+            PROBE1(lock__acquire, fd);
+            metrics_lock(&lock);
+            PROBE1(lock__acquired, fd);
+            Reply title(arena, 128);
+            title.add("From <").add(sender).add("> ").add(ctime_r(&cur, date));
+            uint64_t started = metrics_clock();
+            if (!deliver(address, title.c_str(), title.size(), body, content, terms))
+            {
+                fprintf(stderr, "Cannot deliver a message to %s\n", address.c_str());
+                delivered = false;
+            }
+            metrics_time(H_MAILBOX_WRITE, started);
+            PROBE1(lock__release, fd);
             pthread_mutex_unlock(&lock);
         }
-        message = OK;
-        write(fd, OK, strlen(OK));
+        if (!repl_sync())
+        {
+            log_session("[%d] Standby did not confirm the message in time\n", fd); // it is stored here, the client must not send it again
+        }
+        message = delivered ? OK : LOCAL_ERR; // the client sends it again, to every recipient
+        tls_write(fd, message, strlen(message));
+        rcpts.clear();
+        relays.clear();
+        content.clear();
         data = false;
-        status = 5;
         status = 1;
     }
     else
     {
-        string l = "";
-        char *head = buffer;
-        while (head != tail)
+        content.append(buffer, tail - buffer);
+        if (LOG_CONTENT)
         {
-            l += *head;
-            head++;
+            message = Reply(arena, 32 + (tail - buffer)).add("Reading to content: ")
+                      .add(buffer, tail - buffer).c_str();
         }
-        content += l;
-        message = "Reading to content: " + l;
     }
 }
 
-/* RSET command handler that checks the state and discard all recipients, sender and content. */
-void do_rset(unsigned int fd, int &status, char *sender, vector<string> &rcpts,
-             string &content, string &message)
+/* RSET command handler that discards all recipients, sender and content. */
+void do_rset(unsigned int fd, int &status, char *sender, vector<string> &rcpts, vector<string> &relays,
+             string &content, const char *&message)
 {
-    if (status == 0)
-    {
-        message = SEQ_ERR;
-        write(fd, SEQ_ERR, strlen(SEQ_ERR));
-    }
-    else
-    {
-        memset(sender, 0, 64);
-        rcpts.clear();
-        content.clear();
-        message = OK;
-        write(fd, OK, strlen(OK));
-        status = 1;
-    }
+    memset(sender, 0, 64);
+    rcpts.clear();
+    relays.clear();
+    content.clear();
+    message = OK;
+    tls_write(fd, OK, strlen(OK));
+    status = 1;
 }
 
 /* Thread function for handling a client */
 void *client_t(void *p)
 {
-    unsigned int fd = *(int *) p;
-    write(fd, READY, strlen(READY)); // greeting message
+    session_t *session = (session_t *) p;
+    unsigned int fd = session->fd;
+    uint32_t peer = session->peer;
+    Client *client = session->client;
+    delete session;
+    tls_write(fd, READY, strlen(READY)); // greeting message
 
     bool disconnect = false;
     char sender[65] = { };
     char buffer[1024 * 8 + 1] = { };
     char *head = buffer;
-    vector<string> rcpts;
+    vector<string> rcpts, relays; // mailbox files, and addresses on other hosts
     string content = "";
+    Arena arena;
     bool data = false;
 
-    int status = 0; // status for a client: 0 new connect, 1 HELO/REST, 2 MAIL, 3 RCPT, 4 DATA Receiving, 5 DATA processed
+    int status = 0; // status for a client: 0 new connect, 1 HELO/REST, 2 MAIL, 3 RCPT, 4 DATA Receiving
+    Timer timer;
+    uint64_t data_end = 0;
+    timer_add(&timer, IDLE_TIMEOUT);
 
     /* Start to respond */
-    while (RUNNING)
+    while (true)
     {
+        if (DRAINING && (timer_now() >= DRAIN_END || (status <= 1 && buffer[0] == '\0')))
+        {
+            tls_write(fd, SERV_UNAVAIL, strlen(SERV_UNAVAIL)); // no transaction in progress, the client retries elsewhere
+            break;
+        }
+        if (timer.expired.load(memory_order_relaxed))
+        {
+            tls_write(fd, TIMEOUT, strlen(TIMEOUT));
+            log_session("[%d] Session timed out\n", fd);
+            break;
+        }
         int len = strlen(buffer);
-        int recv_len = read(fd, head, 1024 * 8 - len);
+        int recv_len = tls_read(fd, head, 1024 * 8 - len);
+        if (recv_len == 0)
+        {
+            log_session("[%d] Connection closed by client\n", fd);
+            break; // the session no longer counts against the limits of the client
+        }
         //		if (DEBUG) {
         //			if (recv_len > 0) {
         //				printf("Client %d received %d char, is %s\n", fd, recv_len,
@@ -333,140 +553,107 @@ void *client_t(void *p)
             {
                 command[i] = buffer[i];
             }
-            string message, operation;
-            if (strcasecmp(command, "HELO") == 0)
+            const char *message = "", *operation = command;
+            arena.reset();
+            uint64_t started = metrics_clock();
+            bool body_line = data;
+            command_t cmd = data ? CMD_DATA : lookup(buffer); // lines of a message are not commands
+            if (!data && !ALLOWED[status][cmd])
             {
-                do_helo(fd, status, buffer, message); // helo response
-                if (DEBUG)
-                {
-                    fprintf(stderr, "GOOD [%d] Client sent helo\n", fd);
-                }
-                operation = "HELO";
+                message = SEQ_ERR;
+                tls_write(fd, SEQ_ERR, strlen(SEQ_ERR));
+                log_command("BAD [%d] Sequence error!\n", fd);
+                cmd = CMD_REJECTED;
+            }
+            if (!body_line)
+            {
+                PROBE3(command__start, fd, VERB_NAMES[cmd], status);
             }
-            else if (strcasecmp(command, "QUIT") == 0)
+            switch (cmd)
             {
+            case CMD_HELO:
+                do_helo(fd, status, buffer, false, message); // helo response
+                log_command("GOOD [%d] Client sent helo\n", fd);
+                operation = "HELO";
+                break;
+            case CMD_EHLO:
+                do_helo(fd, status, buffer, true, message); // ehlo response
+                log_command("GOOD [%d] Client sent ehlo\n", fd);
+                operation = "EHLO";
+                break;
+            case CMD_STARTTLS:
+                do_starttls(fd, status, tail, disconnect, message); // starttls response and handshake
+                log_command("GOOD [%d] Client sent starttls\n", fd);
+                operation = "STARTTLS";
+                break;
+            case CMD_QUIT:
                 message = CLOSE;
-                write(fd, CLOSE, strlen(CLOSE)); // quit response
+                tls_write(fd, CLOSE, strlen(CLOSE)); // quit response
                 disconnect = true;
-                if (DEBUG)
-                {
-                    fprintf(stderr,
-                            "GOOD [%d] Client request to close connection\n",
-                            fd);
-                }
+                log_command("GOOD [%d] Client request to close connection\n", fd);
                 operation = "QUIT";
+                break;
+            case CMD_MAIL:
+                do_mail(fd, status, buffer, sender, message); // mail from response
+                log_command("GOOD [%d] Client sent mail from\n", fd);
+                operation = "MAIL FROM";
+                break;
+            case CMD_RCPT:
+                do_rcpt(fd, status, buffer, rcpts, relays, client, peer, message); // rcpt to response
+                log_command("GOOD [%d] Client sent rcpt to\n", fd);
+                operation = "RCPT TO";
+                break;
+            case CMD_DATA:
+                do_data(fd, status, buffer, sender, rcpts, relays, content, tail, data,
+                        client, peer, arena, message); // data response
+                log_command("GOOD [%d] Client sent data\n", fd);
+                operation = "DATA";
+                break;
+            case CMD_RSET:
+                do_rset(fd, status, sender, rcpts, relays, content, message); // rset response
+                log_command("GOOD [%d] Client sent rset\n", fd);
+                operation = "RSET";
+                break;
+            case CMD_NOOP:
+                message = OK;
+                tls_write(fd, OK, strlen(OK)); // noop response
+                log_command("GOOD [%d] Client sent noop\n", fd);
+                operation = "NOOP";
+                break;
+            case CMD_UNKNOWN:
+                message = UNRECOGNIZED;
+                tls_write(fd, UNRECOGNIZED, strlen(UNRECOGNIZED)); // unknown command
+                log_command("BAD [%d] Client sent unknown command\n", fd);
+                break;
+            case CMD_REJECTED:
+                break;
             }
-            else if (strcasecmp(command, "MAIL") == 0)
-            {
-                for (int i = 5; i < 9; i++)
-                {
-                    command[i - 5] = buffer[i];
-                }
-                if (strcasecmp(command, "FROM") == 0)
-                {
-                    do_mail(fd, status, buffer, sender, message); // mail from response
-                    if (DEBUG)
-                    {
-                        fprintf(stderr, "GOOD [%d] Client sent mail from\n",
-                                fd);
-                    }
-                    operation = "MAIL FROM";
-                }
-                else
-                {
-                    message = UNRECOGNIZED;
-                    write(fd, UNRECOGNIZED, strlen(UNRECOGNIZED)); // unknown command
-                    if (DEBUG)
-                    {
-                        fprintf(stderr,
-                                "BAD [%d] Client sent unknown command\n", fd);
-                    }
-                    operation = "MAIL ";
-                    operation += command;
-                }
-            }
-            else if (strcasecmp(command, "RCPT") == 0)
-            {
-                for (int i = 5; i < 7; i++)
-                {
-                    command[i - 5] = buffer[i];
-                }
-                command[2] = '\0';
-                if (strcasecmp(command, "TO") == 0)
-                {
-                    do_rcpt(fd, status, buffer, rcpts, message); // rcpt to response
-                    if (DEBUG)
-                    {
-                        fprintf(stderr, "GOOD [%d] Client sent rcpt to\n", fd);
-                    }
-                    operation = "RCPT TO";
-                }
-                else
-                {
-                    message = UNRECOGNIZED;
-                    write(fd, UNRECOGNIZED, strlen(UNRECOGNIZED)); // unknown command
-                    if (DEBUG)
-                    {
-                        fprintf(stderr,
-                                "BAD [%d] Client sent unknown command\n", fd);
-                    }
-                    operation = "RCPT ";
-                    operation += command;
-                }
-            }
-            else if (strcasecmp(command, "DATA") == 0 || data)
+
+            log_command("[%d] C: %s\n", fd, operation);
+            log_command("[%d] S: %s", fd, message);
+            if (TRANSCRIPT && !(body_line && data)) // the lines of a message are left out
             {
-                do_data(fd, status, buffer, sender, rcpts, content, tail, data,
-                        message); // data response
-                if (DEBUG)
-                {
-                    fprintf(stderr, "GOOD [%d] Client sent data\n", fd);
-                }
-                operation = "DATA";
+                log_transcript(fd, buffer, tail - buffer, message);
             }
-            else if (strcasecmp(command, "RSET") == 0)
+            if (!body_line)
             {
-                do_rset(fd, status, sender, rcpts, content, message); // rset response
-                if (DEBUG)
-                {
-                    fprintf(stderr, "GOOD [%d] Client sent rset\n", fd);
-                }
-                operation = "RSET";
+                metrics_time(H_VERBS + cmd, started);
+                PROBE3(command__end, fd, VERB_NAMES[cmd], status);
             }
-            else if (strcasecmp(command, "NOOP") == 0)
+
+            /* Restart the deadline, a message has to be received completely within DATA_TIMEOUT */
+            if (!data)
             {
-                if (status == 0)
-                {
-                    message = SEQ_ERR;
-                    write(fd, SEQ_ERR, strlen(SEQ_ERR));
-                }
-                else
-                {
-                    message = OK;
-                    write(fd, OK, strlen(OK)); // noop response
-                }
-                if (DEBUG)
-                {
-                    fprintf(stderr, "GOOD [%d] Client sent noop\n", fd);
-                }
-                operation = "NOOP";
+                timer_reset(&timer, IDLE_TIMEOUT);
+                data_end = 0;
             }
             else
             {
-                message = UNRECOGNIZED;
-                write(fd, UNRECOGNIZED, strlen(UNRECOGNIZED)); // unknown command
-                if (DEBUG)
+                if (data_end == 0)
                 {
-                    fprintf(stderr, "BAD [%d] Client sent unknown command\n",
-                            fd);
+                    data_end = timer_now() + DATA_TIMEOUT;
                 }
-                operation = command;
-            }
-
-            if (DEBUG)
-            {
-                fprintf(stderr, "[%d] C: %s\n", fd, operation.c_str());
-                fprintf(stderr, "[%d] S: %s", fd, message.c_str());
+                timer_reset_until(&timer, min(timer_now() + DATA_BLOCK_TIMEOUT, data_end));
             }
 
             /* Move remain messages to the head */
@@ -497,12 +684,9 @@ void *client_t(void *p)
             i++;
             if (i >= 1024 * 8)   // buffer is full
             {
-                if (DEBUG)
-                {
-                    fprintf(stderr, "Out of buffer bound.\n");
-                }
-                write(fd, OVER_SIZE, strlen(OVER_SIZE));
-                write(fd, buffer, 1024 * 8);
+                log_session("Out of buffer bound.\n");
+                tls_write(fd, OVER_SIZE, strlen(OVER_SIZE));
+                tls_write(fd, buffer, 1024 * 8);
                 memset(buffer, 0, 1024 * 8);
                 head = buffer;
                 break;
@@ -511,14 +695,14 @@ void *client_t(void *p)
     }
 
     /* Close client connection */
-    if (RUNNING)
-    {
-        close(fd);
-    }
-    if (DEBUG)
-    {
-        fprintf(stderr, "[%d] Connection closed\n", fd);
-    }
+    timer_cancel(&timer);
+    metrics_session_end(fd);
+    PROBE1(session__close, fd);
+    limiter_close(client);
+    tls_end();
+    close(fd);
+    ACTIVE--;
+    log_session("[%d] Connection closed\n", fd);
     return NULL;
 }
 
@@ -528,11 +712,15 @@ int main(int argc, char *argv[])
 
     /* Handling shutdown signal */
     signal(SIGINT, sig_handler);
+    signal(SIGUSR1, stats_handler);
 
     /* Parsing command line arguments */
     int ch = 0;
+    bool hashed = false;
+    string handoff, metrics, transcript, replicate, routes, follow;
+    int level = -1;
     unsigned int port_N = 2500;
-    while ((ch = getopt(argc, argv, "p:av")) != -1)
+    while ((ch = getopt(argc, argv, "p:t:s:d:m:l:r:q:z:T:R:F:O:aHv")) != -1)
     {
         switch (ch)
         {
@@ -542,6 +730,67 @@ int main(int argc, char *argv[])
         case 'v':
             DEBUG = true;
             break;
+        case 'H':
+            hashed = true;
+            break;
+        case 's':
+            handoff = optarg;
+            break;
+        case 'd':
+            DRAIN_TIMEOUT = atoi(optarg);
+            break;
+        case 'm':
+            metrics = optarg;
+            break;
+        case 'l':
+            transcript = optarg;
+            break;
+        case 'r':
+            if (!limiter_configure(optarg))
+            {
+                fprintf(stderr, "Invalid limits: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'q':
+            if (!quota_configure(optarg))
+            {
+                fprintf(stderr, "Invalid quota: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'R':
+            replicate = optarg;
+            break;
+        case 'F':
+            follow = optarg;
+            break;
+        case 'O':
+            routes = optarg;
+            break;
+        case 'T':
+            if (!tls_start(optarg))
+            {
+                fprintf(stderr, "Cannot use certificate and key: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'z':
+            level = atoi(optarg);
+            if (level < 0 || level > 9)
+            {
+                fprintf(stderr, "Invalid compression level: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 't':
+            IDLE_TIMEOUT = atoi(optarg);
+            if (IDLE_TIMEOUT <= 0)
+            {
+                fprintf(stderr, "Invalid timeout: %s\n", optarg);
+                exit(1);
+            }
+            break;
         case 'p':
             port_N = atoi(optarg);
             if (port_N <= 0)
@@ -555,7 +804,7 @@ int main(int argc, char *argv[])
             exit(1);
         default:
             fprintf(stderr,
-                    "Error: Please input [-p port_num] [-a] [-v] [mailbox directory]\n");
+                    "Error: Please input [-p port_num] [-t idle_seconds] [-s handoff_path] [-d drain_seconds] [-m metrics_port|path] [-l transcript_file] [-r limits] [-q quota] [-z level] [-T cert,key] [-R standby|log] [-F [address:]repl_port] [-O routes_file] [-H] [-a] [-v] [mailbox directory]\n");
             exit(1);
         }
     }
@@ -565,43 +814,81 @@ int main(int argc, char *argv[])
         exit(1);
     }
     user_dir = argv[optind];
-    get_mboxes();
-
-    struct sockaddr_in server_addr, client_addr; // Structures to represent the server and client
-
-    /* Create a new socket */
-    if ((listen_fd = socket(PF_INET, SOCK_STREAM, 0)) == -1)
+    registry_start(user_dir, hashed);
+    store_start(user_dir, level);
+    if ((!replicate.empty() && !repl_start(user_dir, replicate.c_str())) || (!follow.empty() && !repl_follow(user_dir, follow.c_str())))
     {
-        fprintf(stderr, "Socket open error.\n");
+        fprintf(stderr, "Cannot replicate %s\n", user_dir.c_str());
+        exit(1);
+    }
+    if (!routes.empty() && !relay_start(user_dir, routes))
+    {
+        fprintf(stderr, "Cannot relay with routes %s\n", routes.c_str());
         exit(1);
     }
-    int reuse = 1;
-    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, (const char *) &reuse,
-                   sizeof(int)) == -1)
+    timer_start();
+    if (!metrics.empty() && !metrics_start("smtp", metrics.c_str(), VERB_NAMES, CMD_REJECTED + 1))
     {
-        fprintf(stderr, "Socket set error.\n");
+        fprintf(stderr, "Cannot serve metrics on %s\n", metrics.c_str());
+        exit(1);
+    }
+    if (!log_start("smtp", transcript.empty() ? NULL : transcript.c_str()))
+    {
+        fprintf(stderr, "Cannot open transcript %s\n", transcript.c_str());
         exit(1);
     }
-    //set_nonblocking(listen_fd);
 
-    /* Configure the server */
-    bzero(&server_addr, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = htons(INADDR_ANY);
-    server_addr.sin_port = htons(port_N);
+    struct sockaddr_in server_addr, client_addr; // Structures to represent the server and client
 
-    /* Use the socket and associate it with the port number */
-    if (bind(listen_fd, (struct sockaddr *) &server_addr,
-             sizeof(struct sockaddr)) == -1)
+    /* Take over the listening socket of a running server, or create a new one */
+    listen_fd = handoff.empty() ? -1 : handoff_receive(handoff);
+    if (listen_fd >= 0)
+    {
+        if (DEBUG)
+        {
+            printf("Listening socket taken over from %s\n", handoff.c_str());
+        }
+    }
+    else if ((listen_fd = socket(PF_INET, SOCK_STREAM, 0)) == -1)
     {
-        fprintf(stderr, "Unable to bind.\n");
+        fprintf(stderr, "Socket open error.\n");
         exit(1);
     }
+    else
+    {
+        int reuse = 1;
+        if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, (const char *) &reuse,
+                       sizeof(int)) == -1)
+        {
+            fprintf(stderr, "Socket set error.\n");
+            exit(1);
+        }
 
-    /* Start to listen client connections */
-    if (listen(listen_fd, 100) == -1)
+        /* Configure the server */
+        bzero(&server_addr, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_addr.s_addr = htons(INADDR_ANY);
+        server_addr.sin_port = htons(port_N);
+
+        /* Use the socket and associate it with the port number */
+        if (bind(listen_fd, (struct sockaddr *) &server_addr,
+                 sizeof(struct sockaddr)) == -1)
+        {
+            fprintf(stderr, "Unable to bind.\n");
+            exit(1);
+        }
+
+        /* Start to listen client connections */
+        if (listen(listen_fd, 100) == -1)
+        {
+            fprintf(stderr, "Unable to listen.\n");
+            exit(1);
+        }
+    }
+    set_nonblocking(listen_fd); // shared with the server it is handed to, which may take a pending connection first
+    if (pipe2(wake_fd, O_CLOEXEC) != 0
+            || (!handoff.empty() && !handoff_start(handoff, listen_fd, wake_fd[1])))
     {
-        fprintf(stderr, "Unable to listen.\n");
         exit(1);
     }
     RUNNING = true;
@@ -612,47 +899,92 @@ int main(int argc, char *argv[])
     fflush(stdout);
     pthread_mutex_init(&lock, NULL);
 
-    //	fd_set readfds;
-    //	int maxfd = 1;
-    //	struct timeval timeout;
-
+    struct pollfd fds[2] = { { listen_fd, POLLIN, 0 }, { wake_fd[0], POLLIN, 0 } };
     while (RUNNING)
     {
         /* Set up client connections */
         socklen_t clientaddrlen = sizeof(client_addr);
 
-        /* Set the accept function to nonblock */
-        //		FD_ZERO(&readfds);
-        //		FD_SET(listen_fd, &readfds);
-        //		timeout.tv_sec = 5;
-        //		timeout.tv_usec = 0;
-        //		int res = select(maxfd, &readfds, NULL, NULL, &timeout);
-        //		if (res <= 0) {
-        //			printf("No coming...\n");
-        //			continue;
-        //		}
-        unsigned int comm_fd = accept(listen_fd,
-                                      (struct sockaddr *) &client_addr, &clientaddrlen);
-        if (!RUNNING || comm_fd == -1)
+        /* Wait for a connection, or for a signal or the handoff to stop accepting */
+        if (poll(fds, 2, -1) < 0 && errno != EINTR)
         {
             break;
         }
-        set_nonblocking(comm_fd);
-        SOCKETS.push_back(comm_fd);
-        if (DEBUG)
+        if (fds[1].revents & POLLIN)
+        {
+            char byte;
+            read(wake_fd[0], &byte, 1);
+            if (byte == 's')
+            {
+                print_stats();
+                continue;
+            }
+            RUNNING = false;
+            break;
+        }
+        int comm_fd = accept(listen_fd, (struct sockaddr *) &client_addr,
+                             &clientaddrlen);
+        if (comm_fd == -1)
+        {
+            continue; // taken by the other server during a handoff, or aborted
+        }
+        Client *client;
+        if (!limiter_accept(ntohl(client_addr.sin_addr.s_addr), client))
         {
-            fprintf(stderr, "[%d] New connection\n", comm_fd);
+            write(comm_fd, TOO_MANY, strlen(TOO_MANY));
+            close(comm_fd);
+            log_session("Connection refused by rate limit\n");
+            continue;
         }
+        set_nonblocking(comm_fd);
+        ACTIVE++;
+        metrics_add(M_ACCEPTS);
+        PROBE1(session__accept, comm_fd);
+        log_session("[%d] New connection\n", comm_fd);
 
         /* Assign the client to a thread */
         pthread_t thread;
-        pthread_create(&thread, NULL, &client_t, &comm_fd);
+        session_t *session = new session_t;
+        session->fd = comm_fd;
+        session->peer = ntohl(client_addr.sin_addr.s_addr);
+        session->client = client;
+        pthread_create(&thread, NULL, &client_t, session);
         THREADS.push_back(thread);
     }
 
+    /* Drain: the sessions finish what they are doing until the deadline, a second signal cuts it short */
+    close(listen_fd);
+    DRAIN_END = timer_now() + DRAIN_TIMEOUT + 1;
+    DRAINING = true;
+    relay_stop();
+    if (DEBUG)
+    {
+        printf("\nServer socket closed, draining %d sessions\n", ACTIVE.load());
+    }
+    while (ACTIVE > 0 || (relay_busy() && timer_now() < DRAIN_END)) // relayed messages being sent are finished too
+    {
+        if (poll(&fds[1], 1, 100) > 0)
+        {
+            char byte;
+            read(wake_fd[0], &byte, 1);
+            if (byte == 's')
+            {
+                print_stats();
+                continue;
+            }
+            DRAIN_END = timer_now();
+        }
+    }
+    for (int i = 0; i < THREADS.size(); i++)
+    {
+        pthread_join(THREADS[i], NULL);
+    }
+    THREADS.clear();
+
     if (DEBUG)
     {
         printf("Server successfully shut down.\n");
     }
+    log_flush();
     return 0;
 }
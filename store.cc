@@ -0,0 +1,240 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string>
+#include <memory>
+#include <unordered_map>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "store.h"
+
+using namespace std;
+
+#define ESC 0x1b
+#define MAX_DICT (32 * 1024) // deflate only looks back this far
+
+/* A dictionary file as last read, or the lack of one */
+struct dict_t
+{
+    string bytes;
+    uLong id;
+    bool present;
+    ino_t ino;
+    time_t mtime;
+};
+
+static string DIR;
+static int LEVEL = -1; // no compression
+static unordered_map<string, shared_ptr<const dict_t> > DICTS;
+static pthread_mutex_t dicts_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Set the mailbox directory, which holds the default dictionary, and the compression level of new messages (-1 for none) */
+void store_start(const string &dir, int level)
+{
+    DIR = dir;
+    LEVEL = level;
+}
+
+/* Helper function that returns a dictionary file, read again if it changed */
+static shared_ptr<const dict_t> load_dict(const string &path)
+{
+    struct stat st;
+    bool present = stat(path.c_str(), &st) == 0;
+    pthread_mutex_lock(&dicts_lock);
+    shared_ptr<const dict_t> old = DICTS[path];
+    pthread_mutex_unlock(&dicts_lock);
+    if (old && old->present == present && (!present || (old->ino == st.st_ino && old->mtime == st.st_mtime)))
+    {
+        return old;
+    }
+    shared_ptr<dict_t> dict = make_shared<dict_t>();
+    dict->present = false;
+    int fd = present ? open(path.c_str(), O_RDONLY) : -1;
+    if (fd >= 0)
+    {
+        char buffer[MAX_DICT];
+        ssize_t n;
+        while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+        {
+            dict->bytes.append(buffer, n);
+        }
+        close(fd);
+        if (dict->bytes.size() > MAX_DICT)
+        {
+            dict->bytes.erase(0, dict->bytes.size() - MAX_DICT);
+        }
+        dict->present = !dict->bytes.empty();
+        dict->id = adler32(adler32(0, NULL, 0), (const Bytef *) dict->bytes.data(), dict->bytes.size());
+        dict->ino = st.st_ino;
+        dict->mtime = st.st_mtime;
+    }
+    pthread_mutex_lock(&dicts_lock);
+    DICTS[path] = dict;
+    pthread_mutex_unlock(&dicts_lock);
+    return dict;
+}
+
+/* Helper function that returns the dictionary for new messages of a mailbox, which may be the lack of one */
+static shared_ptr<const dict_t> pick_dict(const string &address)
+{
+    shared_ptr<const dict_t> dict = load_dict(address + DICT_SUFFIX);
+    return dict->present ? dict : load_dict(DIR + "/" DEFAULT_DICT);
+}
+
+/* Compress the content of a message for a mailbox. Returns false if it is better stored as it is.
+ * Content that looks compressed already is always compressed, so it cannot be taken for compressed content later. */
+bool store_encode(const string &address, const string &content, string &stored)
+{
+    bool marked = content.compare(0, STORE_MARK_LEN, STORE_MARK) == 0;
+    if (LEVEL < 0 && !marked)
+    {
+        return false;
+    }
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit(&stream, LEVEL < 0 ? Z_DEFAULT_COMPRESSION : LEVEL) != Z_OK)
+    {
+        return false;
+    }
+    shared_ptr<const dict_t> dict = pick_dict(address);
+    if (dict->present)
+    {
+        deflateSetDictionary(&stream, (const Bytef *) dict->bytes.data(), dict->bytes.size());
+    }
+    string packed(deflateBound(&stream, content.size()), '\0');
+    stream.next_in = (Bytef *) content.data();
+    stream.avail_in = content.size();
+    stream.next_out = (Bytef *) &packed[0];
+    stream.avail_out = packed.size();
+    bool res = deflate(&stream, Z_FINISH) == Z_STREAM_END;
+    packed.resize(stream.total_out);
+    deflateEnd(&stream);
+    if (!res)
+    {
+        return false;
+    }
+
+    /* Octets as POP3 sends the message: bare LFs get a CR, and the last line a CRLF */
+    uint64_t octets = content.size();
+    for (size_t i = 0; i < content.size(); i++)
+    {
+        if (content[i] == '\n' && (i == 0 || content[i - 1] != '\r'))
+        {
+            octets++;
+        }
+    }
+    if (!content.empty() && content.back() != '\n')
+    {
+        octets += 2;
+    }
+
+    char header[64];
+    stored.reserve(packed.size() + packed.size() / 64 + sizeof(header));
+    stored.assign(header, snprintf(header, sizeof(header), STORE_MARK "%llu %llu\n",
+                                   (unsigned long long) octets, (unsigned long long) content.size()));
+    for (size_t i = 0; i < packed.size(); i++)
+    {
+        if (packed[i] == '\n')
+        {
+            stored += ESC;
+            stored += 'n';
+        }
+        else if (packed[i] == ESC)
+        {
+            stored += ESC;
+            stored += 'e';
+        }
+        else
+        {
+            stored += packed[i];
+        }
+    }
+    stored += '\n';
+    return marked || stored.size() < content.size();
+}
+
+Inflater::Inflater(const string &address, const char *content, size_t len)
+    : address(address), done(false), error(false)
+{
+    memset(&stream, 0, sizeof(stream));
+    const char *eol = (const char *) memchr(content, '\n', len);
+    in = eol ? eol + 1 : content + len;
+    end = content + len;
+    if (end > in && end[-1] == '\n')
+    {
+        end--;
+    }
+    error = eol == NULL || inflateInit(&stream) != Z_OK;
+}
+
+Inflater::~Inflater()
+{
+    inflateEnd(&stream);
+}
+
+/* Get the next piece of the original bytes. Returns false at the end, or if the stream is damaged or its dictionary is gone. */
+bool Inflater::next(const char *&data, size_t &len)
+{
+    if (done || error)
+    {
+        return false;
+    }
+    stream.next_out = out;
+    stream.avail_out = sizeof(out);
+    while (stream.avail_out > 0 && !done && !error)
+    {
+        if (stream.avail_in == 0)
+        {
+            size_t n = 0;
+            while (n < sizeof(decoded) && in < end)
+            {
+                if (*in != ESC)
+                {
+                    decoded[n++] = *in++;
+                }
+                else if (in + 1 < end)
+                {
+                    decoded[n++] = in[1] == 'n' ? '\n' : ESC;
+                    in += 2;
+                }
+                else
+                {
+                    in = end; // an escape cut short
+                }
+            }
+            if (n == 0)
+            {
+                error = true; // the stream ends early
+                break;
+            }
+            stream.next_in = decoded;
+            stream.avail_in = n;
+        }
+        int res = inflate(&stream, Z_NO_FLUSH);
+        if (res == Z_NEED_DICT)
+        {
+            shared_ptr<const dict_t> dict = load_dict(address + DICT_SUFFIX);
+            if (!dict->present || dict->id != stream.adler)
+            {
+                dict = load_dict(DIR + "/" DEFAULT_DICT);
+            }
+            error = !dict->present || dict->id != stream.adler
+                    || inflateSetDictionary(&stream, (const Bytef *) dict->bytes.data(), dict->bytes.size()) != Z_OK;
+        }
+        else if (res == Z_STREAM_END)
+        {
+            done = true;
+        }
+        else if (res != Z_OK)
+        {
+            error = true;
+        }
+    }
+    data = (const char *) out;
+    len = sizeof(out) - stream.avail_out;
+    return !error && len > 0;
+}
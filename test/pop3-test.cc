@@ -1,13 +1,18 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "test.h"
 
+// With the optional word tls, the server was started with -T cert,key and
+// STLS is offered and taken.
+
 int main(int argc, char *argv[])
 {
-  if (argc != 2)
-    panic("Syntax: %s <port>", argv[0]);
+  if (argc != 2 && (argc != 3 || strcmp(argv[2], "tls")))
+    panic("Syntax: %s <port> [tls]", argv[0]);
+  bool tls = (argc == 3);
 
   // Initialize the buffers
 
@@ -59,6 +64,19 @@ int main(int argc, char *argv[])
   expectToRead(&conn1, ".");
   expectNoMoreData(&conn1);
 
+  // Search the mailbox, which builds its index, and search it again with the index
+
+  writeString(&conn1, "XSRCH franklin account\r\n");
+  expectToRead(&conn1, "+OK 1 messages");
+  expectToRead(&conn1, "1");
+  expectToRead(&conn1, ".");
+  expectNoMoreData(&conn1);
+
+  writeString(&conn1, "XSRCH franklin jefferson\r\n");
+  expectToRead(&conn1, "+OK 0 messages");
+  expectToRead(&conn1, ".");
+  expectNoMoreData(&conn1);
+
   // Delete the message
 
   writeString(&conn1, "DELE 1\r\n");
@@ -72,6 +90,56 @@ int main(int argc, char *argv[])
   expectRemoteClose(&conn1);
   closeConnection(&conn1);
 
+  // QUIT rewrote the mailbox without the deleted message
+
+  connectToPort(&conn1, atoi(argv[1]));
+  expectToRead(&conn1, "+OK*");
+  expectNoMoreData(&conn1);
+
+  writeString(&conn1, "CAPA\r\n");
+  expectToRead(&conn1, "+OK*");
+  expectToRead(&conn1, "USER");
+  expectToRead(&conn1, "UIDL");
+  expectToRead(&conn1, "XSRCH");
+  if (tls)
+    expectToRead(&conn1, "STLS");
+  expectToRead(&conn1, ".");
+  expectNoMoreData(&conn1);
+
+  writeString(&conn1, "USER linhphan\r\n");
+  expectToRead(&conn1, "+OK*");
+  expectNoMoreData(&conn1);
+
+  writeString(&conn1, "PASS cis505\r\n");
+  expectToRead(&conn1, "+OK*");
+  expectNoMoreData(&conn1);
+
+  writeString(&conn1, "STAT\r\n");
+  expectToRead(&conn1, "+OK 0 0");
+  expectNoMoreData(&conn1);
+
+  writeString(&conn1, "XSRCH franklin\r\n");
+  expectToRead(&conn1, "+OK 0 messages");
+  expectToRead(&conn1, ".");
+  expectNoMoreData(&conn1);
+
+  writeString(&conn1, "QUIT\r\n");
+  expectToRead(&conn1, "+OK*");
+  expectRemoteClose(&conn1);
+  closeConnection(&conn1);
+
+  // STLS is refused without a certificate. With one the handshake would
+  // follow, which this tester cannot do, so the connection ends there.
+
+  connectToPort(&conn1, atoi(argv[1]));
+  expectToRead(&conn1, "+OK*");
+  expectNoMoreData(&conn1);
+
+  writeString(&conn1, "STLS\r\n");
+  expectToRead(&conn1, tls ? "+OK*" : "-ERR*");
+  expectNoMoreData(&conn1);
+  closeConnection(&conn1);
+
   freeBuffers(&conn1);
   return 0;
 }
\ No newline at end of file
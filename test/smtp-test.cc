@@ -1,13 +1,33 @@
  #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "test.h"
 
+// The optional words after the port name the options the server was started
+// with, and turn on the cases that need them:
+//
+//   tls     -T cert,key           STARTTLS is offered and taken
+//   quota   -q messages=1         a second message for linhphan is refused
+//   relay   -O routes_file        remote.test is routed (to any server)
+
 int main(int argc, char *argv[])
 {
-  if (argc != 2)
-    panic("Syntax: %s <port>", argv[0]);
+  if (argc < 2)
+    panic("Syntax: %s <port> [tls] [quota] [relay]", argv[0]);
+
+  bool tls = false, quota = false, relay = false;
+  for (int i=2; i<argc; i++) {
+    if (!strcmp(argv[i], "tls"))
+      tls = true;
+    else if (!strcmp(argv[i], "quota"))
+      quota = true;
+    else if (!strcmp(argv[i], "relay"))
+      relay = true;
+    else
+      panic("Unknown option: %s", argv[i]);
+  }
 
   // Initialize the buffers
 
@@ -59,6 +79,101 @@ int main(int argc, char *argv[])
   expectToRead(&conn1, "250 OK");
   expectNoMoreData(&conn1);
 
+  // EHLO lists the extensions
+
+  writeString(&conn1, "EHLO tester\r\n");
+  expectToRead(&conn1, "250-localhost");
+  if (tls) {
+    expectToRead(&conn1, "250-PIPELINING");
+    expectToRead(&conn1, "250 STARTTLS");
+  } else {
+    expectToRead(&conn1, "250 PIPELINING");
+  }
+  expectNoMoreData(&conn1);
+
+  // With a quota of one message, the mailbox that just got one is full
+
+  if (quota) {
+    writeString(&conn1, "MAIL FROM:<benjamin.franklin@localhost>\r\n");
+    expectToRead(&conn1, "250 OK");
+    expectNoMoreData(&conn1);
+
+    writeString(&conn1, "RCPT TO:<linhphan@localhost>\r\n");
+    expectToRead(&conn1, "552 *");
+    expectNoMoreData(&conn1);
+
+    writeString(&conn1, "RSET\r\n");
+    expectToRead(&conn1, "250 OK");
+    expectNoMoreData(&conn1);
+  }
+
+  // Mail for another host is queued if its domain is routed, and refused otherwise
+
+  writeString(&conn1, "MAIL FROM:<benjamin.franklin@localhost>\r\n");
+  expectToRead(&conn1, "250 OK");
+  expectNoMoreData(&conn1);
+
+  writeString(&conn1, "RCPT TO:<john.adams@nowhere.test>\r\n");
+  expectToRead(&conn1, "550 *");
+  expectNoMoreData(&conn1);
+
+  writeString(&conn1, "RCPT TO:<john.adams@remote.test>\r\n");
+  expectToRead(&conn1, relay ? "250 OK" : "550 *");
+  expectNoMoreData(&conn1);
+
+  if (relay) {
+    writeString(&conn1, "DATA\r\n");
+    expectToRead(&conn1, "354 *");
+    expectNoMoreData(&conn1);
+
+    writeString(&conn1, "Subject: Relayed\r\n");
+    writeString(&conn1, "\r\n");
+    writeString(&conn1, "John, this one is queued.\r\n");
+    writeString(&conn1, ".\r\n");
+    expectToRead(&conn1, "250 OK");
+    expectNoMoreData(&conn1);
+
+    // A message that has been relayed a hundred times is taken for a mail loop
+
+    writeString(&conn1, "MAIL FROM:<benjamin.franklin@localhost>\r\n");
+    expectToRead(&conn1, "250 OK");
+    expectNoMoreData(&conn1);
+
+    writeString(&conn1, "RCPT TO:<john.adams@remote.test>\r\n");
+    expectToRead(&conn1, "250 OK");
+    expectNoMoreData(&conn1);
+
+    writeString(&conn1, "DATA\r\n");
+    expectToRead(&conn1, "354 *");
+    expectNoMoreData(&conn1);
+
+    for (int i=0; i<100; i++)
+      writeString(&conn1, "Received: from remote.test by localhost\r\n");
+    writeString(&conn1, "Subject: Looping\r\n");
+    writeString(&conn1, "\r\n");
+    writeString(&conn1, ".\r\n");
+    expectToRead(&conn1, "554 *");
+    expectNoMoreData(&conn1);
+  } else {
+    writeString(&conn1, "RSET\r\n");
+    expectToRead(&conn1, "250 OK");
+    expectNoMoreData(&conn1);
+  }
+
+  // STARTTLS is refused without a certificate. With one the handshake would
+  // follow, which this tester cannot do, so the connection ends there.
+
+  writeString(&conn1, "STARTTLS\r\n");
+  if (tls) {
+    expectToRead(&conn1, "220 *");
+    expectNoMoreData(&conn1);
+    closeConnection(&conn1);
+    freeBuffers(&conn1);
+    return 0;
+  }
+  expectToRead(&conn1, "454 *");
+  expectNoMoreData(&conn1);
+
   // Close the connection
 
   writeString(&conn1, "QUIT\r\n");
@@ -0,0 +1,175 @@
+#include <unistd.h>
+#include <pthread.h>
+#include <atomic>
+
+#include "timer.h"
+
+using namespace std;
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 3
+
+static Timer *WHEEL[WHEEL_LEVELS][WHEEL_SLOTS];
+static atomic<uint64_t> NOW(0);
+static pthread_mutex_t wheel_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Helper function that links a timer into the slot of its deadline. The level is picked by how far away the deadline is. */
+static void file(Timer *timer, uint64_t now)
+{
+    uint64_t deadline = timer->deadline.load(memory_order_relaxed);
+    if (deadline <= now)
+    {
+        deadline = now + 1; // due, fires on the next tick
+    }
+    uint64_t max = ((uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    if (deadline - now > max)
+    {
+        deadline = now + max; // re-filed from there
+    }
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1
+            && (deadline - now) >= ((uint64_t) 1 << (WHEEL_BITS * (level + 1))))
+    {
+        level++;
+    }
+    Timer **slot = &WHEEL[level][(deadline >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+    timer->filed = deadline;
+    timer->prev = NULL;
+    timer->next = *slot;
+    if (*slot != NULL)
+    {
+        (*slot)->prev = timer;
+    }
+    *slot = timer;
+}
+
+/* Helper function that unlinks a timer from its slot */
+static void unfile(Timer *timer)
+{
+    if (timer->prev != NULL)
+    {
+        timer->prev->next = timer->next;
+    }
+    else
+    {
+        for (int level = 0; level < WHEEL_LEVELS; level++)
+        {
+            Timer **slot = &WHEEL[level][(timer->filed >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+            if (*slot == timer)
+            {
+                *slot = timer->next;
+                break;
+            }
+        }
+    }
+    if (timer->next != NULL)
+    {
+        timer->next->prev = timer->prev;
+    }
+    timer->prev = timer->next = NULL;
+}
+
+/* Helper function that takes the list of a slot and files its timers again, expiring the ones that are due */
+static void cascade(int level, uint64_t now)
+{
+    Timer **slot = &WHEEL[level][(now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+    Timer *timer = *slot;
+    *slot = NULL;
+    while (timer != NULL)
+    {
+        Timer *next = timer->next;
+        if (timer->deadline.load(memory_order_relaxed) <= now)
+        {
+            timer->prev = timer->next = NULL;
+            timer->filed = 0;
+            timer->expired.store(true);
+        }
+        else
+        {
+            file(timer, now); // deadline was moved, or the timer moves down a level
+        }
+        timer = next;
+    }
+}
+
+/* Thread function that advances the wheel once a second */
+static void *wheel_t(void *p)
+{
+    while (true)
+    {
+        sleep(1);
+        pthread_mutex_lock(&wheel_lock);
+        uint64_t now = NOW.load() + 1;
+        NOW.store(now);
+        for (int level = WHEEL_LEVELS - 1; level > 0; level--)
+        {
+            if ((now & (((uint64_t) 1 << (WHEEL_BITS * level)) - 1)) == 0)
+            {
+                cascade(level, now);
+            }
+        }
+        cascade(0, now);
+        pthread_mutex_unlock(&wheel_lock);
+    }
+    return NULL;
+}
+
+/* Start the thread driving the wheel */
+void timer_start()
+{
+    pthread_t thread;
+    pthread_create(&thread, NULL, &wheel_t, NULL);
+    pthread_detach(thread);
+}
+
+/* Current tick of the wheel, in seconds since it was started */
+uint64_t timer_now()
+{
+    return NOW.load(memory_order_relaxed);
+}
+
+/* Arm a timer that expires in a number of seconds */
+void timer_add(Timer *timer, unsigned int seconds)
+{
+    pthread_mutex_lock(&wheel_lock);
+    timer->expired.store(false);
+    timer->deadline.store(NOW.load() + seconds + 1); // the current tick is partly over
+    file(timer, NOW.load());
+    pthread_mutex_unlock(&wheel_lock);
+}
+
+/* Push the deadline of an armed timer to a number of seconds from now */
+void timer_reset(Timer *timer, unsigned int seconds)
+{
+    timer_reset_until(timer, timer_now() + seconds + 1);
+}
+
+/* Move the deadline of an armed timer. Moving it later is a single store; moving it before the slot it is in re-files it. */
+void timer_reset_until(Timer *timer, uint64_t deadline)
+{
+    if (deadline >= timer->deadline.load(memory_order_relaxed))
+    {
+        timer->deadline.store(deadline, memory_order_relaxed);
+        return;
+    }
+    pthread_mutex_lock(&wheel_lock);
+    timer->deadline.store(deadline, memory_order_relaxed);
+    if (!timer->expired.load() && deadline < timer->filed)
+    {
+        unfile(timer);
+        file(timer, NOW.load());
+    }
+    pthread_mutex_unlock(&wheel_lock);
+}
+
+/* Disarm a timer, it can be freed afterwards */
+void timer_cancel(Timer *timer)
+{
+    pthread_mutex_lock(&wheel_lock);
+    if (!timer->expired.load())
+    {
+        unfile(timer);
+    }
+    pthread_mutex_unlock(&wheel_lock);
+}
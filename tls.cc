@@ -0,0 +1,318 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <string>
+#include <atomic>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+#include <openssl/evp.h>
+#include <openssl/core_names.h>
+
+#include "tls.h"
+
+using namespace std;
+
+#define TICKETS_SUFFIX ".tickets"
+#define WRITE_TIMEOUT_MS 30000 // a client that reads nothing for this long is given up on
+
+/* Keys of the session tickets: the name that tells them apart, and the keys of the cipher and the MAC */
+struct tickets_t
+{
+    unsigned char name[16];
+    unsigned char aes[32];
+    unsigned char hmac[32];
+};
+
+static SSL_CTX *CTX = NULL;
+static tickets_t TICKETS;
+static thread_local SSL *SESSION = NULL;
+static thread_local bool KTLS_SEND = false, KTLS_RECV = false;
+static atomic<unsigned long> handshakes(0), resumed(0), offloaded(0);
+
+/* Helper function that reads the ticket keys, made and saved first if there are none. New keys are written to a file of this process
+ * and linked into place whole, so a server starting at the same time reads either no file or a complete one, and takes the keys of
+ * whichever server linked first. */
+static bool load_tickets(const string &path)
+{
+    for (int tries = 0; tries < 3; tries++)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd >= 0)
+        {
+            bool res = read(fd, &TICKETS, sizeof(TICKETS)) == sizeof(TICKETS);
+            close(fd);
+            if (res)
+            {
+                return true;
+            }
+            unlink(path.c_str()); // cut short by a crash of an older version, never in the middle of being written
+            continue;
+        }
+        if (errno != ENOENT)
+        {
+            return false;
+        }
+        string temp = path + ".tmp." + to_string(getpid());
+        fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0)
+        {
+            return false;
+        }
+        bool res = RAND_bytes((unsigned char *) &TICKETS, sizeof(TICKETS)) == 1
+                   && write(fd, &TICKETS, sizeof(TICKETS)) == sizeof(TICKETS) && fsync(fd) == 0;
+        close(fd);
+        bool linked = res && link(temp.c_str(), path.c_str()) == 0;
+        int error = errno;
+        unlink(temp.c_str());
+        if (linked)
+        {
+            return true;
+        }
+        if (!res || error != EEXIST)
+        {
+            return false;
+        }
+        // another server linked its keys first, read those
+    }
+    return false;
+}
+
+/* Seal a new ticket, or open one a client brought back. Returns 0 for a ticket of other keys, a full handshake then. */
+static int ticket_keys(SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *cipher, EVP_MAC_CTX *mac, int enc)
+{
+    OSSL_PARAM params[] =
+    {
+        OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, TICKETS.hmac, sizeof(TICKETS.hmac)),
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char *) "SHA256", 0),
+        OSSL_PARAM_construct_end()
+    };
+    if (enc)
+    {
+        memcpy(name, TICKETS.name, sizeof(TICKETS.name));
+        if (RAND_bytes(iv, EVP_CIPHER_get_iv_length(EVP_aes_256_cbc())) != 1
+                || EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, TICKETS.aes, iv) != 1
+                || EVP_MAC_CTX_set_params(mac, params) != 1)
+        {
+            return -1;
+        }
+        return 1;
+    }
+    if (memcmp(name, TICKETS.name, sizeof(TICKETS.name)) != 0)
+    {
+        return 0;
+    }
+    if (EVP_MAC_CTX_set_params(mac, params) != 1
+            || EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, TICKETS.aes, iv) != 1)
+    {
+        return -1;
+    }
+    return 1;
+}
+
+/* Load the certificate and key of "cert.pem[,key.pem]", returns false if they cannot be used */
+bool tls_start(const char *spec)
+{
+    string cert = spec, key = spec;
+    size_t comma = cert.find(',');
+    if (comma != string::npos)
+    {
+        key = cert.substr(comma + 1);
+        cert.erase(comma);
+    }
+    CTX = SSL_CTX_new(TLS_server_method());
+    if (CTX == NULL
+            || SSL_CTX_use_certificate_chain_file(CTX, cert.c_str()) != 1
+            || SSL_CTX_use_PrivateKey_file(CTX, key.c_str(), SSL_FILETYPE_PEM) != 1
+            || SSL_CTX_check_private_key(CTX) != 1
+            || !load_tickets(key + TICKETS_SUFFIX))
+    {
+        ERR_print_errors_fp(stderr);
+        return false;
+    }
+    SSL_CTX_set_min_proto_version(CTX, TLS1_2_VERSION);
+    SSL_CTX_set_options(CTX, SSL_OP_ENABLE_KTLS | SSL_OP_CIPHER_SERVER_PREFERENCE);
+    SSL_CTX_set_session_id_context(CTX, (const unsigned char *) "simplemail", 10);
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(CTX, ticket_keys);
+    return true;
+}
+
+bool tls_available()
+{
+    return CTX != NULL;
+}
+
+bool tls_active()
+{
+    return SESSION != NULL;
+}
+
+/* Run the server side of a handshake on the connection of the calling thread, within timeout seconds */
+bool tls_accept(int fd, int timeout)
+{
+    SSL *ssl = SSL_new(CTX);
+    if (ssl == NULL || SSL_set_fd(ssl, fd) != 1)
+    {
+        SSL_free(ssl);
+        return false;
+    }
+    time_t deadline = time(NULL) + timeout;
+    int res;
+    while ((res = SSL_accept(ssl)) != 1)
+    {
+        int err = SSL_get_error(ssl, res);
+        struct pollfd pfd = { fd, (short)(err == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT), 0 };
+        int left = deadline - time(NULL);
+        if ((err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) || left <= 0
+                || poll(&pfd, 1, left * 1000) <= 0)
+        {
+            SSL_free(ssl);
+            ERR_clear_error();
+            return false;
+        }
+    }
+    /* Replies go out in whole records already. Nagle would hold back the short last record of one until the client acknowledges
+     * the others, which it delays. */
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    SESSION = ssl;
+    KTLS_SEND = BIO_get_ktls_send(SSL_get_wbio(ssl));
+    KTLS_RECV = BIO_get_ktls_recv(SSL_get_rbio(ssl));
+    handshakes++;
+    if (SSL_session_reused(ssl))
+    {
+        resumed++;
+    }
+    if (KTLS_SEND)
+    {
+        offloaded++;
+    }
+    return true;
+}
+
+/* Helper function that reads application data the kernel decrypted. Any other record, an alert such as close_notify or a
+ * handshake message the kernel cannot handle, comes with its type and ends the session; read() would fail on it with EIO. */
+static ssize_t ktls_read(int fd, void *data, size_t len)
+{
+    char control[CMSG_SPACE(sizeof(unsigned char))];
+    struct iovec iov = { data, len };
+    struct msghdr msg = { };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n = recvmsg(fd, &msg, 0);
+    struct cmsghdr *cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_TLS && cmsg->cmsg_type == TLS_GET_RECORD_TYPE
+            && *(unsigned char *) CMSG_DATA(cmsg) != SSL3_RT_APPLICATION_DATA)
+    {
+        return 0;
+    }
+    return n;
+}
+
+/* read() on the connection of the calling thread. Returns 0 once the client closes or breaks the TLS session. */
+ssize_t tls_read(int fd, void *data, size_t len)
+{
+    if (SESSION == NULL)
+    {
+        return read(fd, data, len);
+    }
+    if (KTLS_RECV)
+    {
+        return ktls_read(fd, data, len);
+    }
+    int n = SSL_read(SESSION, data, len);
+    if (n > 0)
+    {
+        return n;
+    }
+    int err = SSL_get_error(SESSION, n);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    ERR_clear_error();
+    return 0;
+}
+
+/* write() all of a buffer to the connection of the calling thread, waiting while the socket is full. The socket is nonblocking,
+ * so a plain or kTLS write can take part of the buffer too. */
+ssize_t tls_write(int fd, const void *data, size_t len)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        short wait = POLLOUT;
+        if (SESSION == NULL || KTLS_SEND)
+        {
+            ssize_t n = write(fd, (const char *) data + done, len - done);
+            if (n > 0)
+            {
+                done += n;
+                continue;
+            }
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            {
+                return done > 0 ? done : -1;
+            }
+        }
+        else
+        {
+            int n = SSL_write(SESSION, (const char *) data + done, len - done);
+            if (n > 0)
+            {
+                done += n;
+                continue;
+            }
+            int err = SSL_get_error(SESSION, n);
+            if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
+            {
+                ERR_clear_error();
+                return done > 0 ? done : -1;
+            }
+            wait = err == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT;
+        }
+        struct pollfd pfd = { fd, wait, 0 };
+        if (poll(&pfd, 1, WRITE_TIMEOUT_MS) <= 0)
+        {
+            ERR_clear_error();
+            return done > 0 ? done : -1;
+        }
+    }
+    return done;
+}
+
+/* End the TLS session of the calling thread, before its connection is closed */
+void tls_end()
+{
+    if (SESSION != NULL)
+    {
+        SSL_shutdown(SESSION);
+        SSL_free(SESSION);
+        SESSION = NULL;
+        ERR_clear_error();
+    }
+}
+
+void tls_stats(unsigned long &handshakes_out, unsigned long &resumed_out, unsigned long &offloaded_out)
+{
+    handshakes_out = handshakes.load();
+    resumed_out = resumed.load();
+    offloaded_out = offloaded.load();
+}